@@ -0,0 +1,700 @@
+// Benchmarks for the leaderboard server's data structures.
+//
+//   ./leaderboard_bench startup [players]
+//       Time loading the same board from a text dump and from the
+//       memory-mapped snapshot format the server starts from.
+//
+//   ./leaderboard_bench columns [players]
+//       Time top-K and "how many scored above X" scans over the row
+//       layout (packed store records) and a columnar copy built here
+//       only, with scalar and SIMD kernels, next to the skip list's own
+//       answers, which the server uses.
+//
+//   ./leaderboard_bench memory [players]
+//       Fill the boards the server keeps (all-time, daily and weekly) with
+//       one recent score per player and report resident bytes per player.
+//       About 194 at 10^6 players, against about 481 before names were
+//       interned and records packed: 2.5 times less, short of the
+//       several-fold cut that was the goal. Each of the three ranked boards
+//       costs a 20-byte record, an 11-byte skip list node on average and a
+//       4-byte name index entry; each window also keeps the score in one
+//       bucket (a record and its hash slot); the name table takes the rest.
+//       Below that, boards would have to share records.
+//
+//   ./leaderboard_bench snapshots [rounds]
+//       Log submissions to a scratch data directory while starting
+//       snapshots back to back, then recover it and check that no logged
+//       score was lost. Exits nonzero if one was.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include "leaderboard_store.h"
+#include "leaderboard_persist.h"
+#include "leaderboard_window.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#endif
+
+#define DEFAULT_PLAYERS 1000000
+#define SCAN_ROUNDS 20
+#define DEFAULT_SNAPSHOT_ROUNDS 200
+#define SNAPSHOT_ROUND_PLAYERS 500
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Deterministic board with the given number of distinct players
+static int fill_store(leaderboard_store* store, size_t players) {
+    uint64_t rng = 88172645463325252ULL;
+    char name[32];
+    char ip[16];
+    for (size_t i = 0; i < players; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        snprintf(name, sizeof(name), "player%zu", i);
+        snprintf(ip, sizeof(ip), "10.%d.%d.%d", (int)(rng >> 8 & 255),
+                 (int)(rng >> 16 & 255), (int)(rng >> 24 & 255));
+        if (store_submit(store, name, (int)(rng % 1000000), 1700000000 + (time_t)(rng % 86400),
+                         ip) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int same_top(const leaderboard_store* a, const leaderboard_store* b) {
+    const store_record* top_a[10];
+    const store_record* top_b[10];
+    size_t n = store_top(a, top_a, 10);
+    if (store_top(b, top_b, 10) != n) return 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strcmp(store_name(top_a[i]->name), store_name(top_b[i]->name)) != 0 ||
+            top_a[i]->score != top_b[i]->score) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int bench_startup(size_t players) {
+    const char* text_path = "bench_leaderboard.txt";
+    const char* snapshot_path = "bench_leaderboard.snapshot";
+    leaderboard_store source;
+    
+    printf("Building %zu players...\n", players);
+    if (store_init(&source) < 0 || fill_store(&source, players) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
+    FILE* text = fopen(text_path, "w");
+    if (!text) {
+        perror(text_path);
+        return 1;
+    }
+    for (size_t i = 0; i < source.count; i++) {
+        const store_record* r = &source.records[i];
+        char ip[16];
+        store_format_ip(r->client_ip, ip, sizeof(ip));
+        fprintf(text, "%s %d %ld %s\n", store_name(r->name), r->score, (long)r->timestamp, ip);
+    }
+    fclose(text);
+    if (persist_write_snapshot(snapshot_path, &source, 0) < 0) {
+        perror(snapshot_path);
+        return 1;
+    }
+    
+    // Text load: parse every line and index it as the server would
+    leaderboard_store from_text;
+    double start = now_ms();
+    store_init(&from_text);
+    text = fopen(text_path, "r");
+    char name[32];
+    char ip[16];
+    int score;
+    long timestamp;
+    while (fscanf(text, "%31s %d %ld %15s", name, &score, &timestamp, ip) == 4) {
+        store_submit(&from_text, name, score, (time_t)timestamp, ip);
+    }
+    fclose(text);
+    double text_ms = now_ms() - start;
+    
+    // Snapshot load: map the file and build the indexes from the stored order
+    leaderboard_store from_snapshot;
+    uint64_t covered_gen;
+    start = now_ms();
+    store_init(&from_snapshot);
+    if (persist_load_snapshot(snapshot_path, &from_snapshot, &covered_gen) < 0) {
+        fprintf(stderr, "Failed to load %s\n", snapshot_path);
+        return 1;
+    }
+    const store_record* top[10];
+    store_top(&from_snapshot, top, 10);
+    double first_read_ms = now_ms() - start;
+    
+    printf("text load:     %8.1f ms  (%zu players)\n", text_ms, from_text.count);
+    printf("snapshot load: %8.1f ms  (%zu players, first top-10 read included)\n",
+           first_read_ms, from_snapshot.count);
+    printf("speedup:       %8.1fx\n", text_ms / first_read_ms);
+    printf("results match: %s\n",
+           same_top(&source, &from_text) && same_top(&source, &from_snapshot) ? "yes" : "NO");
+    
+    store_free(&source);
+    store_free(&from_text);
+    store_free(&from_snapshot);
+    unlink(text_path);
+    unlink(snapshot_path);
+    return 0;
+}
+
+// Negative if row a ranks ahead of row b, as the store orders them
+static int compare_rows(const store_record* a, const store_record* b) {
+    if (a->score != b->score) return (a->score > b->score) ? -1 : 1;
+    if (a->timestamp != b->timestamp) return (a->timestamp < b->timestamp) ? -1 : 1;
+    return strcmp(store_name(a->name), store_name(b->name));
+}
+
+static int compare_row_ids(const void* a, const void* b, void* records) {
+    const store_record* rows = records;
+    return compare_rows(&rows[*(const uint32_t*)a], &rows[*(const uint32_t*)b]);
+}
+
+// The row-layout scans: what a query has to do without an index when each
+// player is one interleaved store_record
+static size_t row_count_above(const leaderboard_store* store, int score) {
+    size_t above = 0;
+    for (size_t i = 0; i < store->count; i++) {
+        above += store->records[i].score > score;
+    }
+    return above;
+}
+
+static void row_sift_down(const store_record* rows, uint32_t* heap, size_t size,
+                          size_t pos) {
+    for (;;) {
+        size_t worst = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+        if (left < size && compare_rows(&rows[heap[left]], &rows[heap[worst]]) > 0) worst = left;
+        if (right < size && compare_rows(&rows[heap[right]], &rows[heap[worst]]) > 0) worst = right;
+        if (worst == pos) return;
+        uint32_t swap = heap[pos];
+        heap[pos] = heap[worst];
+        heap[worst] = swap;
+        pos = worst;
+    }
+}
+
+static size_t row_top(const leaderboard_store* store, uint32_t* heap, size_t k) {
+    const store_record* rows = store->records;
+    if (k > store->count) k = store->count;
+    if (k == 0) return 0;
+    for (size_t i = 0; i < k; i++) {
+        heap[i] = (uint32_t)i;
+    }
+    for (size_t i = k / 2; i-- > 0;) {
+        row_sift_down(rows, heap, k, i);
+    }
+    for (size_t i = k; i < store->count; i++) {
+        if (rows[i].score >= rows[heap[0]].score &&
+            compare_rows(&rows[i], &rows[heap[0]]) < 0) {
+            heap[0] = (uint32_t)i;
+            row_sift_down(rows, heap, k, 0);
+        }
+    }
+    qsort_r(heap, k, sizeof(uint32_t), compare_row_ids, (void*)rows);
+    return k;
+}
+
+static int same_ids(const uint32_t* a, const uint32_t* b, size_t n) {
+    return memcmp(a, b, n * sizeof(uint32_t)) == 0;
+}
+
+// The same scans over a columnar copy of the records: scores, timestamps
+// and name ids each in their own array, so the scores sit sixteen to a
+// cache line and the AVX2 kernels compare eight at a time. Only the
+// benchmark keeps one; the server's skip list answers both queries far
+// faster, as the last column shows.
+typedef struct {
+    int32_t* scores;
+    int64_t* timestamps;
+    uint32_t* names;
+    size_t count;
+} score_columns;
+
+typedef enum {
+    KERNEL_SCALAR,
+    KERNEL_AVX2
+} scan_kernel;
+
+static scan_kernel active_kernel = KERNEL_SCALAR;
+
+static void columns_free(score_columns* columns) {
+    free(columns->scores);
+    free(columns->timestamps);
+    free(columns->names);
+    memset(columns, 0, sizeof(*columns));
+}
+
+static int columns_load(score_columns* columns, const leaderboard_store* store) {
+    columns->count = store->count;
+    columns->scores = malloc(store->count * sizeof(int32_t));
+    columns->timestamps = malloc(store->count * sizeof(int64_t));
+    columns->names = malloc(store->count * sizeof(uint32_t));
+    if (!columns->scores || !columns->timestamps || !columns->names) {
+        columns_free(columns);
+        return -1;
+    }
+    for (size_t id = 0; id < store->count; id++) {
+        columns->scores[id] = store->records[id].score;
+        columns->timestamps[id] = store->records[id].timestamp;
+        columns->names[id] = store->records[id].name;
+    }
+    return 0;
+}
+
+// Choose the kernels the scans run. Returns the one now in use, which is
+// KERNEL_SCALAR if the CPU or the build lacks AVX2.
+static scan_kernel use_kernel(scan_kernel wanted) {
+    active_kernel = KERNEL_SCALAR;
+#ifdef HAVE_AVX2_KERNELS
+    if (wanted == KERNEL_AVX2 && __builtin_cpu_supports("avx2")) active_kernel = KERNEL_AVX2;
+#endif
+    (void)wanted;
+    return active_kernel;
+}
+
+// Negative if row a ranks ahead of row b
+static int compare_columns(const score_columns* columns, uint32_t a, uint32_t b) {
+    if (columns->scores[a] != columns->scores[b]) {
+        return (columns->scores[a] > columns->scores[b]) ? -1 : 1;
+    }
+    if (columns->timestamps[a] != columns->timestamps[b]) {
+        return (columns->timestamps[a] < columns->timestamps[b]) ? -1 : 1;
+    }
+    return strcmp(store_name(columns->names[a]), store_name(columns->names[b]));
+}
+
+static int compare_column_ids(const void* a, const void* b, void* columns) {
+    return compare_columns(columns, *(const uint32_t*)a, *(const uint32_t*)b);
+}
+
+static size_t column_count_above_scalar(const score_columns* columns, size_t from, int score) {
+    size_t above = 0;
+    for (size_t i = from; i < columns->count; i++) {
+        above += columns->scores[i] > score;
+    }
+    return above;
+}
+
+#ifdef HAVE_AVX2_KERNELS
+// Eight scores per compare; each lane of counts accumulates -1 per hit
+__attribute__((target("avx2")))
+static size_t column_count_above_avx2(const score_columns* columns, int score) {
+    const int32_t* scores = columns->scores;
+    size_t i = 0;
+    __m256i key = _mm256_set1_epi32(score);
+    __m256i counts = _mm256_setzero_si256();
+    for (; i + 8 <= columns->count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(scores + i));
+        counts = _mm256_sub_epi32(counts, _mm256_cmpgt_epi32(v, key));
+    }
+    
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, counts);
+    size_t above = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        above += lanes[lane];
+    }
+    return above + column_count_above_scalar(columns, i, score);
+}
+#endif
+
+static size_t column_count_above(const score_columns* columns, int score) {
+#ifdef HAVE_AVX2_KERNELS
+    if (active_kernel == KERNEL_AVX2) return column_count_above_avx2(columns, score);
+#endif
+    return column_count_above_scalar(columns, 0, score);
+}
+
+// The k best so far are kept in a heap with the worst of them at the top,
+// so a row only has to beat heap[0] to get in
+static void column_sift_down(const score_columns* columns, uint32_t* heap, size_t size,
+                             size_t pos) {
+    for (;;) {
+        size_t worst = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+        if (left < size && compare_columns(columns, heap[left], heap[worst]) > 0) worst = left;
+        if (right < size && compare_columns(columns, heap[right], heap[worst]) > 0) worst = right;
+        if (worst == pos) return;
+        uint32_t swap = heap[pos];
+        heap[pos] = heap[worst];
+        heap[worst] = swap;
+        pos = worst;
+    }
+}
+
+static void column_heap_offer(const score_columns* columns, uint32_t* heap, size_t k,
+                              uint32_t id) {
+    if (compare_columns(columns, id, heap[0]) < 0) {
+        heap[0] = id;
+        column_sift_down(columns, heap, k, 0);
+    }
+}
+
+static void column_top_scalar(const score_columns* columns, uint32_t* heap, size_t k,
+                              size_t from) {
+    for (size_t i = from; i < columns->count; i++) {
+        if (columns->scores[i] >= columns->scores[heap[0]]) {
+            column_heap_offer(columns, heap, k, (uint32_t)i);
+        }
+    }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+// Once the heap is full almost every score falls below the worst kept one,
+// so eight are ruled out per compare and only survivors reach the heap
+__attribute__((target("avx2")))
+static void column_top_avx2(const score_columns* columns, uint32_t* heap, size_t k) {
+    const int32_t* scores = columns->scores;
+    size_t i = k;
+    __m256i floor = _mm256_set1_epi32(scores[heap[0]]);
+    for (; i + 8 <= columns->count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(scores + i));
+        __m256i below = _mm256_cmpgt_epi32(floor, v);
+        unsigned candidates = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(below)) & 0xFF;
+        if (!candidates) continue;
+        while (candidates) {
+            size_t lane = (size_t)__builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            column_heap_offer(columns, heap, k, (uint32_t)(i + lane));
+        }
+        floor = _mm256_set1_epi32(scores[heap[0]]);
+    }
+    column_top_scalar(columns, heap, k, i);
+}
+#endif
+
+// Fill out[] with the ids of up to k best rows in rank order
+static size_t column_top(const score_columns* columns, uint32_t* out, size_t k) {
+    if (k > columns->count) k = columns->count;
+    if (k == 0) return 0;
+    for (size_t i = 0; i < k; i++) {
+        out[i] = (uint32_t)i;
+    }
+    for (size_t i = k / 2; i-- > 0;) {
+        column_sift_down(columns, out, k, i);
+    }
+#ifdef HAVE_AVX2_KERNELS
+    if (active_kernel == KERNEL_AVX2) {
+        column_top_avx2(columns, out, k);
+    } else {
+        column_top_scalar(columns, out, k, k);
+    }
+#else
+    column_top_scalar(columns, out, k, k);
+#endif
+    qsort_r(out, k, sizeof(uint32_t), compare_column_ids, (void*)columns);
+    return k;
+}
+
+static int bench_columns(size_t players) {
+    leaderboard_store store;
+    score_columns columns;
+    
+    printf("Building %zu players...\n", players);
+    if (store_init(&store) < 0 || fill_store(&store, players) < 0 ||
+        columns_load(&columns, &store) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t row_bytes = store.count * sizeof(store_record);
+    size_t column_bytes = columns.count * (sizeof(int32_t) + sizeof(int64_t) + sizeof(uint32_t));
+    printf("row layout:    %3zu bytes per player, %4zu MB\n", row_bytes / store.count,
+           row_bytes >> 20);
+    printf("column layout: %3zu bytes per player, %4zu MB (scores alone %zu MB)\n\n",
+           column_bytes / columns.count, column_bytes >> 20,
+           (columns.count * sizeof(int32_t)) >> 20);
+    int have_simd = use_kernel(KERNEL_AVX2) == KERNEL_AVX2;
+    if (!have_simd) printf("AVX2 not available: the SIMD rows use the scalar kernels\n\n");
+    
+    // Threshold query at a few points of the score range
+    int matches = 1;
+    printf("%-22s %10s %10s %10s %10s\n", "count above X", "rows", "scalar", "simd", "skiplist");
+    int thresholds[] = {10000, 500000, 990000};
+    for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++) {
+        int x = thresholds[t];
+        size_t expect = store_count_ahead(&store, x, 0, "");
+        size_t got[3];
+        double ms[4];
+        
+        double start = now_ms();
+        for (int r = 0; r < SCAN_ROUNDS; r++) got[0] = row_count_above(&store, x);
+        ms[0] = (now_ms() - start) / SCAN_ROUNDS;
+        for (int kernel = 0; kernel < 2; kernel++) {
+            use_kernel(kernel ? KERNEL_AVX2 : KERNEL_SCALAR);
+            start = now_ms();
+            for (int r = 0; r < SCAN_ROUNDS; r++) got[1 + kernel] = column_count_above(&columns, x);
+            ms[1 + kernel] = (now_ms() - start) / SCAN_ROUNDS;
+        }
+        start = now_ms();
+        for (int r = 0; r < SCAN_ROUNDS; r++) expect = store_count_ahead(&store, x, 0, "");
+        ms[3] = (now_ms() - start) / SCAN_ROUNDS;
+        for (int i = 0; i < 3; i++) {
+            if (got[i] != expect) matches = 0;
+        }
+        
+        char label[32];
+        snprintf(label, sizeof(label), "X=%d (%zu)", x, expect);
+        printf("%-22s %8.3fms %8.3fms %8.3fms %8.4fms\n", label, ms[0], ms[1], ms[2], ms[3]);
+    }
+    
+    // Top-K selection; the skip list reads its first K nodes
+    printf("\n%-22s %10s %10s %10s %10s\n", "top K", "rows", "scalar", "simd", "skiplist");
+    size_t ks[] = {10, 100, 1000};
+    uint32_t* ids[3];
+    const store_record** top = malloc(1000 * sizeof(*top));
+    for (int i = 0; i < 3; i++) {
+        ids[i] = malloc(1000 * sizeof(uint32_t));
+    }
+    for (size_t t = 0; t < sizeof(ks) / sizeof(ks[0]); t++) {
+        size_t k = ks[t];
+        double ms[4];
+        
+        double start = now_ms();
+        for (int r = 0; r < SCAN_ROUNDS; r++) row_top(&store, ids[0], k);
+        ms[0] = (now_ms() - start) / SCAN_ROUNDS;
+        for (int kernel = 0; kernel < 2; kernel++) {
+            use_kernel(kernel ? KERNEL_AVX2 : KERNEL_SCALAR);
+            start = now_ms();
+            for (int r = 0; r < SCAN_ROUNDS; r++) column_top(&columns, ids[1 + kernel], k);
+            ms[1 + kernel] = (now_ms() - start) / SCAN_ROUNDS;
+        }
+        start = now_ms();
+        for (int r = 0; r < SCAN_ROUNDS; r++) store_top(&store, top, k);
+        ms[3] = (now_ms() - start) / SCAN_ROUNDS;
+        
+        if (!same_ids(ids[0], ids[1], k) || !same_ids(ids[0], ids[2], k)) matches = 0;
+        for (size_t i = 0; i < k; i++) {
+            if (top[i] != &store.records[ids[0][i]]) matches = 0;
+        }
+        
+        char label[32];
+        snprintf(label, sizeof(label), "K=%zu", k);
+        printf("%-22s %8.3fms %8.3fms %8.3fms %8.4fms\n", label, ms[0], ms[1], ms[2], ms[3]);
+    }
+    printf("\nresults match: %s\n", matches ? "yes" : "NO");
+    
+    free(top);
+    for (int i = 0; i < 3; i++) {
+        free(ids[i]);
+    }
+    columns_free(&columns);
+    store_free(&store);
+    return 0;
+}
+
+// Resident set size of this process
+static size_t resident_bytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (statm) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static int bench_memory(size_t players) {
+    leaderboard_store store;
+    leaderboard_window daily;
+    leaderboard_window weekly;
+    time_t now = time(NULL);
+    
+    size_t before = resident_bytes();
+    if (store_init(&store) < 0 || window_init(&daily, 3600, 24, now) < 0 ||
+        window_init(&weekly, 6 * 3600, 28, now) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
+    // The server's windows, with every score made in the last day
+    printf("Building %zu players...\n", players);
+    uint64_t rng = 88172645463325252ULL;
+    char name[32];
+    char ip[16];
+    double start = now_ms();
+    for (size_t i = 0; i < players; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        snprintf(name, sizeof(name), "player%zu", i);
+        snprintf(ip, sizeof(ip), "10.%d.%d.%d", (int)(rng >> 8 & 255),
+                 (int)(rng >> 16 & 255), (int)(rng >> 24 & 255));
+        int score = (int)(rng % 1000000);
+        time_t timestamp = now - (time_t)(rng % 86400);
+        if (store_submit(&store, name, score, timestamp, ip) < 0 ||
+            window_submit(&daily, name, score, timestamp, ip) < 0 ||
+            window_submit(&weekly, name, score, timestamp, ip) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+    double build_ms = now_ms() - start;
+    size_t after = resident_bytes();
+    
+    printf("record size:      %zu bytes\n", sizeof(store.records[0]));
+    printf("build time:       %.1f ms\n", build_ms);
+    printf("resident growth:  %zu MB\n", (after - before) >> 20);
+    printf("bytes per player: %.1f (all-time, daily and weekly boards)\n",
+           (double)(after - before) / players);
+    printf("before packing:   about 481, so the several-fold target is not met\n");
+    
+    window_free(&weekly);
+    window_free(&daily);
+    store_free(&store);
+    return 0;
+}
+
+// Submit players first to first + count - 1 to the store and the log
+static int log_players(leaderboard_store* store, size_t first, size_t count) {
+    for (size_t i = first; i < first + count; i++) {
+        leaderboard_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        snprintf(entry.player_name, sizeof(entry.player_name), "player%zu", i);
+        entry.score = (int)(i * 7919 % 1000000);
+        entry.timestamp = 1700000000 + (time_t)i;
+        strcpy(entry.client_ip, "10.0.0.1");
+        if (store_submit(store, entry.player_name, entry.score, entry.timestamp,
+                         entry.client_ip) < 0) {
+            return -1;
+        }
+        persist_append(&entry);
+    }
+    return 0;
+}
+
+static void remove_data_dir(const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* file;
+    char name[512];
+    while ((file = readdir(dir)) != NULL) {
+        if (file->d_name[0] == '.') continue;
+        snprintf(name, sizeof(name), "%s/%s", path, file->d_name);
+        unlink(name);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static int bench_snapshots(size_t rounds) {
+    char data_dir[] = "/tmp/leaderboard_bench.XXXXXX";
+    if (!mkdtemp(data_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    leaderboard_store logged;
+    if (store_init(&logged) < 0 || persist_open(data_dir, &logged, 1, NULL) < 0) {
+        fprintf(stderr, "Failed to open %s\n", data_dir);
+        return 1;
+    }
+    
+    // Two snapshots per round, the second asked for before the log writer
+    // has had a chance to act on the first, with records logged around both
+    size_t started = 0;
+    size_t refused = 0;
+    size_t next = 0;
+    double start = now_ms();
+    for (size_t round = 0; round < rounds; round++) {
+        persist_snapshot_due();
+        for (int i = 0; i < 2; i++) {
+            if (log_players(&logged, next, SNAPSHOT_ROUND_PLAYERS) < 0) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            next += SNAPSHOT_ROUND_PLAYERS;
+            if (persist_start_snapshot(&logged) == 0) {
+                started++;
+            } else {
+                refused++;
+            }
+        }
+    }
+    if (log_players(&logged, next, SNAPSHOT_ROUND_PLAYERS) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    next += SNAPSHOT_ROUND_PLAYERS;
+    persist_close();
+    double log_ms = now_ms() - start;
+    
+    leaderboard_store recovered;
+    if (store_init(&recovered) < 0 || persist_open(data_dir, &recovered, 1, NULL) < 0) {
+        fprintf(stderr, "Failed to reopen %s\n", data_dir);
+        return 1;
+    }
+    persist_close();
+    size_t lost = 0;
+    for (size_t i = 0; i < logged.count; i++) {
+        const store_record* r = &logged.records[i];
+        const store_record* found = store_find_id(&recovered, r->name);
+        if (!found || found->score != r->score) lost++;
+    }
+    
+    printf("players logged:    %zu in %.1f ms\n", next, log_ms);
+    printf("snapshots started: %zu (%zu refused while one was pending)\n", started, refused);
+    printf("players recovered: %zu\n", recovered.count);
+    printf("scores lost:       %zu\n", lost);
+    int failed = lost > 0 || recovered.count != next;
+    
+    store_free(&logged);
+    store_free(&recovered);
+    remove_data_dir(data_dir);
+    return failed;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s startup|columns|memory [players]\n", program);
+    fprintf(stderr, "       %s snapshots [rounds]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    if (strcmp(argv[1], "startup") == 0) {
+        size_t players = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_PLAYERS;
+        return bench_startup(players);
+    }
+    if (strcmp(argv[1], "columns") == 0) {
+        size_t players = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_PLAYERS;
+        return bench_columns(players);
+    }
+    if (strcmp(argv[1], "memory") == 0) {
+        size_t players = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_PLAYERS;
+        return bench_memory(players);
+    }
+    if (strcmp(argv[1], "snapshots") == 0) {
+        size_t rounds = (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_SNAPSHOT_ROUNDS;
+        return bench_snapshots(rounds);
+    }
+    
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "leaderboard_capture.h"
+#include "leaderboard_log.h"
+
+#define CAPTURE_SPARE_CHUNKS 8      // Written chunks kept for reuse
+
+static int trace_fd = -1;
+static uint64_t start_us;           // Unix time the trace starts at
+static uint64_t start_mono_us;      // The same moment on the monotonic clock
+static uint32_t next_connection = 0;
+static uint64_t recorded = 0;       // Written to the trace
+static uint64_t dropped = 0;
+
+// Chunks handed over, oldest first, and written ones kept for reuse
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static capture_chunk* queue_head = NULL;
+static capture_chunk* queue_tail = NULL;
+static size_t queued = 0;
+static capture_chunk* spare = NULL;
+static size_t spare_count = 0;
+static int writer_stopping = 0;
+static pthread_t writer;
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static int write_all(const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(trace_fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Put a written or dropped chunk aside for reuse. Call with queue_lock held.
+static void recycle(capture_chunk* chunk) {
+    if (spare_count >= CAPTURE_SPARE_CHUNKS) {
+        free(chunk);
+        return;
+    }
+    chunk->next = spare;
+    spare = chunk;
+    spare_count++;
+}
+
+static void* run_writer(void* arg) {
+    int failed = 0;
+    (void)arg;
+    
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!queue_head && !writer_stopping) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        capture_chunk* chunk = queue_head;
+        if (!chunk) break;
+        queue_head = chunk->next;
+        if (!queue_head) queue_tail = NULL;
+        queued--;
+        pthread_mutex_unlock(&queue_lock);
+        
+        if (!failed && write_all(chunk->data, chunk->len) < 0) {
+            log_message(LOG_ERROR, "Capture stopped: %s", strerror(errno));
+            failed = 1;
+        }
+        __atomic_add_fetch(failed ? &dropped : &recorded, chunk->records, __ATOMIC_RELAXED);
+        
+        pthread_mutex_lock(&queue_lock);
+        recycle(chunk);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+int capture_open(const char* path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("open capture file");
+        return -1;
+    }
+    // The lock lasts as long as the trace is open, so a server taking over
+    // from one still capturing to path can't truncate its trace
+    if (flock(trace_fd, LOCK_EX | LOCK_NB) < 0 || ftruncate(trace_fd, 0) < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "Capture file %s is in use by another server\n", path);
+        } else {
+            perror("open capture file");
+        }
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_us = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    start_mono_us = monotonic_us();
+    
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 8);
+    put_u32(header + 8, CAPTURE_HEADER_SIZE);
+    put_u32(header + 12, CAPTURE_RECORD_HEADER_SIZE);
+    put_u64(header + 16, start_us);
+    if (write_all(header, sizeof(header)) < 0) {
+        perror("write capture file");
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    if (pthread_create(&writer, NULL, run_writer, NULL) != 0) {
+        perror("pthread_create");
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int capture_enabled() {
+    return trace_fd >= 0;
+}
+
+uint32_t capture_connection_id() {
+    return __atomic_add_fetch(&next_connection, 1, __ATOMIC_RELAXED);
+}
+
+// Queue a chunk for the writer, or drop it if too many are waiting
+static void hand_over(capture_chunk* chunk) {
+    pthread_mutex_lock(&queue_lock);
+    if (queued >= CAPTURE_MAX_QUEUED) {
+        __atomic_add_fetch(&dropped, chunk->records, __ATOMIC_RELAXED);
+        recycle(chunk);
+    } else {
+        chunk->next = NULL;
+        if (queue_tail) queue_tail->next = chunk;
+        else queue_head = chunk;
+        queue_tail = chunk;
+        queued++;
+        pthread_cond_signal(&queue_ready);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static capture_chunk* new_chunk(uint64_t now_ms) {
+    pthread_mutex_lock(&queue_lock);
+    capture_chunk* chunk = spare;
+    if (chunk) {
+        spare = chunk->next;
+        spare_count--;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    if (!chunk && !(chunk = malloc(sizeof(capture_chunk)))) return NULL;
+    chunk->started_ms = now_ms;
+    chunk->len = 0;
+    chunk->records = 0;
+    return chunk;
+}
+
+void capture_record(capture_buffer* buffer, capture_kind kind, uint32_t connection,
+                    uint32_t client_addr, const void* message, size_t length) {
+    if (trace_fd < 0) return;
+    if (length > CAPTURE_MAX_MESSAGE) length = CAPTURE_MAX_MESSAGE;
+    size_t size = CAPTURE_RECORD_HEADER_SIZE + length;
+    uint64_t now = monotonic_us();
+    
+    capture_chunk* chunk = buffer->chunk;
+    if (chunk && chunk->len + size > sizeof(chunk->data)) {
+        hand_over(chunk);
+        chunk = buffer->chunk = NULL;
+    }
+    if (!chunk && size <= sizeof(chunk->data)) {
+        chunk = buffer->chunk = new_chunk(now / 1000);
+    }
+    if (!chunk) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    unsigned char* p = chunk->data + chunk->len;
+    put_u64(p, start_us + (now - start_mono_us));
+    put_u32(p + 8, connection);
+    put_u32(p + 12, client_addr);
+    put_u32(p + 16, (uint32_t)kind << 24 | (uint32_t)length);
+    if (length > 0) memcpy(p + CAPTURE_RECORD_HEADER_SIZE, message, length);
+    chunk->len += size;
+    chunk->records++;
+}
+
+void capture_flush(capture_buffer* buffer, uint64_t now_ms, int force) {
+    capture_chunk* chunk = buffer->chunk;
+    if (!chunk) return;
+    if (!force && now_ms - chunk->started_ms < CAPTURE_FLUSH_MS) return;
+    hand_over(chunk);
+    buffer->chunk = NULL;
+}
+
+void capture_close() {
+    if (trace_fd < 0) return;
+    pthread_mutex_lock(&queue_lock);
+    writer_stopping = 1;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(writer, NULL);
+    
+    while (spare) {
+        capture_chunk* next = spare->next;
+        free(spare);
+        spare = next;
+    }
+    spare_count = 0;
+    if (close(trace_fd) < 0) perror("close capture file");
+    trace_fd = -1;
+}
+
+uint64_t capture_records() {
+    return __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+}
+
+uint64_t capture_dropped() {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
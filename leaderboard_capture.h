@@ -0,0 +1,77 @@
+#ifndef LEADERBOARD_CAPTURE_H
+#define LEADERBOARD_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Traffic capture: every request the server reads is written to a trace
+// file, exactly as it arrived, so that real traffic can later be played
+// back against a test server (leaderboard_replay.c). Each worker fills its
+// own chunk without locking and hands full ones, or ones older than
+// CAPTURE_FLUSH_MS, to a writer thread. If the disk falls behind, whole
+// chunks are dropped and counted rather than stalling the event loops.
+//
+// The trace is a header followed by records, all little-endian:
+//   header  char magic[8] "LBTRACE1", u32 header size, u32 record header
+//           size, u64 start time (unix microseconds)
+//   record  u64 time (unix microseconds), u32 connection, u32 client IPv4,
+//           u32 kind << 24 | length, then length bytes of message
+// Connection ids are unique within a trace; datagrams have connection 0.
+// Records from different workers may be out of time order by up to a
+// chunk's age, so readers sort them. Times come from a monotonic clock
+// anchored at the start time and never go backwards for one connection.
+
+#define CAPTURE_MAGIC "LBTRACE1"
+#define CAPTURE_HEADER_SIZE 24
+#define CAPTURE_RECORD_HEADER_SIZE 20
+#define CAPTURE_MAX_MESSAGE 0xFFFFFF
+#define CAPTURE_CHUNK_SIZE (256 * 1024)
+#define CAPTURE_FLUSH_MS 100
+#define CAPTURE_MAX_QUEUED 64       // Chunks waiting for the writer before new ones are dropped
+
+typedef enum {
+    CAPTURE_TEXT = 1,               // A legacy one-shot text request
+    CAPTURE_FRAMED,                 // A framed text request, without its length prefix
+    CAPTURE_BINARY,                 // A binary request, header and payload
+    CAPTURE_DATAGRAM,               // A whole UDP datagram, request id and all
+    CAPTURE_CLOSE                   // The connection closed; no message
+} capture_kind;
+
+typedef struct capture_chunk {
+    struct capture_chunk* next;
+    uint64_t started_ms;            // When its first record was added
+    size_t len;
+    size_t records;
+    unsigned char data[CAPTURE_CHUNK_SIZE];
+} capture_chunk;
+
+// One worker's records not yet handed to the writer. Zeroed is empty.
+typedef struct {
+    capture_chunk* chunk;
+} capture_buffer;
+
+// Create or truncate the trace at path and start the writer thread.
+// Returns -1 on error, or if another server is capturing to path.
+int capture_open(const char* path);
+
+int capture_enabled();
+
+// A new connection id for the trace
+uint32_t capture_connection_id();
+
+// Add one record to a worker's buffer. client_addr is in host byte order.
+void capture_record(capture_buffer* buffer, capture_kind kind, uint32_t connection,
+                    uint32_t client_addr, const void* message, size_t length);
+
+// Hand the buffer to the writer if its records have waited long enough,
+// or at once if force is set
+void capture_flush(capture_buffer* buffer, uint64_t now_ms, int force);
+
+// Write out everything handed over so far and stop the writer thread.
+// Flush every buffer first.
+void capture_close();
+
+uint64_t capture_records();         // Written to the trace so far
+uint64_t capture_dropped();         // Records lost to a full queue or failed writes
+
+#endif
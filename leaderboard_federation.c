@@ -0,0 +1,700 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "leaderboard_federation.h"
+#include "leaderboard_protocol.h"
+#include "leaderboard_log.h"
+
+#define LEAF_SHIFT 48               // Leaf of a name: the top 16 bits of its hash
+#define LEAVES_REPLY_SIZE (8 + FEDERATION_MAX_ENTRIES * WIRE_KEYED_ENTRY_SIZE)
+#define MESSAGE_SIZE (BINARY_HEADER_SIZE + LEAVES_REPLY_SIZE)
+#define MESSAGE_DROPPED -2          // exchange(): lost to fault injection
+#define MAX_ATTEMPTS 8              // Sends of an anti-entropy request before the round gives up
+#define RUN_GAP_PLAYERS 64          // Players in matching leaves swapped anyway to join two runs
+
+typedef struct {
+    struct sockaddr_in address;
+    char label[INET_ADDRSTRLEN + 8];  // IP:PORT, for the log
+    int fd;                         // -1 while disconnected
+    int up;
+    uint64_t cursor;                // Queue position of the next score to send
+    uint64_t retry_ms;              // Left alone until then after a failure
+    uint64_t next_round_ms;         // Next anti-entropy round
+} peer;
+
+// A local score waiting to be sent
+typedef struct {
+    uint32_t name;
+    int32_t score;
+    int64_t timestamp;
+} queued_score;
+
+static peer peers[FEDERATION_MAX_PEERS];
+static int peer_count = 0;
+static int drop_percent = 0;
+static int delay_ms = 0;
+static int interval_ms = FEDERATION_DEFAULT_INTERVAL * 1000;
+static uint64_t rng;
+static unsigned char secret[FEDERATION_MAX_SECRET];
+static size_t secret_len = 0;
+
+static leaderboard_store* board = NULL;
+static pthread_rwlock_t* board_lock = NULL;
+static federation_merge_fn merge_records;
+
+// The digest tree's leaves, and for each name on the board its hash and
+// the next name in the same leaf, so a leaf's players can be listed
+// without scanning the board. A hash of 0 means the name is not on the
+// board yet. Guarded by board_lock; NULL board means not started.
+static uint64_t* name_hashes = NULL;
+static uint32_t* leaf_next = NULL;  // Name id -> next name id + 1 (0 = last)
+static size_t names_len = 0;
+static uint32_t leaf_head[FEDERATION_LEAVES];  // First name id + 1 (0 = empty)
+static uint32_t leaf_players[FEDERATION_LEAVES];
+static uint64_t leaf_digest[FEDERATION_LEAVES];
+
+// Local scores in the order they were kept. Position n is in slot
+// n % FEDERATION_QUEUE_SIZE; when the queue wraps, peers that had not sent
+// the oldest scores yet lose them.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static queued_score queue[FEDERATION_QUEUE_SIZE];
+static uint64_t queue_end = 0;      // Scores ever queued
+
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_wake = PTHREAD_COND_INITIALIZER;
+static int thread_stopping = 0;
+static pthread_t thread;
+
+// Only the federation thread sends, so one buffer each way will do
+static unsigned char outgoing[MESSAGE_SIZE];
+static unsigned char incoming[MESSAGE_SIZE];
+
+static uint64_t sent = 0;
+static uint64_t lost = 0;
+static uint64_t merged = 0;
+static uint64_t repaired = 0;
+static uint64_t rounds = 0;
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// splitmix64's finalizer: spreads every input bit over the whole word
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// What a record adds to its leaf's digest. The client address is left
+// out: two servers may hold the same best score from different addresses.
+static uint64_t record_hash(uint64_t name_hash, const store_record* record) {
+    return mix(name_hash ^ mix((uint64_t)(uint32_t)record->score ^
+                               mix((uint64_t)record->timestamp)));
+}
+
+static uint32_t leaf_of(uint64_t name_hash) {
+    return (uint32_t)(name_hash >> LEAF_SHIFT);
+}
+
+int federation_add_peer(const char* address) {
+    char ip[INET_ADDRSTRLEN];
+    const char* colon = strrchr(address, ':');
+    if (peer_count >= FEDERATION_MAX_PEERS || !colon || colon == address ||
+        (size_t)(colon - address) >= sizeof(ip)) {
+        return -1;
+    }
+    memcpy(ip, address, colon - address);
+    ip[colon - address] = '\0';
+    int port = atoi(colon + 1);
+    
+    peer* p = &peers[peer_count];
+    memset(p, 0, sizeof(*p));
+    p->address.sin_family = AF_INET;
+    p->address.sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &p->address.sin_addr) != 1) return -1;
+    snprintf(p->label, sizeof(p->label), "%s:%d", ip, port);
+    p->fd = -1;
+    peer_count++;
+    return 0;
+}
+
+int federation_enabled() {
+    return peer_count > 0;
+}
+
+int federation_load_secret(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    char line[FEDERATION_MAX_SECRET + 2];
+    size_t len = fgets(line, sizeof(line), file) ? strcspn(line, "\r\n") : 0;
+    fclose(file);
+    if (len == 0 || len > FEDERATION_MAX_SECRET) {
+        fprintf(stderr, "%s: the secret must be one line of 1 to %d bytes\n", path,
+                FEDERATION_MAX_SECRET);
+        return -1;
+    }
+    memcpy(secret, line, len);
+    secret_len = len;
+    return 0;
+}
+
+int federation_check_secret(const void* candidate, size_t len) {
+    // Compared in constant time, so timing tells nothing of the secret
+    const unsigned char* bytes = candidate;
+    unsigned char differ = len != secret_len;
+    for (size_t i = 0; i < secret_len; i++) {
+        differ |= secret[i] ^ (i < len ? bytes[i] : 0);
+    }
+    return secret_len > 0 && !differ;
+}
+
+int federation_is_peer(uint32_t client_addr) {
+    for (int i = 0; i < peer_count; i++) {
+        if (ntohl(peers[i].address.sin_addr.s_addr) == client_addr) return 1;
+    }
+    return 0;
+}
+
+void federation_set_faults(int drop, int delay) {
+    drop_percent = drop;
+    delay_ms = delay;
+}
+
+// Make room for name id in the per-name arrays
+static int reserve_names(uint32_t id) {
+    if (id < names_len) return 0;
+    size_t len = names_len ? names_len : 1024;
+    while (len <= id) len *= 2;
+    uint64_t* hashes = realloc(name_hashes, len * sizeof(uint64_t));
+    if (!hashes) return -1;
+    name_hashes = hashes;
+    uint32_t* next = realloc(leaf_next, len * sizeof(uint32_t));
+    if (!next) return -1;
+    leaf_next = next;
+    memset(name_hashes + names_len, 0, (len - names_len) * sizeof(uint64_t));
+    memset(leaf_next + names_len, 0, (len - names_len) * sizeof(uint32_t));
+    names_len = len;
+    return 0;
+}
+
+// Hash of a name on the board, adding it to its leaf if new; 0 if memory
+// ran out
+static uint64_t name_hash(uint32_t id) {
+    if (reserve_names(id) < 0) return 0;
+    if (name_hashes[id] == 0) {
+        uint64_t hash = mix(store_hash_name(store_name(id)));
+        name_hashes[id] = hash ? hash : 1;
+        uint32_t leaf = leaf_of(name_hashes[id]);
+        leaf_next[id] = leaf_head[leaf];
+        leaf_head[leaf] = id + 1;
+        leaf_players[leaf]++;
+    }
+    return name_hashes[id];
+}
+
+int federation_update(const store_record* before, const store_record* after) {
+    if (!board) return 0;
+    uint64_t hash = name_hash(after->name);
+    if (hash == 0) return -1;
+    uint32_t leaf = leaf_of(hash);
+    if (before) leaf_digest[leaf] -= record_hash(hash, before);
+    leaf_digest[leaf] += record_hash(hash, after);
+    return 0;
+}
+
+// Compute every digest from the board. Call with board_lock held for
+// writing.
+static int rebuild_digests() {
+    memset(leaf_head, 0, sizeof(leaf_head));
+    memset(leaf_players, 0, sizeof(leaf_players));
+    memset(leaf_digest, 0, sizeof(leaf_digest));
+    if (names_len > 0) memset(name_hashes, 0, names_len * sizeof(uint64_t));
+    for (size_t i = 0; i < board->count; i++) {
+        if (federation_update(NULL, &board->records[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+int federation_digests(uint32_t level, uint32_t first, uint32_t count, unsigned char* out) {
+    uint32_t nodes = level == 0 ? 1 : level == 1 ? FEDERATION_FANOUT : FEDERATION_LEAVES;
+    uint32_t leaves = FEDERATION_LEAVES / nodes;    // Under each node
+    if (level > 2 || count > FEDERATION_FANOUT || first > nodes || count > nodes - first) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t digest = 0;
+        for (uint32_t leaf = (first + i) * leaves; leaf < (first + i + 1) * leaves; leaf++) {
+            digest += leaf_digest[leaf];
+        }
+        put_u64le(out + i * 8, digest);
+    }
+    return 0;
+}
+
+size_t federation_leaf_records(uint32_t first, uint32_t count, unsigned char* out,
+                               uint32_t* next) {
+    size_t written = 0;
+    uint32_t leaf = first;
+    if (first > FEDERATION_LEAVES) first = leaf = FEDERATION_LEAVES;
+    if (count > FEDERATION_LEAVES - first) count = FEDERATION_LEAVES - first;
+    
+    for (; leaf < first + count; leaf++) {
+        // Whole leaves only, so the reader can carry on from the next one.
+        // A leaf too big to send at all (tens of millions of players) is
+        // cut short.
+        if (written > 0 && written + leaf_players[leaf] > FEDERATION_MAX_ENTRIES) break;
+        for (uint32_t id = leaf_head[leaf]; id && written < FEDERATION_MAX_ENTRIES;
+             id = leaf_next[id - 1]) {
+            const store_record* record = store_find_id(board, id - 1);
+            if (!record) continue;
+            unsigned char* entry = out + written * WIRE_KEYED_ENTRY_SIZE;
+            memset(entry, 0, WIRE_NAME_SIZE);
+            memcpy(entry, store_name(id - 1), strnlen(store_name(id - 1), WIRE_NAME_SIZE - 1));
+            put_u32le(entry + WIRE_NAME_SIZE, (uint32_t)record->score);
+            put_u64le(entry + WIRE_ENTRY_SIZE, (uint64_t)record->timestamp);
+            written++;
+        }
+    }
+    *next = leaf;
+    return written;
+}
+
+void federation_publish(const leaderboard_entry* record) {
+    if (!board) return;
+    uint32_t name = store_name_id(record->player_name);
+    if (name == STORE_NO_NAME) return;
+    pthread_mutex_lock(&queue_lock);
+    queued_score* slot = &queue[queue_end & (FEDERATION_QUEUE_SIZE - 1)];
+    slot->name = name;
+    slot->score = record->score;
+    slot->timestamp = (int64_t)record->timestamp;
+    queue_end++;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void federation_count_merged(size_t count) {
+    __atomic_add_fetch(&merged, count, __ATOMIC_RELAXED);
+}
+
+static void peer_down(peer* p, const char* why) {
+    if (p->fd >= 0) close(p->fd);
+    p->fd = -1;
+    if (p->up) log_message(LOG_WARN, "Federation peer %s down: %s", p->label, why);
+    __atomic_store_n(&p->up, 0, __ATOMIC_RELAXED);
+    p->retry_ms = monotonic_ms() + FEDERATION_RETRY_MS;
+}
+
+static int send_all(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Present the shared secret on a new connection. Returns -1 if the peer
+// failed or refused it, with errno EACCES if it refused.
+static int authenticate(int fd) {
+    unsigned char message[BINARY_HEADER_SIZE + FEDERATION_MAX_SECRET];
+    binary_put_header(message, OP_PEER_AUTH, (uint32_t)secret_len);
+    memcpy(message + BINARY_HEADER_SIZE, secret, secret_len);
+    if (send_all(fd, message, BINARY_HEADER_SIZE + secret_len) < 0) return -1;
+    
+    unsigned char header[BINARY_HEADER_SIZE];
+    if (recv_all(fd, header, sizeof(header)) < 0) return -1;
+    uint32_t len = get_u32le(header + 4);
+    if (header[0] != BINARY_MAGIC || len > sizeof(message) || recv_all(fd, message, len) < 0) {
+        return -1;
+    }
+    if (get_u16le(header + 2) != OP_OK) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+static int peer_connect(peer* p) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    // On Linux the send timeout bounds connect() as well
+    struct timeval timeout = {FEDERATION_TIMEOUT_MS / 1000, FEDERATION_TIMEOUT_MS % 1000 * 1000};
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&p->address, sizeof(p->address)) < 0 ||
+        authenticate(fd) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    p->fd = fd;
+    return 0;
+}
+
+// Send the request in outgoing (payload after the header) to a peer and
+// read the reply payload into incoming. Returns the reply opcode,
+// MESSAGE_DROPPED if fault injection lost the request, or -1 if the peer
+// failed, after which it is disconnected, or the server is stopping.
+static int exchange(peer* p, uint16_t opcode, size_t len, uint32_t* reply_len) {
+    if (__atomic_load_n(&thread_stopping, __ATOMIC_RELAXED)) return -1;
+    if (delay_ms > 0) {
+        uint64_t wait_ms = next_random() % (uint64_t)(delay_ms + 1);
+        struct timespec pause = {(time_t)(wait_ms / 1000), (long)(wait_ms % 1000) * 1000000L};
+        nanosleep(&pause, NULL);
+    }
+    if (drop_percent > 0 && (int)(next_random() % 100) < drop_percent) return MESSAGE_DROPPED;
+    if (p->fd < 0 && peer_connect(p) < 0) {
+        peer_down(p, strerror(errno));
+        return -1;
+    }
+    
+    binary_put_header(outgoing, opcode, (uint32_t)len);
+    if (send_all(p->fd, outgoing, BINARY_HEADER_SIZE + len) < 0) {
+        peer_down(p, "send failed");
+        return -1;
+    }
+    unsigned char header[BINARY_HEADER_SIZE];
+    if (recv_all(p->fd, header, sizeof(header)) < 0) {
+        peer_down(p, "no reply");
+        return -1;
+    }
+    *reply_len = get_u32le(header + 4);
+    if (header[0] != BINARY_MAGIC || *reply_len > LEAVES_REPLY_SIZE ||
+        recv_all(p->fd, incoming, *reply_len) < 0) {
+        peer_down(p, "bad reply");
+        return -1;
+    }
+    uint16_t reply = get_u16le(header + 2);
+    if (reply == OP_ERROR) {
+        log_message(LOG_WARN, "Federation peer %s refused: %.*s", p->label, (int)*reply_len,
+                    (const char*)incoming);
+        peer_down(p, "refused");
+        return -1;
+    }
+    if (!p->up) log_message(LOG_INFO, "Federation peer %s up", p->label);
+    __atomic_store_n(&p->up, 1, __ATOMIC_RELAXED);
+    return reply;
+}
+
+// exchange() for anti-entropy requests: one that was dropped is sent
+// again, as it would be after a timeout. Returns the reply opcode, or -1.
+static int request(peer* p, uint16_t opcode, size_t len, uint32_t* reply_len) {
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        int reply = exchange(p, opcode, len, reply_len);
+        if (reply != MESSAGE_DROPPED) return reply;
+    }
+    return -1;
+}
+
+// Send the scores queued since the last batch, up to a batch at a time
+static void push_deltas(peer* p) {
+    while (p->fd >= 0 || monotonic_ms() >= p->retry_ms) {
+        unsigned char* payload = outgoing + BINARY_HEADER_SIZE;
+        uint32_t count = 0;
+        pthread_mutex_lock(&queue_lock);
+        if (queue_end - p->cursor > FEDERATION_QUEUE_SIZE) {
+            __atomic_add_fetch(&lost, queue_end - p->cursor - FEDERATION_QUEUE_SIZE,
+                               __ATOMIC_RELAXED);
+            p->cursor = queue_end - FEDERATION_QUEUE_SIZE;
+        }
+        for (; p->cursor + count < queue_end && count < FEDERATION_MAX_ENTRIES; count++) {
+            const queued_score* score = &queue[(p->cursor + count) & (FEDERATION_QUEUE_SIZE - 1)];
+            unsigned char* entry = payload + 4 + count * WIRE_KEYED_ENTRY_SIZE;
+            const char* name = store_name(score->name);
+            memset(entry, 0, WIRE_NAME_SIZE);
+            memcpy(entry, name, strnlen(name, WIRE_NAME_SIZE - 1));
+            put_u32le(entry + WIRE_NAME_SIZE, (uint32_t)score->score);
+            put_u64le(entry + WIRE_ENTRY_SIZE, (uint64_t)score->timestamp);
+        }
+        pthread_mutex_unlock(&queue_lock);
+        if (count == 0) return;
+        
+        put_u32le(payload, count);
+        uint32_t reply_len;
+        int reply = exchange(p, OP_MERGE, 4 + (size_t)count * WIRE_KEYED_ENTRY_SIZE, &reply_len);
+        if (reply < 0 && reply != MESSAGE_DROPPED) return;  // Resent once the peer is back
+        __atomic_add_fetch(reply == OP_OK ? &sent : &lost, count, __ATOMIC_RELAXED);
+        p->cursor += count;
+    }
+}
+
+// Fetch count digests of a level from a peer. Returns 0, or -1 if the
+// round has to be abandoned.
+static int peer_digests(peer* p, uint32_t level, uint32_t first, uint32_t count,
+                        uint64_t* out) {
+    unsigned char* payload = outgoing + BINARY_HEADER_SIZE;
+    put_u32le(payload, level);
+    put_u32le(payload + 4, first);
+    put_u32le(payload + 8, count);
+    uint32_t reply_len;
+    if (request(p, OP_GET_DIGEST, 12, &reply_len) != OP_DIGEST || reply_len < 4 + count * 8 ||
+        get_u32le(incoming) != count) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = get_u64le(incoming + 4 + i * 8);
+    }
+    return 0;
+}
+
+// Our own digests, and for leaves how many players each holds if players
+// is not NULL
+static void local_digests(uint32_t level, uint32_t first, uint32_t count, uint64_t* out,
+                          uint32_t* players) {
+    unsigned char digests[FEDERATION_FANOUT * 8];
+    pthread_rwlock_rdlock(board_lock);
+    federation_digests(level, first, count, digests);
+    if (players) memcpy(players, leaf_players + first, count * sizeof(uint32_t));
+    pthread_rwlock_unlock(board_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = get_u64le(digests + i * 8);
+    }
+}
+
+// Apply wire entries from a peer. Returns how many changed a board.
+static size_t merge_entries(const unsigned char* entries, uint32_t count) {
+    leaderboard_entry* records = malloc((count ? count : 1) * sizeof(leaderboard_entry));
+    if (!records) return 0;
+    size_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char* entry = entries + i * WIRE_KEYED_ENTRY_SIZE;
+        leaderboard_entry* record = &records[kept];
+        memset(record, 0, sizeof(*record));
+        memcpy(record->player_name, entry, strnlen((const char*)entry, WIRE_NAME_SIZE - 1));
+        record->score = (int)get_u32le(entry + WIRE_NAME_SIZE);
+        record->timestamp = (time_t)get_u64le(entry + WIRE_ENTRY_SIZE);
+        if (record->player_name[0]) kept++;
+    }
+    size_t changed = merge_records(records, kept);
+    free(records);
+    return changed;
+}
+
+// Swap the records of leaves first to first + count - 1 with a peer: take
+// theirs, then send ours. Returns -1 if the round has to be abandoned.
+static int exchange_leaves(peer* p, uint32_t first, uint32_t count) {
+    uint32_t end = first + count;
+    for (uint32_t leaf = first; leaf < end;) {
+        unsigned char* payload = outgoing + BINARY_HEADER_SIZE;
+        put_u32le(payload, leaf);
+        put_u32le(payload + 4, end - leaf);
+        uint32_t reply_len;
+        if (request(p, OP_GET_LEAVES, 8, &reply_len) != OP_LEAVES || reply_len < 8) return -1;
+        uint32_t next = get_u32le(incoming);
+        uint32_t entries = get_u32le(incoming + 4);
+        if (next <= leaf || next > end || entries > FEDERATION_MAX_ENTRIES ||
+            reply_len < 8 + entries * WIRE_KEYED_ENTRY_SIZE) {
+            return -1;
+        }
+        __atomic_add_fetch(&repaired, merge_entries(incoming + 8, entries), __ATOMIC_RELAXED);
+        leaf = next;
+    }
+    
+    for (uint32_t leaf = first; leaf < end;) {
+        unsigned char* payload = outgoing + BINARY_HEADER_SIZE;
+        uint32_t next;
+        pthread_rwlock_rdlock(board_lock);
+        size_t entries = federation_leaf_records(leaf, end - leaf, payload + 4, &next);
+        pthread_rwlock_unlock(board_lock);
+        put_u32le(payload, (uint32_t)entries);
+        uint32_t reply_len;
+        if (entries > 0 &&
+            request(p, OP_MERGE, 4 + entries * WIRE_KEYED_ENTRY_SIZE, &reply_len) != OP_OK) {
+            return -1;
+        }
+        leaf = next;
+    }
+    return 0;
+}
+
+// One anti-entropy round: walk down the digest tree where it differs from
+// the peer's and swap the records of every leaf that does. Returns -1 if
+// the peer failed.
+static int reconcile(peer* p) {
+    uint64_t mine[FEDERATION_FANOUT];
+    uint64_t theirs[FEDERATION_FANOUT];
+    if (peer_digests(p, 0, 0, 1, theirs) < 0) return -1;
+    local_digests(0, 0, 1, mine, NULL);
+    if (mine[0] == theirs[0]) return 0;
+    
+    uint64_t range_mine[FEDERATION_FANOUT];
+    uint64_t range_theirs[FEDERATION_FANOUT];
+    if (peer_digests(p, 1, 0, FEDERATION_FANOUT, range_theirs) < 0) return -1;
+    local_digests(1, 0, FEDERATION_FANOUT, range_mine, NULL);
+    for (uint32_t range = 0; range < FEDERATION_FANOUT; range++) {
+        if (range_mine[range] == range_theirs[range]) continue;
+        uint32_t base = range * FEDERATION_FANOUT;
+        if (peer_digests(p, 2, base, FEDERATION_FANOUT, theirs) < 0) return -1;
+        uint32_t players[FEDERATION_FANOUT];
+        local_digests(2, base, FEDERATION_FANOUT, mine, players);
+        
+        // Differing leaves go in runs, joined across matching ones holding
+        // up to RUN_GAP_PLAYERS: a few records too many cost less than
+        // another message
+        int start = -1;                 // First leaf of the current run
+        uint32_t last = 0;              // Its last differing leaf
+        uint32_t gap = 0;               // Players in matching leaves since
+        for (uint32_t i = 0; i < FEDERATION_FANOUT; i++) {
+            if (mine[i] == theirs[i]) {
+                gap += players[i];
+                continue;
+            }
+            if (start >= 0 && gap > RUN_GAP_PLAYERS) {
+                if (exchange_leaves(p, base + start, last - start + 1) < 0) return -1;
+                start = -1;
+            }
+            if (start < 0) start = (int)i;
+            last = i;
+            gap = 0;
+        }
+        if (start >= 0 && exchange_leaves(p, base + start, last - start + 1) < 0) return -1;
+    }
+    return 0;
+}
+
+static void* run_federation(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&thread_lock);
+    while (!thread_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += FEDERATION_PUSH_MS * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&thread_wake, &thread_lock, &until);
+        if (thread_stopping) break;
+        pthread_mutex_unlock(&thread_lock);
+        
+        for (int i = 0; i < peer_count; i++) {
+            peer* p = &peers[i];
+            push_deltas(p);
+            uint64_t now = monotonic_ms();
+            if (now < p->next_round_ms || now < p->retry_ms) continue;
+            if (reconcile(p) == 0) {
+                __atomic_add_fetch(&rounds, 1, __ATOMIC_RELAXED);
+                p->next_round_ms = monotonic_ms() + interval_ms;
+            } else {
+                // What was swapped so far stays swapped; try again soon
+                p->next_round_ms = monotonic_ms() + FEDERATION_RETRY_MS;
+            }
+        }
+        pthread_mutex_lock(&thread_lock);
+    }
+    pthread_mutex_unlock(&thread_lock);
+    return NULL;
+}
+
+int federation_start(leaderboard_store* store, pthread_rwlock_t* lock, federation_merge_fn merge,
+                     int interval_seconds) {
+    if (peer_count == 0) return 0;
+    board_lock = lock;
+    merge_records = merge;
+    interval_ms = interval_seconds * 1000;
+    rng = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    
+    pthread_rwlock_wrlock(board_lock);
+    board = store;
+    int result = rebuild_digests();
+    pthread_rwlock_unlock(board_lock);
+    if (result < 0) {
+        fprintf(stderr, "Failed to allocate federation digests\n");
+        return -1;
+    }
+    // The first round runs soon after start, to catch up after downtime
+    for (int i = 0; i < peer_count; i++) {
+        peers[i].next_round_ms = monotonic_ms() + FEDERATION_RETRY_MS;
+    }
+    if (pthread_create(&thread, NULL, run_federation, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    log_message(LOG_INFO, "Federated with %d peer%s", peer_count, peer_count == 1 ? "" : "s");
+    return 0;
+}
+
+void federation_stop() {
+    if (!board) return;
+    pthread_mutex_lock(&thread_lock);
+    __atomic_store_n(&thread_stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&thread_wake);
+    pthread_mutex_unlock(&thread_lock);
+    pthread_join(thread, NULL);
+    
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].fd >= 0) close(peers[i].fd);
+        peers[i].fd = -1;
+    }
+    pthread_rwlock_wrlock(board_lock);
+    board = NULL;
+    pthread_rwlock_unlock(board_lock);
+    free(name_hashes);
+    free(leaf_next);
+    name_hashes = NULL;
+    leaf_next = NULL;
+    names_len = 0;
+}
+
+void federation_get_totals(federation_totals* totals) {
+    memset(totals, 0, sizeof(*totals));
+    totals->peers = peer_count;
+    for (int i = 0; i < peer_count; i++) {
+        totals->peers_up += __atomic_load_n(&peers[i].up, __ATOMIC_RELAXED);
+    }
+    totals->sent = __atomic_load_n(&sent, __ATOMIC_RELAXED);
+    totals->lost = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+    totals->merged = __atomic_load_n(&merged, __ATOMIC_RELAXED);
+    totals->repaired = __atomic_load_n(&repaired, __ATOMIC_RELAXED);
+    totals->rounds = __atomic_load_n(&rounds, __ATOMIC_RELAXED);
+    if (board_lock) {
+        unsigned char root[8];
+        pthread_rwlock_rdlock(board_lock);
+        if (board) {
+            federation_digests(0, 0, 1, root);
+            totals->digest = get_u64le(root);
+        }
+        pthread_rwlock_unlock(board_lock);
+    }
+}
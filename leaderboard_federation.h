@@ -0,0 +1,124 @@
+#ifndef LEADERBOARD_FEDERATION_H
+#define LEADERBOARD_FEDERATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "leaderboard_store.h"
+
+// Federation: several servers, one per site, each taking submissions and
+// answering reads on its own, that all end up holding the same all-time
+// board with no primary among them. Each player's best score is the
+// better of two records (see store_merge), and keeping the better record
+// is commutative and idempotent, which makes the board a state-based CRDT:
+// servers may exchange records in any order, lose some or see them twice,
+// and still agree once each has seen the other's.
+//
+// Two mechanisms carry records between peers. Every score a server keeps
+// from its own clients is queued and sent to each peer in OP_MERGE
+// batches within about FEDERATION_PUSH_MS. Deltas that are lost, to a
+// full queue or a peer that was down, are repaired by anti-entropy: every
+// interval a server compares digests with each peer and swaps the records
+// wherever they differ. The digest is a Merkle tree over name hashes with
+// FEDERATION_FANOUT children per node: the root covers every player, the
+// level below it FEDERATION_FANOUT ranges of the hash space, and the
+// leaves FEDERATION_LEAVES smaller ranges. A node's digest is the sum of
+// a hash of (name, score, time) for each player in its range, so it
+// changes in O(1) with each score and two servers compare a million
+// players in a few small messages when they mostly agree.
+//
+// Peers authenticate each connection with a secret all sites share
+// (OP_PEER_AUTH), and only their --peer addresses may: a server answers
+// federation requests, unthrottled, on connections that have. The secret
+// crosses the wire as is, so links between sites should be private or
+// tunnelled. Records dated more than FEDERATION_MAX_SKEW seconds ahead of
+// the local clock are not merged until they are due.
+//
+// Records received from a peer are not forwarded, so with every site
+// listing every other as a peer a score takes one hop; with fewer links
+// anti-entropy still carries it, a round per hop. Only the all-time board
+// is reconciled. The rolling windows take in merged scores as they
+// arrive, and namespaces are not federated at all.
+//
+// Digests and the name hash cache are guarded by the lock passed to
+// federation_start(), the one that guards the board.
+
+#define FEDERATION_MAX_PEERS 16
+#define FEDERATION_FANOUT 256
+#define FEDERATION_LEAVES (FEDERATION_FANOUT * FEDERATION_FANOUT)
+#define FEDERATION_QUEUE_SIZE 65536     // Local scores awaiting send; power of two
+#define FEDERATION_MAX_ENTRIES 1000     // Records per OP_MERGE or OP_LEAVES
+#define FEDERATION_PUSH_MS 50
+#define FEDERATION_DEFAULT_INTERVAL 10  // Seconds between anti-entropy rounds
+#define FEDERATION_TIMEOUT_MS 2000      // Peer replies
+#define FEDERATION_RETRY_MS 1000        // Pause after a peer fails
+#define FEDERATION_MAX_SECRET 256       // Bytes
+#define FEDERATION_MAX_SKEW 60          // Seconds a peer's clock may run ahead
+
+// Apply records from a peer to the board, each player's best winning.
+// Takes the board's lock itself. Returns how many changed it.
+typedef size_t (*federation_merge_fn)(leaderboard_entry* records, size_t count);
+
+typedef struct {
+    int peers;
+    int peers_up;                   // Answered their last message
+    uint64_t sent;                  // Local scores sent to a peer
+    uint64_t lost;                  // Dropped from a full queue or by fault injection
+    uint64_t merged;                // Records peers sent that changed a board
+    uint64_t repaired;              // Records fetched from peers that changed one
+    uint64_t rounds;                // Anti-entropy rounds completed
+    uint64_t digest;                // Root digest; equal on servers that agree
+} federation_totals;
+
+// Add a peer given as "IP:PORT". Returns -1 if malformed or too many.
+int federation_add_peer(const char* address);
+
+int federation_enabled();
+
+// Read the secret peers share from the first line of path. Returns -1 if
+// it can't be read or is empty or too long.
+int federation_load_secret(const char* path);
+
+// Nonzero if len bytes at candidate are the shared secret
+int federation_check_secret(const void* candidate, size_t len);
+
+// Nonzero if client_addr (host byte order) belongs to a peer
+int federation_is_peer(uint32_t client_addr);
+
+// Fault injection for testing: drop this percentage of messages to peers,
+// and hold each one back for a random time up to delay_ms first
+void federation_set_faults(int drop_percent, int delay_ms);
+
+// Compute every digest from the board, then start the thread that talks
+// to peers. Call once the board is loaded. Returns -1 on error.
+int federation_start(leaderboard_store* board, pthread_rwlock_t* lock, federation_merge_fn merge,
+                     int interval_seconds);
+
+void federation_stop();
+
+// A player's record changed from before (NULL if new) to after. Call with
+// the lock held for writing. Returns -1 if memory ran out.
+int federation_update(const store_record* before, const store_record* after);
+
+// Queue a score some board kept from a local client, for the peers. Call
+// with the lock held for writing, so the queue stays in the order scores
+// were kept.
+void federation_publish(const leaderboard_entry* record);
+
+// Count records peers sent in OP_MERGE that changed a board
+void federation_count_merged(size_t count);
+
+// Write count digests of a tree level (0 = root, 1, 2 = leaves) from
+// first, as u64s. Returns -1 if out of range. Call with the lock held.
+int federation_digests(uint32_t level, uint32_t first, uint32_t count, unsigned char* out);
+
+// Write the records of leaves first to first + count - 1 as wire entries,
+// whole leaves at a time and at most FEDERATION_MAX_ENTRIES. Returns how
+// many and sets *next to the first leaf not written. Call with the lock
+// held.
+size_t federation_leaf_records(uint32_t first, uint32_t count, unsigned char* out,
+                               uint32_t* next);
+
+void federation_get_totals(federation_totals* totals);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "leaderboard_handoff.h"
+
+static int unix_address(struct sockaddr_un* address, const char* path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char* path) {
+    struct sockaddr_un address;
+    if (unix_address(&address, path) < 0) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 1) < 0) {
+        perror("upgrade socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_accept(int listen_fd) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return -1;
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+int handoff_connect(const char* path) {
+    struct sockaddr_un address;
+    if (unix_address(&address, path) < 0) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "No server to take over at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_send(int sock, const void* message, size_t len, const int* fds, int fd_count) {
+    struct iovec iov = {(void*)message, len};
+    struct msghdr msg;
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+    
+    for (;;) {
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent == (ssize_t)len) return 0;
+        if (sent < 0 && errno == EINTR) continue;
+        return -1;
+    }
+}
+
+ssize_t handoff_recv(int sock, void* buffer, int* fds, int* fd_count) {
+    struct iovec iov = {buffer, HANDOFF_MAX_MESSAGE};
+    struct msghdr msg;
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *fd_count = 0;
+    
+    ssize_t len;
+    do {
+        len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) return -1;
+    
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*fd_count < HANDOFF_MAX_FDS) fds[(*fd_count)++] = fd;
+            else close(fd);
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int i = 0; i < *fd_count; i++) {
+            close(fds[i]);
+        }
+        *fd_count = 0;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return len;
+}
+
+void handoff_batch_start(handoff_batch* batch, int sock, int board, const char* name_space) {
+    batch->sock = sock;
+    batch->failed = 0;
+    memset(&batch->header, 0, sizeof(batch->header));
+    batch->header.type = HANDOFF_ENTRIES;
+    batch->header.board = board;
+    snprintf(batch->header.name_space, sizeof(batch->header.name_space), "%s",
+             name_space ? name_space : "");
+}
+
+static void send_batch(handoff_batch* batch) {
+    if (batch->header.count == 0) return;
+    memcpy(batch->message, &batch->header, sizeof(batch->header));
+    size_t len = sizeof(batch->header) + batch->header.count * sizeof(leaderboard_entry);
+    if (handoff_send(batch->sock, batch->message, len, NULL, 0) < 0) batch->failed = 1;
+    batch->header.count = 0;
+}
+
+void handoff_batch_add(handoff_batch* batch, const store_record* record) {
+    size_t offset = sizeof(batch->header) + batch->header.count * sizeof(leaderboard_entry);
+    if (offset + sizeof(leaderboard_entry) > sizeof(batch->message)) {
+        send_batch(batch);
+        offset = sizeof(batch->header);
+    }
+    leaderboard_entry entry;
+    store_unpack(record, &entry);
+    memcpy(batch->message + offset, &entry, sizeof(entry));
+    batch->header.count++;
+}
+
+int handoff_batch_finish(handoff_batch* batch) {
+    send_batch(batch);
+    return batch->failed ? -1 : 0;
+}
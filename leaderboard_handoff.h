@@ -0,0 +1,120 @@
+#ifndef LEADERBOARD_HANDOFF_H
+#define LEADERBOARD_HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include "leaderboard_store.h"
+#include "leaderboard_namespace.h"
+
+// Hot restart: a new server process takes over from a running one without
+// refusing a single connection. The running server listens on a Unix
+// socket; the new one connects and asks to take over. The old one stops
+// reading requests, finishes sending the replies it owes and closes its
+// log, then passes over its listening sockets, its open client connections
+// and whatever state is not on disk. Sockets travel as SCM_RIGHTS
+// descriptors, so the kernel objects themselves change hands: clients
+// waiting in an accept queue or mid-conversation never notice.
+//
+// The exchange is a series of SOCK_SEQPACKET messages, each starting with
+// its type:
+//   new -> old  HANDOFF_REQUEST     which build and data directory asks
+//   old -> new  HANDOFF_HELLO       the log is closed; disk is up to date
+//               HANDOFF_ENTRIES     scores for one board (any number)
+//               HANDOFF_LISTENER    one worker's listening sockets
+//               HANDOFF_CONNECTION  one client connection
+//               HANDOFF_DONE        nothing further
+//   new -> old  one byte            everything was taken over
+
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_MESSAGE (96 * 1024)  // Fits a connection's largest unhandled input
+#define HANDOFF_MAX_FDS 2
+#define HANDOFF_TIMEOUT 10          // Seconds the old process waits on the new one
+
+enum {
+    HANDOFF_REQUEST = 1,
+    HANDOFF_HELLO,
+    HANDOFF_ENTRIES,
+    HANDOFF_LISTENER,
+    HANDOFF_CONNECTION,
+    HANDOFF_DONE
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t version;
+    uint32_t entry_size;            // sizeof(leaderboard_entry) in the new build
+    uint32_t persistent;
+    char data_dir[PATH_MAX];        // Resolved; "" without persistence
+} handoff_request;
+
+typedef struct {
+    uint32_t type;
+    int32_t pid;
+    uint32_t port;
+    uint32_t workers;
+} handoff_hello;
+
+// Followed by count leaderboard_entry records
+typedef struct {
+    uint32_t type;
+    int32_t board;                  // Window id, for boards outside any namespace
+    char name_space[NAMESPACE_NAME_SIZE];  // "" for the main boards
+    uint32_t count;
+} handoff_entries;
+
+// Carries the TCP listener, then the UDP socket if the worker had one
+typedef struct {
+    uint32_t type;
+    uint32_t worker;
+} handoff_listener;
+
+// Carries the client's socket and is followed by input_len bytes the old
+// process read but did not handle
+typedef struct {
+    uint32_t type;
+    uint32_t worker;
+    uint32_t protocol;
+    uint32_t subscribed;
+    uint32_t federation_peer;
+    uint32_t client_addr;
+    char client_ip[16];
+    uint32_t input_len;
+} handoff_connection;
+
+// Collects one board's records into HANDOFF_ENTRIES messages
+typedef struct {
+    int sock;
+    int failed;
+    handoff_entries header;
+    unsigned char message[HANDOFF_MAX_MESSAGE];
+} handoff_batch;
+
+// Listen at path for a process taking over, replacing any stale socket
+// file. Returns the listening socket, or -1 on error.
+int handoff_listen(const char* path);
+
+// Accept the process taking over, with HANDOFF_TIMEOUT on its replies.
+// Returns -1 on error.
+int handoff_accept(int listen_fd);
+
+// Connect to a running server's socket. Returns -1 on error.
+int handoff_connect(const char* path);
+
+// Send one message with up to HANDOFF_MAX_FDS descriptors. Returns -1 on
+// error.
+int handoff_send(int sock, const void* message, size_t len, const int* fds, int fd_count);
+
+// Receive one message into buffer, which must hold HANDOFF_MAX_MESSAGE
+// bytes, and the descriptors sent with it. Returns its length, 0 if the
+// peer hung up, or -1 on error.
+ssize_t handoff_recv(int sock, void* buffer, int* fds, int* fd_count);
+
+void handoff_batch_start(handoff_batch* batch, int sock, int board, const char* name_space);
+void handoff_batch_add(handoff_batch* batch, const store_record* record);
+
+// Send what is left. Returns -1 if any message could not be sent.
+int handoff_batch_finish(handoff_batch* batch);
+
+#endif
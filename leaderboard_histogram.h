@@ -0,0 +1,79 @@
+#ifndef LEADERBOARD_HISTOGRAM_H
+#define LEADERBOARD_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Latency histogram with HDR-style log-linear buckets, shared by the
+// server's stats, leaderboard_loadgen and leaderboard_replay. Values below
+// 64 are counted exactly and each power of two above that is split into 32
+// linear steps, so every recorded value is kept to within about 3%. The
+// unit is the caller's: the server counts nanoseconds, the tools
+// microseconds.
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_MAX_SHIFT 34      // Values up to about 2^40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_HALF)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram;
+
+static inline size_t histogram_bucket(uint64_t value) {
+    if (value < 2 * HISTOGRAM_HALF) return (size_t)value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+    if (shift > HISTOGRAM_MAX_SHIFT) return HISTOGRAM_BUCKETS - 1;
+    return ((size_t)shift << (HISTOGRAM_SUB_BITS - 1)) + (size_t)(value >> shift);
+}
+
+// Largest value that lands in a bucket
+static inline uint64_t histogram_bucket_limit(size_t index) {
+    if (index < 2 * HISTOGRAM_HALF) return index;
+    int shift = (int)(index >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+    uint64_t sub = index - ((size_t)shift << (HISTOGRAM_SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void histogram_record(histogram* h, uint64_t value) {
+    h->counts[histogram_bucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+static inline void histogram_merge(histogram* into, const histogram* from) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+// Value at or below which the given fraction of samples fall. The buckets
+// may have been summed one at a time from a running thread, so their own
+// sum is trusted over total.
+static inline uint64_t histogram_percentile(const histogram* h, double fraction) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        total += h->counts[i];
+    }
+    if (total == 0) return 0;
+    
+    uint64_t wanted = (uint64_t)(fraction * total);
+    if (wanted >= total) wanted = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > wanted) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
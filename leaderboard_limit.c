@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "leaderboard_limit.h"
+
+#define LIMIT_STRIPES 64
+#define LIMIT_PROBES 8              // Slots an address may occupy within its stripe
+
+typedef struct {
+    uint32_t address;               // 0 = empty
+    uint64_t refilled_ms;           // When tokens were last brought up to date
+    double tokens[LIMIT_KINDS];
+} limit_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    limit_entry* entries;
+} limit_stripe;
+
+static limit_stripe stripes[LIMIT_STRIPES];
+static size_t stripe_size = 0;      // Entries per stripe; 0 = not initialized
+static double rates[LIMIT_KINDS];   // Tokens per millisecond, 0 = unlimited
+static double burst[LIMIT_KINDS];   // Bucket capacity
+static uint64_t full_after_ms = 0;  // Time for an empty bucket to refill
+
+static uint32_t hash_address(uint32_t address) {
+    address ^= address >> 16;
+    address *= 0x7feb352d;
+    address ^= address >> 15;
+    address *= 0x846ca68b;
+    address ^= address >> 16;
+    return address;
+}
+
+int limit_init(double read_rate, double write_rate, size_t table_size) {
+    double per_second[LIMIT_KINDS] = {read_rate, write_rate};
+    full_after_ms = 0;
+    for (int k = 0; k < LIMIT_KINDS; k++) {
+        rates[k] = per_second[k] / 1000.0;
+        burst[k] = per_second[k] < 1 ? 1 : per_second[k];
+        if (rates[k] > 0 && burst[k] / rates[k] > full_after_ms) {
+            full_after_ms = (uint64_t)(burst[k] / rates[k]) + 1;
+        }
+    }
+    
+    if (rates[LIMIT_READ] <= 0 && rates[LIMIT_WRITE] <= 0) return 0;
+    
+    stripe_size = table_size / LIMIT_STRIPES;
+    if (stripe_size < LIMIT_PROBES) stripe_size = LIMIT_PROBES;
+    for (int i = 0; i < LIMIT_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        stripes[i].entries = calloc(stripe_size, sizeof(limit_entry));
+        if (!stripes[i].entries) return -1;
+    }
+    return 0;
+}
+
+void limit_free() {
+    if (stripe_size == 0) return;
+    for (int i = 0; i < LIMIT_STRIPES; i++) {
+        free(stripes[i].entries);
+        pthread_mutex_destroy(&stripes[i].lock);
+    }
+    stripe_size = 0;
+}
+
+// The entry for an address, claiming a slot if it has none. Call with the
+// stripe locked.
+static limit_entry* find_entry(limit_stripe* stripe, uint32_t hash, uint32_t address,
+                               uint64_t now_ms) {
+    limit_entry* reusable = NULL;
+    limit_entry* oldest = NULL;
+    size_t slot = (hash / LIMIT_STRIPES) % stripe_size;
+    
+    for (int probe = 0; probe < LIMIT_PROBES; probe++, slot = (slot + 1) % stripe_size) {
+        limit_entry* entry = &stripe->entries[slot];
+        if (entry->address == address) return entry;
+        if (!reusable && (entry->address == 0 || now_ms >= entry->refilled_ms + full_after_ms)) {
+            reusable = entry;
+        }
+        if (!oldest || entry->refilled_ms < oldest->refilled_ms) {
+            oldest = entry;
+        }
+    }
+    
+    limit_entry* entry = reusable ? reusable : oldest;
+    entry->address = address;
+    entry->refilled_ms = now_ms;
+    for (int k = 0; k < LIMIT_KINDS; k++) {
+        entry->tokens[k] = burst[k];
+    }
+    return entry;
+}
+
+uint64_t limit_take(uint32_t address, limit_kind kind, uint64_t now_ms) {
+    if (rates[kind] <= 0 || stripe_size == 0) return 0;
+    
+    uint32_t hash = hash_address(address);
+    limit_stripe* stripe = &stripes[hash % LIMIT_STRIPES];
+    uint64_t wait_ms = 0;
+    
+    pthread_mutex_lock(&stripe->lock);
+    limit_entry* entry = find_entry(stripe, hash, address, now_ms);
+    if (now_ms > entry->refilled_ms) {
+        double elapsed = (double)(now_ms - entry->refilled_ms);
+        for (int k = 0; k < LIMIT_KINDS; k++) {
+            entry->tokens[k] += elapsed * rates[k];
+            if (entry->tokens[k] > burst[k]) entry->tokens[k] = burst[k];
+        }
+        entry->refilled_ms = now_ms;
+    }
+    if (entry->tokens[kind] >= 1) {
+        entry->tokens[kind] -= 1;
+    } else {
+        wait_ms = (uint64_t)((1 - entry->tokens[kind]) / rates[kind]) + 1;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return wait_ms;
+}
@@ -0,0 +1,37 @@
+#ifndef LEADERBOARD_LIMIT_H
+#define LEADERBOARD_LIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-IP request rate limits, shared by every worker. Each client address
+// has two token buckets, one for reads and one for writes, that refill at
+// the configured rate and hold up to one second's worth.
+//
+// Addresses live in a fixed-size hash table split into stripes, each with
+// its own lock, so workers rarely contend unless they serve the same
+// client. The table never grows: an address whose buckets have refilled
+// completely is indistinguishable from a new one, so its slot is simply
+// reused, and when every slot an address could take is in use the least
+// recently seen one is evicted.
+
+#define LIMIT_DEFAULT_READ_RATE 500     // Requests per second per address
+#define LIMIT_DEFAULT_WRITE_RATE 50
+#define LIMIT_DEFAULT_TABLE_SIZE 65536  // Addresses tracked at once
+
+typedef enum {
+    LIMIT_READ,
+    LIMIT_WRITE,
+    LIMIT_KINDS
+} limit_kind;
+
+// Set the per-second rates (0 = unlimited) and allocate the table.
+// Returns -1 if memory ran out.
+int limit_init(double read_rate, double write_rate, size_t table_size);
+void limit_free();
+
+// Take a token from an address's bucket. Returns 0 if the request may go
+// ahead, or else how many milliseconds until a token will be available.
+uint64_t limit_take(uint32_t address, limit_kind kind, uint64_t now_ms);
+
+#endif
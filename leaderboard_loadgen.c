@@ -0,0 +1,315 @@
+// Open-loop load generator for the leaderboard server.
+//
+//   ./leaderboard_loadgen [--server IP] [--port N] [--connections N]
+//                         [--rate REQUESTS_PER_SECOND] [--duration SECONDS]
+//                         [--submit-percent P] [--players N]
+//
+// Simulates many players, each on its own persistent connection made with
+// the game's client code, sending a mix of GET_LEADERBOARD polls and
+// SUBMITs. Requests go out on a fixed schedule whether or not earlier ones
+// have been answered, and latency is measured from when each request was
+// due, so a stalled server shows up as latency rather than as a lower
+// request rate.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include "tetris_network.h"
+#include "leaderboard_protocol.h"
+#include "leaderboard_histogram.h"
+
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_RATE 10000
+#define DEFAULT_DURATION 10
+#define DEFAULT_SUBMIT_PERCENT 10
+#define DEFAULT_PLAYERS 100000
+#define MAX_IN_FLIGHT 256           // Per connection
+#define MAX_EVENTS 256
+
+enum { KIND_POLL, KIND_SUBMIT, KIND_COUNT };
+static const char* kind_names[KIND_COUNT] = {"GET_LEADERBOARD", "SUBMIT"};
+
+// One simulated player. Replies come back in request order, so the due
+// times of requests in flight are kept in a ring.
+typedef struct {
+    server_connection conn;
+    int registered_fd;              // Socket currently in the epoll set
+    uint64_t due_us[MAX_IN_FLIGHT];
+    unsigned char kind[MAX_IN_FLIGHT];
+    int head;
+    int in_flight;
+} player;
+
+static int epoll_fd;
+static histogram totals[KIND_COUNT];
+static histogram interval;          // Reset every report
+static uint64_t completed = 0;
+static uint64_t errors = 0;         // Error replies and requests lost with a connection
+static uint64_t skipped = 0;        // Not sent: MAX_IN_FLIGHT already outstanding
+static uint64_t busy = 0;           // Refused by the server's rate limit
+static uint64_t rng = 88172645463325252ULL;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void on_reply(server_connection* conn, uint16_t opcode,
+                     const unsigned char* payload, size_t length) {
+    player* p = conn->user;
+    (void)payload;
+    (void)length;
+    if (opcode == OP_LEADERBOARD_DELTA || p->in_flight == 0) return;
+    
+    uint64_t latency = now_us() - p->due_us[p->head];
+    int kind = p->kind[p->head];
+    p->head = (p->head + 1) % MAX_IN_FLIGHT;
+    p->in_flight--;
+    if (opcode == OP_ERROR) {
+        errors++;
+        return;
+    }
+    if (opcode == OP_BUSY) {
+        busy++;
+        return;
+    }
+    histogram_record(&totals[kind], latency);
+    histogram_record(&interval, latency);
+    completed++;
+}
+
+// Whatever was in flight on a dropped connection is lost
+static void reset_player(player* p) {
+    errors += p->in_flight;
+    p->in_flight = 0;
+    p->head = 0;
+    p->registered_fd = -1;
+}
+
+static void send_next(player* p, int kind, int players, uint64_t due) {
+    if (p->in_flight == MAX_IN_FLIGHT) {
+        skipped++;
+        return;
+    }
+    
+    int sent;
+    if (kind == KIND_SUBMIT) {
+        unsigned char payload[WIRE_ENTRY_SIZE] = {0};
+        snprintf((char*)payload, WIRE_NAME_SIZE, "load%d", (int)(next_random() % players));
+        put_u32le(payload + WIRE_NAME_SIZE, (uint32_t)(next_random() % 1000000));
+        sent = connection_send(&p->conn, OP_SUBMIT, payload, sizeof(payload));
+    } else {
+        sent = connection_send(&p->conn, OP_GET_LEADERBOARD, NULL, 0);
+    }
+    if (sent < 0) {
+        reset_player(p);
+        errors++;
+        return;
+    }
+    
+    // A reconnect brings a new socket to watch
+    if (p->conn.sock != p->registered_fd) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = p;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->conn.sock, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        p->registered_fd = p->conn.sock;
+    }
+    int slot = (p->head + p->in_flight) % MAX_IN_FLIGHT;
+    p->due_us[slot] = due;
+    p->kind[slot] = (unsigned char)kind;
+    p->in_flight++;
+}
+
+static void print_latency(const char* label, const histogram* h) {
+    printf("%-16s %10llu  %8.3f %8.3f %8.3f %8.3f %8.3f\n", label,
+           (unsigned long long)h->total,
+           histogram_percentile(h, 0.50) / 1000.0, histogram_percentile(h, 0.90) / 1000.0,
+           histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0,
+           h->max / 1000.0);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--server IP] [--port N] [--connections N]\n"
+                    "          [--rate REQUESTS_PER_SECOND] [--duration SECONDS]\n"
+                    "          [--submit-percent P] [--players N]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    const char* server_ip = "127.0.0.1";
+    int port = SERVER_PORT;
+    int connections = DEFAULT_CONNECTIONS;
+    double rate = DEFAULT_RATE;
+    int duration = DEFAULT_DURATION;
+    int submit_percent = DEFAULT_SUBMIT_PERCENT;
+    int players = DEFAULT_PLAYERS;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_ip = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--submit-percent") == 0 && i + 1 < argc) {
+            submit_percent = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+            players = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (connections <= 0 || rate <= 0 || duration <= 0 || submit_percent < 0 ||
+        submit_percent > 100 || players <= 0 || set_server_address(server_ip, port) < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    // Thousands of connections need more descriptors than the usual default
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    // Sends are paced by a timer with microsecond resolution; epoll_wait()
+    // timeouts only have milliseconds
+    int timer_fd;
+    if ((epoll_fd = epoll_create1(0)) < 0 ||
+        (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    struct epoll_event timer_ev;
+    timer_ev.events = EPOLLIN;
+    timer_ev.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev);
+    player* all = calloc(connections, sizeof(player));
+    if (!all) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
+    printf("Connecting %d players to %s:%d...\n", connections, server_ip, port);
+    for (int i = 0; i < connections; i++) {
+        connection_init(&all[i].conn, on_reply, &all[i]);
+        all[i].registered_fd = -1;
+        if (connection_open(&all[i].conn) < 0) {
+            fprintf(stderr, "Connection %d failed: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+    printf("Sending %.0f requests/s for %d s, %d%% submits\n", rate, duration, submit_percent);
+    printf("%6s %10s %10s %10s %10s\n", "time", "sent/s", "done/s", "p50 ms", "p99 ms");
+    
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t start = now_us();
+    uint64_t end = start + (uint64_t)duration * 1000000;
+    uint64_t next_report = start + 1000000;
+    uint64_t sent = 0;
+    uint64_t sent_at_report = 0;
+    uint64_t completed_at_report = 0;
+    int next_player = 0;
+    
+    for (;;) {
+        uint64_t now = now_us();
+        
+        // Send everything that has come due, catching up if we fell behind
+        uint64_t due;
+        while ((due = start + (uint64_t)(sent * 1000000 / rate)) <= now && due < end) {
+            int kind = (int)(next_random() % 100) < submit_percent ? KIND_SUBMIT : KIND_POLL;
+            send_next(&all[next_player], kind, players, due);
+            next_player = (next_player + 1) % connections;
+            sent++;
+        }
+        
+        if (now >= next_report) {
+            printf("%5llus %10llu %10llu %10.3f %10.3f\n",
+                   (unsigned long long)((next_report - start) / 1000000),
+                   (unsigned long long)(sent - sent_at_report),
+                   (unsigned long long)(completed - completed_at_report),
+                   histogram_percentile(&interval, 0.50) / 1000.0,
+                   histogram_percentile(&interval, 0.99) / 1000.0);
+            fflush(stdout);
+            memset(&interval, 0, sizeof(interval));
+            sent_at_report = sent;
+            completed_at_report = completed;
+            next_report += 1000000;
+        }
+        
+        // Give stragglers a second after the last request before giving up
+        if (now >= end + 1000000 || (now >= end && completed + errors + skipped + busy >= sent)) {
+            break;
+        }
+        
+        uint64_t wake = (due < end && due < next_report) ? due : next_report;
+        struct itimerspec timer;
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = (time_t)(wake / 1000000);
+        timer.it_value.tv_nsec = (long)(wake % 1000000) * 1000;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+        
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < ready; i++) {
+            player* p = events[i].data.ptr;
+            if (!p) continue;  // Timer; re-arming it above clears it
+            int fd = p->conn.sock;
+            if (connection_read(&p->conn, 0) < 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                reset_player(p);
+            }
+        }
+    }
+    
+    double elapsed = (now_us() - start) / 1e6;
+    histogram all_kinds;
+    memset(&all_kinds, 0, sizeof(all_kinds));
+    for (int k = 0; k < KIND_COUNT; k++) {
+        histogram_merge(&all_kinds, &totals[k]);
+    }
+    
+    printf("\nSent %llu, completed %llu, errors %llu, busy %llu, skipped %llu in %.1f s\n",
+           (unsigned long long)sent, (unsigned long long)completed, (unsigned long long)errors,
+           (unsigned long long)busy, (unsigned long long)skipped, elapsed);
+    printf("Throughput: %.0f requests/s\n\n", completed / elapsed);
+    printf("%-16s %10s  %8s %8s %8s %8s %8s\n", "latency (ms)", "count",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int k = 0; k < KIND_COUNT; k++) {
+        print_latency(kind_names[k], &totals[k]);
+    }
+    print_latency("all", &all_kinds);
+    
+    for (int i = 0; i < connections; i++) {
+        connection_free(&all[i].conn);
+    }
+    free(all);
+    close(timer_fd);
+    close(epoll_fd);
+    return 0;
+}
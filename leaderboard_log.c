@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "leaderboard_log.h"
+
+#define LOG_IDLE_SLEEP_MS 2         // Writer's nap when the ring is empty
+#define LOG_LINE_SIZE 512
+
+// One ring slot. sequence says whose turn it is, as in Dmitry Vyukov's
+// bounded queue but counted per lap of the ring so that an all-zero ring
+// is ready to use: for the lap starting at position L it is L while the
+// slot is free, L + 1 once filled, and L + LOG_RING_SLOTS after the writer
+// has taken it.
+typedef struct {
+    uint64_t sequence;
+    struct timespec time;
+    log_formatter formatter;        // NULL for preformatted text
+    uint16_t length;
+    uint8_t level;
+    char data[LOG_MAX_RECORD];
+} log_slot;
+
+log_level log_threshold = LOG_INFO;
+
+static log_slot ring[LOG_RING_SLOTS];
+static uint64_t ring_head = 0;      // Next position producers claim
+static uint64_t ring_tail = 0;      // Next position the writer takes
+static uint64_t dropped = 0;
+
+static FILE* output;
+static pthread_t writer;
+static int writer_running = 0;
+static volatile int writer_stopping = 0;
+
+static const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static uint64_t lap_of(uint64_t position) {
+    return position & ~(uint64_t)(LOG_RING_SLOTS - 1);
+}
+
+// Claim a free slot, or NULL if the ring is full
+static log_slot* claim_slot(uint64_t* position) {
+    uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    for (;;) {
+        log_slot* slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - lap_of(pos));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *position = pos;
+                return slot;
+            }
+            // pos now holds the current head; try again from there
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void publish_slot(log_slot* slot, uint64_t position) {
+    __atomic_store_n(&slot->sequence, lap_of(position) + 1, __ATOMIC_RELEASE);
+}
+
+void log_message(log_level level, const char* format, ...) {
+    if (!log_enabled(level)) return;
+    uint64_t position;
+    log_slot* slot = claim_slot(&position);
+    if (!slot) return;
+    
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = (uint8_t)level;
+    slot->formatter = NULL;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(slot->data, sizeof(slot->data), format, args);
+    va_end(args);
+    if (n < 0) n = 0;
+    slot->length = (uint16_t)(n < (int)sizeof(slot->data) ? n : (int)sizeof(slot->data) - 1);
+    publish_slot(slot, position);
+}
+
+void log_binary(log_level level, log_formatter formatter, const void* data, size_t length) {
+    if (!log_enabled(level)) return;
+    uint64_t position;
+    log_slot* slot = claim_slot(&position);
+    if (!slot) return;
+    
+    if (length > sizeof(slot->data)) length = sizeof(slot->data);
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = (uint8_t)level;
+    slot->formatter = formatter;
+    slot->length = (uint16_t)length;
+    memcpy(slot->data, data, length);
+    publish_slot(slot, position);
+}
+
+uint64_t log_dropped() {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+int log_parse_level(const char* name) {
+    static const char* names[] = {"debug", "info", "warn", "error"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static void write_line(const struct timespec* time, int level, const char* text) {
+    struct tm local;
+    char stamp[32];
+    localtime_r(&time->tv_sec, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    fprintf(output, "%s.%03ld %-5s %s\n", stamp, time->tv_nsec / 1000000,
+            level_names[level], text);
+}
+
+// Format and write one record
+static void write_record(const log_slot* slot) {
+    char text[LOG_LINE_SIZE];
+    if (slot->formatter) {
+        slot->formatter(slot->data, slot->length, text, sizeof(text));
+    } else {
+        memcpy(text, slot->data, slot->length);
+        text[slot->length] = '\0';
+    }
+    write_line(&slot->time, slot->level, text);
+}
+
+// Write out every filled slot. Returns how many.
+static size_t drain_ring() {
+    size_t written = 0;
+    for (;;) {
+        log_slot* slot = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+        uint64_t lap = lap_of(ring_tail);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != lap + 1) break;
+        write_record(slot);
+        __atomic_store_n(&slot->sequence, lap + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ring_tail++;
+        written++;
+    }
+    return written;
+}
+
+static void* run_writer(void* arg) {
+    uint64_t reported_drops = 0;
+    struct timespec nap = {0, LOG_IDLE_SLEEP_MS * 1000000L};
+    
+    for (;;) {
+        int stopping = writer_stopping;
+        size_t written = drain_ring();
+        uint64_t drops = log_dropped();
+        if (drops != reported_drops) {
+            char text[64];
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(text, sizeof(text), "%llu log records dropped (buffer full)",
+                     (unsigned long long)(drops - reported_drops));
+            write_line(&now, LOG_WARN, text);
+            reported_drops = drops;
+        }
+        if (written == 0) {
+            fflush(output);
+            if (stopping) break;
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_open(const char* path, log_level threshold) {
+    log_threshold = threshold;
+    output = stdout;
+    if (path && !(output = fopen(path, "a"))) {
+        perror("open log file");
+        output = stdout;
+        return -1;
+    }
+    if (pthread_create(&writer, NULL, run_writer, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+void log_close() {
+    if (!writer_running) return;
+    writer_stopping = 1;
+    pthread_join(writer, NULL);
+    writer_running = 0;
+    if (output != stdout) fclose(output);
+}
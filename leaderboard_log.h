@@ -0,0 +1,56 @@
+#ifndef LEADERBOARD_LOG_H
+#define LEADERBOARD_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Asynchronous logging for the server. Callers copy a record into a
+// bounded lock-free ring and return; a background thread formats records
+// and writes them out. Any number of threads may log at once. When the
+// ring is full the record is dropped and counted instead of waiting, so a
+// slow disk or terminal can never stall an event loop.
+//
+// A record is either text formatted by the caller (log_message) or raw
+// bytes plus a function the writer thread later uses to format them
+// (log_binary), which keeps even the snprintf off the hot path.
+
+#define LOG_RING_SLOTS 8192         // Power of two
+#define LOG_MAX_RECORD 200          // Bytes of text or binary data per record
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+} log_level;
+
+// Turns a binary record's bytes into text. Runs on the writer thread.
+typedef void (*log_formatter)(const void* data, size_t length, char* out, size_t size);
+
+extern log_level log_threshold;     // Records below this level are skipped
+
+// Start the writer thread. path NULL logs to stdout. Returns -1 on error.
+int log_open(const char* path, log_level threshold);
+
+// Write out everything logged so far and stop the writer thread
+void log_close();
+
+static inline int log_enabled(log_level level) {
+    return level >= log_threshold;
+}
+
+// Log printf-style text, cut short at LOG_MAX_RECORD bytes
+void log_message(log_level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Log length bytes of data (at most LOG_MAX_RECORD) to be formatted later
+void log_binary(log_level level, log_formatter formatter, const void* data, size_t length);
+
+// Records lost because the ring was full
+uint64_t log_dropped();
+
+// Level named on the command line ("debug", "info", "warn" or "error"),
+// or -1
+int log_parse_level(const char* name);
+
+#endif
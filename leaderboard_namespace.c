@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "leaderboard_namespace.h"
+#include "leaderboard_persist.h"
+#include "leaderboard_log.h"
+
+#define NAMESPACE_BUCKETS 1024
+#define NAMESPACE_DIR "namespaces"
+#define COMPACT_MIN_RECORDS 100000  // Log length worth folding into a snapshot
+#define MIN_RESIDENT_SECONDS 5      // Not evicted for memory sooner than this after use
+#define MAINTAIN_SECONDS 1
+
+// The table of resident namespaces: hash chains guarded by table_lock,
+// which requests only take for reading
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static leaderboard_namespace* buckets[NAMESPACE_BUCKETS];
+static size_t resident = 0;             // Guarded by table_lock
+static size_t resident_memory = 0;      // Atomic
+static unsigned long loaded_count = 0;  // Atomic
+static unsigned long evicted_count = 0; // Atomic
+
+static char namespace_dir[PATH_MAX - 64];  // Leaves room for file names
+static int persistent = 0;
+static size_t memory_budget;
+static time_t idle_timeout;
+static size_t max_resident;
+static namespace_format_fn format_top;
+static size_t top_count;
+
+// The maintenance thread, only started with a data directory
+static pthread_t thread;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_wake = PTHREAD_COND_INITIALIZER;
+static int thread_running = 0;
+static int thread_stopping = 0;
+
+static void* run_maintenance(void* arg);
+
+int namespace_init(const char* data_dir, size_t budget, time_t idle, size_t max,
+                   namespace_format_fn format, size_t count) {
+    memory_budget = budget;
+    idle_timeout = idle;
+    max_resident = max;
+    format_top = format;
+    top_count = count;
+    if (!data_dir) return 0;
+    
+    snprintf(namespace_dir, sizeof(namespace_dir), "%s/" NAMESPACE_DIR, data_dir);
+    if (mkdir(namespace_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir namespace directory");
+        return -1;
+    }
+    persistent = 1;
+    thread_stopping = 0;
+    if (pthread_create(&thread, NULL, run_maintenance, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    thread_running = 1;
+    return 0;
+}
+
+int namespace_valid_name(const char* name) {
+    if (!isalpha((unsigned char)name[0])) return 0;
+    size_t length = 0;
+    for (; name[length]; length++) {
+        char c = name[length];
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return 0;
+    }
+    return length < NAMESPACE_NAME_SIZE;
+}
+
+static void file_path(char* out, size_t size, const char* name, const char* suffix) {
+    snprintf(out, size, "%s/%s%s", namespace_dir, name, suffix);
+}
+
+// Whether a namespace has ever been written to disk. Its log is created
+// as soon as it is, and only truncated or moved aside to .log.old.
+static int saved_on_disk(const char* name) {
+    char path[PATH_MAX];
+    file_path(path, sizeof(path), name, ".log");
+    if (access(path, F_OK) == 0) return 1;
+    file_path(path, sizeof(path), name, ".log.old");
+    return access(path, F_OK) == 0;
+}
+
+// Make a snapshot's rename durable
+static void sync_namespace_dir() {
+    int fd = open(namespace_dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Find a resident namespace. Call with table_lock held.
+static leaderboard_namespace* find_namespace(leaderboard_namespace* chain, const char* name) {
+    while (chain && strcmp(chain->name, name) != 0) {
+        chain = chain->next;
+    }
+    return chain;
+}
+
+static void take_ref(leaderboard_namespace* ns) {
+    __atomic_add_fetch(&ns->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+void namespace_release(leaderboard_namespace* ns) {
+    __atomic_sub_fetch(&ns->refs, 1, __ATOMIC_RELEASE);
+}
+
+// Bring the budget up to date with what the board holds now. Call with
+// ns->lock held for writing.
+static void count_memory(leaderboard_namespace* ns) {
+    size_t memory = sizeof(*ns) + store_memory(&ns->board);
+    __atomic_add_fetch(&resident_memory, memory - ns->memory, __ATOMIC_RELAXED);
+    ns->memory = memory;
+}
+
+static void refresh_top(leaderboard_namespace* ns) {
+    ns->top_len = format_top(&ns->board, ns->top, sizeof(ns->top));
+}
+
+static leaderboard_namespace* new_namespace(const char* name) {
+    leaderboard_namespace* ns = calloc(1, sizeof(*ns));
+    if (!ns) return NULL;
+    if (store_init(&ns->board) < 0) {
+        free(ns);
+        return NULL;
+    }
+    snprintf(ns->name, sizeof(ns->name), "%s", name);
+    ns->log_fd = -1;
+    
+    // Prefer writers, as the main board's lock does
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ns->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    return ns;
+}
+
+static void free_namespace(leaderboard_namespace* ns) {
+    if (ns->log_fd >= 0) close(ns->log_fd);
+    __atomic_sub_fetch(&resident_memory, ns->memory, __ATOMIC_RELAXED);
+    store_free(&ns->board);
+    pthread_rwlock_destroy(&ns->lock);
+    free(ns);
+}
+
+// Load a namespace's snapshot and logs and open the log for appending. If
+// the log can't be opened the namespace is kept in memory only until it is
+// next saved. Returns -1, opening nothing, if the snapshot is there but
+// can't be read: serving the namespace without it would lose its scores,
+// and the next save would overwrite it. Call with ns->lock held for
+// writing.
+static int load_namespace(leaderboard_namespace* ns) {
+    char path[PATH_MAX];
+    uint64_t covered_gen;
+    file_path(path, sizeof(path), ns->name, ".snapshot");
+    if (access(path, F_OK) == 0 && persist_load_snapshot(path, &ns->board, &covered_gen) < 0) {
+        log_message(LOG_ERROR, "Namespace %s: unreadable snapshot; not serving it", ns->name);
+        return -1;
+    }
+    
+    // A log moved aside for a save that never finished comes first
+    file_path(path, sizeof(path), ns->name, ".log.old");
+    long replayed = persist_replay_file(path, &ns->board);
+    ns->rotated = replayed >= 0;
+    ns->logged = replayed > 0 ? (unsigned long)replayed : 0;
+    
+    file_path(path, sizeof(path), ns->name, ".log");
+    replayed = persist_replay_file(path, &ns->board);
+    if (replayed > 0) ns->logged += (unsigned long)replayed;
+    ns->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (ns->log_fd < 0) {
+        log_message(LOG_WARN, "Namespace %s: can't open log: %s", ns->name, strerror(errno));
+    }
+    return 0;
+}
+
+// Write a namespace's board to its snapshot and empty the logs the
+// snapshot now covers, all before returning. Only used on shutdown, with
+// no save running. Returns -1 on error, leaving the logs as they were.
+// Call with ns->lock held for writing.
+static int save_namespace(leaderboard_namespace* ns) {
+    if (ns->state != NAMESPACE_READY || (ns->logged == 0 && !ns->rotated)) return 0;
+    
+    char path[PATH_MAX];
+    file_path(path, sizeof(path), ns->name, ".snapshot");
+    if (persist_write_snapshot(path, &ns->board, 0) < 0) {
+        log_message(LOG_ERROR, "Namespace %s: can't write snapshot: %s", ns->name,
+                    strerror(errno));
+        return -1;
+    }
+    sync_namespace_dir();
+    // A crash before this only means replaying scores the snapshot has
+    if (ns->log_fd >= 0 && ftruncate(ns->log_fd, 0) < 0) {
+        log_message(LOG_ERROR, "Namespace %s: can't truncate log: %s", ns->name,
+                    strerror(errno));
+        return -1;
+    }
+    file_path(path, sizeof(path), ns->name, ".log.old");
+    unlink(path);
+    ns->rotated = 0;
+    ns->logged = 0;
+    __atomic_store_n(&ns->unsynced, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Start writing a namespace's board to its snapshot in a forked child, so
+// requests for it only wait for the fork. The log so far moves aside to
+// .log.old, which the snapshot covers and which is deleted once it is
+// written; scores from now on go to a new log. If an earlier save failed
+// its .log.old is still there, and the log just keeps growing until one
+// succeeds. Returns the moved-aside log's descriptor, still to be synced
+// and closed by the caller once it has unlocked, or -1. Call from the
+// maintenance thread with ns->lock held for writing.
+static int start_save(leaderboard_namespace* ns) {
+    if (ns->state != NAMESPACE_READY || ns->save_pid > 0) return -1;
+    
+    char path[PATH_MAX];
+    int old_fd = -1;
+    if (!ns->rotated) {
+        char old_path[PATH_MAX];
+        file_path(path, sizeof(path), ns->name, ".log");
+        file_path(old_path, sizeof(old_path), ns->name, ".log.old");
+        if (rename(path, old_path) < 0 && errno != ENOENT) {
+            log_message(LOG_WARN, "Namespace %s: can't move log aside: %s", ns->name,
+                        strerror(errno));
+            return -1;
+        }
+        old_fd = ns->log_fd;
+        ns->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (ns->log_fd < 0) {
+            log_message(LOG_WARN, "Namespace %s: can't open log: %s", ns->name, strerror(errno));
+        }
+        ns->rotated = 1;
+        ns->logged = 0;
+        __atomic_store_n(&ns->unsynced, 0, __ATOMIC_RELAXED);
+    }
+    
+    file_path(path, sizeof(path), ns->name, ".snapshot");
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (persist_write_snapshot(path, &ns->board, 0) < 0) _exit(1);
+        sync_namespace_dir();
+        _exit(0);
+    }
+    if (pid < 0) {
+        log_message(LOG_WARN, "Namespace %s: can't fork to save: %s", ns->name, strerror(errno));
+    } else {
+        ns->save_pid = pid;
+    }
+    return old_fd;
+}
+
+// Collect a finished save, deleting the log it made redundant. With block
+// set, wait for it to finish. Call from the maintenance thread, or once it
+// has stopped.
+static void reap_save(leaderboard_namespace* ns, int block) {
+    if (ns->save_pid <= 0) return;
+    int status;
+    if (waitpid(ns->save_pid, &status, block ? 0 : WNOHANG) != ns->save_pid) return;
+    ns->save_pid = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        char path[PATH_MAX];
+        file_path(path, sizeof(path), ns->name, ".log.old");
+        unlink(path);
+        ns->rotated = 0;
+    } else {
+        log_message(LOG_WARN, "Namespace %s: snapshot failed; keeping its log", ns->name);
+    }
+}
+
+// Save a namespace in the background; see start_save
+static void save_in_background(leaderboard_namespace* ns) {
+    pthread_rwlock_wrlock(&ns->lock);
+    int old_fd = start_save(ns);
+    pthread_rwlock_unlock(&ns->lock);
+    if (old_fd >= 0) {
+        // Make the moved log and its replacement durable before relying on them
+        fdatasync(old_fd);
+        close(old_fd);
+        sync_namespace_dir();
+    }
+}
+
+// Make a namespace resident, or find that another request just has. A new
+// one comes back with its lock held for writing and *added set, to be
+// loaded by the caller. Returns NULL if it would exceed the limits.
+static leaderboard_namespace* add_namespace(leaderboard_namespace** chain, const char* name,
+                                            int* added) {
+    pthread_rwlock_wrlock(&table_lock);
+    leaderboard_namespace* ns = find_namespace(*chain, name);
+    *added = 0;
+    if (!ns && resident < max_resident &&
+        __atomic_load_n(&resident_memory, __ATOMIC_RELAXED) < memory_budget &&
+        (ns = new_namespace(name)) != NULL) {
+        // Locked before anyone can find it: requests for this namespace
+        // wait for it to load, requests for any other don't
+        pthread_rwlock_wrlock(&ns->lock);
+        ns->next = *chain;
+        *chain = ns;
+        resident++;
+        *added = 1;
+    }
+    if (ns) take_ref(ns);
+    pthread_rwlock_unlock(&table_lock);
+    return ns;
+}
+
+namespace_status namespace_acquire(const char* name, int create, leaderboard_namespace** out) {
+    if (!namespace_valid_name(name)) return NAMESPACE_INVALID;
+    leaderboard_namespace** chain = &buckets[store_hash_name(name) % NAMESPACE_BUCKETS];
+    
+    pthread_rwlock_rdlock(&table_lock);
+    leaderboard_namespace* ns = find_namespace(*chain, name);
+    if (ns) take_ref(ns);
+    pthread_rwlock_unlock(&table_lock);
+    
+    int added = 0;
+    if (!ns) {
+        // Only namespaces that have had scores are loaded for reading, so
+        // queries for made-up names cost nothing
+        if (!create && !(persistent && saved_on_disk(name))) return NAMESPACE_UNKNOWN;
+        if (!(ns = add_namespace(chain, name, &added))) return NAMESPACE_FULL;
+        if (added) {
+            int state = NAMESPACE_READY;
+            if (persistent && load_namespace(ns) < 0) {
+                // Kept resident but out of service, so the next request
+                // doesn't read the snapshot again; once evicted, the load
+                // is retried
+                store_free(&ns->board);
+                store_init(&ns->board);
+                state = NAMESPACE_BROKEN;
+            }
+            count_memory(ns);
+            refresh_top(ns);
+            __atomic_store_n(&ns->state, state, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&ns->lock);
+            __atomic_add_fetch(&loaded_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (!added && __atomic_load_n(&ns->state, __ATOMIC_ACQUIRE) == NAMESPACE_LOADING) {
+        // Wait for the request loading it
+        pthread_rwlock_rdlock(&ns->lock);
+        pthread_rwlock_unlock(&ns->lock);
+    }
+    if (__atomic_load_n(&ns->state, __ATOMIC_ACQUIRE) != NAMESPACE_READY) {
+        namespace_release(ns);
+        return NAMESPACE_UNAVAILABLE;
+    }
+    __atomic_store_n(&ns->last_used, time(NULL), __ATOMIC_RELAXED);
+    *out = ns;
+    return NAMESPACE_OK;
+}
+
+int namespace_submit(leaderboard_namespace* ns, const leaderboard_entry* record) {
+    const char* name = record->player_name;
+    int outcome = store_submit(&ns->board, name, record->score, record->timestamp,
+                               record->client_ip);
+    if (outcome <= STORE_UNCHANGED) return outcome;
+    
+    ns->logged++;
+    ns->changes++;
+    if (ns->log_fd >= 0) {
+        if (persist_write_record(ns->log_fd, record) < 0) return -1;
+        __atomic_store_n(&ns->unsynced, 1, __ATOMIC_RELEASE);
+    }
+    count_memory(ns);
+    if (store_in_top(&ns->board, name, top_count)) refresh_top(ns);
+    return outcome;
+}
+
+// Drop a namespace from memory once a snapshot covers everything in it,
+// unless a request picked it up meanwhile. One that isn't saved yet gets a
+// save started and is dropped on a later pass. Call holding exactly one
+// reference, which this gives back if it frees the namespace. Returns
+// nonzero if it did.
+static int evict(leaderboard_namespace* ns) {
+    pthread_rwlock_rdlock(&ns->lock);
+    int saved = ns->state == NAMESPACE_BROKEN ||
+                (ns->save_pid <= 0 && ns->logged == 0 && !ns->rotated);
+    unsigned long changes = ns->changes;
+    pthread_rwlock_unlock(&ns->lock);
+    if (!saved) {
+        save_in_background(ns);
+        return 0;
+    }
+    
+    // A request can only take a reference under the table lock, so with
+    // that held for writing and ours the only one, nobody is using it
+    pthread_rwlock_wrlock(&table_lock);
+    int unused = __atomic_load_n(&ns->refs, __ATOMIC_ACQUIRE) == 1 && ns->changes == changes;
+    if (unused) {
+        leaderboard_namespace** link = &buckets[store_hash_name(ns->name) % NAMESPACE_BUCKETS];
+        while (*link != ns) {
+            link = &(*link)->next;
+        }
+        *link = ns->next;
+        resident--;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (!unused) return 0;
+    
+    free_namespace(ns);
+    __atomic_add_fetch(&evicted_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static int compare_last_used(const void* a, const void* b) {
+    time_t x = __atomic_load_n(&(*(leaderboard_namespace* const*)a)->last_used, __ATOMIC_RELAXED);
+    time_t y = __atomic_load_n(&(*(leaderboard_namespace* const*)b)->last_used, __ATOMIC_RELAXED);
+    return (x > y) - (x < y);
+}
+
+// Sync logs, fold long ones into snapshots and evict
+static void maintain(time_t now) {
+    // Hold every resident namespace so none can go away while it is looked
+    // at, without keeping the table locked meanwhile
+    pthread_rwlock_rdlock(&table_lock);
+    leaderboard_namespace** held = malloc((resident + 1) * sizeof(*held));
+    size_t count = 0;
+    for (size_t b = 0; held && b < NAMESPACE_BUCKETS; b++) {
+        for (leaderboard_namespace* ns = buckets[b]; ns; ns = ns->next) {
+            take_ref(ns);
+            held[count++] = ns;
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (!held) return;
+    
+    for (size_t i = 0; i < count; i++) {
+        leaderboard_namespace* ns = held[i];
+        // Only this thread replaces log_fd, so it stays open meanwhile
+        if (__atomic_exchange_n(&ns->unsynced, 0, __ATOMIC_ACQ_REL)) {
+            fdatasync(ns->log_fd);
+        }
+        reap_save(ns, 0);
+        
+        // Fold a long log into the snapshot
+        pthread_rwlock_rdlock(&ns->lock);
+        int compact = ns->logged >= COMPACT_MIN_RECORDS && ns->logged >= ns->board.count;
+        pthread_rwlock_unlock(&ns->lock);
+        if (compact) save_in_background(ns);
+    }
+    
+    // Evict the idle, then the least recently used until the rest fit the
+    // budget. Evicted namespaces are loaded again from disk when next used.
+    qsort(held, count, sizeof(*held), compare_last_used);
+    for (size_t i = 0; i < count; i++) {
+        leaderboard_namespace* ns = held[i];
+        time_t unused_for = now - __atomic_load_n(&ns->last_used, __ATOMIC_RELAXED);
+        int over_budget = __atomic_load_n(&resident_memory, __ATOMIC_RELAXED) > memory_budget;
+        if ((unused_for >= idle_timeout || (over_budget && unused_for >= MIN_RESIDENT_SECONDS)) &&
+            evict(ns)) {
+            continue;
+        }
+        namespace_release(ns);
+    }
+    free(held);
+}
+
+static void* run_maintenance(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&thread_lock);
+    while (!thread_stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += MAINTAIN_SECONDS;
+        pthread_cond_timedwait(&thread_wake, &thread_lock, &until);
+        if (thread_stopping) break;
+        pthread_mutex_unlock(&thread_lock);
+        maintain(time(NULL));
+        pthread_mutex_lock(&thread_lock);
+    }
+    pthread_mutex_unlock(&thread_lock);
+    return NULL;
+}
+
+void namespace_each(namespace_fn fn, void* arg) {
+    pthread_rwlock_rdlock(&table_lock);
+    for (size_t b = 0; b < NAMESPACE_BUCKETS; b++) {
+        for (leaderboard_namespace* ns = buckets[b]; ns; ns = ns->next) {
+            fn(ns, arg);
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
+
+void namespace_close() {
+    if (thread_running) {
+        pthread_mutex_lock(&thread_lock);
+        thread_stopping = 1;
+        pthread_cond_signal(&thread_wake);
+        pthread_mutex_unlock(&thread_lock);
+        pthread_join(thread, NULL);
+        thread_running = 0;
+    }
+    
+    pthread_rwlock_wrlock(&table_lock);
+    for (size_t b = 0; b < NAMESPACE_BUCKETS; b++) {
+        while (buckets[b]) {
+            leaderboard_namespace* ns = buckets[b];
+            buckets[b] = ns->next;
+            reap_save(ns, 1);
+            if (persistent && save_namespace(ns) < 0) {
+                log_message(LOG_ERROR, "Failed to save namespace %s", ns->name);
+            }
+            free_namespace(ns);
+        }
+    }
+    resident = 0;
+    pthread_rwlock_unlock(&table_lock);
+}
+
+void namespace_get_totals(namespace_totals* totals) {
+    pthread_rwlock_rdlock(&table_lock);
+    totals->resident = resident;
+    pthread_rwlock_unlock(&table_lock);
+    totals->memory = __atomic_load_n(&resident_memory, __ATOMIC_RELAXED);
+    totals->loaded = __atomic_load_n(&loaded_count, __ATOMIC_RELAXED);
+    totals->evicted = __atomic_load_n(&evicted_count, __ATOMIC_RELAXED);
+}
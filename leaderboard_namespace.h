@@ -0,0 +1,115 @@
+#ifndef LEADERBOARD_NAMESPACE_H
+#define LEADERBOARD_NAMESPACE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include "leaderboard_store.h"
+
+// Named leaderboards kept apart from the main one, one per game mode or
+// board size. Each namespace has its own store, lock and cached top-N
+// reply, so traffic on a busy namespace never waits on a quiet one; the
+// table that finds them is only locked for writing when one is loaded or
+// evicted.
+//
+// Namespaces are created by their first score and loaded from disk by the
+// first request after an eviction. A maintenance thread evicts those idle
+// for longer than the idle timeout, and the least recently used ones
+// whenever the resident namespaces use more than the memory budget. On
+// disk each has a snapshot and a log of the scores since, in the main
+// log's record format:
+//   <data dir>/namespaces/<name>.snapshot
+//   <data dir>/namespaces/<name>.log
+//   <data dir>/namespaces/<name>.log.old  scores before a save in progress
+// Log records are written before the reply but synced about once a second
+// rather than before it, unlike the main board's. Snapshots are written by
+// a forked child, as the main board's are. A namespace whose snapshot
+// can't be read is not served until it is evicted and loads again, rather
+// than starting over empty. Without a data directory namespaces only live
+// in memory and are never evicted, so the budget caps how many can be
+// created.
+
+#define NAMESPACE_NAME_SIZE 32      // Letter first, then letters, digits, '_' or '-'
+#define NAMESPACE_REPLY_SIZE 1024
+#define NAMESPACE_DEFAULT_MEMORY_MB 256
+#define NAMESPACE_DEFAULT_IDLE_TIMEOUT 600   // Seconds
+#define NAMESPACE_DEFAULT_MAX 1024           // Resident at once
+
+// Formats a board's cached top-N reply into out. Returns the length.
+typedef size_t (*namespace_format_fn)(const leaderboard_store* board, char* out, size_t size);
+
+typedef enum {
+    NAMESPACE_LOADING,
+    NAMESPACE_READY,
+    NAMESPACE_BROKEN                // Its snapshot could not be read
+} namespace_state;
+
+typedef struct leaderboard_namespace {
+    char name[NAMESPACE_NAME_SIZE];
+    pthread_rwlock_t lock;          // Guards everything up to refs
+    leaderboard_store board;
+    char top[NAMESPACE_REPLY_SIZE]; // GET_LEADERBOARD reply, rebuilt when the top-N changes
+    size_t top_len;
+    int log_fd;                     // -1 if kept in memory only
+    unsigned long logged;           // Records in the log since the last snapshot
+    unsigned long changes;          // Scores kept since loading
+    size_t memory;                  // Bytes counted against the budget
+    int refs;                       // Requests holding it; atomic
+    int unsynced;                   // Log written since the last sync; atomic
+    int state;                      // namespace_state; atomic
+    time_t last_used;               // Atomic
+    // Once loaded, only changed by the maintenance thread
+    int rotated;                    // Has a .log.old awaiting a snapshot
+    pid_t save_pid;                 // Child writing its snapshot, or 0
+    struct leaderboard_namespace* next;  // Hash chain
+} leaderboard_namespace;
+
+typedef enum {
+    NAMESPACE_OK,
+    NAMESPACE_INVALID,              // Not a usable name
+    NAMESPACE_UNKNOWN,              // No scores were ever submitted to it
+    NAMESPACE_FULL,                 // Over the memory budget or namespace limit
+    NAMESPACE_UNAVAILABLE           // Its data on disk could not be loaded
+} namespace_status;
+
+typedef struct {
+    size_t resident;
+    size_t memory;
+    unsigned long loaded;
+    unsigned long evicted;
+} namespace_totals;
+
+// Set the limits and, if data_dir is not NULL, keep namespaces on disk
+// under data_dir/namespaces, starting the thread that syncs, saves and
+// evicts them. format builds each namespace's cached reply for its best
+// top_count players. Returns -1 on error.
+int namespace_init(const char* data_dir, size_t memory_budget, time_t idle_timeout,
+                   size_t max_resident, namespace_format_fn format, size_t top_count);
+
+int namespace_valid_name(const char* name);
+
+// Find a namespace, loading it from disk if it was evicted, or creating it
+// if create is set. On NAMESPACE_OK *out holds a reference to give back
+// with namespace_release(); take ns->lock to use the board.
+namespace_status namespace_acquire(const char* name, int create, leaderboard_namespace** out);
+void namespace_release(leaderboard_namespace* ns);
+
+// Record a score, keeping each player's best, log it and refresh the
+// cached reply if the top-N changed. Returns one of the STORE_* outcomes,
+// or -1 if memory ran out or the log could not be written. Call with
+// ns->lock held for writing.
+int namespace_submit(leaderboard_namespace* ns, const leaderboard_entry* record);
+
+// Call fn with each resident namespace, holding the table lock for
+// reading; fn takes ns->lock itself to read the board
+typedef void (*namespace_fn)(leaderboard_namespace* ns, void* arg);
+void namespace_each(namespace_fn fn, void* arg);
+
+// Stop the maintenance thread, save every resident namespace and free
+// them all
+void namespace_close();
+
+void namespace_get_totals(namespace_totals* totals);
+
+#endif
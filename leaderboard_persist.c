@@ -0,0 +1,903 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "leaderboard_persist.h"
+
+#define WAL_RECORD_SIZE 64
+#define SNAPSHOT_V1_HEADER_SIZE 32
+#define SNAPSHOT_V1_MAGIC "LBSNAP01"
+#define SNAPSHOT_HEADER_SIZE 64
+#define SNAPSHOT_V2_MAGIC "LBSNAP02"
+#define SNAPSHOT_V3_MAGIC "LBSNAP03"
+#define SNAPSHOT_MAGIC "LBSNAP04"
+#define SNAPSHOT_FILE "leaderboard.snapshot"
+#define WAL_PREFIX "leaderboard.wal."
+#define NO_ROTATION ((size_t)-1)
+
+static char data_dir[PATH_MAX - 64];   // Leaves room for file names
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+// Log state shared with the writer thread, guarded by wal_mutex
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+static char* pending = NULL;          // Records appended since the last batch
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+static size_t rotate_at = NO_ROTATION; // Offset in pending where a new generation starts
+static uint64_t appended_lsn = 0;
+static uint64_t durable_lsn = 0;
+static uint64_t file_gen = 0;          // Generation of the file the writer has open
+static unsigned long logged_since_snapshot = 0;
+static int notify_fds[PERSIST_MAX_NOTIFY];  // Signalled after every synced batch
+static int notify_count = 0;
+static int writer_running = 0;
+static pthread_t writer_thread;
+
+// Writer thread only
+static int wal_fd = -1;
+
+// Snapshot thread only (see persist_snapshot_due)
+static uint64_t wal_gen = 0;           // Generation new appends belong to
+static uint64_t oldest_gen = 0;        // Oldest generation still on disk
+static uint64_t delete_through = 0;    // Generations covered by the last snapshot
+static pid_t snapshot_pid = -1;
+static uint64_t snapshot_gen = 0;      // Generation covered by the running snapshot
+static unsigned long snapshot_every = PERSIST_DEFAULT_SNAPSHOT_EVERY;
+
+// Recovery only
+static persist_replay_fn replay_hook = NULL;
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const unsigned char* data, size_t len) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Record layout: u32 crc, i32 score, i64 timestamp, name[32], ip[16]
+static void encode_record(unsigned char* out, const leaderboard_entry* entry) {
+    int32_t score = entry->score;
+    int64_t timestamp = entry->timestamp;
+    memset(out, 0, WAL_RECORD_SIZE);
+    memcpy(out + 4, &score, 4);
+    memcpy(out + 8, &timestamp, 8);
+    memcpy(out + 16, entry->player_name, strnlen(entry->player_name, 31));
+    memcpy(out + 48, entry->client_ip, strnlen(entry->client_ip, 15));
+    uint32_t crc = crc32(out + 4, WAL_RECORD_SIZE - 4);
+    memcpy(out, &crc, 4);
+}
+
+// Returns -1 if the record fails its checksum
+static int decode_record(const unsigned char* in, leaderboard_entry* entry) {
+    uint32_t crc;
+    int32_t score;
+    int64_t timestamp;
+    memcpy(&crc, in, 4);
+    if (crc != crc32(in + 4, WAL_RECORD_SIZE - 4)) return -1;
+    memcpy(&score, in + 4, 4);
+    memcpy(&timestamp, in + 8, 8);
+    memset(entry, 0, sizeof(*entry));
+    entry->score = score;
+    entry->timestamp = (time_t)timestamp;
+    memcpy(entry->player_name, in + 16, 31);
+    memcpy(entry->client_ip, in + 48, 15);
+    if (entry->player_name[0] == '\0') return -1;
+    return 0;
+}
+
+static void data_path(char* out, size_t size, const char* name) {
+    snprintf(out, size, "%s/%s", data_dir, name);
+}
+
+static void wal_path(char* out, size_t size, uint64_t gen) {
+    snprintf(out, size, "%s/" WAL_PREFIX "%llu", data_dir, (unsigned long long)gen);
+}
+
+// Make a rename or file creation in the data directory durable
+static void sync_data_dir() {
+    int fd = open(data_dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int open_wal(uint64_t gen) {
+    char path[PATH_MAX];
+    wal_path(path, sizeof(path), gen);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) sync_data_dir();
+    return fd;
+}
+
+// A failed log write means acknowledged scores may not survive; stop
+static void wal_fatal(const char* what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+// Group commit: everything appended while the previous batch was being
+// written and synced goes out together in the next one
+static void* wal_writer(void* arg) {
+    char* batch = NULL;
+    size_t batch_cap = 0;
+    
+    pthread_mutex_lock(&wal_mutex);
+    for (;;) {
+        while (pending_len == 0 && rotate_at == NO_ROTATION && writer_running) {
+            pthread_cond_wait(&wal_cond, &wal_mutex);
+        }
+        if (pending_len == 0 && rotate_at == NO_ROTATION) break;
+        
+        char* swap = batch;
+        size_t swap_cap = batch_cap;
+        batch = pending;
+        batch_cap = pending_cap;
+        pending = swap;
+        pending_cap = swap_cap;
+        size_t len = pending_len;
+        size_t split = rotate_at;
+        uint64_t batch_lsn = appended_lsn;
+        pending_len = 0;
+        rotate_at = NO_ROTATION;
+        pthread_mutex_unlock(&wal_mutex);
+        
+        size_t start = 0;
+        if (split != NO_ROTATION) {
+            if (write_all(wal_fd, batch, split) < 0 || fdatasync(wal_fd) < 0) {
+                wal_fatal("wal write");
+            }
+            close(wal_fd);
+            if ((wal_fd = open_wal(file_gen + 1)) < 0) {
+                wal_fatal("wal open");
+            }
+            pthread_mutex_lock(&wal_mutex);
+            file_gen++;
+            pthread_mutex_unlock(&wal_mutex);
+            start = split;
+        }
+        if (write_all(wal_fd, batch + start, len - start) < 0 || fdatasync(wal_fd) < 0) {
+            wal_fatal("wal write");
+        }
+        
+        pthread_mutex_lock(&wal_mutex);
+        durable_lsn = batch_lsn;
+        uint64_t one = 1;
+        for (int i = 0; i < notify_count; i++) {
+            if (write(notify_fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+                perror("eventfd write");
+            }
+        }
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    
+    free(batch);
+    return NULL;
+}
+
+// Checksum over 8-byte words; fast enough to verify a large snapshot
+// without delaying startup. Feed it whole words, in order.
+static uint64_t checksum_words(uint64_t sum, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        sum = (sum ^ word) * 0x100000001B3ULL;
+        sum ^= sum >> 29;
+    }
+    return sum;
+}
+
+#define CHECKSUM_SEED 0xCBF29CE484222325ULL
+
+// Load a version 1 snapshot (CRC-checked log records) by re-submitting
+// every record. Returns the last log generation it covers.
+static uint64_t load_snapshot_v1(const char* path, leaderboard_store* store) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    
+    unsigned char header[SNAPSHOT_V1_HEADER_SIZE];
+    uint64_t covered_gen = 0;
+    uint64_t count = 0;
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+        fclose(file);
+        return 0;
+    }
+    memcpy(&covered_gen, header + 8, 8);
+    memcpy(&count, header + 16, 8);
+    
+    unsigned char record[WAL_RECORD_SIZE];
+    uint64_t loaded = 0;
+    while (loaded < count && fread(record, 1, sizeof(record), file) == sizeof(record)) {
+        leaderboard_entry entry;
+        if (decode_record(record, &entry) == 0) {
+            store_submit(store, entry.player_name, entry.score, entry.timestamp, entry.client_ip);
+        }
+        loaded++;
+    }
+    fclose(file);
+    
+    if (loaded < count) {
+        fprintf(stderr, "Snapshot %s truncated: %llu of %llu records\n", path,
+                (unsigned long long)loaded, (unsigned long long)count);
+    }
+    return covered_gen;
+}
+
+static int compare_names(const void* a, const void* b, void* entries) {
+    const leaderboard_entry* e = entries;
+    return strcmp(e[*(const uint32_t*)a].player_name, e[*(const uint32_t*)b].player_name);
+}
+
+// Version 2 snapshots broke exact ties by record id; put each run of tied
+// records back in name order, as the store now ranks them
+static void order_ties_by_name(const leaderboard_entry* entries, uint32_t* rank_order,
+                               size_t count) {
+    size_t start = 0;
+    for (size_t i = 1; i <= count; i++) {
+        if (i < count && entries[rank_order[i]].score == entries[rank_order[start]].score &&
+            entries[rank_order[i]].timestamp == entries[rank_order[start]].timestamp) {
+            continue;
+        }
+        if (i - start > 1) {
+            qsort_r(rank_order + start, i - start, sizeof(uint32_t), compare_names,
+                    (void*)entries);
+        }
+        start = i;
+    }
+}
+
+static uint64_t padded(uint64_t length) {
+    return (length + 7) & ~(uint64_t)7;
+}
+
+// Versions 2 and 3 held whole leaderboard_entry records. Intern their names
+// and pack them; they can no longer be used in place.
+static store_record* pack_entries(const leaderboard_entry* entries, size_t count) {
+    store_record* records = malloc(count * sizeof(store_record));
+    if (!records) return NULL;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t name = store_intern_name(entries[i].player_name);
+        if (name == STORE_NO_NAME) {
+            free(records);
+            return NULL;
+        }
+        records[i].timestamp = entries[i].timestamp;
+        records[i].name = name;
+        records[i].score = entries[i].score;
+        records[i].client_ip = store_parse_ip(entries[i].client_ip);
+    }
+    return records;
+}
+
+// Intern a snapshot's name table. Sets *renumber if any name came out with
+// an id other than its position, as happens when this process had already
+// interned other names. Returns the ids, or NULL if the table is malformed
+// or memory ran out.
+static uint32_t* intern_names(const char* names, size_t length, size_t* name_count,
+                              int* renumber) {
+    size_t capacity = 1024;
+    uint32_t* ids = malloc(capacity * sizeof(uint32_t));
+    *name_count = 0;
+    *renumber = 0;
+    if (!ids || (length > 0 && names[length - 1] != '\0')) {
+        free(ids);
+        return NULL;
+    }
+    for (size_t pos = 0; pos < length; pos += strlen(names + pos) + 1) {
+        if (*name_count == capacity) {
+            capacity *= 2;
+            uint32_t* grown = realloc(ids, capacity * sizeof(uint32_t));
+            if (!grown) {
+                free(ids);
+                return NULL;
+            }
+            ids = grown;
+        }
+        uint32_t id = store_intern_name(names + pos);
+        if (id == STORE_NO_NAME) {
+            free(ids);
+            return NULL;
+        }
+        if (id != *name_count) *renumber = 1;
+        ids[(*name_count)++] = id;
+    }
+    return ids;
+}
+
+// Load a version 4 snapshot mapped at base. Its records are used in place
+// unless their names have to be renumbered.
+static int load_packed(unsigned char* base, size_t length, leaderboard_store* store) {
+    uint64_t count, index_offset, names_offset, names_length;
+    memcpy(&count, base + 24, 8);
+    memcpy(&index_offset, base + 32, 8);
+    memcpy(&names_offset, base + 48, 8);
+    memcpy(&names_length, base + 56, 8);
+    
+    size_t name_count;
+    int renumber;
+    uint32_t* ids = intern_names((const char*)base + names_offset, names_length, &name_count,
+                                 &renumber);
+    if (!ids) return -1;
+    
+    store_record* records = (store_record*)(base + SNAPSHOT_HEADER_SIZE);
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].name >= name_count) {
+            free(ids);
+            return -1;
+        }
+    }
+    uint32_t* rank_order = (uint32_t*)(base + index_offset);
+    if (!renumber) {
+        free(ids);
+        return store_load_ranked(store, records, count, rank_order, base, length);
+    }
+    
+    store_record* copy = malloc(count * sizeof(store_record));
+    if (!copy) {
+        free(ids);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        copy[i] = records[i];
+        copy[i].name = ids[records[i].name];
+    }
+    free(ids);
+    int result = store_load_ranked(store, copy, count, rank_order, NULL, 0);
+    if (store->records != copy) free(copy);
+    return result;
+}
+
+int persist_load_snapshot(const char* path, leaderboard_store* store, uint64_t* covered_gen) {
+    *covered_gen = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    
+    struct stat st;
+    char magic[8];
+    if (fstat(fd, &st) < 0 || pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        close(fd);
+        return -1;
+    }
+    if (memcmp(magic, SNAPSHOT_V1_MAGIC, 8) == 0) {
+        close(fd);
+        *covered_gen = load_snapshot_v1(path, store);
+        return 0;
+    }
+    int packed = memcmp(magic, SNAPSHOT_MAGIC, 8) == 0;
+    int ties_by_id = memcmp(magic, SNAPSHOT_V2_MAGIC, 8) == 0;
+    if ((!packed && !ties_by_id && memcmp(magic, SNAPSHOT_V3_MAGIC, 8) != 0) ||
+        (size_t)st.st_size < SNAPSHOT_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    
+    // Private mapping: records are updated in place in memory, while the
+    // file itself is only ever replaced whole by the next snapshot
+    size_t length = st.st_size;
+    unsigned char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+    
+    uint32_t record_size, header_size;
+    uint64_t gen, count, index_offset, checksum, names_offset, names_length;
+    memcpy(&record_size, base + 8, 4);
+    memcpy(&header_size, base + 12, 4);
+    memcpy(&gen, base + 16, 8);
+    memcpy(&count, base + 24, 8);
+    memcpy(&index_offset, base + 32, 8);
+    memcpy(&checksum, base + 40, 8);
+    memcpy(&names_offset, base + 48, 8);
+    memcpy(&names_length, base + 56, 8);
+    
+    size_t expected_size = packed ? sizeof(store_record) : sizeof(leaderboard_entry);
+    uint64_t index_end = index_offset + count * sizeof(uint32_t);
+    if (record_size != expected_size || header_size != SNAPSHOT_HEADER_SIZE ||
+        count > UINT32_MAX ||
+        index_offset != padded(SNAPSHOT_HEADER_SIZE + count * expected_size) ||
+        index_end > length ||
+        (packed && (names_offset != padded(index_end) || names_length > length - names_offset)) ||
+        checksum_words(CHECKSUM_SEED, base + SNAPSHOT_HEADER_SIZE,
+                       length - SNAPSHOT_HEADER_SIZE) != checksum) {
+        munmap(base, length);
+        return -1;
+    }
+    
+    *covered_gen = gen;
+    if (count == 0) {
+        munmap(base, length);
+        return 0;
+    }
+    if (packed) {
+        int result = load_packed(base, length, store);
+        if (store->mapping != base) munmap(base, length);
+        return result;
+    }
+    
+    leaderboard_entry* entries = (leaderboard_entry*)(base + SNAPSHOT_HEADER_SIZE);
+    uint32_t* rank_order = (uint32_t*)(base + index_offset);
+    if (ties_by_id) order_ties_by_name(entries, rank_order, count);
+    store_record* records = pack_entries(entries, count);
+    int result = records ? store_load_ranked(store, records, count, rank_order, NULL, 0) : -1;
+    if (records && store->records != records) free(records);
+    munmap(base, length);
+    return result;
+}
+
+// Buffered snapshot output. The checksum is fed whole chunks, which are a
+// multiple of 8 bytes until the last one, and every section is padded.
+typedef struct {
+    int fd;
+    int failed;
+    uint64_t checksum;
+    uint64_t written;
+    size_t used;
+    unsigned char chunk[64 * 1024];
+} snapshot_output;
+
+static void output_flush(snapshot_output* out) {
+    out->checksum = checksum_words(out->checksum, out->chunk, out->used);
+    out->failed = out->failed || write_all(out->fd, out->chunk, out->used) < 0;
+    out->used = 0;
+}
+
+static void output_write(snapshot_output* out, const void* data, size_t len) {
+    const unsigned char* p = data;
+    while (len > 0 && !out->failed) {
+        size_t n = sizeof(out->chunk) - out->used;
+        if (n > len) n = len;
+        memcpy(out->chunk + out->used, p, n);
+        out->used += n;
+        out->written += n;
+        p += n;
+        len -= n;
+        if (out->used == sizeof(out->chunk)) output_flush(out);
+    }
+}
+
+static void output_pad(snapshot_output* out) {
+    static const unsigned char zeros[8];
+    output_write(out, zeros, padded(out->written) - out->written);
+}
+
+int persist_write_snapshot(const char* path, const leaderboard_store* store, uint64_t covered_gen) {
+    // Built by hand, as this runs in forked children
+    char tmp_path[PATH_MAX + 8];
+    size_t path_len = strlen(path);
+    if (path_len >= PATH_MAX) return -1;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+    
+    snapshot_output output;
+    snapshot_output* out = &output;
+    out->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out->fd < 0) return -1;
+    out->failed = lseek(out->fd, SNAPSHOT_HEADER_SIZE, SEEK_SET) < 0;
+    out->checksum = CHECKSUM_SEED;
+    out->written = SNAPSHOT_HEADER_SIZE;
+    out->used = 0;
+    
+    // Records are written as they sit in memory, except that each names
+    // itself by position: the name table at the end lists the names in
+    // record order, so a process that interns it first (as the server does
+    // at startup) gets those same ids and can use the records in place.
+    // The rank index goes in between.
+    uint64_t count = store->count;
+    store_record batch[1024];
+    for (size_t id = 0; id < count && !out->failed; id += 1024) {
+        size_t n = (count - id < 1024) ? count - id : 1024;
+        memcpy(batch, store->records + id, n * sizeof(store_record));
+        for (size_t i = 0; i < n; i++) {
+            batch[i].name = (uint32_t)(id + i);
+        }
+        output_write(out, batch, n * sizeof(store_record));
+    }
+    output_pad(out);
+    uint64_t index_offset = out->written;
+    uint32_t ids[4096];
+    for (size_t offset = 0; offset < count && !out->failed; offset += 4096) {
+        size_t n = store_range_ids(store, offset, ids, 4096);
+        output_write(out, ids, n * sizeof(uint32_t));
+    }
+    output_pad(out);
+    uint64_t names_offset = out->written;
+    for (size_t id = 0; id < count && !out->failed; id++) {
+        const char* name = store_name(store->records[id].name);
+        output_write(out, name, strlen(name) + 1);
+    }
+    uint64_t names_length = out->written - names_offset;
+    output_pad(out);
+    output_flush(out);
+    
+    unsigned char header[SNAPSHOT_HEADER_SIZE] = {0};
+    uint32_t record_size = sizeof(store_record);
+    uint32_t header_size = SNAPSHOT_HEADER_SIZE;
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    memcpy(header + 8, &record_size, 4);
+    memcpy(header + 12, &header_size, 4);
+    memcpy(header + 16, &covered_gen, 8);
+    memcpy(header + 24, &count, 8);
+    memcpy(header + 32, &index_offset, 8);
+    memcpy(header + 40, &out->checksum, 8);
+    memcpy(header + 48, &names_offset, 8);
+    memcpy(header + 56, &names_length, 8);
+    int fd = out->fd;
+    int failed = out->failed || pwrite(fd, header, sizeof(header), 0) != sizeof(header);
+    
+    if (failed || fsync(fd) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp_path, path);
+}
+
+// Load the snapshot, if any. Returns the last log generation it covers.
+static uint64_t load_snapshot(leaderboard_store* store) {
+    char path[PATH_MAX];
+    uint64_t covered_gen;
+    data_path(path, sizeof(path), SNAPSHOT_FILE);
+    if (access(path, F_OK) < 0) return 0;
+    
+    if (persist_load_snapshot(path, store, &covered_gen) < 0) {
+        fprintf(stderr, "Ignoring unreadable snapshot %s\n", path);
+        if (store->count != 0) {
+            store_free(store);
+            store_init(store);
+        }
+        return 0;
+    }
+    printf("Loaded %zu scores from snapshot\n", store->count);
+    return covered_gen;
+}
+
+// Replay a log file into store, cutting off a torn or corrupt tail.
+// Returns how many records it held, or -1 if it can't be opened.
+static long replay_file(const char* path, leaderboard_store* store, persist_replay_fn hook) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -1;
+    
+    unsigned char record[WAL_RECORD_SIZE];
+    long replayed = 0;
+    off_t good_length = 0;
+    for (;;) {
+        ssize_t n = read(fd, record, sizeof(record));
+        if (n < 0 && errno == EINTR) continue;
+        if (n != WAL_RECORD_SIZE) break;
+        
+        leaderboard_entry entry;
+        if (decode_record(record, &entry) < 0) break;
+        store_merge(store, entry.player_name, entry.score, entry.timestamp, entry.client_ip);
+        if (hook) hook(&entry);
+        good_length += WAL_RECORD_SIZE;
+        replayed++;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > good_length) {
+        fprintf(stderr, "Truncating %s after %ld good records\n", path, replayed);
+        if (ftruncate(fd, good_length) == 0) fsync(fd);
+    }
+    close(fd);
+    return replayed;
+}
+
+// Replay one log generation
+static unsigned long replay_wal(leaderboard_store* store, uint64_t gen) {
+    char path[PATH_MAX];
+    wal_path(path, sizeof(path), gen);
+    long replayed = replay_file(path, store, replay_hook);
+    return replayed > 0 ? (unsigned long)replayed : 0;
+}
+
+static int compare_gens(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Replay every log generation newer than the snapshot, oldest first.
+// Returns the newest generation found.
+static uint64_t replay_log(leaderboard_store* store, uint64_t covered_gen) {
+    DIR* dir = opendir(data_dir);
+    if (!dir) return covered_gen;
+    
+    uint64_t* gens = NULL;
+    size_t gen_count = 0;
+    size_t gen_cap = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, WAL_PREFIX, strlen(WAL_PREFIX)) != 0) continue;
+        char* end;
+        uint64_t gen = strtoull(ent->d_name + strlen(WAL_PREFIX), &end, 10);
+        if (*end != '\0') continue;
+        if (gen <= covered_gen) {
+            // Left over from a snapshot that finished before we could clean up
+            char path[PATH_MAX];
+            wal_path(path, sizeof(path), gen);
+            unlink(path);
+            continue;
+        }
+        if (gen_count == gen_cap) {
+            gen_cap = gen_cap ? gen_cap * 2 : 16;
+            uint64_t* grown = realloc(gens, gen_cap * sizeof(uint64_t));
+            if (!grown) break;
+            gens = grown;
+        }
+        gens[gen_count++] = gen;
+    }
+    closedir(dir);
+    
+    qsort(gens, gen_count, sizeof(uint64_t), compare_gens);
+    uint64_t newest = covered_gen;
+    unsigned long replayed = 0;
+    for (size_t i = 0; i < gen_count; i++) {
+        replayed += replay_wal(store, gens[i]);
+        newest = gens[i];
+    }
+    free(gens);
+    
+    if (replayed > 0) {
+        printf("Replayed %lu scores from the write-ahead log\n", replayed);
+    }
+    logged_since_snapshot = replayed;
+    return newest;
+}
+
+int persist_open(const char* dir, leaderboard_store* store, unsigned long every,
+                 persist_replay_fn replayed) {
+    pthread_once(&crc_table_once, init_crc_table);
+    snprintf(data_dir, sizeof(data_dir), "%s", dir);
+    snapshot_every = every ? every : PERSIST_DEFAULT_SNAPSHOT_EVERY;
+    replay_hook = replayed;
+    
+    if (mkdir(data_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir data directory");
+        return -1;
+    }
+    
+    uint64_t covered_gen = load_snapshot(store);
+    uint64_t newest = replay_log(store, covered_gen);
+    
+    // Always start a fresh generation rather than appending after a tail
+    // we may just have truncated
+    wal_gen = file_gen = newest + 1;
+    oldest_gen = covered_gen + 1;
+    delete_through = covered_gen;
+    if ((wal_fd = open_wal(wal_gen)) < 0) {
+        perror("open write-ahead log");
+        return -1;
+    }
+    
+    writer_running = 1;
+    if (pthread_create(&writer_thread, NULL, wal_writer, NULL) != 0) {
+        perror("pthread_create");
+        writer_running = 0;
+        close(wal_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int persist_write_record(int fd, const leaderboard_entry* entry) {
+    unsigned char record[WAL_RECORD_SIZE];
+    pthread_once(&crc_table_once, init_crc_table);
+    encode_record(record, entry);
+    return write_all(fd, record, sizeof(record));
+}
+
+long persist_replay_file(const char* path, leaderboard_store* store) {
+    pthread_once(&crc_table_once, init_crc_table);
+    return replay_file(path, store, NULL);
+}
+
+uint64_t persist_append(const leaderboard_entry* entry) {
+    return persist_append_batch(entry, 1);
+}
+
+uint64_t persist_append_batch(const leaderboard_entry* entries, size_t count) {
+    if (count == 0) return 0;
+    
+    pthread_mutex_lock(&wal_mutex);
+    size_t needed = pending_len + count * WAL_RECORD_SIZE;
+    if (needed > pending_cap) {
+        size_t new_cap = pending_cap ? pending_cap : 64 * WAL_RECORD_SIZE;
+        while (new_cap < needed) new_cap *= 2;
+        char* grown = realloc(pending, new_cap);
+        if (!grown) {
+            pthread_mutex_unlock(&wal_mutex);
+            wal_fatal("wal buffer");
+        }
+        pending = grown;
+        pending_cap = new_cap;
+    }
+    for (size_t i = 0; i < count; i++) {
+        encode_record((unsigned char*)pending + pending_len, &entries[i]);
+        pending_len += WAL_RECORD_SIZE;
+    }
+    appended_lsn += count;
+    uint64_t lsn = appended_lsn;
+    logged_since_snapshot += count;
+    pthread_cond_signal(&wal_cond);
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+uint64_t persist_durable_lsn() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = durable_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+uint64_t persist_appended_lsn() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t lsn = appended_lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return lsn;
+}
+
+int persist_open_notify() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) return -1;
+    
+    pthread_mutex_lock(&wal_mutex);
+    if (notify_count == PERSIST_MAX_NOTIFY) {
+        pthread_mutex_unlock(&wal_mutex);
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    notify_fds[notify_count++] = fd;
+    pthread_mutex_unlock(&wal_mutex);
+    return fd;
+}
+
+void persist_ack_notify(int fd) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) > 0) {
+    }
+}
+
+// Child side of a snapshot: write the file with plain syscalls and stack
+// buffers only (no stdio or malloc after fork), so path is built before
+static void write_snapshot(const char* path, const leaderboard_store* store,
+                           uint64_t covered_gen) {
+    if (persist_write_snapshot(path, store, covered_gen) < 0) _exit(1);
+    sync_data_dir();
+    _exit(0);
+}
+
+// Remove log generations the last snapshot made redundant, once the writer
+// has moved past them
+static void delete_old_generations() {
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t open_gen = file_gen;
+    pthread_mutex_unlock(&wal_mutex);
+    
+    while (oldest_gen <= delete_through && oldest_gen < open_gen) {
+        char path[PATH_MAX];
+        wal_path(path, sizeof(path), oldest_gen);
+        unlink(path);
+        oldest_gen++;
+    }
+}
+
+int persist_snapshot_due() {
+    if (snapshot_pid > 0) {
+        int status;
+        pid_t done = waitpid(snapshot_pid, &status, WNOHANG);
+        if (done == snapshot_pid) {
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                delete_through = snapshot_gen;
+            } else {
+                fprintf(stderr, "Snapshot failed; keeping write-ahead log\n");
+            }
+            snapshot_pid = -1;
+        }
+    }
+    delete_old_generations();
+    
+    if (snapshot_pid > 0) return 0;
+    pthread_mutex_lock(&wal_mutex);
+    int due = logged_since_snapshot >= snapshot_every && file_gen == wal_gen;
+    pthread_mutex_unlock(&wal_mutex);
+    return due;
+}
+
+int persist_start_snapshot(const leaderboard_store* store) {
+    // Everything appended so far belongs to wal_gen and is in the store we
+    // are about to fork; later appends go to the next generation. The
+    // writer opens one generation per batch, so until it has opened the
+    // last one a second rotation would leave wal_gen a generation ahead of
+    // the files and the next snapshot would claim records it lacks.
+    if (snapshot_pid > 0) return -1;
+    pthread_mutex_lock(&wal_mutex);
+    if (file_gen != wal_gen) {
+        pthread_mutex_unlock(&wal_mutex);
+        return -1;
+    }
+    rotate_at = pending_len;
+    logged_since_snapshot = 0;
+    pthread_cond_signal(&wal_cond);
+    pthread_mutex_unlock(&wal_mutex);
+    snapshot_gen = wal_gen++;
+    
+    char path[PATH_MAX];
+    data_path(path, sizeof(path), SNAPSHOT_FILE);
+    pid_t pid = fork();
+    if (pid == 0) {
+        write_snapshot(path, store, snapshot_gen);
+    }
+    if (pid < 0) {
+        perror("fork snapshot");
+        return -1;
+    }
+    snapshot_pid = pid;
+    return 0;
+}
+
+void persist_close() {
+    if (snapshot_pid > 0) {
+        int status;
+        waitpid(snapshot_pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            delete_through = snapshot_gen;
+        }
+        snapshot_pid = -1;
+    }
+    
+    if (writer_running) {
+        pthread_mutex_lock(&wal_mutex);
+        writer_running = 0;
+        pthread_cond_signal(&wal_cond);
+        pthread_mutex_unlock(&wal_mutex);
+        pthread_join(writer_thread, NULL);
+        delete_old_generations();
+        close(wal_fd);
+        wal_fd = -1;
+        for (int i = 0; i < notify_count; i++) {
+            close(notify_fds[i]);
+        }
+        notify_count = 0;
+    }
+}
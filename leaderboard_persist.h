@@ -0,0 +1,104 @@
+#ifndef LEADERBOARD_PERSIST_H
+#define LEADERBOARD_PERSIST_H
+
+#include <stdint.h>
+#include "leaderboard_store.h"
+
+// Durability for the server's store. Every accepted submission is appended
+// to a write-ahead log; a background thread writes and fsyncs whatever has
+// accumulated as one batch (group commit) and then signals an eventfd. A
+// forked child periodically writes a snapshot so older log segments can be
+// deleted. On startup the snapshot is loaded and the log tail replayed.
+//
+// Files in the data directory:
+//   leaderboard.snapshot   records covered through log generation N, laid
+//                          out so the server can mmap them and use them in
+//                          place (see persist_load_snapshot)
+//   leaderboard.wal.<gen>  fixed-size CRC-checked records, one file per
+//                          generation; a new generation starts at each snapshot
+
+#define PERSIST_DEFAULT_SNAPSHOT_EVERY 100000
+#define PERSIST_MAX_NOTIFY 64
+
+// Called with every log record replayed during recovery, after it has been
+// applied to the store
+typedef void (*persist_replay_fn)(const leaderboard_entry* entry);
+
+// Recover the store from disk and start the log writer. replayed may be
+// NULL. Returns -1 on error.
+int persist_open(const char* data_dir, leaderboard_store* store, unsigned long snapshot_every,
+                 persist_replay_fn replayed);
+
+// Append a record to the log. Returns its log sequence number; the record
+// is durable once persist_durable_lsn() reaches it. Records are submissions
+// and may be replayed in any order: replay keeps each player's best.
+uint64_t persist_append(const leaderboard_entry* entry);
+
+// Append several records at once. Returns the last one's log sequence
+// number, or 0 if count is 0.
+uint64_t persist_append_batch(const leaderboard_entry* entries, size_t count);
+
+uint64_t persist_durable_lsn();
+
+// Sequence number of the last record appended; once that is durable, so
+// is everything logged before it
+uint64_t persist_appended_lsn();
+
+// Log files of the same record format kept apart from the main log, for
+// boards that live outside the main store. A record goes straight to the
+// file with write(); syncing and rotation are up to the caller.
+
+// Append a record to a file opened with O_APPEND. Returns -1 on error.
+int persist_write_record(int fd, const leaderboard_entry* entry);
+
+// Submit every record in the file at path to store, cutting off a torn or
+// corrupt tail. Returns how many, or -1 if the file can't be opened.
+long persist_replay_file(const char* path, leaderboard_store* store);
+
+// Open an eventfd that becomes readable whenever persist_durable_lsn() has
+// advanced; call persist_ack_notify() on it to reset it. Each event loop
+// waiting on durability opens its own. Returns -1 on error.
+int persist_open_notify();
+void persist_ack_notify(int fd);
+
+// Reap a finished background snapshot and report whether enough has been
+// logged to start the next one. Cheap enough to call every event loop
+// iteration, but only ever from one thread.
+int persist_snapshot_due();
+
+// Fork a child that writes the store to a new snapshot. The caller must
+// keep the store from changing (and persist_append() from being called)
+// for the duration of the call; the child works on its own copy after.
+// Returns -1 without starting one while the last snapshot is still running
+// or the log writer has yet to move to the generation it started.
+int persist_start_snapshot(const leaderboard_store* store);
+
+// Flush the log, wait for any snapshot in progress and stop the writer
+void persist_close();
+
+// Snapshot file format (version 4), native-endian:
+//   64-byte header: magic "LBSNAP04", u32 record size, u32 header size,
+//                   u64 covered generation, u64 record count,
+//                   u64 rank index offset, u64 checksum of everything after
+//                   the header, u64 name table offset, u64 name table length
+//   records:        count x store_record, as held in memory except that
+//                   name ids index the name table below
+//   rank index:     count x u32 record ids, best first
+//   name table:     NUL-terminated names in name id order; the server
+//                   writes record i's name as name id i
+// Each section is zero-padded to 8 bytes. Loading maps the file privately,
+// interns the name table and hands the records to the store as-is (unless
+// the process already knew other names, in which case they are copied with
+// their name ids renumbered); the rank index lets both store indexes be
+// built without sorting.
+// Versions 2 and 3 held 64-byte leaderboard_entry records and no name
+// table, and are packed on load. Version 2 also broke exact ties by record
+// id, so its tied runs are re-sorted by name.
+
+// Write store to path (via path.tmp and rename). Returns -1 on error.
+int persist_write_snapshot(const char* path, const leaderboard_store* store, uint64_t covered_gen);
+
+// Load a snapshot into an empty store. Returns -1 if missing or invalid.
+int persist_load_snapshot(const char* path, leaderboard_store* store, uint64_t* covered_gen);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef LEADERBOARD_PROTOCOL_H
+#define LEADERBOARD_PROTOCOL_H
+
+#include <stdint.h>
+
+// Text connections come in two flavours, and binary connections are a third.
+// The server tells them apart from the first byte a client sends.
+//
+// Framed connections carry a 4-byte big-endian payload length before each
+// message. Lengths stay below 16 MB, so the first byte of a framed stream
+// is always 0x00, while legacy one-shot clients start with a command letter.
+#define FRAME_HEADER_SIZE 4
+#define MAX_FRAME_SIZE (64 * 1024)
+
+static inline void frame_put_length(unsigned char* header, uint32_t length) {
+    header[0] = (unsigned char)(length >> 24);
+    header[1] = (unsigned char)(length >> 16);
+    header[2] = (unsigned char)(length >> 8);
+    header[3] = (unsigned char)length;
+}
+
+static inline uint32_t frame_get_length(const unsigned char* header) {
+    return ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+           ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+}
+
+// Binary connections start every message with an 8-byte header:
+//   u8 magic, u8 version, u16 opcode, u32 payload length
+// followed by the payload. All multi-byte fields are little-endian and
+// names travel as fixed NUL-padded WIRE_NAME_SIZE byte fields.
+#define BINARY_MAGIC 0xB1
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 8
+#define WIRE_NAME_SIZE 32
+#define WIRE_ENTRY_SIZE (WIRE_NAME_SIZE + 4)
+#define WIRE_DELTA_ENTRY_SIZE (4 + WIRE_ENTRY_SIZE)
+#define MAX_RANGE_COUNT 1000    // Entries per OP_RANGE / RANGE reply
+#define WIRE_BATCH_ITEM_SIZE (WIRE_ENTRY_SIZE + 8)
+#define MAX_BATCH_COUNT 1000    // Scores per OP_SUBMIT_BATCH / SUBMIT_BATCH
+#define WIRE_KEYED_ENTRY_SIZE (WIRE_ENTRY_SIZE + 8)
+
+//
+// Every request gets exactly one reply, in order. The exceptions are
+// OP_LEADERBOARD_DELTA, which the server pushes unprompted to connections
+// that sent OP_SUBSCRIBE, and the OP_EXPORT_CHUNKs streamed ahead of an
+// OP_EXPORT_END; clients must not count either as a reply. A delta
+// carries the new entry at every rank that changed since the previous
+// OP_LEADERBOARD or delta on that connection, and the new entry count.
+//
+// OP_GET_KEYED_RANGE, OP_GET_RANK_KEY and OP_COUNT_AHEAD are for the
+// cluster router (leaderboard_router.c), which merges answers from shards
+// that each hold some of the players. Entries come with the time they were
+// set, so that together with the name they give the full ranking key:
+// score descending, then time ascending, then name.
+//
+// OP_MERGE, OP_GET_DIGEST and OP_GET_LEAVES are for federated servers
+// (leaderboard_federation.h) and are only answered for their --peer
+// addresses, on a connection that first sent the shared secret in
+// OP_PEER_AUTH. OP_MERGE entries are kept like submissions, each player's
+// best winning (of equal scores, the earlier), but are not passed on to
+// other peers.
+typedef enum {
+    OP_SUBMIT = 0x01,           // name[32], i32 score
+    OP_GET_LEADERBOARD = 0x02,  // empty
+    OP_SUBSCRIBE = 0x03,        // empty; answered with OP_LEADERBOARD
+    OP_GET_RANK = 0x04,         // name[32]
+    OP_GET_RANGE = 0x05,        // u32 offset, u32 count
+    OP_GET_AROUND = 0x06,       // name[32], u32 k (entries either side)
+    OP_SUBMIT_BATCH = 0x07,     // u32 count, count x (name[32], i32 score,
+                                // i64 unix time, 0 = now); applied as one unit
+    OP_GET_STATS = 0x08,        // empty
+    OP_GET_KEYED_RANGE = 0x09,  // u32 offset, u32 count
+    OP_GET_RANK_KEY = 0x0A,     // name[32]
+    OP_COUNT_AHEAD = 0x0B,      // name[32], i32 score, i64 unix time
+    OP_EXPORT = 0x0C,           // empty; the whole board as OP_EXPORT_CHUNKs,
+                                // then OP_EXPORT_END, then the server hangs up
+    OP_MERGE = 0x0D,            // u32 count, count x (name[32], i32 score,
+                                // i64 unix time); answered with OP_OK
+    OP_GET_DIGEST = 0x0E,       // u32 level, u32 first, u32 count
+    OP_GET_LEAVES = 0x0F,       // u32 first leaf, u32 leaf count
+    OP_PEER_AUTH = 0x10,        // the shared federation secret; answered with OP_OK
+    OP_OK = 0x81,               // empty
+    OP_LEADERBOARD = 0x82,      // u32 count, count x (name[32], i32 score)
+    OP_LEADERBOARD_DELTA = 0x83, // u32 count, u32 changed,
+                                 // changed x (u32 rank, name[32], i32 score)
+    OP_RANK = 0x84,             // u32 rank (1 = best, 0 = unknown), i32 score
+    OP_RANGE = 0x85,            // u32 first rank, u32 count,
+                                // count x (name[32], i32 score)
+    OP_BATCH_RESULT = 0x86,     // u32 count, count x u8 batch_result
+    OP_STATS = 0x87,            // UTF-8 JSON snapshot, as in the text STATS reply
+    OP_BUSY = 0x88,             // empty; not handled, the sender is over its
+                                // rate limit (text: BUSY). Try again later.
+    OP_KEYED_RANGE = 0x89,      // u32 first rank, u32 count,
+                                // count x (name[32], i32 score, i64 unix time)
+    OP_RANK_KEY = 0x8A,         // u32 rank (0 = unknown), i32 score, i64 unix time
+    OP_COUNT = 0x8B,            // u32 players ranked ahead of the given key
+    OP_EXPORT_CHUNK = 0x8C,     // u32 first rank, u32 count,
+                                // count x (name[32], i32 score, i64 unix time)
+    OP_EXPORT_END = 0x8D,       // u64 entries exported
+    OP_DIGEST = 0x8E,           // u32 count, count x u64 digest
+    OP_LEAVES = 0x8F,           // u32 next leaf, u32 count,
+                                // count x (name[32], i32 score, i64 unix time)
+    OP_ERROR = 0xFF             // UTF-8 message text
+} binary_opcode;
+
+// What became of each score in a batch submission
+typedef enum {
+    BATCH_UNCHANGED = 0,        // Not a new best on any board
+    BATCH_RECORDED = 1,         // A new best on at least one board
+    BATCH_REJECTED = 2          // Empty name, or made before the weekly window
+} batch_result;
+
+// The same messages can also be sent over UDP to the same port number, one
+// per datagram behind a u32 request id that the reply echoes:
+//   u32 request id, 8-byte binary header, payload
+// Only OP_SUBMIT, OP_GET_LEADERBOARD and OP_GET_RANK are answered this way;
+// anything else gets OP_ERROR. Datagrams can be lost, so clients resend
+// with the same request id until answered. Resending a submission is
+// harmless since only each player's best counts, and its OP_OK comes once
+// the score is durable.
+//
+// No reply is bigger than its request, so a forged source address can't
+// turn the server into an amplifier. An OP_GET_LEADERBOARD payload (the
+// optional window) is padded with zeros to UDP_LEADERBOARD_PAYLOAD bytes,
+// the largest top-10 reply; shorter ones get OP_ERROR. Error texts are cut
+// to fit, and datagrams shorter than a header go unanswered.
+#define UDP_REQUEST_ID_SIZE 4
+#define MAX_DATAGRAM_SIZE 1472
+#define UDP_LEADERBOARD_PAYLOAD (4 + 10 * WIRE_ENTRY_SIZE)
+
+// Which board a query reads. GET_LEADERBOARD, GET_RANK, GET_RANGE,
+// GET_AROUND and EXPORT (and the router's queries) take it as an optional
+// trailing u32 in binary, or a trailing |alltime, |daily or |weekly in
+// text; all-time is the default.
+typedef enum {
+    WINDOW_ALL_TIME = 0,
+    WINDOW_DAILY = 1,           // Rolling last 24 hours
+    WINDOW_WEEKLY = 2,          // Rolling last 7 days
+    WINDOW_COUNT
+} window_id;
+
+static inline void put_u16le(unsigned char* p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void put_u32le(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline void put_u64le(unsigned char* p, uint64_t v) {
+    put_u32le(p, (uint32_t)v);
+    put_u32le(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t get_u16le(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_u32le(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t get_u64le(const unsigned char* p) {
+    return (uint64_t)get_u32le(p) | ((uint64_t)get_u32le(p + 4) << 32);
+}
+
+static inline void binary_put_header(unsigned char* header, uint16_t opcode, uint32_t length) {
+    header[0] = BINARY_MAGIC;
+    header[1] = BINARY_VERSION;
+    put_u16le(header + 2, opcode);
+    put_u32le(header + 4, length);
+}
+
+#endif
@@ -0,0 +1,747 @@
+// Replays a traffic capture against a leaderboard server.
+//
+//   ./leaderboard_replay TRACE [--server IP] [--port N] [--speed N|max]
+//
+// TRACE is a file written by the server's --capture option. Each captured
+// connection is replayed on a connection of its own, opened when its first
+// request is due and closed when the original was, so the server sees as
+// many clients at once as it did live. Requests keep their original
+// spacing divided by the speed (--speed 10 plays an hour in six minutes);
+// with --speed max each goes out as soon as possible, in trace order.
+// Either way no more connections are open at once than at the trace's
+// peak: if the server falls behind, new connections wait for old ones to
+// finish, as they would have queued for a busy server's accept.
+//
+// Latency is measured from when each request was due, as in
+// leaderboard_loadgen, so a server that cannot keep up shows it as
+// latency. Every request comes from this one machine, so per-IP rate
+// limits that were spread over many clients in the trace add up here;
+// run the server with --read-limit 0 --write-limit 0 to replay without
+// them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "leaderboard_protocol.h"
+#include "leaderboard_histogram.h"
+#include "leaderboard_capture.h"
+
+#define DEFAULT_PORT 8080
+#define MAX_IN_FLIGHT 256           // Per connection; later requests wait
+#define MAX_EVENTS 256
+#define READ_CHUNK 16384
+#define DRAIN_TIMEOUT_US 5000000    // Wait for replies after the last request
+#define UDP_SLOTS 65536             // Datagrams awaiting a reply; power of two
+
+enum {
+    KIND_SUBMIT, KIND_SUBMIT_BATCH, KIND_GET_LEADERBOARD, KIND_SUBSCRIBE, KIND_GET_RANK,
+    KIND_GET_RANGE, KIND_GET_AROUND, KIND_STATS, KIND_EXPORT, KIND_OTHER, KIND_COUNT
+};
+static const char* kind_names[KIND_COUNT] = {
+    "SUBMIT", "SUBMIT_BATCH", "GET_LEADERBOARD", "SUBSCRIBE", "GET_RANK",
+    "GET_RANGE", "GET_AROUND", "STATS", "EXPORT", "other"
+};
+
+// One record of the trace, pointing into the mapped file
+typedef struct {
+    uint64_t time_us;
+    uint32_t connection;
+    uint32_t client_addr;
+    uint32_t kind;
+    uint32_t length;
+    const unsigned char* message;
+    size_t order;                   // Position in the file, to keep sorting stable
+} trace_record;
+
+typedef enum { CONN_NEW, CONN_OPEN, CONN_DONE } conn_state;
+
+// One replayed connection. Replies come back in request order, so the due
+// times of requests in flight are kept in a ring.
+typedef struct {
+    int fd;
+    conn_state state;
+    uint32_t protocol;              // capture_kind of its requests
+    int closing;                    // The original closed; hang up once answered
+    unsigned char* rbuf;
+    size_t rlen;
+    size_t rcap;
+    unsigned char* wbuf;
+    size_t wlen;
+    size_t wpos;
+    size_t wcap;
+    int want_write;                 // EPOLLOUT is in the epoll set
+    uint64_t due_us[MAX_IN_FLIGHT];
+    unsigned char kind[MAX_IN_FLIGHT];
+    int head;
+    int in_flight;
+} replay_conn;
+
+// A datagram sent under a new request id, until its reply comes
+typedef struct {
+    uint32_t request_id;
+    int waiting;
+    unsigned char kind;
+    uint64_t due_us;
+} udp_slot;
+
+static int epoll_fd;
+static struct sockaddr_in server_address;
+static histogram totals[KIND_COUNT];
+static histogram interval;          // Reset every report
+static uint64_t sent = 0;
+static uint64_t completed = 0;
+static uint64_t errors = 0;         // Error replies
+static uint64_t busy = 0;           // Refused by the server's rate limit
+static uint64_t lost = 0;           // Unanswered, or lost with a connection
+static uint64_t datagrams_lost = 0; // Unanswered datagrams, never resent
+static uint64_t connect_failures = 0;
+static int open_connections = 0;
+static int udp_fd = -1;
+static udp_slot* udp_slots;
+static uint32_t next_request_id = 0;
+static uint64_t udp_waiting = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int text_kind(const unsigned char* message, size_t length) {
+    static const struct {
+        const char* prefix;
+        int kind;
+    } prefixes[] = {
+        {"SUBMIT|", KIND_SUBMIT}, {"SUBMIT_BATCH|", KIND_SUBMIT_BATCH},
+        {"GET_LEADERBOARD", KIND_GET_LEADERBOARD}, {"SUBSCRIBE", KIND_SUBSCRIBE},
+        {"GET_RANK|", KIND_GET_RANK}, {"GET_RANGE|", KIND_GET_RANGE},
+        {"GET_AROUND|", KIND_GET_AROUND}, {"STATS", KIND_STATS}, {"EXPORT", KIND_EXPORT}
+    };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t n = strlen(prefixes[i].prefix);
+        if (length >= n && memcmp(message, prefixes[i].prefix, n) == 0) return prefixes[i].kind;
+    }
+    return KIND_OTHER;
+}
+
+static int binary_kind(const unsigned char* header, size_t length) {
+    if (length < BINARY_HEADER_SIZE) return KIND_OTHER;
+    switch (get_u16le(header + 2)) {
+    case OP_SUBMIT: return KIND_SUBMIT;
+    case OP_SUBMIT_BATCH: return KIND_SUBMIT_BATCH;
+    case OP_GET_LEADERBOARD: return KIND_GET_LEADERBOARD;
+    case OP_SUBSCRIBE: return KIND_SUBSCRIBE;
+    case OP_GET_RANK:
+    case OP_GET_RANK_KEY:
+    case OP_COUNT_AHEAD: return KIND_GET_RANK;
+    case OP_GET_RANGE:
+    case OP_GET_KEYED_RANGE: return KIND_GET_RANGE;
+    case OP_GET_AROUND: return KIND_GET_AROUND;
+    case OP_GET_STATS: return KIND_STATS;
+    case OP_EXPORT: return KIND_EXPORT;
+    default: return KIND_OTHER;
+    }
+}
+
+static int record_kind(const trace_record* record) {
+    switch (record->kind) {
+    case CAPTURE_TEXT:
+    case CAPTURE_FRAMED:
+        return text_kind(record->message, record->length);
+    case CAPTURE_BINARY:
+        return binary_kind(record->message, record->length);
+    case CAPTURE_DATAGRAM:
+        if (record->length < UDP_REQUEST_ID_SIZE) return KIND_OTHER;
+        return binary_kind(record->message + UDP_REQUEST_ID_SIZE,
+                           record->length - UDP_REQUEST_ID_SIZE);
+    default:
+        return KIND_OTHER;
+    }
+}
+
+static int compare_records(const void* a, const void* b) {
+    const trace_record* x = a;
+    const trace_record* y = b;
+    if (x->time_us != y->time_us) return x->time_us < y->time_us ? -1 : 1;
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+// Read every record of a mapped trace, sorted by time. Returns the count,
+// or -1 if the trace is malformed.
+static long load_trace(const unsigned char* data, size_t size, trace_record** out) {
+    if (size < CAPTURE_HEADER_SIZE || memcmp(data, CAPTURE_MAGIC, 8) != 0) return -1;
+    size_t header_size = get_u32le(data + 8);
+    size_t record_header = get_u32le(data + 12);
+    if (header_size < CAPTURE_HEADER_SIZE || header_size > size ||
+        record_header < CAPTURE_RECORD_HEADER_SIZE) {
+        return -1;
+    }
+    
+    size_t count = 0;
+    for (size_t offset = header_size; offset + record_header <= size; count++) {
+        offset += record_header + (get_u32le(data + offset + 16) & CAPTURE_MAX_MESSAGE);
+    }
+    trace_record* records = malloc((count ? count : 1) * sizeof(trace_record));
+    if (!records) return -1;
+    
+    size_t n = 0;
+    for (size_t offset = header_size; offset + record_header <= size; n++) {
+        const unsigned char* p = data + offset;
+        trace_record* record = &records[n];
+        record->time_us = get_u64le(p);
+        record->connection = get_u32le(p + 8);
+        record->client_addr = get_u32le(p + 12);
+        record->kind = get_u32le(p + 16) >> 24;
+        record->length = get_u32le(p + 16) & CAPTURE_MAX_MESSAGE;
+        record->message = p + record_header;
+        record->order = n;
+        offset += record_header + record->length;
+        if (offset > size) break;  // Cut short by a crash; drop the partial record
+    }
+    qsort(records, n, sizeof(trace_record), compare_records);
+    *out = records;
+    return (long)n;
+}
+
+static int reserve(unsigned char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return 0;
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < needed) new_cap *= 2;
+    unsigned char* grown = realloc(*buf, new_cap);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static void watch(replay_conn* c, int want_write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, c->want_write >= 0 ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    c->want_write = want_write;
+}
+
+// Hang up, counting whatever was still unanswered as lost
+static void finish_connection(replay_conn* c) {
+    if (c->state != CONN_OPEN) return;
+    lost += c->in_flight;
+    c->in_flight = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = CONN_DONE;
+    open_connections--;
+    free(c->rbuf);
+    free(c->wbuf);
+    c->rbuf = c->wbuf = NULL;
+    c->rlen = c->rcap = c->wlen = c->wpos = c->wcap = 0;
+}
+
+static int open_connection(replay_conn* c, uint32_t protocol) {
+    c->protocol = protocol;
+    c->state = CONN_OPEN;
+    c->want_write = -1;
+    open_connections++;
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr*)&server_address, sizeof(server_address)) < 0 &&
+        errno != EINPROGRESS) {
+        connect_failures++;
+        close(c->fd);
+        c->state = CONN_DONE;
+        open_connections--;
+        return -1;
+    }
+    watch(c, 1);
+    return 0;
+}
+
+// Send what is queued. Returns -1 if the connection broke.
+static int flush_output(replay_conn* c) {
+    while (c->wpos < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN) break;
+            return -1;
+        }
+        c->wpos += n;
+    }
+    if (c->wpos == c->wlen) c->wpos = c->wlen = 0;
+    int pending = c->wlen > 0;
+    if (pending != c->want_write) watch(c, pending);
+    return 0;
+}
+
+// Close once the original had and nothing is owed either way
+static void maybe_close(replay_conn* c) {
+    if (c->state == CONN_OPEN && c->closing && c->in_flight == 0 && c->wlen == 0) {
+        finish_connection(c);
+    }
+}
+
+// The oldest request in flight was answered
+static void complete(replay_conn* c, int outcome) {
+    if (c->in_flight == 0) return;
+    uint64_t latency = now_us() - c->due_us[c->head];
+    int kind = c->kind[c->head];
+    c->head = (c->head + 1) % MAX_IN_FLIGHT;
+    c->in_flight--;
+    if (outcome == OP_ERROR) {
+        errors++;
+    } else if (outcome == OP_BUSY) {
+        busy++;
+    } else {
+        histogram_record(&totals[kind], latency);
+        histogram_record(&interval, latency);
+        completed++;
+    }
+}
+
+static int exporting(replay_conn* c) {
+    return c->in_flight > 0 && c->kind[c->head] == KIND_EXPORT;
+}
+
+// Match complete replies in the read buffer to the requests in flight.
+// Exports stream until the server hangs up, so they end at end of file.
+static void handle_replies(replay_conn* c) {
+    size_t offset = 0;
+    if (c->protocol == CAPTURE_FRAMED) {
+        while (c->rlen - offset >= FRAME_HEADER_SIZE) {
+            uint32_t length = frame_get_length(c->rbuf + offset);
+            if (c->rlen - offset - FRAME_HEADER_SIZE < length) break;
+            const unsigned char* reply = c->rbuf + offset + FRAME_HEADER_SIZE;
+            if (!exporting(c)) {
+                int outcome = OP_OK;
+                if (length >= 5 && memcmp(reply, "ERROR", 5) == 0) outcome = OP_ERROR;
+                if (length == 4 && memcmp(reply, "BUSY", 4) == 0) outcome = OP_BUSY;
+                complete(c, outcome);
+            }
+            offset += FRAME_HEADER_SIZE + length;
+        }
+    } else if (c->protocol == CAPTURE_BINARY) {
+        while (c->rlen - offset >= BINARY_HEADER_SIZE) {
+            uint32_t length = get_u32le(c->rbuf + offset + 4);
+            if (c->rlen - offset - BINARY_HEADER_SIZE < length) break;
+            uint16_t opcode = get_u16le(c->rbuf + offset + 2);
+            if (opcode != OP_LEADERBOARD_DELTA && opcode != OP_EXPORT_CHUNK) {
+                complete(c, opcode);
+            }
+            offset += BINARY_HEADER_SIZE + length;
+        }
+    } else {
+        // A legacy reply runs to end of file, but its first bytes say how
+        // it went
+        if (c->rlen > 0 && c->in_flight > 0 && !exporting(c)) {
+            int outcome = OP_OK;
+            if (c->rlen >= 5 && memcmp(c->rbuf, "ERROR", 5) == 0) outcome = OP_ERROR;
+            if (c->rlen >= 4 && memcmp(c->rbuf, "BUSY", 4) == 0) outcome = OP_BUSY;
+            complete(c, outcome);
+        }
+        offset = c->rlen;
+    }
+    if (offset > 0) {
+        memmove(c->rbuf, c->rbuf + offset, c->rlen - offset);
+        c->rlen -= offset;
+    }
+}
+
+static void read_replies(replay_conn* c) {
+    for (;;) {
+        if (reserve(&c->rbuf, &c->rcap, c->rlen + READ_CHUNK) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, READ_CHUNK, 0);
+        if (n > 0) {
+            c->rlen += n;
+            handle_replies(c);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        
+        // The server hung up, which is how a text export ends
+        if (c->protocol != CAPTURE_BINARY && exporting(c)) complete(c, OP_OK);
+        finish_connection(c);
+        return;
+    }
+    maybe_close(c);
+}
+
+// Queue a request on its connection. Returns -1 if it has to wait.
+static int send_request(replay_conn* c, const trace_record* record, uint64_t due) {
+    if (c->state == CONN_DONE) {
+        lost++;  // Its connection broke; the rest of its requests go nowhere
+        return 0;
+    }
+    if (c->in_flight == MAX_IN_FLIGHT) return -1;
+    if (c->state == CONN_NEW && open_connection(c, record->kind) < 0) {
+        lost++;
+        return 0;
+    }
+    
+    size_t needed = c->wlen + FRAME_HEADER_SIZE + record->length;
+    if (reserve(&c->wbuf, &c->wcap, needed) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (record->kind == CAPTURE_FRAMED) {
+        frame_put_length(c->wbuf + c->wlen, record->length);
+        c->wlen += FRAME_HEADER_SIZE;
+    }
+    memcpy(c->wbuf + c->wlen, record->message, record->length);
+    c->wlen += record->length;
+    
+    int slot = (c->head + c->in_flight) % MAX_IN_FLIGHT;
+    c->due_us[slot] = due;
+    c->kind[slot] = (unsigned char)record_kind(record);
+    c->in_flight++;
+    if (flush_output(c) < 0) finish_connection(c);
+    return 0;
+}
+
+// Send a datagram under a fresh request id, so replies to clients that
+// reused ids can still be told apart
+static void send_datagram(const trace_record* record, uint64_t due) {
+    unsigned char datagram[MAX_DATAGRAM_SIZE];
+    if (record->length < UDP_REQUEST_ID_SIZE || record->length > sizeof(datagram)) return;
+    uint32_t request_id = next_request_id++;
+    udp_slot* slot = &udp_slots[request_id & (UDP_SLOTS - 1)];
+    if (slot->waiting) {
+        datagrams_lost++;
+        udp_waiting--;
+    }
+    slot->request_id = request_id;
+    slot->waiting = 1;
+    slot->kind = (unsigned char)record_kind(record);
+    slot->due_us = due;
+    udp_waiting++;
+    
+    memcpy(datagram, record->message, record->length);
+    put_u32le(datagram, request_id);
+    sendto(udp_fd, datagram, record->length, 0, (struct sockaddr*)&server_address,
+           sizeof(server_address));
+}
+
+static void read_datagram_replies() {
+    unsigned char datagram[MAX_DATAGRAM_SIZE];
+    ssize_t n;
+    while ((n = recv(udp_fd, datagram, sizeof(datagram), MSG_DONTWAIT)) >= 0) {
+        if ((size_t)n < UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE) continue;
+        uint32_t request_id = get_u32le(datagram);
+        udp_slot* slot = &udp_slots[request_id & (UDP_SLOTS - 1)];
+        if (!slot->waiting || slot->request_id != request_id) continue;
+        slot->waiting = 0;
+        udp_waiting--;
+        
+        uint16_t opcode = get_u16le(datagram + UDP_REQUEST_ID_SIZE + 2);
+        if (opcode == OP_ERROR) {
+            errors++;
+        } else if (opcode == OP_BUSY) {
+            busy++;
+        } else {
+            uint64_t latency = now_us() - slot->due_us;
+            histogram_record(&totals[slot->kind], latency);
+            histogram_record(&interval, latency);
+            completed++;
+        }
+    }
+}
+
+static void print_latency(const char* label, const histogram* h) {
+    printf("%-16s %10llu  %8.3f %8.3f %8.3f %8.3f %8.3f\n", label,
+           (unsigned long long)h->total,
+           histogram_percentile(h, 0.50) / 1000.0, histogram_percentile(h, 0.90) / 1000.0,
+           histogram_percentile(h, 0.99) / 1000.0, histogram_percentile(h, 0.999) / 1000.0,
+           h->max / 1000.0);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s TRACE [--server IP] [--port N] [--speed N|max]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    const char* trace_path = NULL;
+    const char* server_ip = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    double speed = 1;               // 0 = as fast as possible
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_ip = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            i++;
+            speed = strcmp(argv[i], "max") == 0 ? 0 : atof(argv[i]);
+            if (speed <= 0 && strcmp(argv[i], "max") != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (argv[i][0] != '-' && !trace_path) {
+            trace_path = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (!trace_path || port <= 0 || port > 65535 ||
+        inet_pton(AF_INET, server_ip, &server_address.sin_addr) != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    int trace_fd = open(trace_path, O_RDONLY);
+    struct stat st;
+    if (trace_fd < 0 || fstat(trace_fd, &st) < 0) {
+        perror(trace_path);
+        return 1;
+    }
+    const unsigned char* data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, trace_fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+    trace_record* records;
+    long count = data ? load_trace(data, st.st_size, &records) : -1;
+    if (count < 0) {
+        fprintf(stderr, "%s is not a leaderboard trace\n", trace_path);
+        return 1;
+    }
+    
+    // Connection ids are handed out in order, so they index an array. Find
+    // how many connections were open at once along the way.
+    uint32_t max_id = 0;
+    for (long i = 0; i < count; i++) {
+        if (records[i].connection > max_id) max_id = records[i].connection;
+    }
+    replay_conn** conns = calloc((size_t)max_id + 1, sizeof(replay_conn*));
+    unsigned char* seen = calloc((size_t)max_id + 1, 1);  // 1 open, 2 closed
+    udp_slots = calloc(UDP_SLOTS, sizeof(udp_slot));
+    if (!conns || !seen || !udp_slots) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int open_now = 0;
+    int peak = 0;
+    uint64_t requests = 0;
+    uint32_t connection_count = 0;
+    for (long i = 0; i < count; i++) {
+        const trace_record* record = &records[i];
+        if (record->kind != CAPTURE_CLOSE) requests++;
+        if (record->connection == 0) continue;
+        if (record->kind == CAPTURE_CLOSE) {
+            if (seen[record->connection] == 1) open_now--;
+            seen[record->connection] = 2;
+        } else if (seen[record->connection] == 0) {
+            seen[record->connection] = 1;
+            connection_count++;
+            if (++open_now > peak) peak = open_now;
+        }
+    }
+    free(seen);
+    uint64_t first_us = count ? records[0].time_us : 0;
+    uint64_t span_us = count ? records[count - 1].time_us - first_us : 0;
+    printf("Trace %s: %llu requests on %u connections over %.1f s, peak %d open\n",
+           trace_path, (unsigned long long)requests, connection_count, span_us / 1e6, peak);
+    
+    // Every connection of the trace may be open at once
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    int timer_fd;
+    if ((epoll_fd = epoll_create1(0)) < 0 ||
+        (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+        (udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    // Replies to a burst of datagrams arrive all at once
+    int buffer_size = 4 << 20;
+    setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    static char timer_tag, udp_tag;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timer_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    ev.data.ptr = &udp_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev);
+    
+    if (speed > 0) {
+        printf("Replaying to %s:%d at %gx\n", server_ip, port, speed);
+    } else {
+        printf("Replaying to %s:%d as fast as possible\n", server_ip, port);
+    }
+    printf("%6s %10s %10s %8s %10s %10s\n", "time", "sent/s", "done/s", "open", "p50 ms", "p99 ms");
+    
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t start = now_us();
+    uint64_t next_report = start + 1000000;
+    uint64_t sent_at_report = 0;
+    uint64_t completed_at_report = 0;
+    uint64_t finished_at = 0;
+    long next = 0;
+    
+    for (;;) {
+        uint64_t now = now_us();
+        
+        // Send everything that has come due, catching up if we fell behind
+        uint64_t due = 0;
+        while (next < count) {
+            const trace_record* record = &records[next];
+            due = speed > 0 ? start + (uint64_t)((record->time_us - first_us) / speed) : now;
+            if (due > now) break;
+            
+            if (record->kind == CAPTURE_DATAGRAM) {
+                send_datagram(record, due);
+                sent++;
+            } else if (record->connection != 0 && record->kind >= CAPTURE_TEXT &&
+                       record->kind <= CAPTURE_BINARY) {
+                replay_conn* c = conns[record->connection];
+                if (!c && !(c = conns[record->connection] = calloc(1, sizeof(replay_conn)))) {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+                if (c->state == CONN_NEW && open_connections >= peak) break;
+                if (send_request(c, record, due) < 0) break;  // Waits for replies
+                sent++;
+            } else if (record->kind == CAPTURE_CLOSE && conns[record->connection]) {
+                replay_conn* c = conns[record->connection];
+                c->closing = 1;
+                maybe_close(c);
+            }
+            next++;
+        }
+        
+        if (now >= next_report) {
+            printf("%5llus %10llu %10llu %8d %10.3f %10.3f\n",
+                   (unsigned long long)((next_report - start) / 1000000),
+                   (unsigned long long)(sent - sent_at_report),
+                   (unsigned long long)(completed - completed_at_report), open_connections,
+                   histogram_percentile(&interval, 0.50) / 1000.0,
+                   histogram_percentile(&interval, 0.99) / 1000.0);
+            fflush(stdout);
+            memset(&interval, 0, sizeof(interval));
+            sent_at_report = sent;
+            completed_at_report = completed;
+            next_report += 1000000;
+        }
+        
+        // Done once everything is answered, or a while after the last request
+        if (next == count) {
+            if (!finished_at) finished_at = now;
+            int answered = udp_waiting == 0;
+            for (uint32_t id = 1; id <= max_id && answered; id++) {
+                answered = !conns[id] || conns[id]->state != CONN_OPEN || conns[id]->in_flight == 0;
+            }
+            if (answered || now >= finished_at + DRAIN_TIMEOUT_US) break;
+        }
+        
+        // Wake for the next request if it is waiting on the clock rather
+        // than on replies
+        uint64_t wake = next_report;
+        if (next < count && due > now && due < wake) wake = due;
+        if (next == count && finished_at + DRAIN_TIMEOUT_US < wake) {
+            wake = finished_at + DRAIN_TIMEOUT_US;
+        }
+        struct itimerspec timer;
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = (time_t)(wake / 1000000);
+        timer.it_value.tv_nsec = (long)(wake % 1000000) * 1000;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+        
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == &timer_tag) continue;  // Re-arming it above clears it
+            if (events[i].data.ptr == &udp_tag) {
+                read_datagram_replies();
+                continue;
+            }
+            replay_conn* c = events[i].data.ptr;
+            if (c->state != CONN_OPEN) continue;
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                finish_connection(c);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && flush_output(c) < 0) {
+                finish_connection(c);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) read_replies(c);
+            if (c->state == CONN_OPEN) maybe_close(c);
+        }
+    }
+    
+    double elapsed = (now_us() - start) / 1e6;
+    for (uint32_t id = 1; id <= max_id; id++) {
+        if (conns[id]) {
+            finish_connection(conns[id]);
+            free(conns[id]);
+        }
+    }
+    datagrams_lost += udp_waiting;
+    lost += datagrams_lost;
+    histogram all_kinds;
+    memset(&all_kinds, 0, sizeof(all_kinds));
+    for (int k = 0; k < KIND_COUNT; k++) {
+        histogram_merge(&all_kinds, &totals[k]);
+    }
+    
+    printf("\nSent %llu, completed %llu, errors %llu, busy %llu, lost %llu in %.1f s",
+           (unsigned long long)sent, (unsigned long long)completed, (unsigned long long)errors,
+           (unsigned long long)busy, (unsigned long long)lost, elapsed);
+    if (datagrams_lost) printf(" (%llu datagrams)", (unsigned long long)datagrams_lost);
+    if (connect_failures) printf(" (%llu connections refused)", (unsigned long long)connect_failures);
+    printf("\nThroughput: %.0f requests/s\n\n", completed / elapsed);
+    printf("%-16s %10s  %8s %8s %8s %8s %8s\n", "latency (ms)", "count",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int k = 0; k < KIND_COUNT; k++) {
+        if (totals[k].total > 0) print_latency(kind_names[k], &totals[k]);
+    }
+    print_latency("all", &all_kinds);
+    
+    free(conns);
+    free(udp_slots);
+    free(records);
+    if (data) munmap((void*)data, st.st_size);
+    close(trace_fd);
+    close(timer_fd);
+    close(udp_fd);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,1262 @@
+// Cluster router for the leaderboard server.
+//
+//   ./leaderboard_router --shard IP:PORT [--shard IP:PORT ...] [--port N]
+//                        [--read-limit N] [--write-limit N]
+//   ./leaderboard_router --verify IP:PORT [--players N] [--scores N] [--seed N]
+//
+// Splits the players between several leaderboard_server processes, the
+// shards, by a hash of their name, and stands in front of them as if it
+// were a single server. Clients talk to it in the binary protocol:
+//
+//   SUBMIT           goes to the player's shard
+//   SUBMIT_BATCH     is split up by shard and the results put back in order
+//   GET_LEADERBOARD, GET_RANGE
+//                    ask every shard for its own first offset + count
+//                    entries and merge them; the combined top K is always
+//                    made up of shards' top Ks
+//   GET_RANK         asks the player's shard for the key they are ranked
+//                    by, then every other shard how many players it has
+//                    ranked ahead of that key
+//
+// Every server ranks by the same total order (score, then time, then name),
+// so merged answers are exactly what one server holding every player would
+// give. Reads are not a snapshot across shards, though, and a batch is only
+// applied as one unit within each shard. GET_RANGE reaches at most
+// MAX_RANGE_COUNT ranks deep. GET_AROUND, SUBSCRIBE, GET_STATS, the text
+// protocols and UDP are not routed.
+//
+// The shards see the router as their only client, so run them with
+// --read-limit 0 --write-limit 0 and let the router apply the per-client
+// limits instead.
+//
+// --verify checks a cluster, reached through its router, against a store in
+// this process: it submits random scores with plenty of ties to both, then
+// compares every board's top 10, a spread of ranges and every player's
+// rank. The cluster must start out empty. Exits 0 if everything matched.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "leaderboard_protocol.h"
+#include "leaderboard_store.h"
+#include "leaderboard_window.h"
+#include "leaderboard_limit.h"
+
+#define DEFAULT_PORT 8080
+#define MAX_SHARDS 64
+#define MAX_EVENTS 256
+#define TOP_COUNT 10
+#define READ_CHUNK (64 * 1024)
+#define MAX_CLIENT_REQUESTS 256     // Requests in flight before a client's input is left unread
+#define MAX_PENDING_OUTPUT (256 * 1024)
+#define SHARD_CONNECT_TIMEOUT 1     // Seconds
+#define DEFAULT_VERIFY_PLAYERS 2000
+#define DEFAULT_VERIFY_SCORES 20000
+
+typedef enum {
+    ENDPOINT_LISTENER,
+    ENDPOINT_SHARD,
+    ENDPOINT_CLIENT
+} endpoint_kind;
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+} byte_buffer;
+
+// An entry with the full key it is ranked by
+typedef struct {
+    char name[WIRE_NAME_SIZE];
+    int score;
+    int64_t timestamp;
+} keyed_entry;
+
+typedef struct request request;
+typedef struct client client;
+
+// The piece of a request sent to one shard, waiting for its reply. Shards
+// answer in order, so each keeps its parts in a FIFO.
+typedef struct part {
+    request* request;
+    uint32_t* items;                // SUBMIT_BATCH: positions in the client's batch
+    uint32_t item_count;
+    struct part* next;
+} part;
+
+typedef struct {
+    endpoint_kind kind;
+    const char* address_text;
+    struct sockaddr_in address;
+    int fd;                         // -1 while disconnected
+    int reported_down;
+    uint32_t events;                // Registered with epoll
+    byte_buffer in;
+    byte_buffer out;
+    part* head;
+    part* tail;
+} shard;
+
+struct request {
+    client* client;
+    request* next;                  // Client's requests, oldest first
+    uint16_t opcode;
+    uint32_t window;
+    int outstanding;                // Parts not yet answered
+    const char* error;              // Reply with OP_ERROR if set
+    int done;
+
+    // Reply, once done
+    uint16_t reply_opcode;
+    unsigned char* reply;
+    size_t reply_len;
+
+    // GET_LEADERBOARD and GET_RANGE: every shard's entries, merged when done
+    keyed_entry* entries;
+    size_t entry_count;
+    uint32_t offset;
+    uint32_t count;
+
+    // GET_RANK
+    char name[WIRE_NAME_SIZE];
+    uint64_t rank;
+    int score;
+
+    // SUBMIT_BATCH
+    unsigned char* results;
+};
+
+struct client {
+    endpoint_kind kind;
+    int fd;
+    uint32_t address;               // Host byte order, for the rate limit
+    uint32_t events;
+    byte_buffer in;
+    byte_buffer out;
+    request* head;
+    request* tail;
+    int pending;                    // Requests not yet replied to
+    int processing;                 // Inside process_client_input()
+    int close_after_write;
+    int closed;
+    client* next_closed;
+};
+
+static shard shards[MAX_SHARDS];
+static int shard_count = 0;
+static int epoll_fd;
+static client* closed_clients = NULL;   // Freed once their requests are answered
+static volatile sig_atomic_t router_running = 1;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    router_running = 0;
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static int buffer_append(byte_buffer* b, const void* data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        unsigned char* grown = realloc(b->data, cap);
+        if (!grown) return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void buffer_consume(byte_buffer* b, size_t len) {
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+static int buffer_message(byte_buffer* b, uint16_t opcode, const void* payload, size_t len) {
+    unsigned char header[BINARY_HEADER_SIZE];
+    binary_put_header(header, opcode, (uint32_t)len);
+    if (buffer_append(b, header, sizeof(header)) < 0) return -1;
+    return len ? buffer_append(b, payload, len) : 0;
+}
+
+// Parse "IP:PORT". Returns -1 if malformed.
+static int parse_address(const char* text, struct sockaddr_in* address) {
+    char ip[INET_ADDRSTRLEN];
+    const char* colon = strrchr(text, ':');
+    if (!colon || colon == text || (size_t)(colon - text) >= sizeof(ip)) return -1;
+    memcpy(ip, text, colon - text);
+    ip[colon - text] = '\0';
+    int port = atoi(colon + 1);
+    
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &address->sin_addr) != 1) return -1;
+    return 0;
+}
+
+static void set_events(int fd, void* endpoint, uint32_t* registered, uint32_t wanted) {
+    if (*registered == wanted) return;
+    struct epoll_event ev = {.events = wanted, .data.ptr = endpoint};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    *registered = wanted;
+}
+
+// Copy a NUL-padded wire name into a string
+static void read_wire_name(char* name, const unsigned char* field) {
+    size_t len = strnlen((const char*)field, WIRE_NAME_SIZE - 1);
+    memcpy(name, field, len);
+    name[len] = '\0';
+}
+
+static void write_wire_name(unsigned char* field, const char* name) {
+    memset(field, 0, WIRE_NAME_SIZE);
+    memcpy(field, name, strnlen(name, WIRE_NAME_SIZE - 1));
+}
+
+static int shard_of(const char* name) {
+    return (int)(store_hash_name(name) % (uint64_t)shard_count);
+}
+
+// ---- Replies to clients ----
+
+static void client_progress(client* c);
+
+static void finish_request(request* r, uint16_t opcode, const void* payload, size_t len) {
+    r->reply_opcode = opcode;
+    r->reply_len = len;
+    r->reply = len ? malloc(len) : NULL;
+    if (r->reply) {
+        memcpy(r->reply, payload, len);
+    } else if (len) {
+        static const char no_memory[] = "Out of memory";
+        r->reply_opcode = OP_ERROR;
+        r->reply_len = sizeof(no_memory) - 1;
+        r->reply = malloc(r->reply_len);
+        if (r->reply) memcpy(r->reply, no_memory, r->reply_len);
+        else r->reply_len = 0;
+    }
+    r->done = 1;
+}
+
+static void fail_request(request* r, const char* message) {
+    finish_request(r, OP_ERROR, message, strlen(message));
+}
+
+static int compare_keyed(const void* a, const void* b) {
+    const keyed_entry* ea = a;
+    const keyed_entry* eb = b;
+    if (ea->score != eb->score) return (ea->score > eb->score) ? -1 : 1;
+    if (ea->timestamp != eb->timestamp) return (ea->timestamp < eb->timestamp) ? -1 : 1;
+    return strcmp(ea->name, eb->name);
+}
+
+// Build a merged GET_LEADERBOARD or GET_RANGE reply
+static void finish_merged(request* r) {
+    qsort(r->entries, r->entry_count, sizeof(keyed_entry), compare_keyed);
+    size_t n = r->entry_count > r->offset ? r->entry_count - r->offset : 0;
+    if (n > r->count) n = r->count;
+    
+    size_t header = (r->opcode == OP_GET_RANGE) ? 8 : 4;
+    unsigned char* payload = malloc(header + n * WIRE_ENTRY_SIZE);
+    if (!payload) {
+        fail_request(r, "Out of memory");
+        return;
+    }
+    if (r->opcode == OP_GET_RANGE) {
+        put_u32le(payload, n ? r->offset + 1 : 0);
+        put_u32le(payload + 4, (uint32_t)n);
+    } else {
+        put_u32le(payload, (uint32_t)n);
+    }
+    for (size_t i = 0; i < n; i++) {
+        const keyed_entry* e = &r->entries[r->offset + i];
+        unsigned char* p = payload + header + i * WIRE_ENTRY_SIZE;
+        write_wire_name(p, e->name);
+        put_u32le(p + WIRE_NAME_SIZE, (uint32_t)e->score);
+    }
+    finish_request(r, r->opcode == OP_GET_RANGE ? OP_RANGE : OP_LEADERBOARD,
+                   payload, header + n * WIRE_ENTRY_SIZE);
+    free(payload);
+}
+
+// Every part of a request has been answered: build its reply
+static void complete_request(request* r) {
+    if (r->done) {
+        // Answered up front (errors, BUSY) or relayed from a shard
+    } else if (r->error) {
+        fail_request(r, r->error);
+    } else if (r->opcode == OP_GET_LEADERBOARD || r->opcode == OP_GET_RANGE) {
+        finish_merged(r);
+    } else if (r->opcode == OP_GET_RANK) {
+        unsigned char reply[8];
+        put_u32le(reply, (uint32_t)r->rank);
+        put_u32le(reply + 4, (uint32_t)r->score);
+        finish_request(r, OP_RANK, reply, sizeof(reply));
+    } else if (r->opcode == OP_SUBMIT_BATCH) {
+        uint32_t count = r->count;
+        unsigned char* payload = malloc(4 + count);
+        if (!payload) {
+            fail_request(r, "Out of memory");
+        } else {
+            put_u32le(payload, count);
+            memcpy(payload + 4, r->results, count);
+            finish_request(r, OP_BATCH_RESULT, payload, 4 + count);
+            free(payload);
+        }
+    } else {
+        fail_request(r, "Shard unavailable");
+    }
+    client_progress(r->client);
+}
+
+// One fewer part outstanding
+static void part_done(request* r) {
+    if (--r->outstanding == 0) complete_request(r);
+}
+
+static request* new_request(client* c, uint16_t opcode) {
+    request* r = calloc(1, sizeof(request));
+    if (!r) return NULL;
+    r->client = c;
+    r->opcode = opcode;
+    r->outstanding = 1;             // Held until every part has been sent
+    if (c->tail) c->tail->next = r;
+    else c->head = r;
+    c->tail = r;
+    c->pending++;
+    return r;
+}
+
+static void free_request(request* r) {
+    free(r->reply);
+    free(r->entries);
+    free(r->results);
+    free(r);
+}
+
+static int client_has_room(const client* c) {
+    return c->pending < MAX_CLIENT_REQUESTS && c->out.len < MAX_PENDING_OUTPUT;
+}
+
+static void close_client(client* c) {
+    if (c->closed) return;
+    c->closed = 1;
+    close(c->fd);
+    c->next_closed = closed_clients;
+    closed_clients = c;
+}
+
+static void free_client(client* c) {
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+static void flush_client(client* c) {
+    while (c->out.len > 0) {
+        ssize_t sent = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            close_client(c);
+            return;
+        }
+        buffer_consume(&c->out, sent);
+    }
+    if (c->out.len == 0 && c->close_after_write) {
+        close_client(c);
+        return;
+    }
+    uint32_t wanted = (c->out.len ? EPOLLOUT : 0);
+    if (client_has_room(c) && !c->close_after_write) wanted |= EPOLLIN;
+    set_events(c->fd, c, &c->events, wanted);
+}
+
+// Send every finished reply at the head of the client's queue, in order
+static void deliver_replies(client* c) {
+    int delivered = 0;
+    while (c->head && c->head->done) {
+        request* r = c->head;
+        c->head = r->next;
+        if (!c->head) c->tail = NULL;
+        c->pending--;
+        if (!c->closed && buffer_message(&c->out, r->reply_opcode, r->reply, r->reply_len) < 0) {
+            close_client(c);
+        }
+        free_request(r);
+        delivered = 1;
+    }
+    if (delivered && !c->closed) flush_client(c);
+}
+
+// ---- Shards ----
+
+static void shard_down(shard* s);
+
+static int shard_connect(shard* s) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct timeval timeout = {SHARD_CONNECT_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr*)&s->address, sizeof(s->address)) < 0) {
+        if (!s->reported_down) {
+            fprintf(stderr, "Shard %s unavailable: %s\n", s->address_text, strerror(errno));
+            s->reported_down = 1;
+        }
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (s->reported_down) {
+        printf("Shard %s connected\n", s->address_text);
+        s->reported_down = 0;
+    }
+    s->fd = fd;
+    s->events = EPOLLIN;
+    return 0;
+}
+
+// Send one part of request r to a shard. Returns -1 if the shard can't be
+// reached, in which case nothing was sent. Output goes out at the end of
+// the event loop iteration, so no callbacks run from here.
+static int shard_send(shard* s, request* r, uint16_t opcode, const void* payload, size_t len,
+                      uint32_t* items, uint32_t item_count) {
+    if (s->fd < 0 && shard_connect(s) < 0) return -1;
+    part* p = calloc(1, sizeof(part));
+    if (!p) return -1;
+    if (buffer_message(&s->out, opcode, payload, len) < 0) {
+        free(p);
+        return -1;
+    }
+    p->request = r;
+    p->items = items;
+    p->item_count = item_count;
+    if (s->tail) s->tail->next = p;
+    else s->head = p;
+    s->tail = p;
+    r->outstanding++;
+    return 0;
+}
+
+static void flush_shard(shard* s) {
+    while (s->out.len > 0) {
+        ssize_t sent = send(s->fd, s->out.data, s->out.len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            shard_down(s);
+            return;
+        }
+        buffer_consume(&s->out, sent);
+    }
+    set_events(s->fd, s, &s->events, EPOLLIN | (s->out.len ? EPOLLOUT : 0));
+}
+
+// Fold one shard's reply into its request
+static void part_answered(part* p, uint16_t opcode, const unsigned char* payload, uint32_t len) {
+    request* r = p->request;
+    
+    switch (r->opcode) {
+    case OP_SUBMIT:
+        // Relayed as it came, errors included
+        finish_request(r, opcode, payload, len);
+        break;
+    case OP_SUBMIT_BATCH:
+        if (opcode != OP_BATCH_RESULT || len < 4 + p->item_count ||
+            get_u32le(payload) != p->item_count) {
+            r->error = "Shard error";
+            break;
+        }
+        for (uint32_t i = 0; i < p->item_count; i++) {
+            r->results[p->items[i]] = payload[4 + i];
+        }
+        break;
+    case OP_GET_LEADERBOARD:
+    case OP_GET_RANGE: {
+        uint32_t n = (len >= 8) ? get_u32le(payload + 4) : 0;
+        if (opcode != OP_KEYED_RANGE || len < 8 || len < 8 + (size_t)n * WIRE_KEYED_ENTRY_SIZE) {
+            r->error = "Shard error";
+            break;
+        }
+        keyed_entry* grown = realloc(r->entries, (r->entry_count + n + 1) * sizeof(keyed_entry));
+        if (!grown) {
+            r->error = "Out of memory";
+            break;
+        }
+        r->entries = grown;
+        for (uint32_t i = 0; i < n; i++) {
+            const unsigned char* item = payload + 8 + i * WIRE_KEYED_ENTRY_SIZE;
+            keyed_entry* e = &r->entries[r->entry_count++];
+            read_wire_name(e->name, item);
+            e->score = (int)get_u32le(item + WIRE_NAME_SIZE);
+            e->timestamp = (int64_t)get_u64le(item + WIRE_ENTRY_SIZE);
+        }
+        break;
+    }
+    case OP_GET_RANK:
+        if (opcode == OP_COUNT && len >= 4) {
+            r->rank += get_u32le(payload);
+        } else if (opcode == OP_RANK_KEY && len >= 16) {
+            // The player's own shard: now ask the others how many players
+            // they rank ahead of the same key
+            r->rank = get_u32le(payload);
+            r->score = (int)get_u32le(payload + 4);
+            if (r->rank == 0) break;
+            unsigned char query[WIRE_KEYED_ENTRY_SIZE + 4];
+            write_wire_name(query, r->name);
+            memcpy(query + WIRE_NAME_SIZE, payload + 4, 12);
+            put_u32le(query + WIRE_KEYED_ENTRY_SIZE, r->window);
+            int owner = shard_of(r->name);
+            for (int i = 0; i < shard_count; i++) {
+                if (i != owner &&
+                    shard_send(&shards[i], r, OP_COUNT_AHEAD, query, sizeof(query), NULL, 0) < 0) {
+                    r->error = "Shard unavailable";
+                }
+            }
+        } else {
+            r->error = "Shard error";
+        }
+        break;
+    }
+    part_done(r);
+}
+
+// Fail everything still waiting on a shard that went away; the next
+// request for it reconnects
+static void shard_down(shard* s) {
+    if (s->fd < 0) return;
+    fprintf(stderr, "Lost connection to shard %s\n", s->address_text);
+    s->reported_down = 1;
+    close(s->fd);
+    s->fd = -1;
+    s->in.len = 0;
+    s->out.len = 0;
+    
+    part* p = s->head;
+    s->head = s->tail = NULL;
+    while (p) {
+        part* next = p->next;
+        p->request->error = "Shard unavailable";
+        part_done(p->request);
+        free(p->items);
+        free(p);
+        p = next;
+    }
+}
+
+static void read_shard(shard* s) {
+    char chunk[READ_CHUNK];
+    ssize_t n = recv(s->fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        shard_down(s);
+        return;
+    }
+    if (buffer_append(&s->in, chunk, n) < 0) {
+        shard_down(s);
+        return;
+    }
+    
+    size_t offset = 0;
+    while (s->in.len - offset >= BINARY_HEADER_SIZE) {
+        const unsigned char* header = s->in.data + offset;
+        uint32_t length = get_u32le(header + 4);
+        if (header[0] != BINARY_MAGIC) {
+            shard_down(s);
+            return;
+        }
+        if (s->in.len - offset - BINARY_HEADER_SIZE < length) break;
+        offset += BINARY_HEADER_SIZE + length;
+        
+        part* p = s->head;
+        if (!p) continue;           // Nothing asked; ignore it
+        s->head = p->next;
+        if (!s->head) s->tail = NULL;
+        part_answered(p, get_u16le(header + 2), header + BINARY_HEADER_SIZE, length);
+        free(p->items);
+        free(p);
+    }
+    buffer_consume(&s->in, offset);
+}
+
+// ---- Routing requests ----
+
+// Ask every shard for its first offset + count entries
+static void gather_range(request* r, uint32_t offset, uint32_t count) {
+    unsigned char query[12];
+    r->offset = offset;
+    r->count = count;
+    put_u32le(query, 0);
+    put_u32le(query + 4, offset + count);
+    put_u32le(query + 8, r->window);
+    for (int i = 0; i < shard_count; i++) {
+        if (shard_send(&shards[i], r, OP_GET_KEYED_RANGE, query, sizeof(query), NULL, 0) < 0) {
+            r->error = "Shard unavailable";
+        }
+    }
+}
+
+// Split a batch by shard, keeping each shard's items in their original order
+static void route_batch(request* r, const unsigned char* payload, uint32_t count) {
+    uint32_t per_shard[MAX_SHARDS] = {0};
+    int owner[MAX_BATCH_COUNT];
+    
+    r->count = count;
+    r->results = calloc(count ? count : 1, 1);
+    if (!r->results) {
+        r->error = "Out of memory";
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        char name[WIRE_NAME_SIZE];
+        read_wire_name(name, payload + 4 + i * WIRE_BATCH_ITEM_SIZE);
+        owner[i] = shard_of(name);
+        per_shard[owner[i]]++;
+    }
+    
+    for (int s = 0; s < shard_count; s++) {
+        if (per_shard[s] == 0) continue;
+        unsigned char* batch = malloc(4 + per_shard[s] * WIRE_BATCH_ITEM_SIZE);
+        uint32_t* items = malloc(per_shard[s] * sizeof(uint32_t));
+        if (!batch || !items) {
+            free(batch);
+            free(items);
+            r->error = "Out of memory";
+            return;
+        }
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (owner[i] != s) continue;
+            memcpy(batch + 4 + n * WIRE_BATCH_ITEM_SIZE, payload + 4 + i * WIRE_BATCH_ITEM_SIZE,
+                   WIRE_BATCH_ITEM_SIZE);
+            items[n++] = i;
+        }
+        put_u32le(batch, n);
+        if (shard_send(&shards[s], r, OP_SUBMIT_BATCH, batch, 4 + n * WIRE_BATCH_ITEM_SIZE,
+                       items, n) < 0) {
+            free(items);
+            r->error = "Shard unavailable";
+        }
+        free(batch);
+    }
+}
+
+// Start on one client request. Its reply is sent once it and every request
+// before it are done.
+static void route_request(client* c, const unsigned char* header, const unsigned char* payload,
+                          uint32_t length) {
+    uint16_t opcode = get_u16le(header + 2);
+    request* r = new_request(c, opcode);
+    if (!r) {
+        close_client(c);
+        return;
+    }
+    
+    // Queries may name a window in a u32 after their fixed fields, as on
+    // a single server
+    size_t query_size = 0;
+    if (opcode == OP_GET_RANK) query_size = WIRE_NAME_SIZE;
+    if (opcode == OP_GET_RANGE) query_size = 8;
+    if ((opcode == OP_GET_LEADERBOARD || query_size) && length >= query_size + 4) {
+        r->window = get_u32le(payload + query_size);
+    }
+    
+    int is_write = (opcode == OP_SUBMIT || opcode == OP_SUBMIT_BATCH);
+    if (header[1] != BINARY_VERSION) {
+        fail_request(r, "Unsupported protocol version");
+    } else if (limit_take(c->address, is_write ? LIMIT_WRITE : LIMIT_READ, now_ms()) > 0) {
+        finish_request(r, OP_BUSY, NULL, 0);
+    } else if (r->window >= WINDOW_COUNT) {
+        fail_request(r, "Invalid query payload");
+    } else {
+        char name[WIRE_NAME_SIZE];
+        switch (opcode) {
+        case OP_SUBMIT:
+            if (length < WIRE_ENTRY_SIZE) {
+                fail_request(r, "Invalid SUBMIT payload");
+                break;
+            }
+            read_wire_name(name, payload);
+            if (shard_send(&shards[shard_of(name)], r, opcode, payload, length, NULL, 0) < 0) {
+                r->error = "Shard unavailable";
+            }
+            break;
+        case OP_SUBMIT_BATCH: {
+            uint32_t count = (length >= 4) ? get_u32le(payload) : 0;
+            if (length < 4 || count > MAX_BATCH_COUNT ||
+                length < 4 + (size_t)count * WIRE_BATCH_ITEM_SIZE) {
+                fail_request(r, "Invalid SUBMIT payload");
+                break;
+            }
+            route_batch(r, payload, count);
+            break;
+        }
+        case OP_GET_LEADERBOARD:
+            gather_range(r, 0, TOP_COUNT);
+            break;
+        case OP_GET_RANGE: {
+            if (length < 8) {
+                fail_request(r, "Invalid query payload");
+                break;
+            }
+            uint32_t offset = get_u32le(payload);
+            uint32_t count = get_u32le(payload + 4);
+            if (count > MAX_RANGE_COUNT) count = MAX_RANGE_COUNT;
+            if (offset > MAX_RANGE_COUNT - count) {
+                fail_request(r, "Range too deep for the cluster router");
+                break;
+            }
+            gather_range(r, offset, count);
+            break;
+        }
+        case OP_GET_RANK: {
+            unsigned char query[WIRE_NAME_SIZE + 4];
+            if (length < WIRE_NAME_SIZE || payload[0] == '\0') {
+                fail_request(r, "Invalid query payload");
+                break;
+            }
+            read_wire_name(r->name, payload);
+            write_wire_name(query, r->name);
+            put_u32le(query + WIRE_NAME_SIZE, r->window);
+            if (shard_send(&shards[shard_of(r->name)], r, OP_GET_RANK_KEY, query, sizeof(query),
+                           NULL, 0) < 0) {
+                r->error = "Shard unavailable";
+            }
+            break;
+        }
+        default:
+            fail_request(r, "Not supported by the cluster router");
+            break;
+        }
+    }
+    part_done(r);                   // Release the hold from new_request()
+}
+
+// Route every complete request in the client's input, as far as it has
+// room for more in flight
+static void process_client_input(client* c) {
+    if (c->processing) return;
+    c->processing = 1;
+    size_t offset = 0;
+    while (!c->closed && !c->close_after_write && client_has_room(c) &&
+           c->in.len - offset >= BINARY_HEADER_SIZE) {
+        const unsigned char* header = c->in.data + offset;
+        uint32_t length = get_u32le(header + 4);
+        if (header[0] != BINARY_MAGIC || length > MAX_FRAME_SIZE) {
+            static const char error[] = "The cluster router only speaks the binary protocol";
+            request* r = new_request(c, 0);
+            if (r) {
+                fail_request(r, error);
+                part_done(r);
+            }
+            c->close_after_write = 1;
+            offset = c->in.len;
+            break;
+        }
+        if (c->in.len - offset - BINARY_HEADER_SIZE < length) break;
+        route_request(c, header, header + BINARY_HEADER_SIZE, length);
+        offset += BINARY_HEADER_SIZE + length;
+    }
+    buffer_consume(&c->in, offset);
+    c->processing = 0;
+}
+
+// Send what is ready and take on more input if there is now room
+static void client_progress(client* c) {
+    deliver_replies(c);
+    if (!c->closed && !c->processing && client_has_room(c) && c->in.len > 0) {
+        process_client_input(c);
+        deliver_replies(c);
+    }
+}
+
+static void read_client(client* c) {
+    char chunk[READ_CHUNK];
+    ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+        close_client(c);
+        return;
+    }
+    if (buffer_append(&c->in, chunk, n) < 0) {
+        close_client(c);
+        return;
+    }
+    process_client_input(c);
+    deliver_replies(c);
+}
+
+static void accept_clients(int listen_fd) {
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t address_len = sizeof(address);
+        int fd = accept4(listen_fd, (struct sockaddr*)&address, &address_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            return;
+        }
+        client* c = calloc(1, sizeof(client));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->kind = ENDPOINT_CLIENT;
+        c->fd = fd;
+        c->address = ntohl(address.sin_addr.s_addr);
+        c->events = EPOLLIN;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+// Free closed clients that have no replies left to wait for
+static void reap_closed_clients() {
+    client** link = &closed_clients;
+    while (*link) {
+        client* c = *link;
+        if (c->head) {
+            link = &c->next_closed;
+        } else {
+            *link = c->next_closed;
+            free_client(c);
+        }
+    }
+}
+
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 1024) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int run_router(int port) {
+    static endpoint_kind listener = ENDPOINT_LISTENER;
+    int listen_fd = open_listener(port);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (listen_fd < 0 || epoll_fd < 0) return -1;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listener};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    
+    for (int i = 0; i < shard_count; i++) {
+        shard_connect(&shards[i]);
+    }
+    printf("Leaderboard router on port %d in front of %d shard%s\n", port, shard_count,
+           shard_count == 1 ? "" : "s");
+    
+    struct epoll_event events[MAX_EVENTS];
+    while (router_running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            endpoint_kind kind = *(endpoint_kind*)events[i].data.ptr;
+            if (kind == ENDPOINT_LISTENER) {
+                accept_clients(listen_fd);
+            } else if (kind == ENDPOINT_SHARD) {
+                shard* s = events[i].data.ptr;
+                if (s->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    read_shard(s);
+                }
+            } else {
+                client* c = events[i].data.ptr;
+                if (c->closed) continue;
+                if (events[i].events & EPOLLOUT) flush_client(c);
+                if (!c->closed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                    read_client(c);
+                }
+            }
+        }
+        // Requests routed this iteration go out together
+        for (int i = 0; i < shard_count; i++) {
+            if (shards[i].fd >= 0) flush_shard(&shards[i]);
+        }
+        reap_closed_clients();
+    }
+    printf("Router shutting down\n");
+    close(listen_fd);
+    return 0;
+}
+
+// ---- Verification against a single store ----
+
+static int verify_fd;
+static unsigned long checks = 0;
+static unsigned long mismatches = 0;
+static uint64_t rng = 88172645463325252ULL;
+
+// The reference: what one server holding every player would have
+static leaderboard_store reference;
+static leaderboard_window reference_windows[WINDOW_COUNT];
+static const char* window_names[WINDOW_COUNT] = {"alltime", "daily", "weekly"};
+
+static uint64_t next_random() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static const leaderboard_store* reference_board(int window) {
+    return window == WINDOW_ALL_TIME ? &reference : &reference_windows[window].board;
+}
+
+static void mismatch(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+static void mismatch(const char* format, ...) {
+    if (mismatches++ < 20) {
+        va_list args;
+        va_start(args, format);
+        fputs("MISMATCH: ", stdout);
+        vprintf(format, args);
+        putchar('\n');
+        va_end(args);
+    }
+}
+
+// Send one request through the router and wait for its reply, retrying
+// while the router's rate limit refuses it. Returns the reply opcode, or
+// -1 if the connection failed.
+static int call(uint16_t opcode, const void* payload, size_t len, unsigned char* reply,
+                size_t reply_size, uint32_t* reply_len) {
+    byte_buffer message = {0};
+    if (buffer_message(&message, opcode, payload, len) < 0) return -1;
+    size_t sent = 0;
+    while (sent < message.len) {
+        ssize_t n = send(verify_fd, message.data + sent, message.len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            free(message.data);
+            return -1;
+        }
+        sent += n;
+    }
+    free(message.data);
+    
+    unsigned char header[BINARY_HEADER_SIZE];
+    size_t got = 0;
+    while (got < sizeof(header)) {
+        ssize_t n = recv(verify_fd, header + got, sizeof(header) - got, 0);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    *reply_len = get_u32le(header + 4);
+    if (*reply_len > reply_size) return -1;
+    got = 0;
+    while (got < *reply_len) {
+        ssize_t n = recv(verify_fd, reply + got, *reply_len - got, 0);
+        if (n <= 0) return -1;
+        got += n;
+    }
+    if (get_u16le(header + 2) == OP_BUSY) {
+        struct timespec pause = {0, 10 * 1000000L};
+        nanosleep(&pause, NULL);
+        return call(opcode, payload, len, reply, reply_size, reply_len);
+    }
+    return get_u16le(header + 2);
+}
+
+// Submit random scores in batches to the cluster and the reference alike,
+// comparing each item's result. Returns -1 if the router stopped answering.
+static int verify_submissions(int players, int scores) {
+    static unsigned char batch[4 + MAX_BATCH_COUNT * WIRE_BATCH_ITEM_SIZE];
+    static unsigned char reply[4 + MAX_BATCH_COUNT];
+    // Few distinct scores and times, so that many players tie exactly and
+    // the name decides; times fall well inside or well outside each window
+    static const int hours_ago[] = {0, 1, 2, 3, 5, 30, 40, 50, 120, 130, 200, 210};
+    time_t now = time(NULL);
+    
+    for (int done = 0; done < scores; ) {
+        uint32_t count = (scores - done < MAX_BATCH_COUNT) ? scores - done : MAX_BATCH_COUNT;
+        unsigned char expected[MAX_BATCH_COUNT];
+        for (uint32_t i = 0; i < count; i++) {
+            char name[WIRE_NAME_SIZE];
+            snprintf(name, sizeof(name), "player%d", (int)(next_random() % players));
+            int score = (int)(next_random() % 200);
+            time_t timestamp = now - 3600 * hours_ago[next_random() % (sizeof(hours_ago) / sizeof(hours_ago[0]))];
+            
+            unsigned char* item = batch + 4 + i * WIRE_BATCH_ITEM_SIZE;
+            write_wire_name(item, name);
+            put_u32le(item + WIRE_NAME_SIZE, (uint32_t)score);
+            put_u64le(item + WIRE_ENTRY_SIZE, (uint64_t)timestamp);
+            
+            // As the server's apply_submission() would; it turns away times
+            // older than the weekly window
+            const leaderboard_window* weekly = &reference_windows[WINDOW_WEEKLY];
+            if (timestamp < now - weekly->bucket_seconds * weekly->bucket_count) {
+                expected[i] = BATCH_REJECTED;
+                continue;
+            }
+            int changed = store_submit(&reference, name, score, timestamp, "127.0.0.1") > STORE_UNCHANGED;
+            for (int w = WINDOW_ALL_TIME + 1; w < WINDOW_COUNT; w++) {
+                changed |= window_submit(&reference_windows[w], name, score, timestamp, "127.0.0.1") > 0;
+            }
+            expected[i] = changed ? BATCH_RECORDED : BATCH_UNCHANGED;
+        }
+        // Expire at once whatever the reference windows rolled past
+        for (int w = WINDOW_ALL_TIME + 1; w < WINDOW_COUNT; w++) {
+            window_maintain(&reference_windows[w], now, (size_t)-1);
+        }
+        put_u32le(batch, count);
+        
+        uint32_t len;
+        int opcode = call(OP_SUBMIT_BATCH, batch, 4 + count * WIRE_BATCH_ITEM_SIZE, reply,
+                          sizeof(reply), &len);
+        if (opcode < 0) return -1;
+        checks++;
+        if (opcode != OP_BATCH_RESULT || len != 4 + count) {
+            mismatch("SUBMIT_BATCH answered with opcode 0x%02x", opcode);
+        } else {
+            for (uint32_t i = 0; i < count; i++) {
+                if (reply[4 + i] != expected[i]) {
+                    mismatch("batch item %d: result %d, expected %d", done + (int)i,
+                             reply[4 + i], expected[i]);
+                }
+            }
+        }
+        done += count;
+    }
+    return 0;
+}
+
+// Compare count entries from offset on one board; a GET_LEADERBOARD if
+// range is 0. Returns -1 if the router stopped answering.
+static int verify_entries(int window, int range, uint32_t offset, uint32_t count) {
+    static unsigned char reply[8 + MAX_RANGE_COUNT * WIRE_ENTRY_SIZE];
+    static const store_record* expected[MAX_RANGE_COUNT];
+    unsigned char query[12];
+    uint32_t len;
+    int opcode;
+    
+    if (range) {
+        put_u32le(query, offset);
+        put_u32le(query + 4, count);
+        put_u32le(query + 8, window);
+        opcode = call(OP_GET_RANGE, query, 12, reply, sizeof(reply), &len);
+    } else {
+        put_u32le(query, window);
+        opcode = call(OP_GET_LEADERBOARD, query, 4, reply, sizeof(reply), &len);
+    }
+    if (opcode < 0) return -1;
+    
+    const char* what = range ? "GET_RANGE" : "GET_LEADERBOARD";
+    size_t header = range ? 8 : 4;
+    size_t n = store_range(reference_board(window), offset, expected, count);
+    checks++;
+    if (opcode != (range ? OP_RANGE : OP_LEADERBOARD) || len < header) {
+        mismatch("%s %s %u+%u answered with opcode 0x%02x", what, window_names[window],
+                 offset, count, opcode);
+        return 0;
+    }
+    uint32_t got = get_u32le(reply + header - 4);
+    if (got != n || len != header + n * WIRE_ENTRY_SIZE ||
+        (range && get_u32le(reply) != (n ? offset + 1 : 0))) {
+        mismatch("%s %s %u+%u: %u entries, expected %zu", what, window_names[window],
+                 offset, count, got, n);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char* p = reply + header + i * WIRE_ENTRY_SIZE;
+        char name[WIRE_NAME_SIZE];
+        read_wire_name(name, p);
+        int score = (int)get_u32le(p + WIRE_NAME_SIZE);
+        const char* expected_name = store_name(expected[i]->name);
+        if (strcmp(name, expected_name) != 0 || score != expected[i]->score) {
+            mismatch("%s %s rank %zu: %s %d, expected %s %d", what, window_names[window],
+                     offset + i + 1, name, score, expected_name, expected[i]->score);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static int verify_rank(int window, const char* name) {
+    unsigned char query[WIRE_NAME_SIZE + 4];
+    unsigned char reply[8];
+    uint32_t len;
+    write_wire_name(query, name);
+    put_u32le(query + WIRE_NAME_SIZE, window);
+    int opcode = call(OP_GET_RANK, query, sizeof(query), reply, sizeof(reply), &len);
+    if (opcode < 0) return -1;
+    
+    const leaderboard_store* board = reference_board(window);
+    size_t rank = store_rank(board, name);
+    int score = rank ? store_find(board, name)->score : 0;
+    checks++;
+    if (opcode != OP_RANK || len != 8) {
+        mismatch("GET_RANK %s %s answered with opcode 0x%02x", window_names[window], name, opcode);
+    } else if (get_u32le(reply) != rank || (int)get_u32le(reply + 4) != score) {
+        mismatch("GET_RANK %s %s: rank %u score %d, expected rank %zu score %d",
+                 window_names[window], name, get_u32le(reply), (int)get_u32le(reply + 4),
+                 rank, score);
+    }
+    return 0;
+}
+
+static int run_verify(const char* router, int players, int scores) {
+    struct sockaddr_in address;
+    if (parse_address(router, &address) < 0) {
+        fprintf(stderr, "Invalid router address %s\n", router);
+        return -1;
+    }
+    verify_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (verify_fd < 0 || connect(verify_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    
+    // Laid out as the server lays out its windows
+    time_t now = time(NULL);
+    if (store_init(&reference) < 0 ||
+        window_init(&reference_windows[WINDOW_DAILY], 3600, 24, now) < 0 ||
+        window_init(&reference_windows[WINDOW_WEEKLY], 6 * 3600, 28, now) < 0) {
+        fprintf(stderr, "Failed to allocate reference store\n");
+        return -1;
+    }
+    
+    printf("Submitting %d scores for %d players through %s\n", scores, players, router);
+    if (verify_submissions(players, scores) < 0) goto lost;
+    
+    static const uint32_t ranges[][2] = {{0, 1}, {0, 100}, {1, 10}, {37, 250}, {500, 500},
+                                         {990, 10}, {0, 1000}};
+    for (int w = 0; w < WINDOW_COUNT; w++) {
+        if (verify_entries(w, 0, 0, TOP_COUNT) < 0) goto lost;
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+            if (verify_entries(w, 1, ranges[i][0], ranges[i][1]) < 0) goto lost;
+        }
+        for (int p = 0; p <= players; p++) {
+            char name[WIRE_NAME_SIZE];
+            snprintf(name, sizeof(name), "player%d", p);   // player<players> never played
+            if (verify_rank(w, name) < 0) goto lost;
+        }
+    }
+    
+    printf("%lu checks, %lu mismatches\n", checks, mismatches);
+    if (reference.count != 0 && mismatches == 0) {
+        printf("Cluster matches a single store\n");
+    }
+    return mismatches ? -1 : 0;
+    
+lost:
+    fprintf(stderr, "Lost connection to the router\n");
+    return -1;
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s --shard IP:PORT [--shard IP:PORT ...] [--port N]\n"
+                    "          [--read-limit N] [--write-limit N]\n"
+                    "       %s --verify IP:PORT [--players N] [--scores N] [--seed N]\n",
+            program, program);
+}
+
+int main(int argc, char* argv[]) {
+    int port = DEFAULT_PORT;
+    double read_limit_rate = LIMIT_DEFAULT_READ_RATE;
+    double write_limit_rate = LIMIT_DEFAULT_WRITE_RATE;
+    const char* verify = NULL;
+    int players = DEFAULT_VERIFY_PLAYERS;
+    int scores = DEFAULT_VERIFY_SCORES;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc && shard_count < MAX_SHARDS) {
+            shard* s = &shards[shard_count++];
+            s->kind = ENDPOINT_SHARD;
+            s->fd = -1;
+            s->address_text = argv[++i];
+            if (parse_address(s->address_text, &s->address) < 0) {
+                fprintf(stderr, "Invalid shard address %s\n", s->address_text);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-limit") == 0 && i + 1 < argc) {
+            read_limit_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--write-limit") == 0 && i + 1 < argc) {
+            write_limit_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc) {
+            verify = argv[++i];
+        } else if (strcmp(argv[i], "--players") == 0 && i + 1 < argc) {
+            players = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scores") == 0 && i + 1 < argc) {
+            scores = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng = strtoull(argv[++i], NULL, 10) | 1;
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (verify) {
+        if (players <= 0 || scores < 0) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        return run_verify(verify, players, scores) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    
+    if (shard_count == 0 || port <= 0 || port > 65535 || read_limit_rate < 0 ||
+        write_limit_rate < 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (limit_init(read_limit_rate, write_limit_rate, LIMIT_DEFAULT_TABLE_SIZE) < 0) {
+        fprintf(stderr, "Failed to allocate rate limit table\n");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    int result = run_router(port);
+    limit_free();
+    return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,197 +8,3163 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include "leaderboard_protocol.h"
+#include "leaderboard_store.h"
+#include "leaderboard_persist.h"
+#include "leaderboard_window.h"
+#include "leaderboard_stats.h"
+#include "leaderboard_log.h"
+#include "leaderboard_limit.h"
+#include "leaderboard_namespace.h"
+#include "leaderboard_handoff.h"
+#include "leaderboard_capture.h"
+#include "leaderboard_federation.h"
 
-#define PORT 8080
-#define MAX_ENTRIES 100
+#define DEFAULT_PORT 8080
 #define BUFFER_SIZE 1024
+#define MAX_EVENTS 256
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_IDLE_TIMEOUT 30
+#define DEFAULT_MAX_CONNECTIONS 10000
+#define MAX_WORKERS 64
+#define PUSH_INTERVAL_MS 100
+#define MAX_SUBSCRIBER_BACKLOG (64 * 1024)
+#define WINDOW_DRAIN_BATCH 1024
+#define MAX_PENDING_UDP_ACKS 4096
+#define STATS_REPLY_SIZE 8192
+#define DEFAULT_STATS_INTERVAL 10
+#define MAX_PENDING_OUTPUT (256 * 1024)  // Unsent replies before a client's input is left unread
+#define PAUSE_CHECK_MS 5
+#define MAX_EXPORTS 4               // Export children running at once
+#define EXPORT_CHUNK 1000           // Entries per OP_EXPORT_CHUNK
+#define EXPORT_LINE_MAX 128         // Longest CSV line of a text export
+#define EXPORT_SEND_TIMEOUT 60      // Seconds an export waits on a client that stopped reading
+#define HANDOFF_DRAIN_TIMEOUT_MS 5000  // Longest a handoff waits for replies to be sent
 
+#define TOP_COUNT 10
+
+// One leaderboard shared by every worker. Submissions take the lock for
+// writing; readers mostly never touch it, since GET_LEADERBOARD is served
+// from each worker's cache and only rebuilding that takes a read lock.
+leaderboard_store leaderboard;
+pthread_rwlock_t leaderboard_lock;
+unsigned long leaderboard_generation = 1;  // Bumped whenever the top-N changes
+
+// Rolling boards, indexed by window_id and guarded by leaderboard_lock.
+// The all-time board is the leaderboard store itself.
+leaderboard_window rolling_windows[WINDOW_COUNT];
+const char* window_names[WINDOW_COUNT] = {"alltime", "daily", "weekly"};
+const struct {
+    time_t bucket_seconds;
+    int bucket_count;
+} window_layout[WINDOW_COUNT] = {
+    [WINDOW_DAILY] = {3600, 24},
+    [WINDOW_WEEKLY] = {6 * 3600, 28},
+};
+uint64_t windows_maintained_ms = 0;
+int windows_draining = 0;
+
+volatile sig_atomic_t server_running = 1;
+
+// Wire protocol a connection speaks, detected from its first byte
+typedef enum {
+    PROTO_UNKNOWN,
+    PROTO_LEGACY,   // One unframed text request, then the server hangs up
+    PROTO_FRAMED,   // Length-prefixed text requests on a persistent connection
+    PROTO_BINARY,   // Fixed-header binary requests on a persistent connection
+    PROTO_COUNT
+} wire_protocol;
+
+// Serialized GET_LEADERBOARD reply, exactly as sent on the wire
 typedef struct {
-    char player_name[32];
-    int score;
-    time_t timestamp;
-    char client_ip[16];
-} leaderboard_entry;
+    char* data;
+    size_t len;
+    size_t cap;
+    unsigned long generation;   // leaderboard_generation it was built from; 0 = never
+} cached_reply;
+
+// A submission datagram whose OP_OK waits for its log record to be synced
+typedef struct {
+    struct sockaddr_in addr;
+    uint32_t request_id;
+    uint64_t lsn;
+} udp_ack;
+
+struct client_conn;
+
+// One event loop thread with its own listening socket. Connections stay
+// on the worker that accepted them for their whole life.
+typedef struct worker {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int epoll_fd;
+    int notify_fd;              // Durability notifications, -1 without persistence
+    int udp_fd;                 // Datagram requests, -1 if disabled
+    int wake_fd;                // Interrupts epoll_wait when a handoff starts
+    udp_ack* udp_acks;
+    size_t udp_ack_count;
+    size_t udp_ack_cap;
+    struct client_conn* idle_head;  // Least recently active first
+    struct client_conn* idle_tail;
+    struct client_conn* durability_waiters;
+    struct client_conn* paused;     // Connections whose input is left unread for now
+    cached_reply cache[PROTO_COUNT];  // Top-N replies for each protocol
+    struct client_conn* subscribers;
+    unsigned long published_generation;  // What subscribers were last told
+    unsigned char published[TOP_COUNT * WIRE_ENTRY_SIZE];
+    uint32_t published_count;
+    uint64_t last_push_ms;
+    server_stats stats;         // Written only by this worker's thread
+    capture_buffer capture;     // Requests not yet handed to the capture writer
+    int draining;               // Handing off: no new requests are read
+    int drained;                // Handing off: nothing left to send, loop stopped
+} worker;
+
+// Per-connection state for the event loop
+typedef struct client_conn {
+    worker* owner;
+    int fd;
+    wire_protocol protocol;
+    char client_ip[INET_ADDRSTRLEN];
+    uint32_t client_addr;       // Host byte order, for the rate limits
+    char* rbuf;
+    size_t rlen;
+    size_t rcap;
+    char* wbuf;
+    size_t wlen;
+    size_t wpos;
+    size_t wcap;
+    int close_after_write;
+    uint64_t wait_lsn;          // Output held until this log record is durable
+    time_t last_active;
+    struct client_conn* prev;   // Idle list, least recently active first
+    struct client_conn* next;
+    struct client_conn* wait_prev;  // Connections with output held for durability
+    struct client_conn* wait_next;
+    int subscribed;
+    struct client_conn* sub_prev;   // Subscriber list; subscribers never go idle
+    struct client_conn* sub_next;
+    uint64_t throttled_until_ms;    // Over its rate limit; 0 if not
+    int read_paused;
+    struct client_conn* pause_prev; // Worker's paused list
+    struct client_conn* pause_next;
+    int export_requested;           // Hand over to an export child once replies are sent
+    window_id export_window;
+    uint32_t capture_id;            // Connection id in the capture; 0 until its first request
+    int federation_peer;            // Presented the federation secret
+} client_conn;
+
+int listen_port = DEFAULT_PORT;
+int listen_backlog = DEFAULT_BACKLOG;
+int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+int max_connections = DEFAULT_MAX_CONNECTIONS;
+int active_connections = 0;     // Across all workers; updated atomically
+int worker_count = 1;
+worker workers[MAX_WORKERS];
+
+// epoll tags for the descriptors that aren't client connections
+char listener_tag;
+char persist_tag;
+char udp_tag;
+char handoff_tag;
+char wake_tag;
+
+int udp_enabled = 1;
+
+int persist_enabled = 1;
+const char* data_dir = ".";
+unsigned long snapshot_every = PERSIST_DEFAULT_SNAPSHOT_EVERY;
+
+const char* stats_file = NULL;  // Periodic STATS dump, if set
+int stats_interval = DEFAULT_STATS_INTERVAL;
+uint64_t stats_dumped_ms = 0;
+time_t started_at;
 
-leaderboard_entry leaderboard[MAX_ENTRIES];
-int entry_count = 0;
-int server_running = 1;
+const char* log_file = NULL;    // stdout if not set
+const char* capture_file = NULL;    // Trace of every request read, if set
+log_level log_level_option = LOG_INFO;
+
+double read_limit_rate = LIMIT_DEFAULT_READ_RATE;
+double write_limit_rate = LIMIT_DEFAULT_WRITE_RATE;
+size_t limit_table_size = LIMIT_DEFAULT_TABLE_SIZE;
+
+size_t namespace_memory_mb = NAMESPACE_DEFAULT_MEMORY_MB;
+int namespace_idle_timeout = NAMESPACE_DEFAULT_IDLE_TIMEOUT;
+size_t max_namespaces = NAMESPACE_DEFAULT_MAX;
+
+// Hot restart (see leaderboard_handoff.h)
+const char* upgrade_socket = NULL;  // Where to listen for a process taking over, if set
+int takeover = 0;                   // Take over from the server at upgrade_socket
+int handoff_listen_fd = -1;         // In worker 0's epoll set
+int handoff_fd = -1;                // The process taking over, once one has asked
+int handing_off = 0;                // Atomic; every worker drains once set
+uint64_t handoff_deadline_ms;
+
+// Federation (see leaderboard_federation.h); peers are added as parsed
+int anti_entropy_interval = FEDERATION_DEFAULT_INTERVAL;
+int federation_drop = 0;            // Fault injection: percent of messages to peers lost
+int federation_delay = 0;           // And the longest each is held back, in ms
+const char* federation_secret_file = NULL;  // Required with peers
+
+// Exports in progress, each streamed by a forked child that owns the
+// client's socket; slots are reserved when EXPORT arrives and reaped by
+// worker 0 once the child exits
+typedef struct {
+    pid_t pid;                      // 0 = free
+    char client_ip[INET_ADDRSTRLEN];
+} export_child;
+export_child export_children[MAX_EXPORTS];
+int exports_reserved = 0;
+pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Milliseconds on a monotonic clock
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 // Function to handle SIGINT for graceful shutdown
 void handle_signal(int sig) {
-    printf("\nShutting down server gracefully...\n");
     server_running = 0;
 }
 
-// Add or update score in leaderboard
-void update_leaderboard(const char* name, int score, const char* client_ip) {
-    // Check if player already exists
-    for (int i = 0; i < entry_count; i++) {
-        if (strcmp(leaderboard[i].player_name, name) == 0) {
-            if (score > leaderboard[i].score) {
-                leaderboard[i].score = score;
-                leaderboard[i].timestamp = time(NULL);
-                strcpy(leaderboard[i].client_ip, client_ip);
+// The busiest log messages go in as binary records and are only turned
+// into text on the log thread
+typedef struct {
+    char player_name[WIRE_NAME_SIZE];
+    int score;
+    char client_ip[INET_ADDRSTRLEN];
+} submission_record;
+
+typedef struct {
+    char client_ip[INET_ADDRSTRLEN];
+    uint16_t port;
+} connection_record;
+
+void format_submission(const void* data, size_t length, char* out, size_t size) {
+    const submission_record* record = data;
+    snprintf(out, size, "Score submitted: %s - %d from %s",
+             record->player_name, record->score, record->client_ip);
+}
+
+void format_connection(const void* data, size_t length, char* out, size_t size) {
+    const connection_record* record = data;
+    snprintf(out, size, "New connection from %s:%d", record->client_ip, record->port);
+}
+
+void log_submission(const char* name, int score, const char* client_ip) {
+    if (!log_enabled(LOG_INFO)) return;
+    submission_record record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.player_name, name, strnlen(name, WIRE_NAME_SIZE - 1));
+    record.score = score;
+    memcpy(record.client_ip, client_ip, strnlen(client_ip, INET_ADDRSTRLEN - 1));
+    log_binary(LOG_INFO, format_submission, &record, sizeof(record));
+}
+
+// Make every worker's cached leaderboard replies stale. Call with
+// leaderboard_lock held for writing.
+void invalidate_leaderboard_cache() {
+    __atomic_add_fetch(&leaderboard_generation, 1, __ATOMIC_RELEASE);
+}
+
+// Board a query for the given window reads, guarded by leaderboard_lock
+const leaderboard_store* board_for(window_id window) {
+    return window == WINDOW_ALL_TIME ? &leaderboard : &rolling_windows[window].board;
+}
+
+// Window named in a text request, or -1
+int parse_window(const char* name) {
+    for (int i = 0; i < WINDOW_COUNT; i++) {
+        if (strcmp(name, window_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Add a score to every rolling window. Returns nonzero if any of them
+// changed, -1 if memory ran out. Call with leaderboard_lock held for writing.
+int update_windows(const char* name, int score, time_t timestamp, const char* client_ip) {
+    int changed = 0;
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT; i++) {
+        int result = window_submit(&rolling_windows[i], name, score, timestamp, client_ip);
+        if (result < 0) return -1;
+        changed |= result;
+    }
+    return changed;
+}
+
+// Log records replayed at startup belong in the windows too
+void replay_into_windows(const leaderboard_entry* entry) {
+    update_windows(entry->player_name, entry->score, entry->timestamp, entry->client_ip);
+}
+
+// Fill in a submission record
+void make_record(leaderboard_entry* record, const char* name, int score,
+                 time_t timestamp, const char* client_ip) {
+    memset(record, 0, sizeof(*record));
+    snprintf(record->player_name, sizeof(record->player_name), "%s", name);
+    record->score = score;
+    record->timestamp = timestamp;
+    snprintf(record->client_ip, sizeof(record->client_ip), "%s", client_ip);
+}
+
+// Record a submission on every board, or with merge set a peer's record
+// (see store_merge). Sets *in_top if the all-time top-N may have changed.
+// Returns nonzero if any board kept it. Call with leaderboard_lock held
+// for writing.
+int apply_submission(const leaderboard_entry* record, int merge, int* in_top) {
+    const char* name = record->player_name;
+    const store_record* current = store_find(&leaderboard, name);
+    store_record before;
+    if (current) before = *current;
+    int outcome = merge ?
+        store_merge(&leaderboard, name, record->score, record->timestamp, record->client_ip) :
+        store_submit(&leaderboard, name, record->score, record->timestamp, record->client_ip);
+    int windows_changed = update_windows(name, record->score, record->timestamp,
+                                         record->client_ip);
+    // Peers compare digests of the all-time board, so they follow every change
+    int digest_failed = outcome > STORE_UNCHANGED &&
+        federation_update(current ? &before : NULL, store_find(&leaderboard, name)) < 0;
+    if (outcome < 0 || windows_changed < 0 || digest_failed) {
+        log_message(LOG_ERROR, "Out of memory recording score for %s", name);
+    }
+    // Scores only ever improve, so the top-N can only change if this player
+    // is in it now
+    if (outcome > STORE_UNCHANGED && store_in_top(&leaderboard, name, TOP_COUNT)) {
+        *in_top = 1;
+    }
+    return outcome > STORE_UNCHANGED || windows_changed > 0;
+}
+
+// Add or update score in leaderboard. Returns the log sequence number the
+// reply must wait for, or 0 if nothing changed.
+uint64_t update_leaderboard(const char* name, int score, const char* client_ip) {
+    uint64_t lsn = 0;
+    int in_top = 0;
+    leaderboard_entry record;
+    make_record(&record, name, score, time(NULL), client_ip);
+    
+    pthread_rwlock_wrlock(&leaderboard_lock);
+    // Log every submission some board kept, so replay can rebuild the
+    // windows as well. Logged under the lock so a snapshot never misses a
+    // record that went to an older log generation.
+    if (apply_submission(&record, 0, &in_top)) {
+        federation_publish(&record);
+        if (persist_enabled) lsn = persist_append(&record);
+    }
+    if (in_top) {
+        invalidate_leaderboard_cache();
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    return lsn;
+}
+
+// Apply a batch of submissions as one unit: readers see all of it or none,
+// the cached top-N is invalidated at most once and the log gets a single
+// append. Items already marked BATCH_REJECTED in results are skipped; the
+// rest get BATCH_RECORDED or BATCH_UNCHANGED. Reorders records. Returns
+// the log sequence number the reply must wait for, or 0 if nothing changed.
+uint64_t update_leaderboard_batch(leaderboard_entry* records, unsigned char* results,
+                                  size_t count) {
+    uint64_t lsn = 0;
+    int in_top = 0;
+    size_t kept = 0;
+    
+    pthread_rwlock_wrlock(&leaderboard_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] == BATCH_REJECTED) continue;
+        if (apply_submission(&records[i], 0, &in_top)) {
+            results[i] = BATCH_RECORDED;
+            federation_publish(&records[i]);
+            records[kept++] = records[i];
+        } else {
+            results[i] = BATCH_UNCHANGED;
+        }
+    }
+    if (persist_enabled) {
+        lsn = persist_append_batch(records, kept);
+    }
+    if (in_top) {
+        invalidate_leaderboard_cache();
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    return lsn;
+}
+
+// Apply records from a federation peer like a batch, but without passing
+// them on to the other peers. The peer is answered without waiting for the
+// log: if they are lost in a crash, anti-entropy fetches them again.
+// Records dated too far ahead are skipped, and offered again by
+// anti-entropy until they are due. Returns how many some board kept.
+size_t merge_remote(leaderboard_entry* records, size_t count) {
+    int in_top = 0;
+    size_t kept = 0;
+    time_t latest = time(NULL) + FEDERATION_MAX_SKEW;
+    
+    pthread_rwlock_wrlock(&leaderboard_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].timestamp > latest) continue;
+        if (apply_submission(&records[i], 1, &in_top)) {
+            records[kept++] = records[i];
+        }
+    }
+    if (persist_enabled && kept > 0) {
+        persist_append_batch(records, kept);
+    }
+    if (in_top) {
+        invalidate_leaderboard_cache();
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    return kept;
+}
+
+// Roll the windows forward and expire a batch of scores that have aged out.
+// Runs on worker 0 once a second, and every loop iteration while expired
+// scores remain, so no single pass holds the lock for long.
+void maintain_windows() {
+    if (!windows_draining && now_ms() - windows_maintained_ms < 1000) return;
+    windows_maintained_ms = now_ms();
+    
+    time_t now = time(NULL);
+    pthread_rwlock_wrlock(&leaderboard_lock);
+    windows_draining = 0;
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT; i++) {
+        windows_draining |= window_maintain(&rolling_windows[i], now, WINDOW_DRAIN_BATCH);
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+}
+
+// Format a board's top entries as string for sending to client. Returns
+// the length. Call with leaderboard_lock held.
+int format_leaderboard(const leaderboard_store* board, char* buffer, int buffer_size) {
+    const store_record* top[TOP_COUNT];
+    size_t count = store_top(board, top, TOP_COUNT);
+    
+    int len = snprintf(buffer, buffer_size, "LEADERBOARD");
+    
+    for (size_t i = 0; i < count; i++) {
+        int n = snprintf(buffer + len, buffer_size - len, "|%s:%d",
+                         store_name(top[i]->name), top[i]->score);
+        if (n < 0 || n >= buffer_size - len) {
+            buffer[len] = '\0';  // Never send a partial entry
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+// Encode a board's top 10 as a binary OP_LEADERBOARD payload. The buffer
+// must hold 4 + TOP_COUNT * WIRE_ENTRY_SIZE bytes. Returns the payload
+// length. Call with leaderboard_lock held.
+size_t format_leaderboard_binary(const leaderboard_store* board, unsigned char* buffer) {
+    const store_record* top[TOP_COUNT];
+    size_t count = store_top(board, top, TOP_COUNT);
+    
+    put_u32le(buffer, (uint32_t)count);
+    unsigned char* p = buffer + 4;
+    for (size_t i = 0; i < count; i++) {
+        const char* name = store_name(top[i]->name);
+        memset(p, 0, WIRE_NAME_SIZE);
+        memcpy(p, name, strnlen(name, WIRE_NAME_SIZE - 1));
+        put_u32le(p + WIRE_NAME_SIZE, (uint32_t)top[i]->score);
+        p += WIRE_ENTRY_SIZE;
+    }
+    return p - buffer;
+}
+
+// Copy out up to count entries of a board guarded by lock in rank order,
+// starting after offset or, if name is given, centred on that player with
+// up to count entries either side. Sets *first_rank to the rank of the
+// first entry. Returns how many.
+size_t copy_range(pthread_rwlock_t* lock, const leaderboard_store* board, const char* name,
+                  size_t offset, size_t count, leaderboard_entry* out, size_t* first_rank) {
+    const store_record* found[MAX_RANGE_COUNT];
+    size_t n = 0;
+    
+    pthread_rwlock_rdlock(lock);
+    if (name) {
+        size_t rank = store_rank(board, name);
+        if (count > (MAX_RANGE_COUNT - 1) / 2) count = (MAX_RANGE_COUNT - 1) / 2;
+        offset = (rank > count + 1) ? rank - 1 - count : 0;
+        count = rank ? rank - offset + count : 0;
+    }
+    if (count > MAX_RANGE_COUNT) count = MAX_RANGE_COUNT;
+    n = store_range(board, offset, found, count);
+    for (size_t i = 0; i < n; i++) {
+        store_unpack(found[i], &out[i]);
+    }
+    pthread_rwlock_unlock(lock);
+    
+    *first_rank = n ? offset + 1 : 0;
+    return n;
+}
+
+// Rank of a player on a board guarded by lock (0 if unknown) and their
+// best score there
+size_t board_rank(pthread_rwlock_t* lock, const leaderboard_store* board, const char* name,
+                  int* score) {
+    pthread_rwlock_rdlock(lock);
+    size_t rank = store_rank(board, name);
+    *score = rank ? store_find(board, name)->score : 0;
+    pthread_rwlock_unlock(lock);
+    return rank;
+}
+
+size_t rank_of(window_id window, const char* name, int* score) {
+    return board_rank(&leaderboard_lock, board_for(window), name, score);
+}
+
+// The key a player is ranked by on a board: rank (0 if unknown), score and
+// the time it was set
+size_t rank_key_of(window_id window, const char* name, int* score, time_t* timestamp) {
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    const leaderboard_store* board = board_for(window);
+    size_t rank = store_rank(board, name);
+    const store_record* entry = rank ? store_find(board, name) : NULL;
+    *score = entry ? entry->score : 0;
+    *timestamp = entry ? entry->timestamp : 0;
+    pthread_rwlock_unlock(&leaderboard_lock);
+    return rank;
+}
+
+// Players on a board ranked ahead of the given key
+size_t count_ahead(window_id window, int score, time_t timestamp, const char* name) {
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    size_t count = store_count_ahead(board_for(window), score, timestamp, name);
+    pthread_rwlock_unlock(&leaderboard_lock);
+    return count;
+}
+
+// Write a STATS snapshot, with every worker's counters added up. Returns
+// the length, or -1 on error.
+int format_stats(char* buffer, size_t size) {
+    server_stats* totals = calloc(1, sizeof(server_stats));
+    if (!totals) return -1;
+    for (int i = 0; i < worker_count; i++) {
+        stats_merge(totals, &workers[i].stats);
+    }
+    
+    stats_gauges gauges = {0};
+    gauges.uptime_seconds = (uint64_t)(time(NULL) - started_at);
+    gauges.workers = worker_count;
+    gauges.active_connections = __atomic_load_n(&active_connections, __ATOMIC_RELAXED);
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    for (int i = 0; i < WINDOW_COUNT; i++) {
+        gauges.players[i] = board_for(i)->count;
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    if (persist_enabled) {
+        gauges.appended_lsn = persist_appended_lsn();
+        gauges.durable_lsn = persist_durable_lsn();
+    }
+    gauges.log_dropped = log_dropped();
+    gauges.capture_records = capture_records();
+    gauges.capture_dropped = capture_dropped();
+    namespace_totals namespaces;
+    namespace_get_totals(&namespaces);
+    gauges.namespaces = namespaces.resident;
+    gauges.namespace_bytes = namespaces.memory;
+    gauges.namespaces_loaded = namespaces.loaded;
+    gauges.namespaces_evicted = namespaces.evicted;
+    federation_totals federation;
+    federation_get_totals(&federation);
+    gauges.federation_peers = federation.peers;
+    gauges.federation_peers_up = federation.peers_up;
+    gauges.federation_sent = federation.sent;
+    gauges.federation_lost = federation.lost;
+    gauges.federation_merged = federation.merged;
+    gauges.federation_repaired = federation.repaired;
+    gauges.federation_rounds = federation.rounds;
+    gauges.federation_digest = federation.digest;
+    
+    int len = stats_format(totals, &gauges, buffer, size);
+    free(totals);
+    return len;
+}
+
+// Replace the stats file with a fresh snapshot if one is due. The file is
+// written aside and renamed into place, so readers never see half of one.
+void maybe_dump_stats() {
+    if (!stats_file || now_ms() - stats_dumped_ms < (uint64_t)stats_interval * 1000) return;
+    stats_dumped_ms = now_ms();
+    
+    char snapshot[STATS_REPLY_SIZE];
+    char tmp_path[4096];
+    int len = format_stats(snapshot, sizeof(snapshot));
+    if (len < 0) return;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_file);
+    FILE* file = fopen(tmp_path, "w");
+    if (!file) {
+        log_message(LOG_WARN, "stats file %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+    fprintf(file, "%s\n", snapshot);
+    if (fclose(file) != 0 || rename(tmp_path, stats_file) < 0) {
+        log_message(LOG_WARN, "stats file %s: %s", stats_file, strerror(errno));
+    }
+}
+
+// Unlink a connection from its worker's idle list
+void idle_list_remove(client_conn* conn) {
+    worker* w = conn->owner;
+    if (conn->prev) conn->prev->next = conn->next;
+    else w->idle_head = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    else w->idle_tail = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+// Mark a connection as active and move it to the back of the idle list
+void touch_connection(client_conn* conn) {
+    worker* w = conn->owner;
+    conn->last_active = time(NULL);
+    if (conn->subscribed) return;
+    if (conn == w->idle_tail) return;
+    if (conn->prev || conn->next || conn == w->idle_head) {
+        idle_list_remove(conn);
+    }
+    conn->prev = w->idle_tail;
+    if (w->idle_tail) w->idle_tail->next = conn;
+    else w->idle_head = conn;
+    w->idle_tail = conn;
+}
+
+// Grow a buffer so it can hold at least `needed` bytes
+int reserve_buffer(char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return 0;
+    size_t new_cap = *cap ? *cap : BUFFER_SIZE;
+    while (new_cap < needed) new_cap *= 2;
+    char* grown = realloc(*buf, new_cap);
+    if (!grown) return -1;
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Queue bytes for sending to a client
+int queue_response(client_conn* conn, const char* data, size_t len) {
+    if (reserve_buffer(&conn->wbuf, &conn->wcap, conn->wlen + len) < 0) {
+        return -1;
+    }
+    memcpy(conn->wbuf + conn->wlen, data, len);
+    conn->wlen += len;
+    return 0;
+}
+
+// Queue a reply, framing it if the client speaks the framed protocol
+int send_reply(client_conn* conn, const char* data, size_t len) {
+    if (conn->protocol == PROTO_FRAMED) {
+        unsigned char header[FRAME_HEADER_SIZE];
+        frame_put_length(header, (uint32_t)len);
+        if (queue_response(conn, (const char*)header, sizeof(header)) < 0) {
+            return -1;
+        }
+    }
+    return queue_response(conn, data, len);
+}
+
+// Queue a binary reply with its header
+int send_binary_reply(client_conn* conn, uint16_t opcode, const void* payload, size_t len) {
+    unsigned char header[BINARY_HEADER_SIZE];
+    binary_put_header(header, opcode, (uint32_t)len);
+    if (queue_response(conn, (const char*)header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return len ? queue_response(conn, payload, len) : 0;
+}
+
+// Send bytes straight to the socket when nothing is queued ahead of them,
+// queueing only what the kernel won't take right away
+int send_or_queue(client_conn* conn, const char* data, size_t len) {
+    if (conn->wlen == 0 && conn->wait_lsn == 0) {
+        ssize_t sent = send(conn->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+            stat_add(&conn->owner->stats.bytes_out, sent);
+            data += sent;
+            len -= sent;
+        }
+    }
+    return len ? queue_response(conn, data, len) : 0;
+}
+
+// Serialize the top-N reply for a protocol into a worker's cache slot
+int build_cached_leaderboard(worker* w, wire_protocol protocol) {
+    cached_reply* cache = &w->cache[protocol];
+    unsigned char payload[BUFFER_SIZE];
+    size_t header_len = 0;
+    size_t len;
+    
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    unsigned long generation = __atomic_load_n(&leaderboard_generation, __ATOMIC_ACQUIRE);
+    if (protocol == PROTO_BINARY) {
+        len = format_leaderboard_binary(&leaderboard, payload);
+        header_len = BINARY_HEADER_SIZE;
+    } else {
+        len = format_leaderboard(&leaderboard, (char*)payload, sizeof(payload));
+        if (protocol == PROTO_FRAMED) header_len = FRAME_HEADER_SIZE;
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    
+    if (reserve_buffer(&cache->data, &cache->cap, header_len + len) < 0) {
+        return -1;
+    }
+    if (protocol == PROTO_BINARY) {
+        binary_put_header((unsigned char*)cache->data, OP_LEADERBOARD, (uint32_t)len);
+    } else if (protocol == PROTO_FRAMED) {
+        frame_put_length((unsigned char*)cache->data, (uint32_t)len);
+    }
+    memcpy(cache->data + header_len, payload, len);
+    cache->len = header_len + len;
+    cache->generation = generation;
+    return 0;
+}
+
+// The worker's current top-N reply for a protocol, rebuilt first if stale.
+// Returns NULL if memory ran out.
+const cached_reply* current_leaderboard(worker* w, wire_protocol protocol) {
+    cached_reply* cache = &w->cache[protocol];
+    if (cache->generation == __atomic_load_n(&leaderboard_generation, __ATOMIC_ACQUIRE)) {
+        stat_add(&w->stats.cache_hits, 1);
+    } else {
+        stat_add(&w->stats.cache_misses, 1);
+        if (build_cached_leaderboard(w, protocol) < 0) {
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+// Answer GET_LEADERBOARD from the worker's cache
+void send_cached_leaderboard(client_conn* conn) {
+    const cached_reply* cache = current_leaderboard(conn->owner, conn->protocol);
+    if (cache) {
+        send_or_queue(conn, cache->data, cache->len);
+    }
+}
+
+// Hold a connection's output (this reply and any after it) until the log
+// record at lsn has been synced
+void hold_until_durable(client_conn* conn, uint64_t lsn) {
+    worker* w = conn->owner;
+    if (lsn == 0) return;
+    if (conn->wait_lsn == 0) {
+        conn->wait_prev = NULL;
+        conn->wait_next = w->durability_waiters;
+        if (w->durability_waiters) w->durability_waiters->wait_prev = conn;
+        w->durability_waiters = conn;
+    }
+    conn->wait_lsn = lsn;
+}
+
+void waiter_list_remove(client_conn* conn) {
+    if (conn->wait_prev) conn->wait_prev->wait_next = conn->wait_next;
+    else conn->owner->durability_waiters = conn->wait_next;
+    if (conn->wait_next) conn->wait_next->wait_prev = conn->wait_prev;
+    conn->wait_prev = conn->wait_next = NULL;
+    conn->wait_lsn = 0;
+}
+
+void subscriber_list_add(client_conn* conn) {
+    worker* w = conn->owner;
+    conn->subscribed = 1;
+    conn->sub_prev = NULL;
+    conn->sub_next = w->subscribers;
+    if (w->subscribers) w->subscribers->sub_prev = conn;
+    w->subscribers = conn;
+}
+
+void subscriber_list_remove(client_conn* conn) {
+    if (conn->sub_prev) conn->sub_prev->sub_next = conn->sub_next;
+    else conn->owner->subscribers = conn->sub_next;
+    if (conn->sub_next) conn->sub_next->sub_prev = conn->sub_prev;
+    conn->sub_prev = conn->sub_next = NULL;
+    conn->subscribed = 0;
+}
+
+void paused_list_remove(client_conn* conn) {
+    if (conn->pause_prev) conn->pause_prev->pause_next = conn->pause_next;
+    else conn->owner->paused = conn->pause_next;
+    if (conn->pause_next) conn->pause_next->pause_prev = conn->pause_prev;
+    conn->pause_prev = conn->pause_next = NULL;
+    conn->read_paused = 0;
+}
+
+// Claim one of the MAX_EXPORTS export slots. Returns -1 if all are taken.
+int reserve_export() {
+    pthread_mutex_lock(&export_lock);
+    int reserved = exports_reserved < MAX_EXPORTS;
+    if (reserved) exports_reserved++;
+    pthread_mutex_unlock(&export_lock);
+    return reserved ? 0 : -1;
+}
+
+void release_export() {
+    pthread_mutex_lock(&export_lock);
+    exports_reserved--;
+    pthread_mutex_unlock(&export_lock);
+}
+
+// Close a client connection and release its buffers
+void close_connection(client_conn* conn) {
+    if (conn->capture_id && capture_enabled()) {
+        capture_record(&conn->owner->capture, CAPTURE_CLOSE, conn->capture_id,
+                       conn->client_addr, NULL, 0);
+    }
+    if (conn->export_requested) release_export();
+    if (conn->wait_lsn) waiter_list_remove(conn);
+    if (conn->read_paused) paused_list_remove(conn);
+    if (conn->subscribed) subscriber_list_remove(conn);
+    else idle_list_remove(conn);
+    epoll_ctl(conn->owner->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->rbuf);
+    free(conn->wbuf);
+    free(conn);
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+// Push what changed in the top-N since the last push to every subscriber
+// on this worker. However many submissions landed since then, subscribers
+// get one delta, serialized once and shared by all of them.
+void publish_leaderboard_changes(worker* w) {
+    if (__atomic_load_n(&leaderboard_generation, __ATOMIC_ACQUIRE) == w->published_generation) {
+        return;
+    }
+    
+    unsigned char current[4 + TOP_COUNT * WIRE_ENTRY_SIZE];
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    unsigned long generation = __atomic_load_n(&leaderboard_generation, __ATOMIC_ACQUIRE);
+    format_leaderboard_binary(&leaderboard, current);
+    pthread_rwlock_unlock(&leaderboard_lock);
+    
+    unsigned char message[BINARY_HEADER_SIZE + 8 + TOP_COUNT * WIRE_DELTA_ENTRY_SIZE];
+    unsigned char* p = message + BINARY_HEADER_SIZE + 8;
+    uint32_t count = get_u32le(current);
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char* entry = current + 4 + i * WIRE_ENTRY_SIZE;
+        if (i < w->published_count &&
+            memcmp(entry, w->published + i * WIRE_ENTRY_SIZE, WIRE_ENTRY_SIZE) == 0) {
+            continue;
+        }
+        put_u32le(p, i);
+        memcpy(p + 4, entry, WIRE_ENTRY_SIZE);
+        p += WIRE_DELTA_ENTRY_SIZE;
+        changed++;
+    }
+    int visible = changed > 0 || count != w->published_count;
+    memcpy(w->published, current + 4, count * WIRE_ENTRY_SIZE);
+    w->published_count = count;
+    w->published_generation = generation;
+    if (!visible) return;
+    
+    size_t len = p - message;
+    binary_put_header(message, OP_LEADERBOARD_DELTA, (uint32_t)(len - BINARY_HEADER_SIZE));
+    put_u32le(message + BINARY_HEADER_SIZE, count);
+    put_u32le(message + BINARY_HEADER_SIZE + 4, changed);
+    
+    client_conn* conn = w->subscribers;
+    while (conn) {
+        client_conn* next = conn->sub_next;
+        // A subscriber that stopped reading would otherwise buffer forever
+        if (conn->wlen - conn->wpos > MAX_SUBSCRIBER_BACKLOG ||
+            send_or_queue(conn, (const char*)message, len) < 0) {
+            close_connection(conn);
+        }
+        conn = next;
+    }
+}
+
+// Start pushing top-N changes to a binary connection, beginning with the
+// worker's current baseline in full so later deltas apply to it
+void subscribe_connection(client_conn* conn) {
+    worker* w = conn->owner;
+    if (!conn->subscribed) {
+        if (!w->subscribers) {
+            publish_leaderboard_changes(w);  // Nobody to tell; just catch up
+        }
+        idle_list_remove(conn);
+        subscriber_list_add(conn);
+    }
+    
+    unsigned char payload[4 + TOP_COUNT * WIRE_ENTRY_SIZE];
+    put_u32le(payload, w->published_count);
+    memcpy(payload + 4, w->published, w->published_count * WIRE_ENTRY_SIZE);
+    send_binary_reply(conn, OP_LEADERBOARD, payload, 4 + w->published_count * WIRE_ENTRY_SIZE);
+}
+
+// Answer GET_LEADERBOARD for a rolling window. These change as scores
+// age out as well as on submissions, so they are built per request.
+void send_window_leaderboard(client_conn* conn, window_id window) {
+    char payload[BUFFER_SIZE];
+    size_t len;
+    
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    if (conn->protocol == PROTO_BINARY) {
+        len = format_leaderboard_binary(board_for(window), (unsigned char*)payload);
+    } else {
+        len = format_leaderboard(board_for(window), payload, sizeof(payload));
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    
+    if (conn->protocol == PROTO_BINARY) {
+        send_binary_reply(conn, OP_LEADERBOARD, payload, len);
+    } else {
+        send_reply(conn, payload, len);
+    }
+}
+
+// Answer a range query on a board guarded by lock in the connection's
+// protocol
+void send_board_range(client_conn* conn, pthread_rwlock_t* lock, const leaderboard_store* board,
+                      const char* name, size_t offset, size_t count) {
+    leaderboard_entry* entries = malloc(MAX_RANGE_COUNT * sizeof(leaderboard_entry));
+    size_t first_rank;
+    if (!entries) return;
+    size_t n = copy_range(lock, board, name, offset, count, entries, &first_rank);
+    
+    if (conn->protocol == PROTO_BINARY) {
+        unsigned char* payload = malloc(8 + n * WIRE_ENTRY_SIZE);
+        if (payload) {
+            put_u32le(payload, (uint32_t)first_rank);
+            put_u32le(payload + 4, (uint32_t)n);
+            for (size_t i = 0; i < n; i++) {
+                unsigned char* p = payload + 8 + i * WIRE_ENTRY_SIZE;
+                memset(p, 0, WIRE_NAME_SIZE);
+                memcpy(p, entries[i].player_name, strnlen(entries[i].player_name, WIRE_NAME_SIZE - 1));
+                put_u32le(p + WIRE_NAME_SIZE, (uint32_t)entries[i].score);
+            }
+            send_binary_reply(conn, OP_RANGE, payload, 8 + n * WIRE_ENTRY_SIZE);
+            free(payload);
+        }
+    } else {
+        // Format: RANGE|FirstRank|Name:Score|Name:Score...
+        size_t size = 32 + n * (sizeof(entries[0].player_name) + 13);
+        char* text = malloc(size);
+        if (text) {
+            int len = snprintf(text, size, "RANGE|%zu", first_rank);
+            for (size_t i = 0; i < n; i++) {
+                len += snprintf(text + len, size - len, "|%s:%d",
+                                entries[i].player_name, entries[i].score);
+            }
+            send_reply(conn, text, len);
+            free(text);
+        }
+    }
+    free(entries);
+}
+
+void send_range(client_conn* conn, window_id window, const char* name,
+                size_t offset, size_t count) {
+    send_board_range(conn, &leaderboard_lock, board_for(window), name, offset, count);
+}
+
+// Answer OP_GET_KEYED_RANGE: a range with each entry's timestamp
+void send_keyed_range(client_conn* conn, window_id window, size_t offset, size_t count) {
+    leaderboard_entry* entries = malloc(MAX_RANGE_COUNT * sizeof(leaderboard_entry));
+    unsigned char* payload = malloc(8 + MAX_RANGE_COUNT * WIRE_KEYED_ENTRY_SIZE);
+    size_t first_rank;
+    if (entries && payload) {
+        size_t n = copy_range(&leaderboard_lock, board_for(window), NULL, offset, count, entries,
+                              &first_rank);
+        put_u32le(payload, (uint32_t)first_rank);
+        put_u32le(payload + 4, (uint32_t)n);
+        for (size_t i = 0; i < n; i++) {
+            unsigned char* p = payload + 8 + i * WIRE_KEYED_ENTRY_SIZE;
+            memset(p, 0, WIRE_NAME_SIZE);
+            memcpy(p, entries[i].player_name, strnlen(entries[i].player_name, WIRE_NAME_SIZE - 1));
+            put_u32le(p + WIRE_NAME_SIZE, (uint32_t)entries[i].score);
+            put_u64le(p + WIRE_ENTRY_SIZE, (uint64_t)entries[i].timestamp);
+        }
+        send_binary_reply(conn, OP_KEYED_RANGE, payload, 8 + n * WIRE_KEYED_ENTRY_SIZE);
+    }
+    free(payload);
+    free(entries);
+}
+
+// A batched score may carry the time it was made, for instance during
+// offline play, but never one in the future. 0 means now. Returns -1 for a
+// time before the longest window, which no rolling board would take and
+// which could only serve to backdate a score.
+time_t submission_time(int64_t timestamp, time_t now) {
+    if (timestamp <= 0 || timestamp > now) return now;
+    time_t longest = 0;
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT; i++) {
+        time_t span = window_layout[i].bucket_seconds * window_layout[i].bucket_count;
+        if (span > longest) longest = span;
+    }
+    return (timestamp < now - longest) ? -1 : (time_t)timestamp;
+}
+
+// Apply a batch of submissions and answer with each one's batch_result,
+// once the batch is durable
+void submit_batch(client_conn* conn, leaderboard_entry* records, unsigned char* results,
+                  size_t count) {
+    hold_until_durable(conn, update_leaderboard_batch(records, results, count));
+    log_message(LOG_INFO, "Batch of %zu scores submitted from %s", count, conn->client_ip);
+    
+    if (conn->protocol == PROTO_BINARY) {
+        unsigned char reply[4 + MAX_BATCH_COUNT];
+        put_u32le(reply, (uint32_t)count);
+        memcpy(reply + 4, results, count);
+        send_binary_reply(conn, OP_BATCH_RESULT, reply, 4 + count);
+    } else {
+        // Format: BATCH|Count|Results, one digit per score
+        char reply[32 + MAX_BATCH_COUNT];
+        int len = snprintf(reply, sizeof(reply), "BATCH|%zu|", count);
+        for (size_t i = 0; i < count; i++) {
+            reply[len++] = (char)('0' + results[i]);
+        }
+        send_reply(conn, reply, len);
+    }
+}
+
+// Cached GET_LEADERBOARD reply of a namespace's board
+size_t format_namespace_top(const leaderboard_store* board, char* out, size_t size) {
+    return format_leaderboard(board, out, (int)size);
+}
+
+// Find the namespace a text request names. Window names are not namespace
+// names, so GET_LEADERBOARD|daily keeps its meaning.
+namespace_status acquire_namespace(const char* name, int create, leaderboard_namespace** ns) {
+    if (parse_window(name) >= 0) return NAMESPACE_INVALID;
+    return namespace_acquire(name, create, ns);
+}
+
+void send_namespace_error(client_conn* conn, namespace_status status) {
+    const char* reply = status == NAMESPACE_INVALID ? "ERROR|Invalid namespace" :
+                        status == NAMESPACE_UNKNOWN ? "ERROR|Unknown namespace" :
+                        status == NAMESPACE_UNAVAILABLE ? "ERROR|Namespace unavailable" :
+                        "ERROR|Too many namespaces";
+    send_reply(conn, reply, strlen(reply));
+}
+
+// Record a score in a namespace, creating it if need be. The reply goes
+// out once the score is in the namespace's log, without waiting for a sync.
+void submit_to_namespace(client_conn* conn, const char* ns_name, const char* name, int score) {
+    leaderboard_namespace* ns;
+    namespace_status status = acquire_namespace(ns_name, 1, &ns);
+    if (status != NAMESPACE_OK) {
+        send_namespace_error(conn, status);
+        return;
+    }
+    leaderboard_entry record;
+    make_record(&record, name, score, time(NULL), conn->client_ip);
+    pthread_rwlock_wrlock(&ns->lock);
+    int outcome = namespace_submit(ns, &record);
+    pthread_rwlock_unlock(&ns->lock);
+    namespace_release(ns);
+    
+    char response[BUFFER_SIZE];
+    if (outcome < 0) {
+        log_message(LOG_ERROR, "Failed to record score for %s in %s", name, ns_name);
+        snprintf(response, sizeof(response), "ERROR|Score not recorded");
+    } else {
+        snprintf(response, sizeof(response), "OK|Score submitted: %s - %d", name, score);
+        log_submission(name, score, conn->client_ip);
+    }
+    send_reply(conn, response, strlen(response));
+}
+
+// Answer GET_LEADERBOARD|Namespace from the namespace's cached reply
+void send_namespace_leaderboard(client_conn* conn, const char* ns_name) {
+    leaderboard_namespace* ns;
+    namespace_status status = acquire_namespace(ns_name, 0, &ns);
+    if (status != NAMESPACE_OK) {
+        send_namespace_error(conn, status);
+        return;
+    }
+    char reply[NAMESPACE_REPLY_SIZE];
+    pthread_rwlock_rdlock(&ns->lock);
+    size_t len = ns->top_len;
+    memcpy(reply, ns->top, len);
+    pthread_rwlock_unlock(&ns->lock);
+    namespace_release(ns);
+    send_reply(conn, reply, len);
+}
+
+void send_namespace_rank(client_conn* conn, const char* ns_name, const char* name) {
+    leaderboard_namespace* ns;
+    namespace_status status = acquire_namespace(ns_name, 0, &ns);
+    if (status != NAMESPACE_OK) {
+        send_namespace_error(conn, status);
+        return;
+    }
+    int score;
+    size_t rank = board_rank(&ns->lock, &ns->board, name, &score);
+    namespace_release(ns);
+    
+    char response[BUFFER_SIZE];
+    snprintf(response, sizeof(response), "RANK|%s|%zu|%d", name, rank, score);
+    send_reply(conn, response, strlen(response));
+}
+
+void send_namespace_range(client_conn* conn, const char* ns_name, const char* name,
+                          size_t offset, size_t count) {
+    leaderboard_namespace* ns;
+    namespace_status status = acquire_namespace(ns_name, 0, &ns);
+    if (status != NAMESPACE_OK) {
+        send_namespace_error(conn, status);
+        return;
+    }
+    send_board_range(conn, &ns->lock, &ns->board, name, offset, count);
+    namespace_release(ns);
+}
+
+// Parse the items of SUBMIT_BATCH|Name:Score[:Timestamp]|... into records.
+// Returns how many, or -1 if malformed.
+int parse_text_batch(const char* items, const char* client_ip, leaderboard_entry* records,
+                     unsigned char* results) {
+    time_t now = time(NULL);
+    int count = 0;
+    
+    while (*items) {
+        char player_name[32];
+        int score;
+        long long timestamp = 0;
+        int consumed = 0;
+        if (count == MAX_BATCH_COUNT ||
+            sscanf(items, "%31[^:|]:%d%n", player_name, &score, &consumed) != 2) {
+            return -1;
+        }
+        items += consumed;
+        if (*items == ':') {
+            if (sscanf(items + 1, "%lld%n", &timestamp, &consumed) != 1) return -1;
+            items += 1 + consumed;
+        }
+        if (*items == '|') {
+            items++;
+        } else if (*items != '\0') {
+            return -1;
+        }
+        time_t made = submission_time(timestamp, now);
+        make_record(&records[count], player_name, score, made, client_ip);
+        results[count++] = (made < 0) ? BATCH_REJECTED : BATCH_UNCHANGED;
+    }
+    return count;
+}
+
+// What kind of request a text message is, for the stats
+stat_request text_request_kind(const char* message) {
+    if (strncmp(message, "SUBMIT|", 7) == 0) return STAT_SUBMIT;
+    if (strncmp(message, "SUBMIT_BATCH|", 13) == 0) return STAT_SUBMIT_BATCH;
+    if (strncmp(message, "GET_LEADERBOARD", 15) == 0) return STAT_GET_LEADERBOARD;
+    if (strncmp(message, "GET_RANK|", 9) == 0) return STAT_GET_RANK;
+    if (strncmp(message, "GET_RANGE|", 10) == 0) return STAT_GET_RANGE;
+    if (strncmp(message, "GET_AROUND|", 11) == 0) return STAT_GET_AROUND;
+    if (strncmp(message, "SUBSCRIBE", 9) == 0) return STAT_SUBSCRIBE;
+    if (strcmp(message, "STATS") == 0) return STAT_GET_STATS;
+    if (strncmp(message, "EXPORT", 6) == 0) return STAT_EXPORT;
+    return STAT_UNKNOWN;
+}
+
+// What kind of request a binary or datagram opcode is, for the stats
+stat_request binary_request_kind(uint16_t opcode) {
+    switch (opcode) {
+    case OP_SUBMIT: return STAT_SUBMIT;
+    case OP_SUBMIT_BATCH: return STAT_SUBMIT_BATCH;
+    case OP_GET_LEADERBOARD: return STAT_GET_LEADERBOARD;
+    case OP_SUBSCRIBE: return STAT_SUBSCRIBE;
+    case OP_GET_RANK:
+    case OP_GET_RANK_KEY:
+    case OP_COUNT_AHEAD: return STAT_GET_RANK;
+    case OP_GET_RANGE:
+    case OP_GET_KEYED_RANGE: return STAT_GET_RANGE;
+    case OP_GET_AROUND: return STAT_GET_AROUND;
+    case OP_GET_STATS: return STAT_GET_STATS;
+    case OP_EXPORT: return STAT_EXPORT;
+    case OP_MERGE:
+    case OP_GET_DIGEST:
+    case OP_GET_LEAVES:
+    case OP_PEER_AUTH: return STAT_FEDERATION;
+    default: return STAT_UNKNOWN;
+    }
+}
+
+// Queue an export of a board: once every earlier reply has gone out,
+// flush_connection() hands the connection to start_export(). Returns -1 if
+// too many exports are already running.
+int request_export(client_conn* conn, window_id window) {
+    if (reserve_export() < 0) return -1;
+    conn->export_requested = 1;
+    conn->export_window = window;
+    return 0;
+}
+
+// Process client message
+void process_client_message(client_conn* conn, const char* message) {
+    char response[BUFFER_SIZE];
+    const char* client_ip = conn->client_ip;
+    
+    if (strncmp(message, "SUBMIT|", 7) == 0) {
+        // Format: SUBMIT|PlayerName|Score or SUBMIT|Namespace|PlayerName|Score
+        char ns_name[32];
+        char player_name[32];
+        int score;
+        
+        if (sscanf(message + 7, "%31[^|]|%31[^|]|%d", ns_name, player_name, &score) == 3) {
+            submit_to_namespace(conn, ns_name, player_name, score);
+            return;
+        }
+        if (sscanf(message + 7, "%31[^|]|%d", player_name, &score) == 2) {
+            hold_until_durable(conn, update_leaderboard(player_name, score, client_ip));
+            snprintf(response, sizeof(response), "OK|Score submitted: %s - %d", player_name, score);
+            log_submission(player_name, score, client_ip);
+        } else {
+            snprintf(response, sizeof(response), "ERROR|Invalid SUBMIT format");
+        }
+    }
+    else if (strncmp(message, "SUBMIT_BATCH|", 13) == 0) {
+        // Format: SUBMIT_BATCH|PlayerName:Score[:Timestamp]|...
+        leaderboard_entry* records = malloc(MAX_BATCH_COUNT * sizeof(leaderboard_entry));
+        unsigned char results[MAX_BATCH_COUNT];
+        int count = records ? parse_text_batch(message + 13, client_ip, records, results) : -1;
+        if (count >= 0) {
+            submit_batch(conn, records, results, (size_t)count);
+            free(records);
+            return;
+        }
+        free(records);
+        snprintf(response, sizeof(response), "ERROR|Invalid SUBMIT_BATCH format");
+    }
+    else if (strncmp(message, "GET_LEADERBOARD", 15) == 0) {
+        // Format: GET_LEADERBOARD[|Window] or GET_LEADERBOARD|Namespace
+        log_message(LOG_DEBUG, "Leaderboard requested by %s", client_ip);
+        int window = (message[15] == '|') ? parse_window(message + 16) : WINDOW_ALL_TIME;
+        if (window == WINDOW_ALL_TIME) {
+            send_cached_leaderboard(conn);
+        } else if (window > 0) {
+            send_window_leaderboard(conn, window);
+        } else {
+            send_namespace_leaderboard(conn, message + 16);
+        }
+        return;
+    }
+    else if (strncmp(message, "GET_RANK|", 9) == 0) {
+        // Format: GET_RANK|PlayerName[|Window] or GET_RANK|Namespace|PlayerName
+        char ns_name[32];
+        char player_name[32];
+        char window_name[16] = "alltime";
+        int score;
+        int window;
+        if (sscanf(message + 9, "%31[^|]|%15s", player_name, window_name) >= 1 &&
+            (window = parse_window(window_name)) >= 0) {
+            size_t rank = rank_of(window, player_name, &score);
+            snprintf(response, sizeof(response), "RANK|%s|%zu|%d", player_name, rank, score);
+        } else if (sscanf(message + 9, "%31[^|]|%31[^|]", ns_name, player_name) == 2) {
+            send_namespace_rank(conn, ns_name, player_name);
+            return;
+        } else {
+            snprintf(response, sizeof(response), "ERROR|Invalid GET_RANK format");
+        }
+    }
+    else if (strncmp(message, "GET_RANGE|", 10) == 0) {
+        // Format: GET_RANGE|Offset|Count[|Window] or GET_RANGE|Namespace|Offset|Count
+        char ns_name[32];
+        unsigned long offset, count;
+        char window_name[16] = "alltime";
+        int window;
+        if (sscanf(message + 10, "%lu|%lu|%15s", &offset, &count, window_name) >= 2 &&
+            (window = parse_window(window_name)) >= 0) {
+            send_range(conn, window, NULL, offset, count);
+            return;
+        }
+        if (sscanf(message + 10, "%31[^|]|%lu|%lu", ns_name, &offset, &count) == 3) {
+            send_namespace_range(conn, ns_name, NULL, offset, count);
+            return;
+        }
+        snprintf(response, sizeof(response), "ERROR|Invalid GET_RANGE format");
+    }
+    else if (strncmp(message, "GET_AROUND|", 11) == 0) {
+        // Format: GET_AROUND|PlayerName|K[|Window] or GET_AROUND|Namespace|PlayerName|K
+        char ns_name[32];
+        char player_name[32];
+        char window_name[16] = "alltime";
+        unsigned long k;
+        int window;
+        if (sscanf(message + 11, "%31[^|]|%lu|%15s", player_name, &k, window_name) >= 2 &&
+            (window = parse_window(window_name)) >= 0) {
+            send_range(conn, window, player_name, 0, k);
+            return;
+        }
+        if (sscanf(message + 11, "%31[^|]|%31[^|]|%lu", ns_name, player_name, &k) == 3) {
+            send_namespace_range(conn, ns_name, player_name, 0, k);
+            return;
+        }
+        snprintf(response, sizeof(response), "ERROR|Invalid GET_AROUND format");
+    }
+    else if (strncmp(message, "SUBSCRIBE", 9) == 0) {
+        snprintf(response, sizeof(response), "ERROR|SUBSCRIBE requires the binary protocol");
+    }
+    else if (strcmp(message, "STATS") == 0) {
+        // Format: STATS|{JSON snapshot}
+        char stats[6 + STATS_REPLY_SIZE];
+        memcpy(stats, "STATS|", 6);
+        int len = format_stats(stats + 6, STATS_REPLY_SIZE);
+        if (len >= 0) {
+            send_reply(conn, stats, 6 + len);
+            return;
+        }
+        snprintf(response, sizeof(response), "ERROR|Statistics unavailable");
+    }
+    else if (strncmp(message, "EXPORT", 6) == 0 && (message[6] == '\0' || message[6] == '|')) {
+        // Format: EXPORT[|Window]; answered with the whole board as CSV,
+        // after which the server hangs up
+        int window = (message[6] == '|') ? parse_window(message + 7) : WINDOW_ALL_TIME;
+        if (window >= 0 && request_export(conn, window) == 0) {
+            return;
+        }
+        snprintf(response, sizeof(response), window < 0 ? "ERROR|Unknown window" :
+                 "ERROR|Too many exports in progress");
+    }
+    else {
+        snprintf(response, sizeof(response), "ERROR|Unknown command");
+    }
+    
+    send_reply(conn, response, strlen(response));
+}
+
+// Answer a federation peer's OP_PEER_AUTH, OP_MERGE, OP_GET_DIGEST or
+// OP_GET_LEAVES. Anyone else, and a peer that hasn't presented the secret
+// on this connection, is refused.
+void serve_peer(client_conn* conn, uint16_t opcode, const unsigned char* payload,
+                uint32_t length) {
+    static const char not_peer[] = "Not a federation peer";
+    static const char bad_request[] = "Invalid federation payload";
+    if (!federation_enabled() || !federation_is_peer(conn->client_addr)) {
+        send_binary_reply(conn, OP_ERROR, not_peer, sizeof(not_peer) - 1);
+        return;
+    }
+    if (opcode == OP_PEER_AUTH) {
+        conn->federation_peer = federation_check_secret(payload, length);
+        if (!conn->federation_peer) {
+            log_message(LOG_WARN, "Wrong federation secret from %s", conn->client_ip);
+            send_binary_reply(conn, OP_ERROR, not_peer, sizeof(not_peer) - 1);
+            return;
+        }
+        send_binary_reply(conn, OP_OK, NULL, 0);
+        return;
+    }
+    if (!conn->federation_peer) {
+        send_binary_reply(conn, OP_ERROR, not_peer, sizeof(not_peer) - 1);
+        return;
+    }
+    
+    if (opcode == OP_MERGE) {
+        uint32_t count = (length >= 4) ? get_u32le(payload) : 0;
+        leaderboard_entry* records = NULL;
+        if (length < 4 || count > FEDERATION_MAX_ENTRIES ||
+            length < 4 + (size_t)count * WIRE_KEYED_ENTRY_SIZE ||
+            !(records = malloc((count ? count : 1) * sizeof(leaderboard_entry)))) {
+            send_binary_reply(conn, OP_ERROR, bad_request, sizeof(bad_request) - 1);
+            return;
+        }
+        size_t valid = 0;
+        const unsigned char* item = payload + 4;
+        for (uint32_t i = 0; i < count; i++, item += WIRE_KEYED_ENTRY_SIZE) {
+            char player_name[WIRE_NAME_SIZE];
+            size_t name_len = strnlen((const char*)item, WIRE_NAME_SIZE - 1);
+            if (name_len == 0) continue;
+            memcpy(player_name, item, name_len);
+            player_name[name_len] = '\0';
+            make_record(&records[valid++], player_name, (int)get_u32le(item + WIRE_NAME_SIZE),
+                        (time_t)get_u64le(item + WIRE_ENTRY_SIZE), "");
+        }
+        federation_count_merged(merge_remote(records, valid));
+        free(records);
+        send_binary_reply(conn, OP_OK, NULL, 0);
+    } else if (opcode == OP_GET_DIGEST) {
+        unsigned char reply[4 + FEDERATION_FANOUT * 8];
+        uint32_t count = (length >= 12) ? get_u32le(payload + 8) : 0;
+        pthread_rwlock_rdlock(&leaderboard_lock);
+        int result = (length >= 12) ? federation_digests(get_u32le(payload), get_u32le(payload + 4),
+                                                         count, reply + 4) : -1;
+        pthread_rwlock_unlock(&leaderboard_lock);
+        if (result < 0) {
+            send_binary_reply(conn, OP_ERROR, bad_request, sizeof(bad_request) - 1);
+            return;
+        }
+        put_u32le(reply, count);
+        send_binary_reply(conn, OP_DIGEST, reply, 4 + (size_t)count * 8);
+    } else {
+        unsigned char* reply = malloc(8 + FEDERATION_MAX_ENTRIES * WIRE_KEYED_ENTRY_SIZE);
+        if (length < 8 || !reply) {
+            free(reply);
+            send_binary_reply(conn, OP_ERROR, bad_request, sizeof(bad_request) - 1);
+            return;
+        }
+        uint32_t next;
+        pthread_rwlock_rdlock(&leaderboard_lock);
+        size_t count = federation_leaf_records(get_u32le(payload), get_u32le(payload + 4),
+                                               reply + 8, &next);
+        pthread_rwlock_unlock(&leaderboard_lock);
+        put_u32le(reply, next);
+        put_u32le(reply + 4, (uint32_t)count);
+        send_binary_reply(conn, OP_LEAVES, reply, 8 + count * WIRE_KEYED_ENTRY_SIZE);
+        free(reply);
+    }
+}
+
+// Which rate limit a request counts against
+limit_kind limit_kind_of(stat_request kind) {
+    return (kind == STAT_SUBMIT || kind == STAT_SUBMIT_BATCH) ? LIMIT_WRITE : LIMIT_READ;
+}
+
+// Charge a request to its sender's rate limit. Over the limit it gets a
+// BUSY reply instead of being handled, and the connection's input is left
+// unread until the sender has a token again. Returns nonzero if refused.
+int refuse_over_limit(client_conn* conn, stat_request kind) {
+    // Peers are answered regardless; anyone else pays for being refused
+    if (kind == STAT_FEDERATION && conn->federation_peer) return 0;
+    uint64_t now = now_ms();
+    uint64_t wait_ms = limit_take(conn->client_addr, limit_kind_of(kind), now);
+    if (wait_ms == 0) return 0;
+    
+    stat_add(&conn->owner->stats.busy_replies, 1);
+    conn->throttled_until_ms = now + wait_ms;
+    if (conn->protocol == PROTO_BINARY) {
+        send_binary_reply(conn, OP_BUSY, NULL, 0);
+    } else {
+        send_reply(conn, "BUSY", 4);
+    }
+    return 1;
+}
+
+// Handle one text request and count it in the worker's stats
+void handle_text_request(client_conn* conn, const char* message) {
+    stat_request kind = text_request_kind(message);
+    if (refuse_over_limit(conn, kind)) return;
+    uint64_t started = stats_now_ns();
+    process_client_message(conn, message);
+    stats_record(&conn->owner->stats, kind, stats_now_ns() - started);
+}
+
+// Process one binary request
+void process_binary_message(client_conn* conn, const unsigned char* header,
+                            const unsigned char* payload, uint32_t length) {
+    static const char bad_version[] = "Unsupported protocol version";
+    static const char bad_submit[] = "Invalid SUBMIT payload";
+    static const char bad_query[] = "Invalid query payload";
+    static const char unknown[] = "Unknown opcode";
+    uint16_t opcode = get_u16le(header + 2);
+    int window = WINDOW_ALL_TIME;
+    
+    if (header[1] != BINARY_VERSION) {
+        send_binary_reply(conn, OP_ERROR, bad_version, sizeof(bad_version) - 1);
+        return;
+    }
+    
+    // Queries may name a window in a u32 after their fixed fields
+    size_t query_size = 0;
+    if (opcode == OP_GET_RANK) query_size = WIRE_NAME_SIZE;
+    if (opcode == OP_GET_RANGE) query_size = 8;
+    if (opcode == OP_GET_AROUND) query_size = WIRE_NAME_SIZE + 4;
+    if (opcode == OP_GET_KEYED_RANGE) query_size = 8;
+    if (opcode == OP_GET_RANK_KEY) query_size = WIRE_NAME_SIZE;
+    if (opcode == OP_COUNT_AHEAD) query_size = WIRE_KEYED_ENTRY_SIZE;
+    if ((opcode == OP_GET_LEADERBOARD || opcode == OP_EXPORT || query_size) &&
+        length >= query_size + 4) {
+        window = (int)get_u32le(payload + query_size);
+        if (window < 0 || window >= WINDOW_COUNT) {
+            send_binary_reply(conn, OP_ERROR, bad_query, sizeof(bad_query) - 1);
+            return;
+        }
+    }
+    
+    switch (opcode) {
+    case OP_SUBMIT: {
+        if (length < WIRE_ENTRY_SIZE) {
+            send_binary_reply(conn, OP_ERROR, bad_submit, sizeof(bad_submit) - 1);
+            return;
+        }
+        char player_name[WIRE_NAME_SIZE];
+        size_t name_len = strnlen((const char*)payload, WIRE_NAME_SIZE - 1);
+        memcpy(player_name, payload, name_len);
+        player_name[name_len] = '\0';
+        int score = (int)get_u32le(payload + WIRE_NAME_SIZE);
+        if (name_len == 0) {
+            send_binary_reply(conn, OP_ERROR, bad_submit, sizeof(bad_submit) - 1);
+            return;
+        }
+        hold_until_durable(conn, update_leaderboard(player_name, score, conn->client_ip));
+        log_submission(player_name, score, conn->client_ip);
+        send_binary_reply(conn, OP_OK, NULL, 0);
+        break;
+    }
+    case OP_SUBMIT_BATCH: {
+        uint32_t count = (length >= 4) ? get_u32le(payload) : 0;
+        leaderboard_entry* records = NULL;
+        if (length < 4 || count > MAX_BATCH_COUNT ||
+            length < 4 + (size_t)count * WIRE_BATCH_ITEM_SIZE ||
+            !(records = malloc((count ? count : 1) * sizeof(leaderboard_entry)))) {
+            send_binary_reply(conn, OP_ERROR, bad_submit, sizeof(bad_submit) - 1);
+            return;
+        }
+        unsigned char results[MAX_BATCH_COUNT];
+        time_t now = time(NULL);
+        const unsigned char* item = payload + 4;
+        for (uint32_t i = 0; i < count; i++, item += WIRE_BATCH_ITEM_SIZE) {
+            char player_name[WIRE_NAME_SIZE];
+            size_t name_len = strnlen((const char*)item, WIRE_NAME_SIZE - 1);
+            memcpy(player_name, item, name_len);
+            player_name[name_len] = '\0';
+            time_t made = submission_time((int64_t)get_u64le(item + WIRE_ENTRY_SIZE), now);
+            make_record(&records[i], player_name, (int)get_u32le(item + WIRE_NAME_SIZE), made,
+                        conn->client_ip);
+            results[i] = (name_len && made >= 0) ? BATCH_UNCHANGED : BATCH_REJECTED;
+        }
+        submit_batch(conn, records, results, count);
+        free(records);
+        break;
+    }
+    case OP_GET_LEADERBOARD:
+        log_message(LOG_DEBUG, "Leaderboard requested by %s", conn->client_ip);
+        if (window == WINDOW_ALL_TIME) {
+            send_cached_leaderboard(conn);
+        } else {
+            send_window_leaderboard(conn, window);
+        }
+        break;
+    case OP_SUBSCRIBE:
+        log_message(LOG_INFO, "Leaderboard subscription from %s", conn->client_ip);
+        subscribe_connection(conn);
+        break;
+    case OP_GET_RANK:
+    case OP_GET_AROUND: {
+        size_t needed = (opcode == OP_GET_AROUND) ? WIRE_NAME_SIZE + 4 : WIRE_NAME_SIZE;
+        char player_name[WIRE_NAME_SIZE];
+        size_t name_len = (length >= needed) ? strnlen((const char*)payload, WIRE_NAME_SIZE - 1) : 0;
+        if (name_len == 0) {
+            send_binary_reply(conn, OP_ERROR, bad_query, sizeof(bad_query) - 1);
+            return;
+        }
+        memcpy(player_name, payload, name_len);
+        player_name[name_len] = '\0';
+        if (opcode == OP_GET_AROUND) {
+            send_range(conn, window, player_name, 0, get_u32le(payload + WIRE_NAME_SIZE));
+        } else {
+            unsigned char reply[8];
+            int score;
+            put_u32le(reply, (uint32_t)rank_of(window, player_name, &score));
+            put_u32le(reply + 4, (uint32_t)score);
+            send_binary_reply(conn, OP_RANK, reply, sizeof(reply));
+        }
+        break;
+    }
+    case OP_GET_RANGE:
+        if (length < 8) {
+            send_binary_reply(conn, OP_ERROR, bad_query, sizeof(bad_query) - 1);
+            return;
+        }
+        send_range(conn, window, NULL, get_u32le(payload), get_u32le(payload + 4));
+        break;
+    case OP_GET_KEYED_RANGE:
+        if (length < 8) {
+            send_binary_reply(conn, OP_ERROR, bad_query, sizeof(bad_query) - 1);
+            return;
+        }
+        send_keyed_range(conn, window, get_u32le(payload), get_u32le(payload + 4));
+        break;
+    case OP_GET_RANK_KEY:
+    case OP_COUNT_AHEAD: {
+        char player_name[WIRE_NAME_SIZE];
+        size_t name_len = (length >= query_size) ? strnlen((const char*)payload, WIRE_NAME_SIZE - 1) : 0;
+        if (name_len == 0) {
+            send_binary_reply(conn, OP_ERROR, bad_query, sizeof(bad_query) - 1);
+            return;
+        }
+        memcpy(player_name, payload, name_len);
+        player_name[name_len] = '\0';
+        if (opcode == OP_COUNT_AHEAD) {
+            unsigned char reply[4];
+            time_t timestamp = (time_t)get_u64le(payload + WIRE_ENTRY_SIZE);
+            put_u32le(reply, (uint32_t)count_ahead(window, (int)get_u32le(payload + WIRE_NAME_SIZE),
+                                                   timestamp, player_name));
+            send_binary_reply(conn, OP_COUNT, reply, sizeof(reply));
+        } else {
+            unsigned char reply[16];
+            int score;
+            time_t timestamp;
+            put_u32le(reply, (uint32_t)rank_key_of(window, player_name, &score, &timestamp));
+            put_u32le(reply + 4, (uint32_t)score);
+            put_u64le(reply + 8, (uint64_t)timestamp);
+            send_binary_reply(conn, OP_RANK_KEY, reply, sizeof(reply));
+        }
+        break;
+    }
+    case OP_EXPORT:
+        if (request_export(conn, window) < 0) {
+            static const char busy[] = "Too many exports in progress";
+            send_binary_reply(conn, OP_ERROR, busy, sizeof(busy) - 1);
+        }
+        break;
+    case OP_MERGE:
+    case OP_GET_DIGEST:
+    case OP_GET_LEAVES:
+    case OP_PEER_AUTH:
+        serve_peer(conn, opcode, payload, length);
+        break;
+    case OP_GET_STATS: {
+        char stats[STATS_REPLY_SIZE];
+        int len = format_stats(stats, sizeof(stats));
+        if (len < 0) {
+            static const char unavailable[] = "Statistics unavailable";
+            send_binary_reply(conn, OP_ERROR, unavailable, sizeof(unavailable) - 1);
+            return;
+        }
+        send_binary_reply(conn, OP_STATS, stats, len);
+        break;
+    }
+    default:
+        send_binary_reply(conn, OP_ERROR, unknown, sizeof(unknown) - 1);
+        break;
+    }
+}
+
+// Write all of data to a blocking socket, or exit: for export children
+void export_send(int fd, const void* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) _exit(1);
+        data = (const char*)data + sent;
+        len -= sent;
+    }
+}
+
+// Send len bytes of text that follow FRAME_HEADER_SIZE spare bytes in
+// buffer, as one frame if the client is framed
+void export_text(int fd, unsigned char* buffer, size_t len, int framed) {
+    if (framed) {
+        frame_put_length(buffer, (uint32_t)len);
+        export_send(fd, buffer, FRAME_HEADER_SIZE + len);
+    } else {
+        export_send(fd, buffer + FRAME_HEADER_SIZE, len);
+    }
+}
+
+// Write one CSV line for an exported entry, quoting the name if it needs
+// it. Returns the length.
+size_t format_export_line(char* out, size_t rank, const store_record* entry) {
+    const char* name = store_name(entry->name);
+    size_t len = (size_t)snprintf(out, EXPORT_LINE_MAX, "%zu,", rank);
+    if (strpbrk(name, ",\"\r\n")) {
+        out[len++] = '"';
+        for (const char* c = name; *c; c++) {
+            if (*c == '"') out[len++] = '"';
+            out[len++] = *c;
+        }
+        out[len++] = '"';
+    } else {
+        size_t name_len = strlen(name);
+        memcpy(out + len, name, name_len);
+        len += name_len;
+    }
+    len += (size_t)snprintf(out + len, EXPORT_LINE_MAX - len, ",%d,%lld\n", entry->score,
+                            (long long)entry->timestamp);
+    return len;
+}
+
+// Child side of an export: stream the board as it stood at the fork
+// straight to the client, with plain syscalls and stack buffers only (no
+// stdio or malloc after fork). Binary clients get OP_EXPORT_CHUNKs and an
+// OP_EXPORT_END; text clients get CSV lines, framed clients behind an
+// EXPORT|count frame and followed by an END frame.
+void write_export(int fd, wire_protocol protocol, window_id window) {
+    // Keep nothing else open, so a long export never holds on to the
+    // listening sockets or other clients' connections
+    if (fd > 3) close_range(3, fd - 1, 0);
+    close_range(fd + 1, ~0U, 0);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    struct timeval timeout = {EXPORT_SEND_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    const leaderboard_store* board = board_for(window);
+    const store_record* found[EXPORT_CHUNK];
+    unsigned char chunk[BINARY_HEADER_SIZE + 8 + EXPORT_CHUNK * WIRE_KEYED_ENTRY_SIZE];
+    size_t n;
+    
+    if (protocol == PROTO_BINARY) {
+        for (size_t offset = 0; (n = store_range(board, offset, found, EXPORT_CHUNK)) > 0; offset += n) {
+            unsigned char* payload = chunk + BINARY_HEADER_SIZE;
+            put_u32le(payload, (uint32_t)(offset + 1));
+            put_u32le(payload + 4, (uint32_t)n);
+            for (size_t i = 0; i < n; i++) {
+                unsigned char* p = payload + 8 + i * WIRE_KEYED_ENTRY_SIZE;
+                const char* name = store_name(found[i]->name);
+                memset(p, 0, WIRE_NAME_SIZE);
+                memcpy(p, name, strnlen(name, WIRE_NAME_SIZE - 1));
+                put_u32le(p + WIRE_NAME_SIZE, (uint32_t)found[i]->score);
+                put_u64le(p + WIRE_ENTRY_SIZE, (uint64_t)found[i]->timestamp);
+            }
+            binary_put_header(chunk, OP_EXPORT_CHUNK, (uint32_t)(8 + n * WIRE_KEYED_ENTRY_SIZE));
+            export_send(fd, chunk, BINARY_HEADER_SIZE + 8 + n * WIRE_KEYED_ENTRY_SIZE);
+        }
+        binary_put_header(chunk, OP_EXPORT_END, 8);
+        put_u64le(chunk + BINARY_HEADER_SIZE, board->count);
+        export_send(fd, chunk, BINARY_HEADER_SIZE + 8);
+        _exit(0);
+    }
+    
+    // Text goes out a bufferful of lines at a time, after room for a frame
+    // header
+    int framed = (protocol == PROTO_FRAMED);
+    char* text = (char*)chunk + FRAME_HEADER_SIZE;
+    size_t lines = (sizeof(chunk) - FRAME_HEADER_SIZE) / EXPORT_LINE_MAX;
+    size_t len = framed ? (size_t)sprintf(text, "EXPORT|%zu", board->count) :
+                          (size_t)sprintf(text, "rank,name,score,timestamp\n");
+    export_text(fd, chunk, len, framed);
+    for (size_t offset = 0; (n = store_range(board, offset, found, lines)) > 0; offset += n) {
+        len = 0;
+        for (size_t i = 0; i < n; i++) {
+            len += format_export_line(text + len, offset + i + 1, found[i]);
+        }
+        export_text(fd, chunk, len, framed);
+    }
+    if (framed) {
+        memcpy(text, "END", 3);
+        export_text(fd, chunk, 3, framed);
+    }
+    _exit(0);
+}
+
+// Hand a connection that asked for EXPORT over to a forked child. The
+// child streams from its copy-on-write view of the board, so this worker
+// and every writer carry on meanwhile, and a client reading slowly only
+// ever holds up its own child. Returns -1: either way the connection is
+// no longer this worker's to serve.
+int start_export(client_conn* conn) {
+    conn->export_requested = 0;
+    pthread_rwlock_rdlock(&leaderboard_lock);
+    size_t count = board_for(conn->export_window)->count;
+    pid_t pid = fork();
+    if (pid == 0) {
+        write_export(conn->fd, conn->protocol, conn->export_window);
+    }
+    pthread_rwlock_unlock(&leaderboard_lock);
+    
+    if (pid < 0) {
+        log_message(LOG_ERROR, "Failed to start export for %s: %s", conn->client_ip,
+                    strerror(errno));
+        release_export();
+        return -1;
+    }
+    pthread_mutex_lock(&export_lock);
+    for (int i = 0; i < MAX_EXPORTS; i++) {
+        if (export_children[i].pid == 0) {
+            export_children[i].pid = pid;
+            memcpy(export_children[i].client_ip, conn->client_ip, INET_ADDRSTRLEN);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&export_lock);
+    log_message(LOG_INFO, "Exporting %zu %s scores to %s", count,
+                window_names[conn->export_window], conn->client_ip);
+    return -1;
+}
+
+// Collect export children that have finished
+void reap_exports() {
+    pthread_mutex_lock(&export_lock);
+    for (int i = 0; i < MAX_EXPORTS; i++) {
+        int status;
+        export_child* child = &export_children[i];
+        if (child->pid == 0 || waitpid(child->pid, &status, WNOHANG) != child->pid) continue;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            log_message(LOG_INFO, "Export to %s finished", child->client_ip);
+        } else {
+            log_message(LOG_WARN, "Export to %s failed", child->client_ip);
+        }
+        child->pid = 0;
+        exports_reserved--;
+    }
+    pthread_mutex_unlock(&export_lock);
+}
+
+// Send as much queued output as the socket accepts. Returns -1 if the
+// connection should be closed.
+int flush_connection(client_conn* conn) {
+    if (conn->wait_lsn) return 0;  // Released by release_durable_replies()
+    
+    while (conn->wpos < conn->wlen) {
+        ssize_t sent = send(conn->fd, conn->wbuf + conn->wpos,
+                            conn->wlen - conn->wpos, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        conn->wpos += sent;
+        stat_add(&conn->owner->stats.bytes_out, sent);
+    }
+    conn->wpos = conn->wlen = 0;
+    if (conn->export_requested) return start_export(conn);
+    return conn->close_after_write ? -1 : 0;
+}
+
+// Send one reply datagram: the request id, then a binary message
+void send_datagram(worker* w, const struct sockaddr_in* addr, uint32_t request_id,
+                   uint16_t opcode, const void* payload, size_t len) {
+    unsigned char datagram[MAX_DATAGRAM_SIZE];
+    if (UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE + len > sizeof(datagram)) {
+        return;
+    }
+    put_u32le(datagram, request_id);
+    binary_put_header(datagram + UDP_REQUEST_ID_SIZE, opcode, (uint32_t)len);
+    if (len > 0) {
+        memcpy(datagram + UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE, payload, len);
+    }
+    // Lost replies are the client's to retry
+    ssize_t sent = sendto(w->udp_fd, datagram, UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE + len,
+                          MSG_DONTWAIT, (const struct sockaddr*)addr, sizeof(*addr));
+    if (sent > 0) {
+        stat_add(&w->stats.datagrams_out, 1);
+        stat_add(&w->stats.bytes_out, sent);
+    }
+}
+
+// Send OP_ERROR with as much of text as keeps the reply no bigger than the
+// request_len-byte datagram it answers
+void send_datagram_error(worker* w, const struct sockaddr_in* addr, uint32_t request_id,
+                         const char* text, size_t request_len) {
+    size_t room = request_len - UDP_REQUEST_ID_SIZE - BINARY_HEADER_SIZE;
+    size_t text_len = strlen(text);
+    send_datagram(w, addr, request_id, OP_ERROR, text, text_len < room ? text_len : room);
+}
+
+// Acknowledge a submission datagram once lsn is durable. If too many are
+// waiting the datagram is dropped and the client will send it again.
+void ack_when_durable(worker* w, const struct sockaddr_in* addr, uint32_t request_id,
+                      uint64_t lsn) {
+    if (lsn == 0 || lsn <= persist_durable_lsn()) {
+        send_datagram(w, addr, request_id, OP_OK, NULL, 0);
+        return;
+    }
+    if (w->udp_ack_count == w->udp_ack_cap) {
+        size_t new_cap = w->udp_ack_cap ? w->udp_ack_cap * 2 : 64;
+        udp_ack* grown = NULL;
+        if (new_cap <= MAX_PENDING_UDP_ACKS) {
+            grown = realloc(w->udp_acks, new_cap * sizeof(udp_ack));
+        }
+        if (!grown) return;
+        w->udp_acks = grown;
+        w->udp_ack_cap = new_cap;
+    }
+    udp_ack* ack = &w->udp_acks[w->udp_ack_count++];
+    ack->addr = *addr;
+    ack->request_id = request_id;
+    ack->lsn = lsn;
+}
+
+// Answer one datagram. Only requests whose reply fits in a datagram are
+// served here; the rest need a connection.
+void process_datagram(worker* w, const unsigned char* datagram, size_t len,
+                      const struct sockaddr_in* addr) {
+    char client_ip[INET_ADDRSTRLEN];
+    
+    if (len < UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE) return;
+    uint32_t request_id = get_u32le(datagram);
+    const unsigned char* header = datagram + UDP_REQUEST_ID_SIZE;
+    const unsigned char* payload = header + BINARY_HEADER_SIZE;
+    uint32_t length = get_u32le(header + 4);
+    uint16_t opcode = get_u16le(header + 2);
+    if (header[0] != BINARY_MAGIC || header[1] != BINARY_VERSION ||
+        length != len - UDP_REQUEST_ID_SIZE - BINARY_HEADER_SIZE) {
+        send_datagram_error(w, addr, request_id, "Invalid request", len);
+        return;
+    }
+    inet_ntop(AF_INET, &addr->sin_addr, client_ip, sizeof(client_ip));
+    
+    size_t query_size = (opcode == OP_GET_RANK) ? WIRE_NAME_SIZE : 0;
+    int window = WINDOW_ALL_TIME;
+    if ((opcode == OP_GET_LEADERBOARD || opcode == OP_GET_RANK) && length >= query_size + 4) {
+        window = (int)get_u32le(payload + query_size);
+    }
+    char player_name[WIRE_NAME_SIZE] = "";
+    int named = (opcode == OP_SUBMIT || opcode == OP_GET_RANK);
+    if (named && length >= WIRE_NAME_SIZE) {
+        size_t name_len = strnlen((const char*)payload, WIRE_NAME_SIZE - 1);
+        memcpy(player_name, payload, name_len);
+        player_name[name_len] = '\0';
+    }
+    
+    if (window < 0 || window >= WINDOW_COUNT || (named && player_name[0] == '\0') ||
+        (opcode == OP_SUBMIT && length < WIRE_ENTRY_SIZE)) {
+        send_datagram_error(w, addr, request_id, "Invalid request", len);
+        return;
+    }
+    
+    switch (opcode) {
+    case OP_SUBMIT: {
+        // A resend of a submission that already counted changes nothing, but
+        // must still wait for the original's log record
+        int score = (int)get_u32le(payload + WIRE_NAME_SIZE);
+        uint64_t lsn = update_leaderboard(player_name, score, client_ip);
+        if (lsn == 0 && persist_enabled) lsn = persist_appended_lsn();
+        log_submission(player_name, score, client_ip);
+        ack_when_durable(w, addr, request_id, lsn);
+        break;
+    }
+    case OP_GET_LEADERBOARD:
+        if (length < UDP_LEADERBOARD_PAYLOAD) {
+            send_datagram_error(w, addr, request_id, "Request not padded", len);
+        } else if (window == WINDOW_ALL_TIME) {
+            const cached_reply* cache = current_leaderboard(w, PROTO_BINARY);
+            if (cache) {
+                send_datagram(w, addr, request_id, OP_LEADERBOARD, cache->data + BINARY_HEADER_SIZE,
+                              cache->len - BINARY_HEADER_SIZE);
+            }
+        } else {
+            unsigned char reply[4 + TOP_COUNT * WIRE_ENTRY_SIZE];
+            pthread_rwlock_rdlock(&leaderboard_lock);
+            size_t reply_len = format_leaderboard_binary(board_for(window), reply);
+            pthread_rwlock_unlock(&leaderboard_lock);
+            send_datagram(w, addr, request_id, OP_LEADERBOARD, reply, reply_len);
+        }
+        break;
+    case OP_GET_RANK: {
+        unsigned char reply[8];
+        int score;
+        put_u32le(reply, (uint32_t)rank_of(window, player_name, &score));
+        put_u32le(reply + 4, (uint32_t)score);
+        send_datagram(w, addr, request_id, OP_RANK, reply, sizeof(reply));
+        break;
+    }
+    default:
+        send_datagram_error(w, addr, request_id, "Not available over UDP", len);
+        break;
+    }
+}
+
+// Answer every datagram waiting on a worker's UDP socket
+void read_datagrams(worker* w) {
+    unsigned char datagram[MAX_DATAGRAM_SIZE];
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        ssize_t len = recvfrom(w->udp_fd, datagram, sizeof(datagram), MSG_DONTWAIT,
+                               (struct sockaddr*)&address, &addrlen);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        stat_add(&w->stats.datagrams_in, 1);
+        stat_add(&w->stats.bytes_in, len);
+        if (capture_enabled()) {
+            capture_record(&w->capture, CAPTURE_DATAGRAM, 0, ntohl(address.sin_addr.s_addr),
+                           datagram, (size_t)len);
+        }
+        
+        stat_request kind = STAT_UNKNOWN;
+        if ((size_t)len >= UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE) {
+            kind = binary_request_kind(get_u16le(datagram + UDP_REQUEST_ID_SIZE + 2));
+        }
+        if (limit_take(ntohl(address.sin_addr.s_addr), limit_kind_of(kind), now_ms()) > 0) {
+            stat_add(&w->stats.busy_replies, 1);
+            if ((size_t)len >= UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE) {
+                send_datagram(w, &address, get_u32le(datagram), OP_BUSY, NULL, 0);
+            }
+            continue;
+        }
+        
+        uint64_t started = stats_now_ns();
+        process_datagram(w, datagram, (size_t)len, &address);
+        stats_record(&w->stats, kind, stats_now_ns() - started);
+    }
+}
+
+// Send a worker's replies whose submissions the log writer has now synced
+void release_durable_replies(worker* w) {
+    persist_ack_notify(w->notify_fd);
+    uint64_t durable = persist_durable_lsn();
+    
+    size_t kept = 0;
+    for (size_t i = 0; i < w->udp_ack_count; i++) {
+        udp_ack* ack = &w->udp_acks[i];
+        if (ack->lsn <= durable) {
+            send_datagram(w, &ack->addr, ack->request_id, OP_OK, NULL, 0);
+        } else {
+            w->udp_acks[kept++] = *ack;
+        }
+    }
+    w->udp_ack_count = kept;
+    
+    client_conn* conn = w->durability_waiters;
+    while (conn) {
+        client_conn* next = conn->wait_next;
+        if (conn->wait_lsn <= durable) {
+            waiter_list_remove(conn);
+            if (flush_connection(conn) < 0) {
+                close_connection(conn);
+            }
+        }
+        conn = next;
+    }
+}
+
+// Whether to leave a connection's further requests unread for now: it is
+// over its rate limit, it sends requests faster than it reads replies, or
+// it asked for an export, which is the last thing it gets
+int input_paused(client_conn* conn) {
+    return conn->throttled_until_ms != 0 || conn->wlen - conn->wpos > MAX_PENDING_OUTPUT ||
+           conn->export_requested;
+}
+
+// Stop reading from a connection until resume_paused_connections() finds
+// it ready again. Edge-triggered epoll won't report input that is already
+// waiting, so paused connections are checked on a timer instead.
+void pause_reading(client_conn* conn) {
+    worker* w = conn->owner;
+    if (conn->read_paused) return;
+    stat_add(&w->stats.paused_reads, 1);
+    conn->read_paused = 1;
+    conn->pause_prev = NULL;
+    conn->pause_next = w->paused;
+    if (w->paused) w->paused->pause_prev = conn;
+    w->paused = conn;
+}
+
+// Add a request to the traffic capture, as it arrived
+void capture_request(client_conn* conn, capture_kind kind, const void* message, size_t len) {
+    if (!capture_enabled()) return;
+    if (!conn->capture_id) conn->capture_id = capture_connection_id();
+    capture_record(&conn->owner->capture, kind, conn->capture_id, conn->client_addr,
+                   message, len);
+}
+
+// Handle every complete binary request sitting in the read buffer
+void process_binary_input(client_conn* conn) {
+    size_t offset = 0;
+    while (conn->rlen - offset >= BINARY_HEADER_SIZE && !input_paused(conn)) {
+        const unsigned char* header = (unsigned char*)conn->rbuf + offset;
+        uint32_t length = get_u32le(header + 4);
+        if (header[0] != BINARY_MAGIC || length > MAX_FRAME_SIZE) {
+            static const char error[] = "Malformed message";
+            send_binary_reply(conn, OP_ERROR, error, sizeof(error) - 1);
+            conn->close_after_write = 1;
+            offset = conn->rlen;
+            break;
+        }
+        if (conn->rlen - offset - BINARY_HEADER_SIZE < length) break;
+        
+        capture_request(conn, CAPTURE_BINARY, header, BINARY_HEADER_SIZE + length);
+        stat_request kind = binary_request_kind(get_u16le(header + 2));
+        if (!refuse_over_limit(conn, kind)) {
+            uint64_t started = stats_now_ns();
+            process_binary_message(conn, header, header + BINARY_HEADER_SIZE, length);
+            stats_record(&conn->owner->stats, kind, stats_now_ns() - started);
+        }
+        offset += BINARY_HEADER_SIZE + length;
+    }
+    
+    if (offset > 0) {
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rlen - offset);
+        conn->rlen -= offset;
+    }
+}
+
+// Pick the wire protocol from the first byte a client sends
+wire_protocol detect_protocol(unsigned char first_byte) {
+    if (first_byte == 0) return PROTO_FRAMED;
+    if (first_byte == BINARY_MAGIC) return PROTO_BINARY;
+    return PROTO_LEGACY;
+}
+
+// Handle every complete request sitting in the read buffer
+void process_input(client_conn* conn) {
+    if (conn->rlen == 0 || conn->close_after_write) return;
+    
+    if (conn->protocol == PROTO_LEGACY) {
+        // One request per connection: everything received so far is the message
+        conn->rbuf[conn->rlen] = '\0';
+        log_message(LOG_DEBUG, "Received: %s", conn->rbuf);
+        capture_request(conn, CAPTURE_TEXT, conn->rbuf, conn->rlen);
+        handle_text_request(conn, conn->rbuf);
+        conn->rlen = 0;
+        conn->close_after_write = 1;
+        return;
+    }
+    
+    if (conn->protocol == PROTO_BINARY) {
+        process_binary_input(conn);
+        return;
+    }
+    
+    size_t offset = 0;
+    while (conn->rlen - offset >= FRAME_HEADER_SIZE && !input_paused(conn)) {
+        uint32_t length = frame_get_length((unsigned char*)conn->rbuf + offset);
+        if (length > MAX_FRAME_SIZE) {
+            static const char error[] = "ERROR|Message too long";
+            send_reply(conn, error, sizeof(error) - 1);
+            conn->close_after_write = 1;
+            offset = conn->rlen;
+            break;
+        }
+        if (conn->rlen - offset - FRAME_HEADER_SIZE < length) break;
+        
+        // Requests are NUL-terminated in place; the byte after the payload
+        // belongs to the next frame, so save and restore it
+        char* message = conn->rbuf + offset + FRAME_HEADER_SIZE;
+        char saved = message[length];
+        message[length] = '\0';
+        capture_request(conn, CAPTURE_FRAMED, message, length);
+        handle_text_request(conn, message);
+        message[length] = saved;
+        offset += FRAME_HEADER_SIZE + length;
+    }
+    
+    if (offset > 0) {
+        memmove(conn->rbuf, conn->rbuf + offset, conn->rlen - offset);
+        conn->rlen -= offset;
+    }
+}
+
+// Largest number of unprocessed bytes a connection may buffer
+size_t read_limit(client_conn* conn) {
+    if (conn->protocol == PROTO_LEGACY) return BUFFER_SIZE;
+    if (conn->protocol == PROTO_BINARY) return BINARY_HEADER_SIZE + MAX_FRAME_SIZE + 1;
+    return FRAME_HEADER_SIZE + MAX_FRAME_SIZE + 1;
+}
+
+// Drain readable data from a client and process the requests it carries.
+// Returns -1 if the connection should be closed.
+int read_connection(client_conn* conn) {
+    int peer_closed = 0;
+    
+    for (;;) {
+        if (conn->close_after_write) {
+            conn->rlen = 0;  // Final reply already queued; discard anything further
+        }
+        if (input_paused(conn)) {
+            pause_reading(conn);
+            break;
+        }
+        if (conn->rlen + 1 >= read_limit(conn)) {
+            // Make room by handling what has arrived so far
+            process_input(conn);
+            if (input_paused(conn)) {
+                pause_reading(conn);
+                break;
+            }
+            if (conn->rlen + 1 >= read_limit(conn)) {
+                static const char error[] = "ERROR|Message too long";
+                send_reply(conn, error, sizeof(error) - 1);
+                conn->close_after_write = 1;
+                continue;
+            }
+        }
+        size_t want = conn->rlen + BUFFER_SIZE;
+        if (want > read_limit(conn)) want = read_limit(conn);
+        if (reserve_buffer(&conn->rbuf, &conn->rcap, want) < 0) {
+            return -1;
+        }
+        ssize_t bytes_read = read(conn->fd, conn->rbuf + conn->rlen,
+                                  want - 1 - conn->rlen);
+        if (bytes_read > 0) {
+            if (conn->protocol == PROTO_UNKNOWN) {
+                conn->protocol = detect_protocol((unsigned char)conn->rbuf[0]);
+            }
+            conn->rlen += bytes_read;
+            stat_add(&conn->owner->stats.bytes_in, bytes_read);
+            continue;
+        }
+        if (bytes_read == 0) {
+            peer_closed = 1;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
+    }
+    
+    process_input(conn);
+    if (input_paused(conn)) {
+        pause_reading(conn);  // Requests left in the buffer wait for the resume
+    }
+    
+    if (peer_closed) {
+        if (conn->wlen == 0 && !conn->export_requested) return -1;
+        conn->close_after_write = 1;  // Finish sending replies, then hang up
+    }
+    return 0;
+}
+
+// Accept every pending connection on a worker's listening socket
+void accept_connections(worker* w) {
+    int opt_one = 1;
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int client_socket = accept4(w->listen_fd, (struct sockaddr *)&address,
+                                    &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                stat_add(&w->stats.accept_errors, 1);
+                log_message(LOG_ERROR, "accept: %s", strerror(errno));
             }
             return;
         }
-    }
-    
-    // Add new entry if there's space
-    if (entry_count < MAX_ENTRIES) {
-        strcpy(leaderboard[entry_count].player_name, name);
-        leaderboard[entry_count].score = score;
-        leaderboard[entry_count].timestamp = time(NULL);
-        strcpy(leaderboard[entry_count].client_ip, client_ip);
-        entry_count++;
+        
+        if (__atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED) > max_connections) {
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            stat_add(&w->stats.rejected, 1);
+            close(client_socket);
+            continue;
+        }
+        
+        client_conn* conn = calloc(1, sizeof(client_conn));
+        if (!conn) {
+            stat_add(&w->stats.accept_errors, 1);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            close(client_socket);
+            continue;
+        }
+        conn->owner = w;
+        conn->fd = client_socket;
+        conn->client_addr = ntohl(address.sin_addr.s_addr);
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &opt_one, sizeof(opt_one));
+        inet_ntop(AF_INET, &address.sin_addr, conn->client_ip, INET_ADDRSTRLEN);
+        if (log_enabled(LOG_DEBUG)) {
+            connection_record record;
+            memcpy(record.client_ip, conn->client_ip, INET_ADDRSTRLEN);
+            record.port = ntohs(address.sin_port);
+            log_binary(LOG_DEBUG, format_connection, &record, sizeof(record));
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            log_message(LOG_ERROR, "epoll_ctl: %s", strerror(errno));
+            stat_add(&w->stats.accept_errors, 1);
+            __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+            close(client_socket);
+            free(conn);
+            continue;
+        }
+        stat_add(&w->stats.accepted, 1);
+        touch_connection(conn);
     }
 }
 
-// Sort leaderboard by score (descending)
-void sort_leaderboard() {
-    for (int i = 0; i < entry_count - 1; i++) {
-        for (int j = 0; j < entry_count - i - 1; j++) {
-            if (leaderboard[j].score < leaderboard[j + 1].score) {
-                leaderboard_entry temp = leaderboard[j];
-                leaderboard[j] = leaderboard[j + 1];
-                leaderboard[j + 1] = temp;
+// Go back to reading from paused connections whose limit has refilled
+// or whose replies have drained
+void resume_paused_connections(worker* w) {
+    uint64_t now = now_ms();
+    client_conn* conn = w->paused;
+    while (conn) {
+        client_conn* next = conn->pause_next;
+        if (conn->throttled_until_ms && now >= conn->throttled_until_ms) {
+            conn->throttled_until_ms = 0;
+        }
+        if (!input_paused(conn)) {
+            paused_list_remove(conn);
+            if (read_connection(conn) < 0 || flush_connection(conn) < 0) {
+                close_connection(conn);
+            } else {
+                touch_connection(conn);
             }
         }
+        conn = next;
+    }
+}
+
+// Close a worker's connections that have been quiet for longer than the
+// idle timeout
+void expire_idle_connections(worker* w) {
+    time_t now = time(NULL);
+    while (w->idle_head && now - w->idle_head->last_active >= idle_timeout) {
+        close_connection(w->idle_head);
     }
 }
 
-// Format leaderboard as string for sending to client
-void format_leaderboard(char* buffer, int buffer_size) {
-    sort_leaderboard();
+// Start a background snapshot if one is due. The store must not change
+// while the child is forked, so this briefly excludes all submissions.
+void maybe_snapshot() {
+    if (!persist_snapshot_due()) return;
+    pthread_rwlock_wrlock(&leaderboard_lock);
+    persist_start_snapshot(&leaderboard);
+    pthread_rwlock_unlock(&leaderboard_lock);
+}
+
+// A new process asked to take over. If it runs with the same data, stop
+// listening for others and have every worker wind down.
+void begin_handoff() {
+    int fd = handoff_accept(handoff_listen_fd);
+    if (fd < 0) return;
+    
+    handoff_request* request = malloc(HANDOFF_MAX_MESSAGE);
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count = 0;
+    ssize_t len = request ? handoff_recv(fd, request, fds, &fd_count) : -1;
+    for (int i = 0; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    char resolved[PATH_MAX] = "";
+    if (persist_enabled && !realpath(data_dir, resolved)) resolved[0] = '\0';
     
-    char temp[256];
-    snprintf(buffer, buffer_size, "LEADERBOARD");
+    const char* refused = NULL;
+    if (len != sizeof(*request) || request->type != HANDOFF_REQUEST) {
+        refused = "malformed request";
+    } else if (request->version != HANDOFF_VERSION ||
+               request->entry_size != sizeof(leaderboard_entry)) {
+        refused = "incompatible version";
+    } else if (request->persistent != (uint32_t)persist_enabled ||
+               strncmp(request->data_dir, resolved, sizeof(resolved)) != 0) {
+        refused = "different data directory";
+    }
+    free(request);
+    if (refused) {
+        log_message(LOG_WARN, "Refused takeover: %s", refused);
+        close(fd);
+        return;
+    }
     
-    int max_entries = (entry_count > 10) ? 10 : entry_count; // Send top 10
-    for (int i = 0; i < max_entries; i++) {
-        snprintf(temp, sizeof(temp), "|%s:%d", 
-                 leaderboard[i].player_name, leaderboard[i].score);
-        strncat(buffer, temp, buffer_size - strlen(buffer) - 1);
+    log_message(LOG_INFO, "Handing over to a new server process...");
+    epoll_ctl(workers[0].epoll_fd, EPOLL_CTL_DEL, handoff_listen_fd, NULL);
+    close(handoff_listen_fd);
+    handoff_listen_fd = -1;
+    handoff_fd = fd;
+    handoff_deadline_ms = now_ms() + HANDOFF_DRAIN_TIMEOUT_MS;
+    __atomic_store_n(&handing_off, 1, __ATOMIC_RELEASE);
+    for (int i = 1; i < worker_count; i++) {
+        eventfd_write(workers[i].wake_fd, 1);
     }
 }
 
-// Process client message
-void process_client_message(int client_socket, const char* message, const char* client_ip) {
-    char response[BUFFER_SIZE];
+// Wind a worker down for a handoff: accept nothing more, read no more
+// requests, and stop once every reply owed has been sent. Connections
+// still owed one at the deadline are closed.
+void drain_worker(worker* w) {
+    if (!w->draining) {
+        w->draining = 1;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+        if (w->udp_fd >= 0) epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->udp_fd, NULL);
+    }
+    int overdue = now_ms() >= handoff_deadline_ms;
+    size_t owed = 0;
     
-    if (strncmp(message, "SUBMIT|", 7) == 0) {
-        // Format: SUBMIT|PlayerName|Score
-        char player_name[32];
-        int score;
-        
-        if (sscanf(message + 7, "%31[^|]|%d", player_name, &score) == 2) {
-            update_leaderboard(player_name, score, client_ip);
-            snprintf(response, sizeof(response), "OK|Score submitted: %s - %d", player_name, score);
-            printf("Score submitted: %s - %d from %s\n", player_name, score, client_ip);
-        } else {
-            snprintf(response, sizeof(response), "ERROR|Invalid SUBMIT format");
+    client_conn* lists[2] = {w->idle_head, w->subscribers};
+    for (int i = 0; i < 2; i++) {
+        client_conn* conn = lists[i];
+        while (conn) {
+            client_conn* next = conn->subscribed ? conn->sub_next : conn->next;
+            if (conn->wpos < conn->wlen || conn->wait_lsn || conn->close_after_write ||
+                conn->export_requested) {
+                owed++;
+                if (overdue) close_connection(conn);
+            }
+            conn = next;
         }
     }
-    else if (strncmp(message, "GET_LEADERBOARD", 15) == 0) {
-        format_leaderboard(response, sizeof(response));
-        printf("Leaderboard requested by %s\n", client_ip);
-    }
-    else {
-        snprintf(response, sizeof(response), "ERROR|Unknown command");
+    // Unacknowledged datagrams are resent by their clients
+    owed += w->udp_ack_count;
+    if (overdue) {
+        if (owed > 0) {
+            log_message(LOG_WARN, "Handoff: gave up on %zu replies still unsent", owed);
+        }
+        w->udp_ack_count = 0;
+        owed = 0;
     }
-    
-    send(client_socket, response, strlen(response), 0);
+    if (owed == 0) w->drained = 1;
 }
 
-int main() {
-    int server_fd, client_socket;
+// Create a listening socket on listen_port. Every worker binds its own with
+// SO_REUSEPORT and the kernel spreads incoming connections across them.
+// Returns -1 on error.
+int open_listener() {
     struct sockaddr_in address;
     int opt = 1;
-    int addrlen = sizeof(address);
-    
-    // Setup signal handler for graceful shutdown
-    signal(SIGINT, handle_signal);
+    int server_fd;
     
     // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     
     // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
         perror("setsockopt");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
     
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(listen_port);
     
     // Bind socket to port
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind failed");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
     
     // Start listening
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, listen_backlog) < 0) {
         perror("listen");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
+    return server_fd;
+}
+
+// Create a UDP socket on listen_port, shared out across workers with
+// SO_REUSEPORT like the listeners. Returns -1 on error.
+int open_datagram_socket() {
+    struct sockaddr_in address;
+    int opt = 1;
+    int fd;
+    
+    if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(fd);
+        return -1;
+    }
+    
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(listen_port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Give a worker its listening sockets, epoll instance and durability
+// notifications. listen_fd and udp_fd are sockets taken over from another
+// process, or -1 to open new ones. Returns -1 on error.
+int init_worker(worker* w, int id, int listen_fd, int udp_fd) {
+    memset(w, 0, sizeof(*w));
+    w->id = id;
+    w->epoll_fd = w->notify_fd = w->udp_fd = w->wake_fd = -1;
     
-    printf("Leaderboard Server started on port %d\n", PORT);
-    printf("Waiting for connections...\n");
+    if (listen_fd < 0 && (listen_fd = open_listener()) < 0) {
+        return -1;
+    }
+    w->listen_fd = listen_fd;
+    
+    // Register the listening socket with epoll
+    if ((w->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listener_tag;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    
+    if (udp_enabled) {
+        if (udp_fd < 0 && (udp_fd = open_datagram_socket()) < 0) {
+            return -1;
+        }
+        w->udp_fd = udp_fd;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &udp_tag;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->udp_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    } else if (udp_fd >= 0) {
+        close(udp_fd);
+    }
+    
+    if (persist_enabled) {
+        if ((w->notify_fd = persist_open_notify()) < 0) {
+            perror("eventfd");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &persist_tag;
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->notify_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+    
+    if ((w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Event loop for one worker; worker 0 also takes care of snapshots and
+// handoffs. Runs until shutdown, or until a handoff has drained it.
+void* run_worker(void* arg) {
+    worker* w = arg;
+    struct epoll_event events[MAX_EVENTS];
     
-    // Main server loop
-    while (server_running) {
-        // Accept incoming connection with timeout
-        fd_set readfds;
-        struct timeval timeout;
+    while (server_running && !w->drained) {
+        // Wake at least once a second to check for shutdown and idle
+        // clients, often enough to keep subscribers current, and soon
+        // after each batch while worker 0 has expired scores to drain
+        int timeout = w->subscribers ? PUSH_INTERVAL_MS : 1000;
+        if (w->paused || w->draining) timeout = PAUSE_CHECK_MS;
+        if (w->id == 0 && windows_draining) timeout = PAUSE_CHECK_MS;
+        int ready = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
         
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
+        if (ready < 0) {
+            if (errno != EINTR) log_message(LOG_ERROR, "epoll_wait: %s", strerror(errno));
+            continue;
+        }
         
-        timeout.tv_sec = 1;  // 1 second timeout
-        timeout.tv_usec = 0;
+        for (int i = 0; i < ready; i++) {
+            client_conn* conn = events[i].data.ptr;
+            
+            if (events[i].data.ptr == &listener_tag) {
+                accept_connections(w);
+                continue;
+            }
+            if (events[i].data.ptr == &persist_tag) {
+                release_durable_replies(w);
+                continue;
+            }
+            if (events[i].data.ptr == &udp_tag) {
+                read_datagrams(w);
+                continue;
+            }
+            if (events[i].data.ptr == &handoff_tag) {
+                begin_handoff();
+                continue;
+            }
+            if (events[i].data.ptr == &wake_tag) {
+                eventfd_t value;
+                eventfd_read(w->wake_fd, &value);
+                continue;
+            }
+            
+            if (events[i].events & EPOLLERR) {
+                close_connection(conn);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !w->draining &&
+                read_connection(conn) < 0) {
+                close_connection(conn);
+                continue;
+            }
+            if (flush_connection(conn) < 0) {
+                close_connection(conn);
+                continue;
+            }
+            touch_connection(conn);
+        }
         
-        int activity = select(server_fd + 1, &readfds, NULL, NULL, &timeout);
+        if (w->paused && !w->draining) resume_paused_connections(w);
+        expire_idle_connections(w);
+        // Coalesce pushes: at most one delta per interval
+        if (w->subscribers && now_ms() - w->last_push_ms >= PUSH_INTERVAL_MS) {
+            publish_leaderboard_changes(w);
+            w->last_push_ms = now_ms();
+        }
+        if (w->id == 0) {
+            maintain_windows();
+            if (persist_enabled) maybe_snapshot();
+            maybe_dump_stats();
+            reap_exports();
+        }
+        if (__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE)) drain_worker(w);
+        capture_flush(&w->capture, now_ms(), 0);
+    }
+    capture_flush(&w->capture, now_ms(), 1);
+    return NULL;
+}
+
+// Close a worker's connections and descriptors once its loop has stopped
+void free_worker(worker* w) {
+    while (w->idle_head) {
+        close_connection(w->idle_head);
+    }
+    while (w->subscribers) {
+        close_connection(w->subscribers);
+    }
+    if (w->epoll_fd >= 0) close(w->epoll_fd);
+    if (w->listen_fd >= 0) close(w->listen_fd);
+    if (w->udp_fd >= 0) close(w->udp_fd);
+    if (w->wake_fd >= 0) close(w->wake_fd);
+    free(w->udp_acks);
+    for (int i = 0; i < PROTO_COUNT; i++) {
+        free(w->cache[i].data);
+    }
+}
+
+// Hand every worker's remaining records to the capture writer, then
+// close the trace
+void finish_capture() {
+    for (int i = 0; i < worker_count; i++) {
+        capture_flush(&workers[i].capture, now_ms(), 1);
+    }
+    capture_close();
+}
+
+void add_window_record(const store_record* record, void* batch) {
+    handoff_batch_add(batch, record);
+}
+
+void add_namespace_records(leaderboard_namespace* ns, void* arg) {
+    handoff_batch* batch = arg;
+    if (batch->failed) return;
+    pthread_rwlock_rdlock(&ns->lock);
+    handoff_batch_start(batch, handoff_fd, WINDOW_ALL_TIME, ns->name);
+    for (size_t i = 0; i < ns->board.count; i++) {
+        handoff_batch_add(batch, &ns->board.records[i]);
+    }
+    handoff_batch_finish(batch);
+    pthread_rwlock_unlock(&ns->lock);
+}
+
+// Pass a connection on with the input it sent that was never handled
+int send_connection(client_conn* conn, unsigned char* message) {
+    handoff_connection header;
+    memset(&header, 0, sizeof(header));
+    header.type = HANDOFF_CONNECTION;
+    header.worker = (uint32_t)conn->owner->id;
+    header.protocol = conn->protocol;
+    header.subscribed = (uint32_t)conn->subscribed;
+    header.federation_peer = (uint32_t)conn->federation_peer;
+    header.client_addr = conn->client_addr;
+    memcpy(header.client_ip, conn->client_ip, INET_ADDRSTRLEN);
+    header.input_len = (uint32_t)conn->rlen;
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), conn->rbuf, conn->rlen);
+    return handoff_send(handoff_fd, message, sizeof(header) + conn->rlen, &conn->fd, 1);
+}
+
+// Pass everything to the process taking over once the workers have
+// drained: the boards that only live in memory, then every worker's
+// listening sockets, then their connections. The log and namespaces are
+// closed first, since the new process opens them as soon as it hears back.
+void hand_over() {
+    if (persist_enabled) {
+        namespace_close();
+        persist_close();
+    }
+    handoff_hello hello = {HANDOFF_HELLO, getpid(), (uint32_t)listen_port, (uint32_t)worker_count};
+    int failed = handoff_send(handoff_fd, &hello, sizeof(hello), NULL, 0) < 0;
+    
+    handoff_batch* batch = malloc(sizeof(handoff_batch));
+    if (!batch) failed = 1;
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT && !failed; i++) {
+        handoff_batch_start(batch, handoff_fd, i, NULL);
+        window_each_record(&rolling_windows[i], add_window_record, batch);
+        failed = handoff_batch_finish(batch) < 0;
+    }
+    if (!persist_enabled && !failed) {
+        handoff_batch_start(batch, handoff_fd, WINDOW_ALL_TIME, NULL);
+        for (size_t i = 0; i < leaderboard.count; i++) {
+            handoff_batch_add(batch, &leaderboard.records[i]);
+        }
+        handoff_batch_finish(batch);
+        namespace_each(add_namespace_records, batch);
+        failed = batch->failed;
+    }
+    if (!persist_enabled) namespace_close();
+    free(batch);
+    
+    size_t handed = 0;
+    unsigned char* message = malloc(HANDOFF_MAX_MESSAGE);
+    if (!message) failed = 1;
+    for (int i = 0; i < worker_count && !failed; i++) {
+        worker* w = &workers[i];
+        handoff_listener listener = {HANDOFF_LISTENER, (uint32_t)i};
+        int fds[2] = {w->listen_fd, w->udp_fd};
+        failed = handoff_send(handoff_fd, &listener, sizeof(listener), fds,
+                              w->udp_fd >= 0 ? 2 : 1) < 0;
+    }
+    for (int i = 0; i < worker_count && !failed; i++) {
+        worker* w = &workers[i];
+        client_conn* lists[2] = {w->idle_head, w->subscribers};
+        for (int j = 0; j < 2; j++) {
+            for (client_conn* conn = lists[j]; conn && !failed;
+                 conn = conn->subscribed ? conn->sub_next : conn->next) {
+                failed = send_connection(conn, message) < 0;
+                handed++;
+            }
+        }
+    }
+    free(message);
+    
+    uint32_t done = HANDOFF_DONE;
+    char ack;
+    if (!failed && handoff_send(handoff_fd, &done, sizeof(done), NULL, 0) == 0 &&
+        recv(handoff_fd, &ack, 1, 0) == 1) {
+        log_message(LOG_INFO, "Handed over %zu connections to the new server", handed);
+    } else {
+        log_message(LOG_ERROR, "Handoff failed: the new server did not take over");
+    }
+    close(handoff_fd);
+}
+
+// Ask the server at upgrade_socket to hand over, and wait until it has
+// drained and closed its log. Returns the socket, or -1 on error.
+int request_takeover(handoff_hello* hello) {
+    int fd = handoff_connect(upgrade_socket);
+    if (fd < 0) return -1;
+    
+    handoff_request* request = calloc(1, HANDOFF_MAX_MESSAGE);
+    if (!request) {
+        close(fd);
+        return -1;
+    }
+    request->type = HANDOFF_REQUEST;
+    request->version = HANDOFF_VERSION;
+    request->entry_size = sizeof(leaderboard_entry);
+    request->persistent = (uint32_t)persist_enabled;
+    if (persist_enabled && !realpath(data_dir, request->data_dir)) {
+        perror(data_dir);
+        free(request);
+        close(fd);
+        return -1;
+    }
+    
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count = 0;
+    ssize_t len = -1;
+    if (handoff_send(fd, request, sizeof(*request), NULL, 0) == 0) {
+        len = handoff_recv(fd, request, fds, &fd_count);
+    }
+    for (int i = 0; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    memcpy(hello, request, len == sizeof(*hello) ? sizeof(*hello) : 0);
+    free(request);
+    if (len != sizeof(*hello) || hello->type != HANDOFF_HELLO || hello->workers == 0 ||
+        hello->workers > MAX_WORKERS) {
+        fprintf(stderr, "The server at %s refused the takeover; see its log\n", upgrade_socket);
+        close(fd);
+        return -1;
+    }
+    
+    // The sockets taken over decide the port, and each needs a worker
+    listen_port = (int)hello->port;
+    if (worker_count < (int)hello->workers) worker_count = (int)hello->workers;
+    return fd;
+}
+
+// Add one HANDOFF_ENTRIES message to the board it names. Returns -1 if it
+// is malformed.
+int receive_entries(const unsigned char* message, size_t len) {
+    handoff_entries header;
+    memcpy(&header, message, sizeof(header));
+    header.name_space[sizeof(header.name_space) - 1] = '\0';
+    if (len != sizeof(header) + (size_t)header.count * sizeof(leaderboard_entry) ||
+        header.board < 0 || header.board >= WINDOW_COUNT) {
+        return -1;
+    }
+    
+    leaderboard_namespace* ns = NULL;
+    if (header.name_space[0]) {
+        if (acquire_namespace(header.name_space, 1, &ns) != NAMESPACE_OK) {
+            log_message(LOG_WARN, "Takeover: no room for namespace %s", header.name_space);
+            return 0;
+        }
+        pthread_rwlock_wrlock(&ns->lock);
+    }
+    for (uint32_t i = 0; i < header.count; i++) {
+        leaderboard_entry entry;
+        memcpy(&entry, message + sizeof(header) + i * sizeof(entry), sizeof(entry));
+        entry.player_name[sizeof(entry.player_name) - 1] = '\0';
+        entry.client_ip[sizeof(entry.client_ip) - 1] = '\0';
+        if (ns) {
+            namespace_submit(ns, &entry);
+        } else if (header.board == WINDOW_ALL_TIME) {
+            store_submit(&leaderboard, entry.player_name, entry.score, entry.timestamp,
+                         entry.client_ip);
+        } else {
+            window_submit(&rolling_windows[header.board], entry.player_name, entry.score,
+                          entry.timestamp, entry.client_ip);
+        }
+    }
+    if (ns) {
+        pthread_rwlock_unlock(&ns->lock);
+        namespace_release(ns);
+    }
+    return 0;
+}
+
+// Register a connection passed over by the server being taken over, and
+// handle any requests it sent that were never answered
+int adopt_connection(const unsigned char* message, size_t len, int fd) {
+    handoff_connection header;
+    memcpy(&header, message, sizeof(header));
+    if (len != sizeof(header) + header.input_len || header.protocol >= PROTO_COUNT) {
+        close(fd);
+        return -1;
+    }
+    client_conn* conn = calloc(1, sizeof(client_conn));
+    if (!conn || reserve_buffer(&conn->rbuf, &conn->rcap, header.input_len + 1) < 0) {
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    conn->owner = &workers[header.worker % worker_count];
+    conn->fd = fd;
+    conn->protocol = (wire_protocol)header.protocol;
+    conn->client_addr = header.client_addr;
+    conn->federation_peer = (int)header.federation_peer;
+    memcpy(conn->client_ip, header.client_ip, INET_ADDRSTRLEN);
+    conn->client_ip[INET_ADDRSTRLEN - 1] = '\0';
+    memcpy(conn->rbuf, message + sizeof(header), header.input_len);
+    conn->rlen = header.input_len;
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->owner->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(conn->rbuf);
+        free(conn);
+        close(fd);
+        return -1;
+    }
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    // Subscribers get their next delta against an empty baseline, which
+    // carries the whole top-N
+    if (header.subscribed) subscriber_list_add(conn);
+    touch_connection(conn);
+    if (read_connection(conn) < 0 || flush_connection(conn) < 0) {
+        close_connection(conn);
+    }
+    return 0;
+}
+
+// Receive the boards, sockets and connections of the server being taken
+// over, starting the workers on its listeners once they have all arrived.
+// Returns -1 if the handoff broke off.
+int take_over(int fd, pid_t from) {
+    int listen_fds[MAX_WORKERS];
+    int udp_fds[MAX_WORKERS];
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        listen_fds[i] = udp_fds[i] = -1;
+    }
+    unsigned char* message = malloc(HANDOFF_MAX_MESSAGE);
+    int started = 0;
+    size_t adopted = 0;
+    
+    while (message) {
+        int fds[HANDOFF_MAX_FDS];
+        int fd_count;
+        ssize_t len = handoff_recv(fd, message, fds, &fd_count);
+        uint32_t type = 0;
+        if (len >= (ssize_t)sizeof(type)) memcpy(&type, message, sizeof(type));
         
-        if (activity < 0 && server_running) {
-            perror("select error");
+        if (type == HANDOFF_ENTRIES && len >= (ssize_t)sizeof(handoff_entries) &&
+            fd_count == 0 && receive_entries(message, (size_t)len) == 0) {
             continue;
         }
-        
-        if (activity > 0 && FD_ISSET(server_fd, &readfds)) {
-            // Accept new connection
-            if ((client_socket = accept(server_fd, (struct sockaddr *)&address, 
-                                       (socklen_t*)&addrlen)) < 0) {
-                perror("accept");
+        if (type == HANDOFF_LISTENER && len == sizeof(handoff_listener) && fd_count > 0) {
+            handoff_listener listener;
+            memcpy(&listener, message, sizeof(listener));
+            if (!started && listener.worker < MAX_WORKERS && listen_fds[listener.worker] < 0) {
+                listen_fds[listener.worker] = fds[0];
+                udp_fds[listener.worker] = fd_count > 1 ? fds[1] : -1;
                 continue;
             }
-            
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
-            printf("New connection from %s:%d\n", client_ip, ntohs(address.sin_port));
-            
-            // Handle client communication
-            char buffer[BUFFER_SIZE] = {0};
-            int bytes_read = read(client_socket, buffer, BUFFER_SIZE - 1);
-            
-            if (bytes_read > 0) {
-                buffer[bytes_read] = '\0';
-                printf("Received: %s\n", buffer);
-                process_client_message(client_socket, buffer, client_ip);
+        }
+        if ((type == HANDOFF_CONNECTION || type == HANDOFF_DONE) && !started) {
+            for (int i = 0; i < worker_count; i++) {
+                if (init_worker(&workers[i], i, listen_fds[i], udp_fds[i]) < 0) {
+                    exit(EXIT_FAILURE);
+                }
             }
-            
-            close(client_socket);
+            started = 1;
         }
+        if (type == HANDOFF_CONNECTION && len >= (ssize_t)sizeof(handoff_connection) &&
+            fd_count == 1) {
+            if (adopt_connection(message, (size_t)len, fds[0]) == 0) adopted++;
+            continue;
+        }
+        if (type == HANDOFF_DONE && fd_count == 0 && send(fd, "", 1, MSG_NOSIGNAL) == 1) {
+            free(message);
+            close(fd);
+            log_message(LOG_INFO, "Took over %zu connections from process %d", adopted, (int)from);
+            return 0;
+        }
+        
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        break;
+    }
+    free(message);
+    close(fd);
+    fprintf(stderr, "Takeover broke off; the old server's state may be incomplete\n");
+    return -1;
+}
+
+// Listen on upgrade_socket for the next process to take over. Returns -1
+// on error.
+int listen_for_takeover() {
+    if ((handoff_listen_fd = handoff_listen(upgrade_socket)) < 0) {
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &handoff_tag;
+    if (epoll_ctl(workers[0].epoll_fd, EPOLL_CTL_ADD, handoff_listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--port N] [--backlog N] [--idle-timeout SECONDS] [--max-connections N]\n"
+                    "          [--workers N] [--data-dir DIR] [--snapshot-every N] [--no-persist]\n"
+                    "          [--no-udp] [--stats-file PATH] [--stats-interval SECONDS]\n"
+                    "          [--log-file PATH] [--log-level debug|info|warn|error]\n"
+                    "          [--read-limit N] [--write-limit N] [--limit-table N]\n"
+                    "          [--namespace-memory MB] [--namespace-idle SECONDS] [--max-namespaces N]\n"
+                    "          [--upgrade-socket PATH [--takeover]] [--capture PATH]\n"
+                    "          [--peer IP:PORT]... [--federation-secret-file PATH]\n"
+                    "          [--anti-entropy SECONDS]\n"
+                    "          [--federation-drop PERCENT] [--federation-delay MS]\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            listen_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            listen_backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+            max_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--data-dir") == 0 && i + 1 < argc) {
+            data_dir = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-every") == 0 && i + 1 < argc) {
+            snapshot_every = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--no-persist") == 0) {
+            persist_enabled = 0;
+        } else if (strcmp(argv[i], "--no-udp") == 0) {
+            udp_enabled = 0;
+        } else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc) {
+            stats_file = argv[++i];
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-file") == 0 && i + 1 < argc) {
+            log_file = argv[++i];
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc &&
+                   log_parse_level(argv[i + 1]) >= 0) {
+            log_level_option = log_parse_level(argv[++i]);
+        } else if (strcmp(argv[i], "--read-limit") == 0 && i + 1 < argc) {
+            read_limit_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--write-limit") == 0 && i + 1 < argc) {
+            write_limit_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--limit-table") == 0 && i + 1 < argc) {
+            limit_table_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--namespace-memory") == 0 && i + 1 < argc) {
+            namespace_memory_mb = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--namespace-idle") == 0 && i + 1 < argc) {
+            namespace_idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-namespaces") == 0 && i + 1 < argc) {
+            max_namespaces = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--upgrade-socket") == 0 && i + 1 < argc) {
+            upgrade_socket = argv[++i];
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = 1;
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_file = argv[++i];
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (federation_add_peer(argv[++i]) < 0) {
+                fprintf(stderr, "Bad or too many peers: %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--federation-secret-file") == 0 && i + 1 < argc) {
+            federation_secret_file = argv[++i];
+            if (federation_load_secret(federation_secret_file) < 0) exit(EXIT_FAILURE);
+        } else if (strcmp(argv[i], "--anti-entropy") == 0 && i + 1 < argc) {
+            anti_entropy_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--federation-drop") == 0 && i + 1 < argc) {
+            federation_drop = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--federation-delay") == 0 && i + 1 < argc) {
+            federation_delay = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (listen_port <= 0 || listen_port > 65535 || listen_backlog <= 0 || idle_timeout <= 0 || max_connections <= 0 ||
+        worker_count <= 0 || worker_count > MAX_WORKERS || stats_interval <= 0 ||
+        read_limit_rate < 0 || write_limit_rate < 0 || namespace_idle_timeout <= 0 ||
+        (takeover && !upgrade_socket) || anti_entropy_interval <= 0 ||
+        (federation_enabled() && !federation_secret_file) ||
+        federation_drop < 0 || federation_drop > 100 || federation_delay < 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    started_at = time(NULL);
+    if (log_open(log_file, log_level_option) < 0 ||
+        (capture_file && capture_open(capture_file) < 0)) {
+        exit(EXIT_FAILURE);
+    }
+    if (store_init(&leaderboard) < 0 ||
+        limit_init(read_limit_rate, write_limit_rate, limit_table_size) < 0) {
+        fprintf(stderr, "Failed to allocate leaderboard\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Prefer writers so a steady stream of cache rebuilds can't starve
+    // submissions
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&leaderboard_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT; i++) {
+        if (window_init(&rolling_windows[i], window_layout[i].bucket_seconds,
+                        window_layout[i].bucket_count, time(NULL)) < 0) {
+            fprintf(stderr, "Failed to allocate %s leaderboard\n", window_names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Taking over: wait until the old server has let go of the data
+    // directory, then recover from it as on any start
+    handoff_hello hello;
+    int takeover_fd = -1;
+    if (takeover && (takeover_fd = request_takeover(&hello)) < 0) {
+        exit(EXIT_FAILURE);
     }
     
-    printf("Server shutdown complete.\n");
-    close(server_fd);
+    // Recover saved scores before accepting any clients
+    if (persist_enabled && persist_open(data_dir, &leaderboard, snapshot_every,
+                                        replay_into_windows) < 0) {
+        fprintf(stderr, "Failed to open leaderboard data in %s\n", data_dir);
+        exit(EXIT_FAILURE);
+    }
+    if (namespace_init(persist_enabled ? data_dir : NULL, namespace_memory_mb << 20,
+                       namespace_idle_timeout, max_namespaces, format_namespace_top, TOP_COUNT) < 0) {
+        fprintf(stderr, "Failed to open namespaces in %s\n", data_dir);
+        exit(EXIT_FAILURE);
+    }
+    // The snapshot holds each player's all-time best only; those recent
+    // enough seed the windows alongside the replayed log tail
+    for (size_t i = 0; i < leaderboard.count; i++) {
+        const store_record* record = &leaderboard.records[i];
+        for (int w = WINDOW_ALL_TIME + 1; w < WINDOW_COUNT; w++) {
+            window_submit_id(&rolling_windows[w], record->name, record->score,
+                             (time_t)record->timestamp, record->client_ip);
+        }
+    }
+    
+    // Setup signal handler for graceful shutdown
+    signal(SIGINT, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (takeover_fd >= 0) {
+        if (take_over(takeover_fd, hello.pid) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        for (int i = 0; i < worker_count; i++) {
+            if (init_worker(&workers[i], i, -1, -1) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (upgrade_socket && listen_for_takeover() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Digests are built from the board as recovered or handed over
+    federation_set_faults(federation_drop, federation_delay);
+    if (federation_start(&leaderboard, &leaderboard_lock, merge_remote,
+                         anti_entropy_interval) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    log_message(LOG_INFO, "Leaderboard Server started on port %d%s with %d worker%s",
+                listen_port, udp_enabled ? " (TCP and UDP)" : "", worker_count,
+                worker_count == 1 ? "" : "s");
+    log_message(LOG_INFO, "Waiting for connections...");
+    
+    // The main thread runs worker 0 itself
+    for (int i = 1; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    run_worker(&workers[0]);
+    if (handoff_fd < 0) log_message(LOG_INFO, "Shutting down server gracefully...");
+    
+    unsigned long cache_hits = 0;
+    unsigned long cache_misses = 0;
+    for (int i = 0; i < worker_count; i++) {
+        if (i > 0) pthread_join(workers[i].thread, NULL);
+        cache_hits += workers[i].stats.cache_hits;
+        cache_misses += workers[i].stats.cache_misses;
+    }
+    
+    // Merges write to the log, so peers are let go before it closes
+    federation_stop();
+    
+    // A handoff interrupted by a shutdown signal is abandoned
+    int handing_over = handoff_fd >= 0;
+    for (int i = 0; i < worker_count; i++) {
+        handing_over = handing_over && workers[i].drained;
+    }
+    if (handing_over) {
+        hand_over();
+        // The connections live on, so closing them below is not recorded
+        finish_capture();
+    } else {
+        if (handoff_fd >= 0) close(handoff_fd);
+        namespace_close();
+        if (persist_enabled) {
+            persist_close();
+        }
+    }
+    if (handoff_listen_fd >= 0) {
+        close(handoff_listen_fd);
+        unlink(upgrade_socket);
+    }
+    log_message(LOG_INFO, "Leaderboard cache: %lu hits, %lu misses", cache_hits, cache_misses);
+    log_message(LOG_INFO, "Server shutdown complete.");
+    for (int i = 0; i < worker_count; i++) {
+        free_worker(&workers[i]);
+    }
+    if (!handing_over) finish_capture();
+    store_free(&leaderboard);
+    for (int i = WINDOW_ALL_TIME + 1; i < WINDOW_COUNT; i++) {
+        window_free(&rolling_windows[i]);
+    }
+    pthread_rwlock_destroy(&leaderboard_lock);
+    limit_free();
+    log_close();
     return 0;
 }
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "leaderboard_stats.h"
+
+static const char* request_names[STAT_REQUEST_COUNT] = {
+    "SUBMIT", "SUBMIT_BATCH", "GET_LEADERBOARD", "SUBSCRIBE",
+    "GET_RANK", "GET_RANGE", "GET_AROUND", "GET_STATS", "EXPORT", "FEDERATION",
+    "UNKNOWN"
+};
+
+// Board names as text requests spell them
+static const char* board_names[WINDOW_COUNT] = {"alltime", "daily", "weekly"};
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void stats_record(server_stats* stats, stat_request request, uint64_t elapsed_ns) {
+    histogram* h = &stats->service[request];
+    stat_add(&h->counts[histogram_bucket(elapsed_ns)], 1);
+    stat_add(&h->total, 1);
+    stat_add(&h->sum, elapsed_ns);
+    if (elapsed_ns > h->max) {
+        __atomic_store_n(&h->max, elapsed_ns, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_merge(server_stats* into, const server_stats* from) {
+    for (int r = 0; r < STAT_REQUEST_COUNT; r++) {
+        histogram* to = &into->service[r];
+        const histogram* source = &from->service[r];
+        if (load(&source->total) == 0) continue;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            to->counts[i] += load(&source->counts[i]);
+        }
+        to->total += load(&source->total);
+        to->sum += load(&source->sum);
+        uint64_t max = load(&source->max);
+        if (max > to->max) to->max = max;
+    }
+    into->bytes_in += load(&from->bytes_in);
+    into->bytes_out += load(&from->bytes_out);
+    into->datagrams_in += load(&from->datagrams_in);
+    into->datagrams_out += load(&from->datagrams_out);
+    into->accepted += load(&from->accepted);
+    into->rejected += load(&from->rejected);
+    into->accept_errors += load(&from->accept_errors);
+    into->cache_hits += load(&from->cache_hits);
+    into->cache_misses += load(&from->cache_misses);
+    into->busy_replies += load(&from->busy_replies);
+    into->paused_reads += load(&from->paused_reads);
+}
+
+int stats_format(const server_stats* stats, const stats_gauges* gauges, char* buffer,
+                 size_t size) {
+    size_t len = 0;
+    int n;
+    
+#define APPEND(...)                                                     \
+    do {                                                                \
+        n = snprintf(buffer + len, size - len, __VA_ARGS__);            \
+        if (n < 0 || (size_t)n >= size - len) return -1;                \
+        len += n;                                                       \
+    } while (0)
+    
+    APPEND("{\"time\":%lld,\"uptime_s\":%llu,\"workers\":%d",
+           (long long)time(NULL), (unsigned long long)gauges->uptime_seconds, gauges->workers);
+    APPEND(",\"connections\":{\"active\":%d,\"accepted\":%llu,\"rejected\":%llu,"
+           "\"accept_errors\":%llu}",
+           gauges->active_connections, (unsigned long long)stats->accepted,
+           (unsigned long long)stats->rejected, (unsigned long long)stats->accept_errors);
+    APPEND(",\"bytes\":{\"in\":%llu,\"out\":%llu},\"datagrams\":{\"in\":%llu,\"out\":%llu}",
+           (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out,
+           (unsigned long long)stats->datagrams_in, (unsigned long long)stats->datagrams_out);
+    APPEND(",\"cache\":{\"hits\":%llu,\"misses\":%llu}",
+           (unsigned long long)stats->cache_hits, (unsigned long long)stats->cache_misses);
+    APPEND(",\"limits\":{\"busy\":%llu,\"paused_reads\":%llu}",
+           (unsigned long long)stats->busy_replies, (unsigned long long)stats->paused_reads);
+    
+    APPEND(",\"players\":{");
+    for (int i = 0; i < WINDOW_COUNT; i++) {
+        APPEND("%s\"%s\":%zu", i ? "," : "", board_names[i], gauges->players[i]);
+    }
+    APPEND("},\"log\":{\"appended_lsn\":%llu,\"durable_lsn\":%llu}",
+           (unsigned long long)gauges->appended_lsn, (unsigned long long)gauges->durable_lsn);
+    APPEND(",\"log_dropped\":%llu", (unsigned long long)gauges->log_dropped);
+    APPEND(",\"capture\":{\"records\":%llu,\"dropped\":%llu}",
+           (unsigned long long)gauges->capture_records,
+           (unsigned long long)gauges->capture_dropped);
+    APPEND(",\"namespaces\":{\"resident\":%zu,\"bytes\":%zu,\"loaded\":%llu,\"evicted\":%llu}",
+           gauges->namespaces, gauges->namespace_bytes,
+           (unsigned long long)gauges->namespaces_loaded,
+           (unsigned long long)gauges->namespaces_evicted);
+    APPEND(",\"federation\":{\"peers\":%d,\"up\":%d,\"sent\":%llu,\"lost\":%llu,"
+           "\"merged\":%llu,\"repaired\":%llu,\"rounds\":%llu,\"digest\":\"%016llx\"}",
+           gauges->federation_peers, gauges->federation_peers_up,
+           (unsigned long long)gauges->federation_sent,
+           (unsigned long long)gauges->federation_lost,
+           (unsigned long long)gauges->federation_merged,
+           (unsigned long long)gauges->federation_repaired,
+           (unsigned long long)gauges->federation_rounds,
+           (unsigned long long)gauges->federation_digest);
+    
+    APPEND(",\"requests\":{");
+    for (int r = 0; r < STAT_REQUEST_COUNT; r++) {
+        const histogram* h = &stats->service[r];
+        APPEND("%s\"%s\":{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+               "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+               r ? "," : "", request_names[r], (unsigned long long)h->total,
+               (unsigned long long)(h->total ? h->sum / h->total : 0),
+               (unsigned long long)histogram_percentile(h, 0.50),
+               (unsigned long long)histogram_percentile(h, 0.90),
+               (unsigned long long)histogram_percentile(h, 0.99),
+               (unsigned long long)histogram_percentile(h, 0.999),
+               (unsigned long long)h->max);
+    }
+    APPEND("}}");
+    
+#undef APPEND
+    return (int)len;
+}
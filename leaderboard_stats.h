@@ -0,0 +1,92 @@
+#ifndef LEADERBOARD_STATS_H
+#define LEADERBOARD_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "leaderboard_protocol.h"
+#include "leaderboard_histogram.h"
+
+// Live server metrics. Every worker keeps its own server_stats that only
+// its thread ever writes, so counting a request is a few plain adds with
+// no lock and no shared cache line. Readers (STATS requests, the periodic
+// dump) load each worker's counters relaxed and add them up; a snapshot
+// may be a request or two behind but never stalls a worker.
+
+// Kinds of request counted separately, whatever protocol carried them
+typedef enum {
+    STAT_SUBMIT,
+    STAT_SUBMIT_BATCH,
+    STAT_GET_LEADERBOARD,
+    STAT_SUBSCRIBE,
+    STAT_GET_RANK,
+    STAT_GET_RANGE,
+    STAT_GET_AROUND,
+    STAT_GET_STATS,
+    STAT_EXPORT,
+    STAT_FEDERATION,            // Merges and digests from federation peers
+    STAT_UNKNOWN,               // Unknown command or opcode
+    STAT_REQUEST_COUNT
+} stat_request;
+
+typedef struct {
+    histogram service[STAT_REQUEST_COUNT];  // Nanoseconds spent handling each request
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t datagrams_in;
+    uint64_t datagrams_out;
+    uint64_t accepted;
+    uint64_t rejected;              // Over --max-connections
+    uint64_t accept_errors;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t busy_replies;          // Requests refused by the rate limit
+    uint64_t paused_reads;          // Times a connection's input was left unread
+} server_stats;
+
+// Values read at snapshot time rather than counted
+typedef struct {
+    uint64_t uptime_seconds;
+    int workers;
+    int active_connections;
+    size_t players[WINDOW_COUNT];   // Size of each board
+    uint64_t appended_lsn;          // 0 without persistence
+    uint64_t durable_lsn;
+    uint64_t log_dropped;           // Log records lost to a full buffer
+    uint64_t capture_records;       // Records written to the traffic capture
+    uint64_t capture_dropped;       // And lost to a full queue
+    size_t namespaces;              // Resident namespaces
+    size_t namespace_bytes;         // Memory they use, against the budget
+    uint64_t namespaces_loaded;     // Created or brought back from disk
+    uint64_t namespaces_evicted;
+    int federation_peers;
+    int federation_peers_up;
+    uint64_t federation_sent;       // Local scores sent to peers
+    uint64_t federation_lost;       // Deltas dropped, left to anti-entropy
+    uint64_t federation_merged;     // Peers' records that changed a board
+    uint64_t federation_repaired;   // Records fetched by anti-entropy that did
+    uint64_t federation_rounds;     // Anti-entropy rounds completed
+    uint64_t federation_digest;     // Root digest, equal on servers that agree
+} stats_gauges;
+
+// Add to a counter owned by the calling thread. A relaxed load and store
+// rather than an atomic add: there is only one writer, and this compiles
+// to a plain increment while still being a well-defined read for others.
+static inline void stat_add(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Nanoseconds on a monotonic clock
+uint64_t stats_now_ns();
+
+// Count one request and how long it took to handle
+void stats_record(server_stats* stats, stat_request request, uint64_t elapsed_ns);
+
+// Add a worker's counters into a total. Safe while the worker is running.
+void stats_merge(server_stats* into, const server_stats* from);
+
+// Write a snapshot as one line of JSON. Returns the length, or -1 if it
+// did not fit.
+int stats_format(const server_stats* stats, const stats_gauges* gauges, char* buffer,
+                 size_t size);
+
+#endif
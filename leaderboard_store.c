@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "leaderboard_store.h"
+
+#define INITIAL_CAPACITY 1024
+#define HEAD 0                      // Pool offset of every store's head node
+#define LEVEL_BITS 5                // Node header: record id << LEVEL_BITS | level - 1
+#define NAME_CHUNK_BITS 20          // Names are stored in 1 MB chunks
+#define NAME_CHUNK_SIZE ((size_t)1 << NAME_CHUNK_BITS)
+#define NAME_CHUNKS 4096            // Chunk number must fit above the offset in a u32
+#define NAME_PAGE_BITS 16           // Name ids per page of the location table
+#define NAME_PAGE_SIZE ((size_t)1 << NAME_PAGE_BITS)
+#define NAME_PAGES ((size_t)1 << (32 - NAME_PAGE_BITS))
+
+// The name table shared by every store. Names go into chunks and are found
+// through pages of locations (chunk << NAME_CHUNK_BITS | offset); neither
+// moves once written, so store_name() reads them without a lock. The hash
+// table and the counters are guarded by names_lock.
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char* name_chunks[NAME_CHUNKS];
+static size_t name_chunk_count = 0;
+static size_t name_chunk_used = 0;      // Bytes taken in the newest chunk
+static uint32_t* name_pages[NAME_PAGES];
+static size_t name_count = 0;
+static uint32_t* name_slots = NULL;     // Open addressing, name id + 1 (0 = empty)
+static size_t name_slot_count = 0;      // Always a power of two
+
+uint64_t store_hash_name(const char* name) {
+    uint64_t hash = 1469598103934665603ULL;
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const char* store_name(uint32_t id) {
+    uint32_t location = name_pages[id >> NAME_PAGE_BITS][id & (NAME_PAGE_SIZE - 1)];
+    return name_chunks[location >> NAME_CHUNK_BITS] + (location & (NAME_CHUNK_SIZE - 1));
+}
+
+size_t store_name_count() {
+    pthread_rwlock_rdlock(&names_lock);
+    size_t count = name_count;
+    pthread_rwlock_unlock(&names_lock);
+    return count;
+}
+
+// Copy of a name cut to the longest one kept
+static void name_key(char* key, const char* name) {
+    strncpy(key, name, STORE_NAME_SIZE - 1);
+    key[STORE_NAME_SIZE - 1] = '\0';
+}
+
+// Slot holding name, or the empty slot where it would go. Call with
+// names_lock held.
+static size_t name_slot(const char* name) {
+    size_t mask = name_slot_count - 1;
+    size_t slot = store_hash_name(name) & mask;
+    while (name_slots[slot] != 0 && strcmp(store_name(name_slots[slot] - 1), name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Id of an interned name, or STORE_NO_NAME. Call with names_lock held.
+static uint32_t lookup_name(const char* key) {
+    if (name_count == 0) return STORE_NO_NAME;
+    uint32_t id = name_slots[name_slot(key)];
+    return id ? id - 1 : STORE_NO_NAME;
+}
+
+static int grow_name_slots() {
+    size_t new_count = name_slot_count ? name_slot_count * 2 : INITIAL_CAPACITY * 2;
+    uint32_t* slots = calloc(new_count, sizeof(uint32_t));
+    if (!slots) return -1;
+    free(name_slots);
+    name_slots = slots;
+    name_slot_count = new_count;
+    for (size_t id = 0; id < name_count; id++) {
+        name_slots[name_slot(store_name((uint32_t)id))] = (uint32_t)id + 1;
+    }
+    return 0;
+}
+
+// Copy key into the chunks and give it the next id. Call with names_lock
+// held for writing.
+static uint32_t add_name(const char* key) {
+    size_t length = strlen(key) + 1;
+    if (name_count >= STORE_NO_NAME - 1) return STORE_NO_NAME;
+    if (name_chunk_count == 0 || name_chunk_used + length > NAME_CHUNK_SIZE) {
+        if (name_chunk_count == NAME_CHUNKS) return STORE_NO_NAME;
+        char* chunk = malloc(NAME_CHUNK_SIZE);
+        if (!chunk) return STORE_NO_NAME;
+        name_chunks[name_chunk_count++] = chunk;
+        name_chunk_used = 0;
+    }
+    uint32_t** page = &name_pages[name_count >> NAME_PAGE_BITS];
+    if (!*page && !(*page = malloc(NAME_PAGE_SIZE * sizeof(uint32_t)))) {
+        return STORE_NO_NAME;
+    }
+    
+    size_t chunk = name_chunk_count - 1;
+    memcpy(name_chunks[chunk] + name_chunk_used, key, length);
+    (*page)[name_count & (NAME_PAGE_SIZE - 1)] =
+        (uint32_t)(chunk << NAME_CHUNK_BITS | name_chunk_used);
+    name_chunk_used += length;
+    return (uint32_t)name_count++;
+}
+
+uint32_t store_name_id(const char* name) {
+    char key[STORE_NAME_SIZE];
+    name_key(key, name);
+    pthread_rwlock_rdlock(&names_lock);
+    uint32_t id = lookup_name(key);
+    pthread_rwlock_unlock(&names_lock);
+    return id;
+}
+
+uint32_t store_intern_name(const char* name) {
+    char key[STORE_NAME_SIZE];
+    name_key(key, name);
+    
+    // Most names are already known, and readers don't exclude each other
+    pthread_rwlock_rdlock(&names_lock);
+    uint32_t id = lookup_name(key);
+    pthread_rwlock_unlock(&names_lock);
+    if (id != STORE_NO_NAME) return id;
+    
+    pthread_rwlock_wrlock(&names_lock);
+    // Keep the hash table at most half full
+    if ((name_count + 1) * 2 > name_slot_count && grow_name_slots() < 0) {
+        pthread_rwlock_unlock(&names_lock);
+        return STORE_NO_NAME;
+    }
+    size_t slot = name_slot(key);
+    if (name_slots[slot] != 0) {
+        id = name_slots[slot] - 1;
+    } else if ((id = add_name(key)) != STORE_NO_NAME) {
+        name_slots[slot] = id + 1;
+    }
+    pthread_rwlock_unlock(&names_lock);
+    return id;
+}
+
+void store_unpack(const store_record* record, leaderboard_entry* out) {
+    memset(out, 0, sizeof(*out));
+    strcpy(out->player_name, store_name(record->name));
+    out->score = record->score;
+    out->timestamp = (time_t)record->timestamp;
+    store_format_ip(record->client_ip, out->client_ip, sizeof(out->client_ip));
+}
+
+uint32_t store_parse_ip(const char* text) {
+    struct in_addr address;
+    return inet_pton(AF_INET, text, &address) == 1 ? address.s_addr : 0;
+}
+
+void store_format_ip(uint32_t address, char* out, size_t size) {
+    struct in_addr in = {.s_addr = address};
+    if (!inet_ntop(AF_INET, &in, out, size) && size > 0) out[0] = '\0';
+}
+
+// Random skip list level, each level a quarter as likely as the one below
+static int random_level(leaderboard_store* store) {
+    store->rng ^= store->rng << 13;
+    store->rng ^= store->rng >> 7;
+    store->rng ^= store->rng << 17;
+    uint64_t bits = store->rng;
+    int level = 1;
+    while ((bits & 3) == 0 && level < STORE_MAX_LEVEL) {
+        level++;
+        bits >>= 2;
+    }
+    return level;
+}
+
+// Skip list nodes live in a pool of 32-bit words owned by their store and
+// refer to each other by offset; the head node sits at offset 0, so a next
+// of 0 means the end of the list. A node is a header word (record id and
+// level), the level-0 next, then a next and span pair for each level
+// above: 2 * level words. The span of a link is the rank of its next minus
+// the rank of its node, which at level 0 is always 1 and so is not stored.
+
+static uint32_t next_of(const leaderboard_store* store, uint32_t node, int level) {
+    return store->nodes[node + (level ? 2 * level : 1)];
+}
+
+static void set_next(leaderboard_store* store, uint32_t node, int level, uint32_t next) {
+    store->nodes[node + (level ? 2 * level : 1)] = next;
+}
+
+static uint32_t span_of(const leaderboard_store* store, uint32_t node, int level) {
+    return level ? store->nodes[node + 2 * level + 1] : 1;
+}
+
+static void set_span(leaderboard_store* store, uint32_t node, int level, uint32_t span) {
+    if (level) store->nodes[node + 2 * level + 1] = span;
+}
+
+static uint32_t node_id(const leaderboard_store* store, uint32_t node) {
+    return store->nodes[node] >> LEVEL_BITS;
+}
+
+static int node_level(const leaderboard_store* store, uint32_t node) {
+    return (int)(store->nodes[node] & ((1 << LEVEL_BITS) - 1)) + 1;
+}
+
+static void set_node(leaderboard_store* store, uint32_t node, uint32_t id, int level) {
+    store->nodes[node] = id << LEVEL_BITS | (uint32_t)(level - 1);
+}
+
+// Make room in the node pool for more words
+static int reserve_nodes(leaderboard_store* store, size_t more) {
+    size_t needed = store->nodes_len + more;
+    if (needed <= store->nodes_cap) return 0;
+    size_t new_cap = store->nodes_cap;
+    while (new_cap < needed) new_cap *= 2;
+    if (new_cap > UINT32_MAX) return -1;
+    uint32_t* grown = realloc(store->nodes, new_cap * sizeof(uint32_t));
+    if (!grown) return -1;
+    store->nodes = grown;
+    store->nodes_cap = new_cap;
+    return 0;
+}
+
+// A node for record id, from the free list for its level if there is one.
+// Freed nodes are chained through their level-0 next. Returns its offset,
+// or 0 if memory ran out.
+static uint32_t new_node(leaderboard_store* store, uint32_t id, int level) {
+    uint32_t node = store->free_nodes[level];
+    if (node) {
+        store->free_nodes[level] = next_of(store, node, 0);
+    } else {
+        if (reserve_nodes(store, 2 * level) < 0) return 0;
+        node = (uint32_t)store->nodes_len;
+        store->nodes_len += 2 * level;
+    }
+    set_node(store, node, id, level);
+    memset(&store->nodes[node + 1], 0, (2 * level - 1) * sizeof(uint32_t));
+    return node;
+}
+
+static void free_node(leaderboard_store* store, uint32_t node) {
+    int level = node_level(store, node);
+    set_next(store, node, 0, store->free_nodes[level]);
+    store->free_nodes[level] = node;
+}
+
+// Negative if record r ranks ahead of the key (score, timestamp, name):
+// higher score first, then whoever reached it earlier, then by name. Names
+// are unique, so the order is total and any two stores holding the same
+// players agree on it.
+static int compare_key(const store_record* r, int score, time_t timestamp, const char* name) {
+    if (r->score != score) return (r->score > score) ? -1 : 1;
+    if (r->timestamp != timestamp) return (r->timestamp < timestamp) ? -1 : 1;
+    return strcmp(store_name(r->name), name);
+}
+
+// Negative if record a ranks ahead of record b
+static int compare_records(const leaderboard_store* store, uint32_t a, uint32_t b) {
+    const store_record* rb = &store->records[b];
+    return compare_key(&store->records[a], rb->score, rb->timestamp, store_name(rb->name));
+}
+
+// Find the predecessors of record id at every level, and the rank of each
+// predecessor (0 for the head)
+static void find_path(const leaderboard_store* store, uint32_t id, uint32_t* update,
+                      size_t* rank) {
+    uint32_t node = HEAD;
+    size_t traversed = 0;
+    for (int i = store->level - 1; i >= 0; i--) {
+        uint32_t next;
+        while ((next = next_of(store, node, i)) &&
+               compare_records(store, node_id(store, next), id) < 0) {
+            traversed += span_of(store, node, i);
+            node = next;
+        }
+        update[i] = node;
+        rank[i] = traversed;
+    }
+}
+
+// Link a node in under its record's current key. length is the number of
+// nodes already in the list; spans to the end of the list count up to it.
+static void skiplist_link(leaderboard_store* store, uint32_t node, size_t length) {
+    uint32_t update[STORE_MAX_LEVEL];
+    size_t rank[STORE_MAX_LEVEL];
+    find_path(store, node_id(store, node), update, rank);
+    
+    int level = node_level(store, node);
+    if (level > store->level) {
+        for (int i = store->level; i < level; i++) {
+            update[i] = HEAD;
+            rank[i] = 0;
+            set_span(store, HEAD, i, (uint32_t)length);
+        }
+        store->level = level;
+    }
+    for (int i = 0; i < level; i++) {
+        uint32_t prev = update[i];
+        set_next(store, node, i, next_of(store, prev, i));
+        set_span(store, node, i, span_of(store, prev, i) - (uint32_t)(rank[0] - rank[i]));
+        set_next(store, prev, i, node);
+        set_span(store, prev, i, (uint32_t)(rank[0] - rank[i]) + 1);
+    }
+    // Links passing over the new node now skip one more rank
+    for (int i = level; i < store->level; i++) {
+        set_span(store, update[i], i, span_of(store, update[i], i) + 1);
+    }
+}
+
+static int skiplist_insert(leaderboard_store* store, uint32_t id) {
+    uint32_t node = new_node(store, id, random_level(store));
+    if (!node) return -1;
+    skiplist_link(store, node, store->count);
+    return 0;
+}
+
+// Unlink record id, which must still hold the key it was inserted with.
+// Returns its node, or 0 if it was not found.
+static uint32_t skiplist_unlink(leaderboard_store* store, uint32_t id) {
+    uint32_t update[STORE_MAX_LEVEL];
+    size_t rank[STORE_MAX_LEVEL];
+    find_path(store, id, update, rank);
+    
+    uint32_t node = next_of(store, update[0], 0);
+    if (!node || node_id(store, node) != id) return 0;
+    for (int i = 0; i < store->level; i++) {
+        uint32_t prev = update[i];
+        if (next_of(store, prev, i) == node) {
+            set_span(store, prev, i, span_of(store, prev, i) + span_of(store, node, i) - 1);
+            set_next(store, prev, i, next_of(store, node, i));
+        } else {
+            set_span(store, prev, i, span_of(store, prev, i) - 1);
+        }
+    }
+    while (store->level > 1 && next_of(store, HEAD, store->level - 1) == 0) {
+        store->level--;
+    }
+    return node;
+}
+
+// Re-link an unlinked node under its record's current key
+static void skiplist_relink(leaderboard_store* store, uint32_t node) {
+    skiplist_link(store, node, store->count - 1);
+}
+
+// Node at the given rank (1 being the best), or 0 past the end
+static uint32_t node_at_rank(const leaderboard_store* store, size_t rank) {
+    if (rank == 0 || rank > store->count) return 0;
+    uint32_t node = HEAD;
+    size_t traversed = 0;
+    for (int i = store->level - 1; i >= 0; i--) {
+        while (next_of(store, node, i) && traversed + span_of(store, node, i) <= rank) {
+            traversed += span_of(store, node, i);
+            node = next_of(store, node, i);
+        }
+        if (traversed == rank) return node;
+    }
+    return 0;
+}
+
+// Record id + 1 of the player with this name id, 0 if none
+static uint32_t record_for(const leaderboard_store* store, uint32_t name) {
+    return name < store->by_name_len ? store->by_name[name] : 0;
+}
+
+static int grow_by_name(leaderboard_store* store, uint32_t name) {
+    if (name < store->by_name_len) return 0;
+    size_t new_len = store->by_name_len ? store->by_name_len * 2 : INITIAL_CAPACITY;
+    while (new_len <= name) new_len *= 2;
+    uint32_t* grown = realloc(store->by_name, new_len * sizeof(uint32_t));
+    if (!grown) return -1;
+    memset(grown + store->by_name_len, 0, (new_len - store->by_name_len) * sizeof(uint32_t));
+    store->by_name = grown;
+    store->by_name_len = new_len;
+    return 0;
+}
+
+int store_init(leaderboard_store* store) {
+    memset(store, 0, sizeof(*store));
+    store->capacity = INITIAL_CAPACITY;
+    store->records = malloc(store->capacity * sizeof(store_record));
+    store->nodes_cap = INITIAL_CAPACITY * 4;
+    store->nodes = malloc(store->nodes_cap * sizeof(uint32_t));
+    store->level = 1;
+    store->rng = 0x9E3779B97F4A7C15ULL;
+    if (!store->records || !store->nodes) {
+        store_free(store);
+        return -1;
+    }
+    store->nodes_len = 2 * STORE_MAX_LEVEL;
+    set_node(store, HEAD, 0, STORE_MAX_LEVEL);
+    memset(&store->nodes[HEAD + 1], 0, (2 * STORE_MAX_LEVEL - 1) * sizeof(uint32_t));
+    return 0;
+}
+
+void store_free(leaderboard_store* store) {
+    if (store->mapping) {
+        munmap(store->mapping, store->mapping_len);
+    } else {
+        free(store->records);
+    }
+    free(store->nodes);
+    free(store->by_name);
+    memset(store, 0, sizeof(*store));
+}
+
+size_t store_memory(const leaderboard_store* store) {
+    size_t records = store->mapping ? store->mapping_len : store->capacity * sizeof(store_record);
+    return records + store->nodes_cap * sizeof(uint32_t) + store->by_name_len * sizeof(uint32_t);
+}
+
+// Give the record array room for one more record, moving mapped records
+// to the heap the first time they outgrow their snapshot
+static int grow_records(leaderboard_store* store) {
+    size_t new_capacity = store->capacity * 2;
+    if (store->mapping) {
+        store_record* moved = malloc(new_capacity * sizeof(store_record));
+        if (!moved) return -1;
+        memcpy(moved, store->records, store->count * sizeof(store_record));
+        munmap(store->mapping, store->mapping_len);
+        store->mapping = NULL;
+        store->mapping_len = 0;
+        store->records = moved;
+    } else {
+        store_record* grown = realloc(store->records, new_capacity * sizeof(store_record));
+        if (!grown) return -1;
+        store->records = grown;
+    }
+    store->capacity = new_capacity;
+    return 0;
+}
+
+static int compare_ids(const void* a, const void* b, void* store) {
+    return compare_records(store, *(const uint32_t*)a, *(const uint32_t*)b);
+}
+
+// Nonzero if rank_order names every record once, best first
+static int ranked_in_order(const leaderboard_store* store, const uint32_t* rank_order) {
+    unsigned char* seen = calloc(store->count / 8 + 1, 1);
+    if (!seen) return 0;
+    int valid = 1;
+    for (size_t i = 0; i < store->count && valid; i++) {
+        uint32_t id = rank_order[i];
+        if (id >= store->count || (seen[id / 8] & (1 << (id % 8))) ||
+            (i > 0 && compare_records(store, rank_order[i - 1], id) >= 0)) {
+            valid = 0;
+        } else {
+            seen[id / 8] |= 1 << (id % 8);
+        }
+    }
+    free(seen);
+    return valid;
+}
+
+int store_load_ranked(leaderboard_store* store, store_record* records, size_t count,
+                      const uint32_t* rank_order, void* mapping, size_t mapping_len) {
+    if (count == 0 || count > STORE_MAX_RECORDS || store->count != 0) return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (records[i].name >= name_count) return -1;
+    }
+    
+    size_t by_name_len = INITIAL_CAPACITY;
+    while (by_name_len < name_count) by_name_len *= 2;
+    uint32_t* by_name = calloc(by_name_len, sizeof(uint32_t));
+    if (!by_name) return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (by_name[records[i].name] != 0) {
+            free(by_name);
+            return -1;              // The same player twice
+        }
+        by_name[records[i].name] = (uint32_t)i + 1;
+    }
+    
+    free(store->records);
+    free(store->by_name);
+    store->records = records;
+    store->count = count;
+    store->capacity = count;
+    store->by_name = by_name;
+    store->by_name_len = by_name_len;
+    store->mapping = mapping;
+    store->mapping_len = mapping_len;
+    
+    // A damaged or hand-made rank index would corrupt the skip list, so it
+    // is checked, and the records sorted afresh if it is wrong
+    uint32_t* sorted = NULL;
+    if (!ranked_in_order(store, rank_order)) {
+        sorted = malloc(count * sizeof(uint32_t));
+        if (!sorted) return -1;
+        for (size_t i = 0; i < count; i++) {
+            sorted[i] = (uint32_t)i;
+        }
+        qsort_r(sorted, count, sizeof(uint32_t), compare_ids, store);
+        rank_order = sorted;
+    }
+    
+    // Records arrive in rank order, so each node goes at the tail of every
+    // level it reaches. A level-n node is 2n words and a quarter of nodes
+    // reach each further level.
+    if (reserve_nodes(store, count * 8 / 3 + 1) < 0) {
+        free(sorted);
+        return -1;
+    }
+    uint32_t tail[STORE_MAX_LEVEL];
+    size_t tail_rank[STORE_MAX_LEVEL];
+    for (int i = 0; i < STORE_MAX_LEVEL; i++) {
+        tail[i] = HEAD;
+        tail_rank[i] = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        int level = random_level(store);
+        uint32_t node = new_node(store, rank_order[i], level);
+        if (!node) {
+            free(sorted);
+            return -1;
+        }
+        for (int l = 0; l < level; l++) {
+            set_next(store, tail[l], l, node);
+            set_span(store, tail[l], l, (uint32_t)(i + 1 - tail_rank[l]));
+            tail[l] = node;
+            tail_rank[l] = i + 1;
+        }
+        if (level > store->level) store->level = level;
+    }
+    for (int l = 0; l < STORE_MAX_LEVEL; l++) {
+        set_span(store, tail[l], l, (uint32_t)(count - tail_rank[l]));
+    }
+    free(sorted);
+    return 0;
+}
+
+int store_submit_id(leaderboard_store* store, uint32_t name, int score, time_t timestamp,
+                    uint32_t client_ip) {
+    const store_record* record = store_find_id(store, name);
+    if (record && score <= record->score) return STORE_UNCHANGED;
+    return store_set_id(store, name, score, timestamp, client_ip);
+}
+
+int store_submit(leaderboard_store* store, const char* name, int score,
+                 time_t timestamp, const char* client_ip) {
+    uint32_t id = store_intern_name(name);
+    if (id == STORE_NO_NAME) return -1;
+    return store_submit_id(store, id, score, timestamp, store_parse_ip(client_ip));
+}
+
+int store_merge(leaderboard_store* store, const char* name, int score,
+                time_t timestamp, const char* client_ip) {
+    uint32_t id = store_intern_name(name);
+    if (id == STORE_NO_NAME) return -1;
+    const store_record* record = store_find_id(store, id);
+    if (record && (score < record->score ||
+                   (score == record->score && timestamp >= record->timestamp))) {
+        return STORE_UNCHANGED;
+    }
+    return store_set_id(store, id, score, timestamp, store_parse_ip(client_ip));
+}
+
+int store_set_id(leaderboard_store* store, uint32_t name, int score, time_t timestamp,
+                 uint32_t client_ip) {
+    uint32_t found = record_for(store, name);
+    if (found) {
+        uint32_t id = found - 1;
+        store_record* record = &store->records[id];
+        uint32_t node = skiplist_unlink(store, id);
+        record->score = score;
+        record->timestamp = timestamp;
+        record->client_ip = client_ip;
+        skiplist_relink(store, node);
+        return STORE_IMPROVED;
+    }
+    
+    if (store->count == STORE_MAX_RECORDS || grow_by_name(store, name) < 0) return -1;
+    if (store->count == store->capacity && grow_records(store) < 0) {
+        return -1;
+    }
+    
+    uint32_t id = (uint32_t)store->count;
+    store_record* record = &store->records[id];
+    record->timestamp = timestamp;
+    record->name = name;
+    record->score = score;
+    record->client_ip = client_ip;
+    
+    if (skiplist_insert(store, id) < 0) return -1;
+    store->count++;
+    store->by_name[name] = id + 1;
+    return STORE_INSERTED;
+}
+
+int store_set(leaderboard_store* store, const char* name, int score,
+              time_t timestamp, const char* client_ip) {
+    uint32_t id = store_intern_name(name);
+    if (id == STORE_NO_NAME) return -1;
+    return store_set_id(store, id, score, timestamp, store_parse_ip(client_ip));
+}
+
+int store_remove_id(leaderboard_store* store, uint32_t name) {
+    uint32_t found = record_for(store, name);
+    if (!found) return -1;
+    uint32_t id = found - 1;
+    
+    free_node(store, skiplist_unlink(store, id));
+    store->by_name[name] = 0;
+    store->count--;
+    
+    // Keep ids dense: move the last record into the freed one
+    uint32_t last = (uint32_t)store->count;
+    if (id != last) {
+        uint32_t node = skiplist_unlink(store, last);
+        store->records[id] = store->records[last];
+        store->by_name[store->records[id].name] = id + 1;
+        set_node(store, node, id, node_level(store, node));
+        skiplist_relink(store, node);
+    }
+    return 0;
+}
+
+int store_remove(leaderboard_store* store, const char* name) {
+    uint32_t id = store_name_id(name);
+    if (id == STORE_NO_NAME) return -1;
+    return store_remove_id(store, id);
+}
+
+const store_record* store_find_id(const leaderboard_store* store, uint32_t name) {
+    uint32_t found = record_for(store, name);
+    return found ? &store->records[found - 1] : NULL;
+}
+
+const store_record* store_find(const leaderboard_store* store, const char* name) {
+    uint32_t id = store_name_id(name);
+    return id == STORE_NO_NAME ? NULL : store_find_id(store, id);
+}
+
+int store_in_top(const leaderboard_store* store, const char* name, size_t k) {
+    size_t rank = store_rank(store, name);
+    return rank != 0 && rank <= k;
+}
+
+size_t store_rank(const leaderboard_store* store, const char* name) {
+    uint32_t name_id = store_name_id(name);
+    uint32_t found = name_id == STORE_NO_NAME ? 0 : record_for(store, name_id);
+    if (found == 0) return 0;
+    uint32_t id = found - 1;
+    
+    uint32_t node = HEAD;
+    size_t traversed = 0;
+    for (int i = store->level - 1; i >= 0; i--) {
+        uint32_t next;
+        while ((next = next_of(store, node, i)) &&
+               compare_records(store, node_id(store, next), id) <= 0) {
+            traversed += span_of(store, node, i);
+            node = next;
+        }
+        if (node != HEAD && node_id(store, node) == id) return traversed;
+    }
+    return 0;
+}
+
+size_t store_count_ahead(const leaderboard_store* store, int score, time_t timestamp,
+                         const char* name) {
+    uint32_t node = HEAD;
+    size_t traversed = 0;
+    for (int i = store->level - 1; i >= 0; i--) {
+        uint32_t next;
+        while ((next = next_of(store, node, i)) &&
+               compare_key(&store->records[node_id(store, next)], score, timestamp, name) < 0) {
+            traversed += span_of(store, node, i);
+            node = next;
+        }
+    }
+    return traversed;
+}
+
+size_t store_top(const leaderboard_store* store, const store_record** out, size_t k) {
+    return store_range(store, 0, out, k);
+}
+
+size_t store_range(const leaderboard_store* store, size_t offset,
+                   const store_record** out, size_t k) {
+    size_t n = 0;
+    for (uint32_t node = node_at_rank(store, offset + 1); node && n < k;
+         node = next_of(store, node, 0)) {
+        out[n++] = &store->records[node_id(store, node)];
+    }
+    return n;
+}
+
+size_t store_range_ids(const leaderboard_store* store, size_t offset, uint32_t* out, size_t k) {
+    size_t n = 0;
+    for (uint32_t node = node_at_rank(store, offset + 1); node && n < k;
+         node = next_of(store, node, 0)) {
+        out[n++] = node_id(store, node);
+    }
+    return n;
+}
@@ -0,0 +1,160 @@
+#ifndef LEADERBOARD_STORE_H
+#define LEADERBOARD_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STORE_MAX_LEVEL 32
+#define STORE_NAME_SIZE 32          // Longest name kept is one less
+#define STORE_NO_NAME UINT32_MAX
+
+// A submission as it arrives and is logged
+typedef struct {
+    char player_name[STORE_NAME_SIZE];
+    int score;
+    time_t timestamp;
+    char client_ip[16];
+} leaderboard_entry;
+
+// A player's record as a store keeps it. The name is an id in the shared
+// name table below and the client address an IPv4 number, so a record is
+// 20 bytes where a leaderboard_entry is 64.
+typedef struct {
+    int64_t timestamp;
+    uint32_t name;                  // Name id
+    int32_t score;
+    uint32_t client_ip;             // IPv4 address, network byte order; 0 if unknown
+} __attribute__((packed)) store_record;
+
+// Most records a store holds; a skip list node packs the record id into
+// 27 bits beside its level
+#define STORE_MAX_RECORDS ((size_t)1 << 27)
+
+// Player records indexed two ways: by name id, through an array holding
+// each player's record id, for O(1) lookups, and by a skip list ordered by
+// (score desc, timestamp asc, name) for O(log n) updates, O(log n) rank
+// lookups and O(log n + K) range reads. Each link records how many ranks
+// it skips, which makes the list an order-statistic index.
+typedef struct {
+    store_record* records;          // Record id is the index
+    size_t count;
+    size_t capacity;
+    uint32_t* by_name;              // Name id -> record id + 1 (0 = none)
+    size_t by_name_len;
+    uint32_t* nodes;                // Skip list node pool in 32-bit words; head at 0
+    size_t nodes_len;
+    size_t nodes_cap;
+    uint32_t free_nodes[STORE_MAX_LEVEL + 1];  // Freed nodes by level, chained through next
+    int level;
+    uint64_t rng;
+    void* mapping;                  // Snapshot mapping records live in, if any
+    size_t mapping_len;
+} leaderboard_store;
+
+// store_submit() and store_set() outcomes
+#define STORE_UNCHANGED 0
+#define STORE_INSERTED 1
+#define STORE_IMPROVED 2            // Existing record updated
+
+// Every store in the process shares one table of player names. A name is
+// copied once into an append-only arena and given the next id, so records
+// carry 4 bytes instead of the name itself; ids are never reused. The table
+// has its own lock, so stores guarded by different locks can intern names
+// at the same time, and a name never moves once added, so store_name()
+// takes no lock at all. Names are cut to STORE_NAME_SIZE - 1 characters.
+
+// Id of name, adding it if new; STORE_NO_NAME if memory ran out
+uint32_t store_intern_name(const char* name);
+
+// Id of name if it was ever interned, else STORE_NO_NAME
+uint32_t store_name_id(const char* name);
+
+const char* store_name(uint32_t id);
+size_t store_name_count();
+
+// Expand a record into a leaderboard_entry
+void store_unpack(const store_record* record, leaderboard_entry* out);
+
+// IPv4 addresses in dotted form to and from record form. Anything that
+// does not parse is kept as 0.
+uint32_t store_parse_ip(const char* text);
+void store_format_ip(uint32_t address, char* out, size_t size);
+
+int store_init(leaderboard_store* store);
+void store_free(leaderboard_store* store);
+
+// Bytes the store has allocated (or mapped), not counting the name table
+size_t store_memory(const leaderboard_store* store);
+
+// Record a client's score, keeping each player's best: it replaces the
+// current one only if higher. Returns one of the STORE_* outcomes, or -1
+// if memory ran out.
+int store_submit(leaderboard_store* store, const char* name, int score,
+                 time_t timestamp, const char* client_ip);
+int store_submit_id(leaderboard_store* store, uint32_t name, int score, time_t timestamp,
+                    uint32_t client_ip);
+
+// Keep the better of a player's record and this one: the higher score, or
+// of two equal ones the earlier. Keeping the better of two records is
+// commutative and idempotent, so stores given the same records in any
+// order, any number of times, end up the same. Only for records a server
+// already kept, from a peer or a log: a client could otherwise backdate an
+// equal score to move ahead of the players tied with it.
+int store_merge(leaderboard_store* store, const char* name, int score,
+                time_t timestamp, const char* client_ip);
+
+// Record a score even if it is lower than the player's current one
+int store_set(leaderboard_store* store, const char* name, int score,
+              time_t timestamp, const char* client_ip);
+int store_set_id(leaderboard_store* store, uint32_t name, int score, time_t timestamp,
+                 uint32_t client_ip);
+
+// Drop a player. The last record takes the removed one's id. Returns -1 if
+// the player is unknown.
+int store_remove(leaderboard_store* store, const char* name);
+int store_remove_id(leaderboard_store* store, uint32_t name);
+
+// FNV-1a hash of a player name, as used by the name table
+uint64_t store_hash_name(const char* name);
+
+// Adopt records that are already ranked, such as a mapped snapshot, into
+// a freshly initialized store. records is used in place (no copy) and
+// rank_order lists every record id best first, so both indexes are built
+// in O(n) without sorting. rank_order is checked, and if it skips or
+// repeats a record or is out of order the records are sorted instead.
+// Every name id must be interned. If mapping is non-NULL the store takes
+// ownership (store->mapping is set) and unmaps it when the records outgrow
+// it; otherwise records must come from malloc and the store frees them.
+// Returns -1 on failure, after which the store must be freed.
+int store_load_ranked(leaderboard_store* store, store_record* records, size_t count,
+                      const uint32_t* rank_order, void* mapping, size_t mapping_len);
+
+// Look up a player; NULL if unknown
+const store_record* store_find(const leaderboard_store* store, const char* name);
+const store_record* store_find_id(const leaderboard_store* store, uint32_t name);
+
+// Nonzero if the named player currently ranks among the k best
+int store_in_top(const leaderboard_store* store, const char* name, size_t k);
+
+// Rank of the named player, 1 being the best; 0 if unknown
+size_t store_rank(const leaderboard_store* store, const char* name);
+
+// How many players rank ahead of one who would hold (score, timestamp,
+// name), whether or not such a player exists. Lets several stores that
+// split the players between them work out a combined rank.
+size_t store_count_ahead(const leaderboard_store* store, int score, time_t timestamp,
+                         const char* name);
+
+// Fill out[] with up to k best records in rank order. Returns how many.
+size_t store_top(const leaderboard_store* store, const store_record** out, size_t k);
+
+// Fill out[] with up to k records in rank order, starting after the first
+// offset ones. Returns how many.
+size_t store_range(const leaderboard_store* store, size_t offset,
+                   const store_record** out, size_t k);
+
+// The same, as record ids
+size_t store_range_ids(const leaderboard_store* store, size_t offset, uint32_t* out, size_t k);
+
+#endif
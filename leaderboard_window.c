@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include "leaderboard_window.h"
+
+#define BUCKET_INITIAL_CAPACITY 256
+
+static size_t hash_name_id(uint32_t name) {
+    return (size_t)(((uint64_t)name * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// Slot holding name, or the empty slot where it would go
+static size_t bucket_find_slot(const window_bucket* bucket, uint32_t name) {
+    size_t mask = bucket->slot_count - 1;
+    size_t slot = hash_name_id(name) & mask;
+    while (bucket->slots[slot] != 0 && bucket->records[bucket->slots[slot] - 1].name != name) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static const store_record* bucket_find(const window_bucket* bucket, uint32_t name) {
+    if (bucket->count == 0) return NULL;
+    uint32_t index = bucket->slots[bucket_find_slot(bucket, name)];
+    return index ? &bucket->records[index - 1] : NULL;
+}
+
+static void bucket_clear(window_bucket* bucket) {
+    free(bucket->records);
+    free(bucket->slots);
+    memset(bucket, 0, sizeof(*bucket));
+}
+
+// Make room for one more record, keeping the hash table at most 3/4 full
+static int bucket_reserve(window_bucket* bucket) {
+    if (bucket->count == bucket->capacity) {
+        size_t new_capacity = bucket->capacity ? bucket->capacity * 2 : BUCKET_INITIAL_CAPACITY;
+        store_record* grown = realloc(bucket->records, new_capacity * sizeof(store_record));
+        if (!grown) return -1;
+        bucket->records = grown;
+        bucket->capacity = new_capacity;
+    }
+    if ((bucket->count + 1) * 4 > bucket->slot_count * 3) {
+        size_t new_count = bucket->slot_count ? bucket->slot_count * 2 : BUCKET_INITIAL_CAPACITY * 2;
+        uint32_t* slots = calloc(new_count, sizeof(uint32_t));
+        if (!slots) return -1;
+        free(bucket->slots);
+        bucket->slots = slots;
+        bucket->slot_count = new_count;
+        for (size_t i = 0; i < bucket->count; i++) {
+            bucket->slots[bucket_find_slot(bucket, bucket->records[i].name)] = (uint32_t)i + 1;
+        }
+    }
+    return 0;
+}
+
+// Keep the player's best in this bucket. Returns 1 if it improved, 0 if
+// not, -1 if memory ran out.
+static int bucket_submit(window_bucket* bucket, uint32_t name, int score,
+                         time_t timestamp, uint32_t client_ip) {
+    if (bucket_reserve(bucket) < 0) return -1;
+    
+    size_t slot = bucket_find_slot(bucket, name);
+    store_record* record;
+    if (bucket->slots[slot] != 0) {
+        record = &bucket->records[bucket->slots[slot] - 1];
+        if (score <= record->score) return 0;
+    } else {
+        record = &bucket->records[bucket->count++];
+        bucket->slots[slot] = (uint32_t)bucket->count;
+        record->name = name;
+    }
+    record->score = score;
+    record->timestamp = timestamp;
+    record->client_ip = client_ip;
+    return 1;
+}
+
+static int ring_slot(const leaderboard_window* window, int64_t bucket_number) {
+    return (int)(bucket_number % window->bucket_count);
+}
+
+// Re-rank a player whose score was recorded in the expiring bucket. Only
+// players whose window best came from that bucket need anything done.
+static void expire_record(leaderboard_window* window, const store_record* expired) {
+    const store_record* current = store_find_id(&window->board, expired->name);
+    if (!current || current->score != expired->score || current->timestamp != expired->timestamp) {
+        return;
+    }
+    
+    const store_record* best = NULL;
+    for (int i = 0; i < window->bucket_count && window->newest - i >= 0; i++) {
+        const window_bucket* bucket = &window->buckets[ring_slot(window, window->newest - i)];
+        const store_record* found = bucket_find(bucket, expired->name);
+        if (found && (!best || found->score > best->score ||
+                      (found->score == best->score && found->timestamp < best->timestamp))) {
+            best = found;
+        }
+    }
+    
+    if (best) {
+        store_set_id(&window->board, best->name, best->score, best->timestamp, best->client_ip);
+    } else {
+        store_remove_id(&window->board, expired->name);
+    }
+}
+
+// Expire up to budget players from the queued buckets, oldest first.
+// Returns nonzero while some remain.
+static int drain(leaderboard_window* window, size_t budget) {
+    while (window->expired_count > 0) {
+        window_bucket* bucket = &window->expired[0];
+        while (window->drain_pos < bucket->count && budget > 0) {
+            expire_record(window, &bucket->records[window->drain_pos++]);
+            budget--;
+        }
+        if (window->drain_pos < bucket->count) return 1;
+        
+        bucket_clear(bucket);
+        window->expired_count--;
+        memmove(&window->expired[0], &window->expired[1],
+                window->expired_count * sizeof(window_bucket));
+        memset(&window->expired[window->expired_count], 0, sizeof(window_bucket));
+        window->drain_pos = 0;
+    }
+    return 0;
+}
+
+// Start new buckets up to bucket_number, queueing the ones they push out of
+// the window for drain(). Nothing is re-ranked here, so this is cheap
+// however far the window moves.
+static void advance(leaderboard_window* window, int64_t bucket_number) {
+    // A whole window on, every live bucket has expired; skip the empty ones
+    // in between
+    if (bucket_number - window->newest > window->bucket_count) {
+        window->newest = bucket_number - window->bucket_count;
+    }
+    while (window->newest < bucket_number) {
+        window->newest++;
+        window_bucket* bucket = &window->buckets[ring_slot(window, window->newest)];
+        if (bucket->count == 0) {
+            bucket_clear(bucket);
+            continue;
+        }
+        // Only if the windows were not maintained for a long time
+        if (window->expired_count == WINDOW_MAX_BUCKETS) {
+            drain(window, window->expired[0].count);
+        }
+        window->expired[window->expired_count++] = *bucket;
+        memset(bucket, 0, sizeof(*bucket));
+    }
+}
+
+int window_init(leaderboard_window* window, time_t bucket_seconds, int bucket_count, time_t now) {
+    memset(window, 0, sizeof(*window));
+    if (bucket_seconds <= 0 || bucket_count <= 0 || bucket_count > WINDOW_MAX_BUCKETS) {
+        return -1;
+    }
+    window->bucket_seconds = bucket_seconds;
+    window->bucket_count = bucket_count;
+    window->newest = now / bucket_seconds;
+    return store_init(&window->board);
+}
+
+void window_free(leaderboard_window* window) {
+    for (int i = 0; i < WINDOW_MAX_BUCKETS; i++) {
+        bucket_clear(&window->buckets[i]);
+        bucket_clear(&window->expired[i]);
+    }
+    store_free(&window->board);
+}
+
+int window_submit_id(leaderboard_window* window, uint32_t name, int score, time_t timestamp,
+                     uint32_t client_ip) {
+    int64_t bucket_number = timestamp / window->bucket_seconds;
+    if (bucket_number > window->newest) {
+        advance(window, bucket_number);
+    }
+    if (bucket_number <= window->newest - window->bucket_count) {
+        return 0;  // Already outside the window
+    }
+    
+    window_bucket* bucket = &window->buckets[ring_slot(window, bucket_number)];
+    int improved = bucket_submit(bucket, name, score, timestamp, client_ip);
+    if (improved <= 0) return improved;
+    if (store_submit_id(&window->board, name, score, timestamp, client_ip) < 0) return -1;
+    return 1;
+}
+
+int window_submit(leaderboard_window* window, const char* name, int score,
+                  time_t timestamp, const char* client_ip) {
+    uint32_t id = store_intern_name(name);
+    if (id == STORE_NO_NAME) return -1;
+    return window_submit_id(window, id, score, timestamp, store_parse_ip(client_ip));
+}
+
+int window_maintain(leaderboard_window* window, time_t now, size_t budget) {
+    int64_t bucket_number = now / window->bucket_seconds;
+    if (bucket_number > window->newest) {
+        advance(window, bucket_number);
+    }
+    return drain(window, budget);
+}
+
+void window_each_record(const leaderboard_window* window, window_record_fn fn, void* arg) {
+    for (int i = 0; i < window->bucket_count && window->newest - i >= 0; i++) {
+        const window_bucket* bucket = &window->buckets[ring_slot(window, window->newest - i)];
+        for (size_t j = 0; j < bucket->count; j++) {
+            fn(&bucket->records[j], arg);
+        }
+    }
+}
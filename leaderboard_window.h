@@ -0,0 +1,59 @@
+#ifndef LEADERBOARD_WINDOW_H
+#define LEADERBOARD_WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "leaderboard_store.h"
+
+#define WINDOW_MAX_BUCKETS 32
+
+// Each player's best score within one time bucket
+typedef struct {
+    store_record* records;
+    size_t count;
+    size_t capacity;
+    uint32_t* slots;                // Open addressing by name id, index + 1 (0 = empty)
+    size_t slot_count;              // Always a power of two
+} window_bucket;
+
+// A rolling leaderboard over the last bucket_count buckets of
+// bucket_seconds each. Scores are kept per bucket, and the board holds
+// each player's best across the live buckets with its own ranking index.
+// When a bucket falls out of the window it is queued, and only its own
+// players are looked at again, a few at a time (window_maintain), so upkeep
+// costs a bounded amount per submission however many players there are.
+// Until then the board may still show scores from queued buckets.
+typedef struct {
+    time_t bucket_seconds;
+    int bucket_count;
+    window_bucket buckets[WINDOW_MAX_BUCKETS];  // Ring of live buckets
+    int64_t newest;                 // Bucket number (timestamp / bucket_seconds)
+    window_bucket expired[WINDOW_MAX_BUCKETS];  // Awaiting drain, oldest first
+    int expired_count;
+    size_t drain_pos;               // Position in expired[0]
+    leaderboard_store board;
+} leaderboard_window;
+
+// Returns -1 if memory ran out or bucket_count is out of range
+int window_init(leaderboard_window* window, time_t bucket_seconds, int bucket_count, time_t now);
+void window_free(leaderboard_window* window);
+
+// Record a score made at timestamp. Scores older than the window are
+// ignored. Returns nonzero if the player's best in its bucket improved,
+// or -1 if memory ran out.
+int window_submit(leaderboard_window* window, const char* name, int score,
+                  time_t timestamp, const char* client_ip);
+int window_submit_id(leaderboard_window* window, uint32_t name, int score, time_t timestamp,
+                     uint32_t client_ip);
+
+// Roll the window forward to now and re-rank up to budget players from
+// the bucket that expired. Returns nonzero while expired players remain.
+int window_maintain(leaderboard_window* window, time_t now, size_t budget);
+
+// Call fn with every record the live buckets hold, each player's best in
+// each bucket. Submitting them all to another window rebuilds this one.
+typedef void (*window_record_fn)(const store_record* record, void* arg);
+void window_each_record(const leaderboard_window* window, window_record_fn fn, void* arg);
+
+#endif
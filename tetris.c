@@ -872,7 +872,10 @@ void start_game() {
     
     // NEW: Initialize network leaderboard
     if (global_leaderboard_enabled) {
-        fetch_leaderboard(); // Get initial leaderboard
+        // Get the initial leaderboard and have changes pushed from now on
+        if (subscribe_leaderboard() == 0) {
+            wait_for_replies();
+        }
         last_leaderboard_update = 0;
         game_time = 0;
     }
@@ -914,13 +917,14 @@ void start_game() {
     while (!shutdown_requested && !return_to_menu && !all_players_done()) {
         render_game_screen(game_win);
         
-        // NEW: Update global leaderboard periodically
+        // NEW: Apply pushed leaderboard changes; checking costs one
+        // non-blocking select per frame. Without a subscription (server
+        // unreachable) retry every 3 seconds at 60 FPS.
         if (global_leaderboard_enabled) {
             game_time++;
-            if (game_time - last_leaderboard_update > 180) { // Update every 3 seconds at 60 FPS
-                if (update_leaderboard_nonblocking() == 0) {
-                    last_leaderboard_update = game_time;
-                }
+            if (leaderboard_subscribed || game_time - last_leaderboard_update > 180) {
+                update_leaderboard_nonblocking();
+                last_leaderboard_update = game_time;
             }
         }
         
@@ -931,13 +935,15 @@ void start_game() {
     if (!return_to_menu) {
         // NEW: Submit scores to global leaderboard
         if (global_leaderboard_enabled) {
+            // Pipeline every submission and the refresh in one round trip
             for (int i = 0; i < num_players; i++) {
                 if (players[i].score > 0) { // Only submit if they actually scored
-                    submit_score(players[i].player_name, players[i].score);
+                    send_score(players[i].player_name, players[i].score);
                 }
             }
             // Refresh leaderboard to show new scores
-            fetch_leaderboard();
+            request_leaderboard();
+            wait_for_replies();
         }
         
         // Game over screen
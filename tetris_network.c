@@ -2,31 +2,95 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <time.h>
 #include "tetris_network.h"
+#include "leaderboard_protocol.h"
 
 #define BUFFER_SIZE 1024
+#define INITIAL_REPLY_BUFFER 4096
+#define REPLY_TIMEOUT_MS 3000
+#define UDP_TIMEOUT_MS 20       // First wait for a datagram reply; doubles per resend
+#define UDP_ATTEMPTS 5
+#define UDP_RETRY_AFTER 60      // Seconds to stay on TCP after UDP went unanswered
 
 leaderboard_entry top_scores[10];
 int score_count = 0;
 int last_leaderboard_update = 0;
+int leaderboard_subscribed = 0;
+
+// Where the server is; SERVER_IP and SERVER_PORT unless set_server_address()
+// says otherwise
+static char server_ip[INET_ADDRSTRLEN] = SERVER_IP;
+static int server_port = SERVER_PORT;
+
+static void handle_reply(server_connection* conn, uint16_t opcode,
+                         const unsigned char* payload, size_t length);
+
+// The game's persistent connection to the leaderboard server
+static server_connection server = { .sock = -1, .on_reply = handle_reply };
+static int leaderboard_request_pending = 0;
+
+// Where the reply to a blocking rank or range query goes
+static leaderboard_entry* query_out = NULL;
+static int query_max = 0;
+static int query_count = -1;
+static int query_first_rank = 0;
+static int query_rank = -1;
+static int query_score = 0;
+
+// Where the results of pipelined batch submissions go, in request order
+static unsigned char* batch_out = NULL;
+static int batch_max = 0;
+static int batch_filled = 0;
+
+// Connectionless fast path for small requests. The server needs no state
+// for it, and a lost datagram just means sending it again.
+static int udp_sock = -1;
+static uint32_t next_request_id = 0;
+static uint32_t udp_poll_id = 0;        // Outstanding render-loop poll, 0 if none
+static int udp_polls_unanswered = 0;
+static time_t udp_unanswered_at = 0;    // When UDP last went unanswered, 0 if it works
+
+static int server_address(struct sockaddr_in* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(server_port);
+    return inet_pton(AF_INET, server_ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+int set_server_address(const char* ip, int port) {
+    struct in_addr parsed;
+    if (inet_pton(AF_INET, ip, &parsed) != 1 || port <= 0 || port > 65535) {
+        return -1;
+    }
+    close_server_connection();
+    if (udp_sock >= 0) {
+        close(udp_sock);
+        udp_sock = -1;
+    }
+    udp_unanswered_at = 0;
+    udp_poll_id = 0;
+    snprintf(server_ip, sizeof(server_ip), "%s", ip);
+    server_port = port;
+    return 0;
+}
 
 int connect_to_server() {
     int sock = 0;
     struct sockaddr_in serv_addr;
     
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if (server_address(&serv_addr) < 0) {
         return -1;
     }
     
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(SERVER_PORT);
-    
-    if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
-        close(sock);
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         return -1;
     }
     
@@ -42,61 +106,627 @@ int connect_to_server() {
         return -1;
     }
     
+    // Pipelined requests are small; don't let Nagle hold them back
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    
     return sock;
 }
 
-int submit_score(const char* player_name, int score) {
-    int sock = connect_to_server();
-    if (sock < 0) {
+void connection_init(server_connection* conn, reply_handler on_reply, void* user) {
+    memset(conn, 0, sizeof(*conn));
+    conn->sock = -1;
+    conn->on_reply = on_reply;
+    conn->user = user;
+}
+
+void connection_close(server_connection* conn) {
+    if (conn->sock >= 0) {
+        close(conn->sock);
+    }
+    conn->sock = -1;
+    conn->reply_len = 0;
+    conn->pending_replies = 0;
+}
+
+void connection_free(server_connection* conn) {
+    connection_close(conn);
+    free(conn->reply_buf);
+    conn->reply_buf = NULL;
+    conn->reply_cap = 0;
+}
+
+void close_server_connection() {
+    connection_close(&server);
+    leaderboard_request_pending = 0;
+    leaderboard_subscribed = 0;
+}
+
+int connection_open(server_connection* conn) {
+    // Reconnect if the server hung up on us (for example after its idle
+    // timeout)
+    if (conn->sock >= 0 && conn->pending_replies == 0) {
+        char probe;
+        ssize_t n = recv(conn->sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            connection_close(conn);
+        }
+    }
+    if (conn->sock < 0) {
+        conn->sock = connect_to_server();
+    }
+    return conn->sock;
+}
+
+int connection_send(server_connection* conn, uint16_t opcode, const void* payload,
+                    size_t length) {
+    if (length > MAX_FRAME_SIZE || connection_open(conn) < 0) {
         return -1;
     }
     
-    char message[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
+    // Header and payload leave in one segment thanks to MSG_MORE
+    unsigned char header[BINARY_HEADER_SIZE];
+    binary_put_header(header, opcode, (uint32_t)length);
+    if (send(conn->sock, header, sizeof(header), MSG_NOSIGNAL | (length ? MSG_MORE : 0)) < 0 ||
+        (length > 0 && send(conn->sock, payload, length, MSG_NOSIGNAL) < 0)) {
+        connection_close(conn);
+        return -1;
+    }
     
-    snprintf(message, sizeof(message), "SUBMIT|%s|%d", player_name, score);
+    conn->pending_replies++;
+    return 0;
+}
+
+// Send one binary request on the game's connection without waiting for its reply
+int send_request(uint16_t opcode, const void* payload, size_t length) {
+    if (connection_send(&server, opcode, payload, length) < 0) {
+        close_server_connection();
+        return -1;
+    }
+    return 0;
+}
+
+// Apply a binary OP_LEADERBOARD payload to top_scores
+void parse_leaderboard_binary(const unsigned char* payload, size_t length) {
+    if (length < 4) {
+        return;
+    }
     
-    if (send(sock, message, strlen(message), 0) < 0) {
-        close(sock);
+    uint32_t count = get_u32le(payload);
+    if (count > (length - 4) / WIRE_ENTRY_SIZE) {
+        return;
+    }
+    
+    score_count = 0;
+    const unsigned char* p = payload + 4;
+    for (uint32_t i = 0; i < count && score_count < 10; i++) {
+        size_t name_len = strnlen((const char*)p, WIRE_NAME_SIZE - 1);
+        memcpy(top_scores[score_count].name, p, name_len);
+        top_scores[score_count].name[name_len] = '\0';
+        top_scores[score_count].score = (int)get_u32le(p + WIRE_NAME_SIZE);
+        score_count++;
+        p += WIRE_ENTRY_SIZE;
+    }
+}
+
+// Apply a pushed OP_LEADERBOARD_DELTA payload to top_scores
+void apply_leaderboard_delta(const unsigned char* payload, size_t length) {
+    if (length < 8) {
+        return;
+    }
+    
+    uint32_t count = get_u32le(payload);
+    uint32_t changed = get_u32le(payload + 4);
+    if (count > 10 || changed > (length - 8) / WIRE_DELTA_ENTRY_SIZE) {
+        return;
+    }
+    
+    const unsigned char* p = payload + 8;
+    for (uint32_t i = 0; i < changed; i++, p += WIRE_DELTA_ENTRY_SIZE) {
+        uint32_t rank = get_u32le(p);
+        if (rank >= count) continue;
+        size_t name_len = strnlen((const char*)p + 4, WIRE_NAME_SIZE - 1);
+        memcpy(top_scores[rank].name, p + 4, name_len);
+        top_scores[rank].name[name_len] = '\0';
+        top_scores[rank].score = (int)get_u32le(p + 4 + WIRE_NAME_SIZE);
+    }
+    score_count = (int)count;
+}
+
+// Copy an OP_RANGE payload into the pending query's buffer
+static void parse_range_binary(const unsigned char* payload, size_t length) {
+    if (length < 8) {
+        return;
+    }
+    
+    uint32_t count = get_u32le(payload + 4);
+    if (count > (length - 8) / WIRE_ENTRY_SIZE) {
+        return;
+    }
+    
+    query_first_rank = (int)get_u32le(payload);
+    query_count = 0;
+    const unsigned char* p = payload + 8;
+    for (uint32_t i = 0; i < count && query_count < query_max; i++, p += WIRE_ENTRY_SIZE) {
+        size_t name_len = strnlen((const char*)p, WIRE_NAME_SIZE - 1);
+        memcpy(query_out[query_count].name, p, name_len);
+        query_out[query_count].name[name_len] = '\0';
+        query_out[query_count].score = (int)get_u32le(p + WIRE_NAME_SIZE);
+        query_count++;
+    }
+}
+
+// Act on one reply or push to the game's connection (or a datagram reply)
+static void handle_reply(server_connection* conn, uint16_t opcode,
+                         const unsigned char* payload, size_t length) {
+    (void)conn;
+    if (opcode == OP_LEADERBOARD) {
+        parse_leaderboard_binary(payload, length);
+        leaderboard_request_pending = 0;
+    } else if (opcode == OP_LEADERBOARD_DELTA) {
+        apply_leaderboard_delta(payload, length);
+    } else if (opcode == OP_RANGE) {
+        parse_range_binary(payload, length);
+    } else if (opcode == OP_RANK && length >= 8) {
+        query_rank = (int)get_u32le(payload);
+        query_score = (int)get_u32le(payload + 4);
+    } else if (opcode == OP_BATCH_RESULT && length >= 4 && batch_out) {
+        uint32_t count = get_u32le(payload);
+        for (uint32_t i = 0; i < count && i < length - 4 && batch_filled < batch_max; i++) {
+            batch_out[batch_filled++] = payload[4 + i];
+        }
+    }
+}
+
+// Dispatch every complete reply and push in the receive buffer. Returns
+// the number of messages handled, or -1 if the stream is corrupt.
+static int dispatch_replies(server_connection* conn) {
+    int handled = 0;
+    size_t offset = 0;
+    
+    while (conn->reply_len - offset >= BINARY_HEADER_SIZE) {
+        const unsigned char* header = conn->reply_buf + offset;
+        uint32_t length = get_u32le(header + 4);
+        if (header[0] != BINARY_MAGIC || length > MAX_FRAME_SIZE) {
+            return -1;
+        }
+        if (conn->reply_len - offset - BINARY_HEADER_SIZE < length) break;
+        offset += BINARY_HEADER_SIZE + length;
+        
+        uint16_t opcode = get_u16le(header + 2);
+        if (opcode != OP_LEADERBOARD_DELTA && opcode != OP_EXPORT_CHUNK && conn->pending_replies > 0) {
+            conn->pending_replies--;
+        }
+        if (conn->on_reply) {
+            conn->on_reply(conn, opcode, header + BINARY_HEADER_SIZE, length);
+        }
+        handled++;
+    }
+    
+    if (offset > 0) {
+        memmove(conn->reply_buf, conn->reply_buf + offset, conn->reply_len - offset);
+        conn->reply_len -= offset;
+    }
+    return handled;
+}
+
+// Make room to receive more, growing the buffer up to one whole message
+static int reserve_reply_space(server_connection* conn) {
+    if (conn->reply_len < conn->reply_cap) return 0;
+    size_t new_cap = conn->reply_cap ? conn->reply_cap * 2 : INITIAL_REPLY_BUFFER;
+    if (new_cap > BINARY_HEADER_SIZE + MAX_FRAME_SIZE) new_cap = BINARY_HEADER_SIZE + MAX_FRAME_SIZE;
+    if (new_cap <= conn->reply_cap) return -1;
+    unsigned char* grown = realloc(conn->reply_buf, new_cap);
+    if (!grown) return -1;
+    conn->reply_buf = grown;
+    conn->reply_cap = new_cap;
+    return 0;
+}
+
+int connection_read(server_connection* conn, int timeout_ms) {
+    if (conn->sock < 0) return -1;
+    
+    int handled = 0;
+    struct timeval deadline, now;
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_usec += (timeout_ms % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+    
+    while (conn->pending_replies > 0 || timeout_ms == 0) {
+        gettimeofday(&now, NULL);
+        long remaining_us = (deadline.tv_sec - now.tv_sec) * 1000000L +
+                            (deadline.tv_usec - now.tv_usec);
+        if (remaining_us < 0) remaining_us = 0;
+        
+        // poll() rather than select(): programs with many connections
+        // have descriptors past FD_SETSIZE
+        struct pollfd readable = { .fd = conn->sock, .events = POLLIN };
+        int activity = poll(&readable, 1, (int)((remaining_us + 999) / 1000));
+        if (activity < 0 && errno == EINTR) continue;
+        if (activity <= 0) break;
+        
+        if (reserve_reply_space(conn) < 0) {
+            connection_close(conn);
+            return -1;
+        }
+        ssize_t bytes_received = recv(conn->sock, conn->reply_buf + conn->reply_len,
+                                      conn->reply_cap - conn->reply_len, MSG_DONTWAIT);
+        if (bytes_received <= 0) {
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            connection_close(conn);
+            return -1;
+        }
+        conn->reply_len += bytes_received;
+        int dispatched = dispatch_replies(conn);
+        if (dispatched < 0) {
+            connection_close(conn);
+            return -1;
+        }
+        handled += dispatched;
+    }
+    return handled;
+}
+
+// Block until every outstanding request has been answered
+int wait_for_replies() {
+    if (connection_read(&server, REPLY_TIMEOUT_MS) < 0) {
+        close_server_connection();
+        return -1;
+    }
+    if (server.pending_replies > 0) {
+        // Replies would now arrive out of step with our requests; start over
+        close_server_connection();
+        return -1;
+    }
+    return 0;
+}
+
+// Whether to try UDP first. After it goes unanswered (server down, or
+// started with --no-udp) stick to TCP for a while.
+static int udp_usable() {
+    return udp_unanswered_at == 0 || time(NULL) - udp_unanswered_at >= UDP_RETRY_AFTER;
+}
+
+static int ensure_udp_socket() {
+    if (udp_sock >= 0) {
+        return udp_sock;
+    }
+    
+    struct sockaddr_in serv_addr;
+    if (server_address(&serv_addr) < 0) {
+        return -1;
+    }
+    // Connected, so only the server's datagrams arrive and a closed port
+    // is reported straight away
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_sock >= 0 && connect(udp_sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(udp_sock);
+        udp_sock = -1;
+    }
+    if (next_request_id == 0) {
+        next_request_id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    }
+    return udp_sock;
+}
+
+static int udp_send(uint32_t request_id, uint16_t opcode, const void* payload, size_t length) {
+    unsigned char datagram[UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE + BUFFER_SIZE];
+    if (length > BUFFER_SIZE) {
+        return -1;
+    }
+    put_u32le(datagram, request_id);
+    binary_put_header(datagram + UDP_REQUEST_ID_SIZE, opcode, (uint32_t)length);
+    if (length > 0) {
+        memcpy(datagram + UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE, payload, length);
+    }
+    return send(udp_sock, datagram, UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE + length,
+                MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Wait up to timeout_ms for the reply to request_id and handle it, skipping
+// late replies to earlier requests. 0 only checks what has arrived.
+// Returns the reply's opcode, or -1 if none came.
+static int udp_receive(uint32_t request_id, int timeout_ms) {
+    unsigned char datagram[MAX_DATAGRAM_SIZE];
+    for (;;) {
+        struct pollfd readable = { .fd = udp_sock, .events = POLLIN };
+        int activity = poll(&readable, 1, timeout_ms);
+        if (activity < 0 && errno == EINTR) continue;
+        if (activity <= 0) return -1;
+        
+        ssize_t len = recv(udp_sock, datagram, sizeof(datagram), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return -1;  // e.g. ECONNREFUSED: nothing listening
+        }
+        if (len < UDP_REQUEST_ID_SIZE + BINARY_HEADER_SIZE ||
+            get_u32le(datagram) != request_id) {
+            continue;
+        }
+        const unsigned char* header = datagram + UDP_REQUEST_ID_SIZE;
+        uint32_t length = get_u32le(header + 4);
+        if (header[0] != BINARY_MAGIC ||
+            length != (size_t)len - UDP_REQUEST_ID_SIZE - BINARY_HEADER_SIZE) {
+            continue;
+        }
+        uint16_t opcode = get_u16le(header + 2);
+        handle_reply(NULL, opcode, header + BINARY_HEADER_SIZE, length);
+        return opcode;
+    }
+}
+
+// Send a request over UDP, resending it under the same request id until
+// it is answered. Returns 0 once it succeeded, -1 if the caller should use
+// TCP instead.
+static int udp_request(uint16_t opcode, const void* payload, size_t length) {
+    if (!udp_usable() || ensure_udp_socket() < 0) {
         return -1;
     }
     
-    int bytes_received = recv(sock, response, BUFFER_SIZE - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
+    uint32_t request_id = ++next_request_id;
+    int timeout_ms = UDP_TIMEOUT_MS;
+    for (int attempt = 0; attempt < UDP_ATTEMPTS; attempt++, timeout_ms *= 2) {
+        if (udp_send(request_id, opcode, payload, length) < 0) {
+            break;
+        }
+        int reply = udp_receive(request_id, timeout_ms);
+        if (reply >= 0) {
+            udp_unanswered_at = 0;
+            return (reply == OP_ERROR || reply == OP_BUSY) ? -1 : 0;
+        }
+    }
+    udp_unanswered_at = time(NULL);
+    return -1;
+}
+
+// Render-loop refresh over UDP: pick up the reply to the previous poll if
+// it has arrived, and send the next. Never blocks. Returns 0 if the
+// previous poll was answered.
+static int poll_leaderboard_udp() {
+    if (ensure_udp_socket() < 0) {
+        return -1;
     }
     
-    close(sock);
+    int answered = udp_poll_id != 0 && udp_receive(udp_poll_id, 0) == OP_LEADERBOARD;
+    if (answered) {
+        udp_unanswered_at = 0;
+        udp_polls_unanswered = 0;
+    } else if (udp_poll_id != 0 && ++udp_polls_unanswered >= UDP_ATTEMPTS) {
+        udp_unanswered_at = time(NULL);
+        udp_polls_unanswered = 0;
+        udp_poll_id = 0;
+        return -1;
+    }
+    static const unsigned char padding[UDP_LEADERBOARD_PAYLOAD];
+    udp_poll_id = ++next_request_id;
+    udp_send(udp_poll_id, OP_GET_LEADERBOARD, padding, sizeof(padding));
+    return answered ? 0 : -1;
+}
+
+static void encode_score(unsigned char* payload, const char* player_name, int score) {
+    memset(payload, 0, WIRE_ENTRY_SIZE);
+    memcpy(payload, player_name, strnlen(player_name, WIRE_NAME_SIZE - 1));
+    put_u32le(payload + WIRE_NAME_SIZE, (uint32_t)score);
+}
+
+// Queue a score submission on the persistent connection
+int send_score(const char* player_name, int score) {
+    unsigned char payload[WIRE_ENTRY_SIZE];
+    encode_score(payload, player_name, score);
+    return send_request(OP_SUBMIT, payload, sizeof(payload));
+}
+
+// Queue a leaderboard request on the persistent connection
+int request_leaderboard() {
+    if (send_request(OP_GET_LEADERBOARD, NULL, 0) < 0) {
+        return -1;
+    }
+    leaderboard_request_pending = 1;
     return 0;
 }
 
-int fetch_leaderboard() {
-    int sock = connect_to_server();
-    if (sock < 0) {
+// One-off requests try UDP first and fall back to the persistent
+// connection if it goes unanswered
+int submit_score(const char* player_name, int score) {
+    unsigned char payload[WIRE_ENTRY_SIZE];
+    encode_score(payload, player_name, score);
+    if (udp_request(OP_SUBMIT, payload, sizeof(payload)) == 0) {
+        return 0;
+    }
+    
+    if (send_request(OP_SUBMIT, payload, sizeof(payload)) < 0) {
+        return -1;
+    }
+    return wait_for_replies();
+}
+
+int submit_scores(const score_submission* scores, int count, unsigned char* results) {
+    unsigned char* payload = malloc(4 + MAX_BATCH_COUNT * WIRE_BATCH_ITEM_SIZE);
+    if (!payload || count < 0) {
+        free(payload);
         return -1;
     }
     
-    char message[] = "GET_LEADERBOARD";
-    char response[BUFFER_SIZE];
+    // Requests over MAX_BATCH_COUNT go as several batches, pipelined
+    int ok = 1;
+    for (int start = 0; start < count && ok; start += MAX_BATCH_COUNT) {
+        int n = (count - start < MAX_BATCH_COUNT) ? count - start : MAX_BATCH_COUNT;
+        put_u32le(payload, (uint32_t)n);
+        for (int i = 0; i < n; i++) {
+            unsigned char* item = payload + 4 + i * WIRE_BATCH_ITEM_SIZE;
+            encode_score(item, scores[start + i].name, scores[start + i].score);
+            put_u64le(item + WIRE_ENTRY_SIZE, (uint64_t)scores[start + i].timestamp);
+        }
+        ok = send_request(OP_SUBMIT_BATCH, payload, 4 + n * WIRE_BATCH_ITEM_SIZE) == 0;
+    }
+    free(payload);
     
-    if (send(sock, message, strlen(message), 0) < 0) {
-        close(sock);
+    batch_out = results;
+    batch_max = count;
+    batch_filled = 0;
+    ok = ok && wait_for_replies() == 0;
+    batch_out = NULL;
+    return ok ? 0 : -1;
+}
+
+// Ask the server to push leaderboard changes on the persistent connection
+// from now on. The current leaderboard comes back first, as for
+// request_leaderboard(); the changes are picked up by
+// update_leaderboard_nonblocking().
+int subscribe_leaderboard() {
+    if (send_request(OP_SUBSCRIBE, NULL, 0) < 0) {
         return -1;
     }
+    leaderboard_request_pending = 1;
+    leaderboard_subscribed = 1;
+    return 0;
+}
+
+int fetch_leaderboard() {
+    // Padded to the reply's size, as the server requires over UDP
+    static const unsigned char padding[UDP_LEADERBOARD_PAYLOAD];
+    if (udp_request(OP_GET_LEADERBOARD, padding, sizeof(padding)) == 0) {
+        return 0;
+    }
     
-    int bytes_received = recv(sock, response, BUFFER_SIZE - 1, 0);
-    if (bytes_received > 0) {
-        response[bytes_received] = '\0';
-        parse_leaderboard_response(response);
-    } else {
-        close(sock);
+    if (request_leaderboard() < 0) {
         return -1;
     }
+    return wait_for_replies();
+}
+
+int fetch_rank(const char* player_name, int window, int* rank, int* score) {
+    unsigned char payload[WIRE_NAME_SIZE + 4] = {0};
+    memcpy(payload, player_name, strnlen(player_name, WIRE_NAME_SIZE - 1));
+    put_u32le(payload + WIRE_NAME_SIZE, (uint32_t)window);
     
-    close(sock);
+    query_rank = -1;
+    if (udp_request(OP_GET_RANK, payload, sizeof(payload)) < 0 &&
+        (send_request(OP_GET_RANK, payload, sizeof(payload)) < 0 || wait_for_replies() < 0)) {
+        return -1;
+    }
+    if (query_rank < 0) {
+        return -1;
+    }
+    *rank = query_rank;
+    *score = query_score;
     return 0;
 }
 
+// Send a range query and collect its OP_RANGE reply into out
+static int run_range_query(uint16_t opcode, const void* payload, size_t length,
+                           leaderboard_entry* out, int max, int* first_rank) {
+    query_out = out;
+    query_max = max;
+    query_count = -1;
+    int ok = send_request(opcode, payload, length) == 0 && wait_for_replies() == 0;
+    query_out = NULL;
+    query_max = 0;
+    if (!ok || query_count < 0) {
+        return -1;
+    }
+    *first_rank = query_first_rank;
+    return query_count;
+}
+
+int fetch_range(int offset, int count, int window, leaderboard_entry* out, int* first_rank) {
+    if (offset < 0 || count < 0) {
+        return -1;
+    }
+    unsigned char payload[12];
+    put_u32le(payload, (uint32_t)offset);
+    put_u32le(payload + 4, (uint32_t)count);
+    put_u32le(payload + 8, (uint32_t)window);
+    return run_range_query(OP_GET_RANGE, payload, sizeof(payload), out, count, first_rank);
+}
+
+int fetch_around(const char* player_name, int k, int window, leaderboard_entry* out,
+                 int* first_rank) {
+    if (k < 0) {
+        return -1;
+    }
+    // The server sends at most this many either side; clamping first also
+    // keeps 2k + 1 from overflowing
+    if (k > (MAX_RANGE_COUNT - 1) / 2) {
+        k = (MAX_RANGE_COUNT - 1) / 2;
+    }
+    unsigned char payload[WIRE_NAME_SIZE + 8] = {0};
+    memcpy(payload, player_name, strnlen(player_name, WIRE_NAME_SIZE - 1));
+    put_u32le(payload + WIRE_NAME_SIZE, (uint32_t)k);
+    put_u32le(payload + WIRE_NAME_SIZE + 4, (uint32_t)window);
+    return run_range_query(OP_GET_AROUND, payload, sizeof(payload), out, 2 * k + 1, first_rank);
+}
+
+// Where export_leaderboard() is writing to, and how it is going
+typedef struct {
+    FILE* out;
+    long written;
+    int finished;
+    int failed;
+} export_state;
+
+// Write a name as a CSV field, quoted if it has to be
+static void write_csv_name(FILE* out, const char* name) {
+    if (!strpbrk(name, ",\"\r\n")) {
+        fputs(name, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char* c = name; *c; c++) {
+        if (*c == '"') fputc('"', out);
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void handle_export(server_connection* conn, uint16_t opcode,
+                          const unsigned char* payload, size_t length) {
+    export_state* state = conn->user;
+    if (opcode == OP_EXPORT_END) {
+        state->finished = 1;
+        return;
+    }
+    uint32_t count = (length >= 8) ? get_u32le(payload + 4) : 0;
+    if (opcode != OP_EXPORT_CHUNK || length < 8 + (size_t)count * WIRE_KEYED_ENTRY_SIZE) {
+        state->failed = 1;
+        return;
+    }
+    uint32_t rank = get_u32le(payload);
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char* p = payload + 8 + i * WIRE_KEYED_ENTRY_SIZE;
+        char name[WIRE_NAME_SIZE];
+        size_t name_len = strnlen((const char*)p, WIRE_NAME_SIZE - 1);
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        fprintf(state->out, "%u,", rank + i);
+        write_csv_name(state->out, name);
+        fprintf(state->out, ",%d,%lld\n", (int)get_u32le(p + WIRE_NAME_SIZE),
+                (long long)get_u64le(p + WIRE_ENTRY_SIZE));
+    }
+    state->written += count;
+}
+
+long export_leaderboard(int window, FILE* out) {
+    // The server hangs up after an export, so it gets a connection of its own
+    export_state state = { .out = out };
+    server_connection conn;
+    connection_init(&conn, handle_export, &state);
+    unsigned char payload[4];
+    put_u32le(payload, (uint32_t)window);
+    
+    fputs("rank,name,score,timestamp\n", out);
+    int ok = connection_send(&conn, OP_EXPORT, payload, sizeof(payload)) == 0;
+    while (ok && !state.finished && !state.failed) {
+        ok = connection_read(&conn, REPLY_TIMEOUT_MS) > 0;
+    }
+    connection_free(&conn);
+    return (state.finished && !state.failed) ? state.written : -1;
+}
+
 void parse_leaderboard_response(const char* response) {
     if (strncmp(response, "LEADERBOARD", 11) != 0) {
         return;
@@ -124,35 +754,25 @@ void parse_leaderboard_response(const char* response) {
     }
 }
 
+// Called from the render loop, never waiting. While subscribed this only
+// applies changes the server has pushed. Otherwise, for instance after the
+// connection dropped, it polls over UDP and only resubscribes once the
+// server has answered, so an unreachable server doesn't stall the frame in
+// connect(). Without UDP it resubscribes straight away. Returns 0 if
+// top_scores is current as of the last message received.
 int update_leaderboard_nonblocking() {
-    fd_set readfds;
-    struct timeval timeout;
-    int sock = connect_to_server();
-    
-    if (sock < 0) return -1;
-    
-    char message[] = "GET_LEADERBOARD";
-    send(sock, message, strlen(message), 0);
-    
-    FD_ZERO(&readfds);
-    FD_SET(sock, &readfds);
-    
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000;
-    
-    int activity = select(sock + 1, &readfds, NULL, NULL, &timeout);
-    
-    if (activity > 0) {
-        char response[BUFFER_SIZE];
-        int bytes_received = recv(sock, response, BUFFER_SIZE - 1, 0);
-        if (bytes_received > 0) {
-            response[bytes_received] = '\0';
-            parse_leaderboard_response(response);
-            close(sock);
-            return 0;
+    if (!leaderboard_subscribed) {
+        if (udp_usable() && poll_leaderboard_udp() < 0) {
+            return -1;
+        }
+        if (subscribe_leaderboard() < 0) {
+            return -1;
         }
     }
     
-    close(sock);
-    return -1;
+    if (connection_read(&server, 0) < 0) {
+        close_server_connection();
+        return -1;
+    }
+    return leaderboard_request_pending ? -1 : 0;
 }
@@ -1,6 +1,10 @@
 #ifndef TETRIS_NETWORK_H
 #define TETRIS_NETWORK_H
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define SERVER_IP "10.0.2.15"  // Change to your server's IP
 #define SERVER_PORT 8080
 
@@ -9,11 +13,91 @@ typedef struct {
     int score;
 } leaderboard_entry;
 
+// A score for submit_scores(), with the unix time it was made (0 = now)
+typedef struct {
+    char name[32];
+    int score;
+    int64_t timestamp;
+} score_submission;
+
+// A persistent binary connection to the server. Requests are pipelined and
+// the server answers them in order, so only the number outstanding is
+// tracked. The game's own connection is built in and used by the functions
+// below; programs that need many (such as leaderboard_loadgen) make their
+// own with connection_init().
+typedef struct server_connection server_connection;
+typedef void (*reply_handler)(server_connection* conn, uint16_t opcode,
+                              const unsigned char* payload, size_t length);
+struct server_connection {
+    int sock;                   // -1 while closed
+    unsigned char* reply_buf;
+    size_t reply_len;
+    size_t reply_cap;
+    int pending_replies;        // Requests sent but not yet answered
+    reply_handler on_reply;     // Called for every reply and push, in order
+    void* user;
+};
+
+void connection_init(server_connection* conn, reply_handler on_reply, void* user);
+// Connect, or reconnect if the server hung up. Returns the socket or -1.
+int connection_open(server_connection* conn);
+void connection_close(server_connection* conn);
+void connection_free(server_connection* conn);
+// Send one request without waiting for its reply, connecting first if
+// needed. Returns -1 on failure.
+int connection_send(server_connection* conn, uint16_t opcode, const void* payload,
+                    size_t length);
+// Read and dispatch replies for up to timeout_ms milliseconds, returning
+// early once none are outstanding. 0 instead drains whatever has arrived,
+// pushes included, without blocking. Returns the messages handled, or -1
+// if the connection failed and was closed.
+int connection_read(server_connection* conn, int timeout_ms);
+
 // Function declarations
+// Talk to ip:port instead of SERVER_IP:SERVER_PORT from now on. Returns -1
+// if ip is not an IPv4 address.
+int set_server_address(const char* ip, int port);
 int connect_to_server();
+void close_server_connection();
 int submit_score(const char* player_name, int score);
 int fetch_leaderboard();
+
+// Pipelined requests on the persistent connection: queue any number, then
+// collect every reply with wait_for_replies()
+int send_request(uint16_t opcode, const void* payload, size_t length);
+int send_score(const char* player_name, int score);
+int request_leaderboard();
+int wait_for_replies();
+
+// Submit many scores as one request that the server applies as a unit.
+// Fills results[] (if not NULL) with a batch_result from
+// leaderboard_protocol.h for each score. Returns 0, or -1 on failure.
+int submit_scores(const score_submission* scores, int count, unsigned char* results);
+
+// Blocking queries against the whole board, beyond the top 10. window picks
+// the all-time, daily or weekly board (a window_id from
+// leaderboard_protocol.h). Ranks start at 1 (0 means the player is
+// unknown). The range functions fill out[] (count entries, or 2k+1 for
+// fetch_around, where k is capped at (MAX_RANGE_COUNT - 1) / 2) in rank
+// order, set *first_rank to the rank of out[0] and return how many entries
+// they wrote, or -1.
+int fetch_rank(const char* player_name, int window, int* rank, int* score);
+int fetch_range(int offset, int count, int window, leaderboard_entry* out, int* first_rank);
+int fetch_around(const char* player_name, int k, int window, leaderboard_entry* out,
+                 int* first_rank);
+
+// Stream every entry of a board, best first, to out as CSV lines
+// (rank,name,score,timestamp) after a header line. The server exports a
+// consistent snapshot however many players there are. Returns the number
+// of entries written, or -1.
+long export_leaderboard(int window, FILE* out);
+
+// Server-pushed leaderboard changes, applied to top_scores as they arrive
+int subscribe_leaderboard();
+void apply_leaderboard_delta(const unsigned char* payload, size_t length);
+
 void parse_leaderboard_response(const char* response);
+void parse_leaderboard_binary(const unsigned char* payload, size_t length);
 void display_leaderboard();
 int update_leaderboard_nonblocking();
 
@@ -21,5 +105,6 @@ int update_leaderboard_nonblocking();
 extern leaderboard_entry top_scores[10];
 extern int score_count;
 extern int last_leaderboard_update;
+extern int leaderboard_subscribed;
 
 #endif